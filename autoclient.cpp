@@ -35,7 +35,7 @@ void data_callback(bool success,
 		   uint8_t returncode,
 		   const char* sztopic,
 		   uint8_t *payload,
-		   uint8_t payloadlen,
+		   mqtt_len_t payloadlen,
 		   uint8_t gwid);
 
 
@@ -280,18 +280,18 @@ void data_callback(bool success,
 		   uint8_t returncode,
 		   const char* sztopic,
 		   uint8_t *payload,
-		   uint8_t payloadlen,
+		   mqtt_len_t payloadlen,
 		   uint8_t gwid)
 {
   if (success){
     printf("Publish received: Topic [") ;
     printf(sztopic);
     printf("] Payload [") ;
-    for (uint8_t i=0; i < payloadlen; i++){
+    for (mqtt_len_t i=0; i < payloadlen; i++){
       printf("%02X",payload[i]) ;
     }
     printf(" - '");
-    for (uint8_t i=0; i < payloadlen; i++){
+    for (mqtt_len_t i=0; i < payloadlen; i++){
       printf("%c",(char)payload[i]) ;
     }
     printf("']\n") ;
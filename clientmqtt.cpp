@@ -16,11 +16,22 @@
 // along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "clientmqtt.hpp"
+#include "mqttpacket.hpp"
 #include "radioutil.hpp"
 #include <string.h>
 #include <stdio.h>
 #ifndef ARDUINO
  #include <wchar.h>
+ #include <unistd.h>
+
+// Topic cache file header. Each topic follows as topic ID, name length
+// and name
+#define MQTT_TOPIC_CACHE_MAGIC 0x4D515443
+struct MqttTopicCacheHeader{
+  uint32_t magic ;
+  uint8_t gwid ;
+  uint16_t count ;
+};
 #endif
 #include <stdlib.h>
 #include <locale.h>
@@ -30,6 +41,33 @@ ClientMqttSn::ClientMqttSn()
   strcpy(m_szclient_id, "CL") ;  
 
   m_sleep_duration = 0 ;
+  m_sleep_power_down = false ;
+  m_poll_sent = 0 ;
+  m_poll_attempts = 0 ;
+  m_publish_window = 1 ;
+  m_send_window = 1 ;
+  m_send_accepted = 0 ;
+  m_congestion_backoff_ms = 0 ;
+  m_congestion_due_ms = 0 ;
+  m_client_connection = &m_connections[0] ;
+  m_standby_connection = &m_connections[1] ;
+  m_standby = false ;
+  m_standby_synced = false ;
+  m_standby_attempt = 0 ;
+  m_search_sent_ms = 0 ;
+  m_search_timed = false ;
+  m_search_due_ms = 0 ;
+  m_search_attempts = 0 ;
+  m_random = 1 ;
+  m_store = NULL ;
+  m_store_rate = MQTT_SPOOL_DRAIN_RATE ;
+  m_store_drain_time = 0 ;
+  m_store_drained = 0 ;
+  m_topic_cache = false ;
+  m_topic_cache_gwid = 0 ;
+#ifndef ARDUINO
+  m_topic_cache_file = NULL ;
+#endif
   
   m_fnconnected = NULL ;
   m_fndisconnected = NULL ;
@@ -38,44 +76,62 @@ ClientMqttSn::ClientMqttSn()
   m_fnregister = NULL;
   m_fnmessage = NULL ;
   m_fnsubscribed = NULL ;
+  m_fnsleep = NULL ;
 }
 
 ClientMqttSn::~ClientMqttSn()
 {
-
+#ifndef ARDUINO
+  if (m_topic_cache_file) fclose(m_topic_cache_file) ;
+#endif
 }
 
 
-void ClientMqttSn::received_puback(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_puback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len != 5) return ;
+  MqttAckView puback(data, len) ;
+  if (!puback.valid()) return ;
   bool bsuccess = false;
   
-  uint16_t topicid = (data[0] << 8) | data[1] ; // Assuming MSB is first
-  uint16_t messageid = (data[2] << 8) | data[3] ; // Assuming MSB is first
-  uint8_t returncode = data[4] ;
+  uint16_t topicid = puback.topic_id() ;
+  uint16_t messageid = puback.message_id() ;
+  uint8_t returncode = puback.return_code() ;
 
   DPRINT("PUBACK: {topicid = %u, messageid = %u, returncode = %u}\n", topicid, messageid, returncode) ;
 
   // not for this client if the connection address is different
-  if (!m_client_connection.address_match(sender_address)) return ; 
-  m_client_connection.update_activity() ;
-  MqttMessage *m = m_client_connection.messages.get_message(messageid) ;
+  if (!m_client_connection->address_match(sender_address)) return ; 
+  m_client_connection->update_activity() ;
+  MqttMessage *m = m_client_connection->messages.get_message(messageid) ;
   if (!m){
     EPRINT("PUBACK: received unknown message ID %u\n", messageid) ;
     return ;
   }
   m->set_inactive() ; // Message complete
+  // A stored publish refused for congestion stays in the store and is
+  // sent again once the back off ends
+  if (returncode != MQTT_RETURN_CONGESTION) store_complete(messageid) ;
     
   switch(returncode){
   case MQTT_RETURN_ACCEPTED:
     bsuccess = true ;
+    accepted() ;
     break ;
   case MQTT_RETURN_CONGESTION:
     EPRINT("PUBACK: {return code = Congestion}\n") ;
+    congested() ;
     break ;
   case MQTT_RETURN_INVALID_TOPIC:
     EPRINT("PUBACK: {return code = Invalid Topic}\n") ;
+    if (m_topic_cache){
+      // Gateway did not resume the session. Forget the cached ID so
+      // the topic is registered again
+      MqttTopic *t = m_client_connection->topics.get_topic(topicid) ;
+      if (t && !t->is_predefined() && !t->is_short_topic()){
+	m_client_connection->topics.del_topic(t) ;
+	save_topic_cache() ;
+      }
+    }
     break ;
   case MQTT_RETURN_NOT_SUPPORTED:
     EPRINT("PUBACK: {return code = Not Supported}\n") ;
@@ -83,27 +139,28 @@ void ClientMqttSn::received_puback(uint8_t *sender_address, uint8_t *data, uint8
   default:
     EPRINT("PUBACK: {unexpected return code = %u}\n", returncode) ;
   }    
-  if (m_fnpublished) (*m_fnpublished)(bsuccess, returncode, topicid, messageid, m_client_connection.get_gwid());
+  if (m_fnpublished) (*m_fnpublished)(bsuccess, returncode, topicid, messageid, m_client_connection->get_gwid());
 
 }
 
-void ClientMqttSn::received_pubrec(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_pubrec(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
   // Check the length, does it match expected PUBREC length?
-  if (len != 2) return ;
+  MqttMessageIdView pubrec(data, len) ;
+  if (!pubrec.valid()) return ;
 
-  if (!m_client_connection.is_connected()) return ;
+  if (!m_client_connection->is_connected()) return ;
 
   // Check that this is coming from the expected gateway
-  if (!m_client_connection.address_match(sender_address)) return ; 
+  if (!m_client_connection->address_match(sender_address)) return ; 
 
   // Note the server activity and reset timers
-  m_client_connection.update_activity() ;
+  m_client_connection->update_activity() ;
 
-  uint16_t messageid = (data[0] << 8) | data[1] ; // Assuming MSB is first
+  uint16_t messageid = pubrec.message_id() ;
   DPRINT("PUBREC: {messageid = %u}\n", messageid) ;
 
-  MqttMessage *m = m_client_connection.messages.get_message(messageid) ;
+  MqttMessage *m = m_client_connection->messages.get_message(messageid) ;
   if (!m){
     EPRINT("PUBREC: received unknown message ID %u\n", messageid) ;
     return ;
@@ -119,22 +176,23 @@ void ClientMqttSn::received_pubrec(uint8_t *sender_address, uint8_t *data, uint8
   m->set_activity(MqttMessage::Activity::publishing) ;
 }
 
-void ClientMqttSn::received_pubrel(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_pubrel(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len != 2) return ; // Invalid PUBREL message length
+  MqttMessageIdView pubrel(data, len) ;
+  if (!pubrel.valid()) return ; // Invalid PUBREL message length
   
-  if (!m_client_connection.is_connected()) return ;
+  if (!m_client_connection->is_connected() && !m_client_connection->is_awake()) return ;
 
   // Check that this is coming from the expected gateway
-  if (!m_client_connection.address_match(sender_address)) return ;
+  if (!m_client_connection->address_match(sender_address)) return ;
 
   // Note the server activity and reset timers
-  m_client_connection.update_activity() ;
+  m_client_connection->update_activity() ;
 
-  uint16_t messageid = (data[0] << 8) | data[1] ;
+  uint16_t messageid = pubrel.message_id() ;
   DPRINT("PUBREL: {messageid = %u}\n", messageid) ;
 
-  MqttMessage *m = m_client_connection.messages.get_message(messageid,true) ;
+  MqttMessage *m = m_client_connection->messages.get_message(messageid,true) ;
   if (!m){
     EPRINT("PUBREL: received unknown message ID %u\n", messageid) ;
     return ;
@@ -146,7 +204,7 @@ void ClientMqttSn::received_pubrel(uint8_t *sender_address, uint8_t *data, uint8
   }
 
   // This is the final comms for a QoS 2 message.
-  if (writemqtt(&m_client_connection, MQTT_PUBCOMP, data, 2)){
+  if (writemqtt(m_client_connection, MQTT_PUBCOMP, data, 2)){
     DPRINT("PUBREL: Writing PUBCOMP to server\n") ;
     m->set_inactive() ; // Close message
   }else{
@@ -155,18 +213,19 @@ void ClientMqttSn::received_pubrel(uint8_t *sender_address, uint8_t *data, uint8
     
 }
 
-void ClientMqttSn::received_pubcomp(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_pubcomp(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len != 2) return ; // Invalid PUBCOMP message length
-  uint16_t messageid = (data[0] << 8) | data[1] ; // Assuming MSB is first
+  MqttMessageIdView pubcomp(data, len) ;
+  if (!pubcomp.valid()) return ; // Invalid PUBCOMP message length
+  uint16_t messageid = pubcomp.message_id() ;
 
   // not for this client if the connection address is different
-  if (!m_client_connection.address_match(sender_address)) return ; 
+  if (!m_client_connection->address_match(sender_address)) return ; 
 
   // Note the server activity and reset timers
-  m_client_connection.update_activity() ;
+  m_client_connection->update_activity() ;
 
-  MqttMessage *m = m_client_connection.messages.get_message(messageid) ;
+  MqttMessage *m = m_client_connection->messages.get_message(messageid) ;
   if (!m){
     EPRINT("PUBCOMP: received unknown message ID %u\n", messageid) ;
     return ;
@@ -181,32 +240,35 @@ void ClientMqttSn::received_pubcomp(uint8_t *sender_address, uint8_t *data, uint
 
   // Complete the message
   m->set_inactive();
+  store_complete(messageid) ;
 
   if (m_fnpublished) (*m_fnpublished)(true,
 				      MQTT_RETURN_ACCEPTED,
 				      m->get_topic_id(),
 				      m->get_message_id(),
-				      m_client_connection.get_gwid());
+				      m_client_connection->get_gwid());
 }
 
-void ClientMqttSn::received_suback(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_suback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len < 6) return ;
+  MqttSubackView suback(data, len) ;
+  if (!suback.valid()) return ;
 
-  uint16_t topicid = (data[1] << 8) | data[2] ; // Assuming MSB is first
-  uint16_t messageid = (data[3] << 8) | data[4] ; // Assuming MSB is first
+  uint16_t topicid = suback.topic_id() ;
+  uint16_t messageid = suback.message_id() ;
+  uint8_t returncode = suback.return_code() ;
 
   // Check connection status, are we connected, otherwise ignore
-  if (!m_client_connection.is_connected()) return ;
+  if (!m_client_connection->is_connected()) return ;
   // Verify the source address is our connected gateway
-  if (!m_client_connection.address_match(sender_address)) return ; 
+  if (!m_client_connection->address_match(sender_address)) return ; 
 
 #ifndef ARDUINO
   pthread_mutex_lock(&m_mqttlock) ;
 #endif
-  m_client_connection.update_activity() ; // Reset timers
+  m_client_connection->update_activity() ; // Reset timers
 
-  MqttMessage *m = m_client_connection.messages.get_message(messageid) ;
+  MqttMessage *m = m_client_connection->messages.get_message(messageid) ;
   if (!m){
     EPRINT("SUBACK: received unknown message ID %u\n", messageid) ;
     return ;
@@ -218,11 +280,46 @@ void ClientMqttSn::received_suback(uint8_t *sender_address, uint8_t *data, uint8
   DPRINT("SUBACK: {topicid: %u, messageid: %u}\n", topicid, messageid) ;
 
   MqttTopic *t = NULL ;
+  uint8_t topictype ;
 
-  switch(data[5]){
+  switch(returncode){
   case MQTT_RETURN_ACCEPTED:
-    if (topicid > 0){ // Do nothing for wildcard topics
-      if ( (t=m_client_connection.topics.get_topic(topicid)) ){
+    accepted() ;
+    topictype = FLAG_NORMAL_TOPIC_ID ;
+    if (m->get_message_type() == MQTT_SUBSCRIBE)
+      topictype = m->get_message()[0] & (FLAG_DEFINED_TOPIC_ID | FLAG_SHORT_TOPIC_NAME) ;
+    if (topictype == FLAG_DEFINED_TOPIC_ID && m->get_message_len() == 5){
+      // Flag the predefined topic so it can be subscribed again after
+      // a failover
+      if ((t = m_predefined_topics.get_topic((m->get_message()[3] << 8) | m->get_message()[4])))
+	t->set_subscribed(true) ;
+    }else if (topictype == FLAG_SHORT_TOPIC_NAME && m->get_message_len() == 5){
+      // Short topics are not registered. Keep the name to subscribe
+      // again after a failover
+      char szshort[3] ;
+      szshort[0] = m->get_message()[3] ;
+      szshort[1] = m->get_message()[4] ;
+      szshort[2] = '\0' ;
+      if ((t = m_short_subscriptions.reg_topic(szshort, messageid))){
+	t->set_short_topic(true) ;
+	t->set_subscribed(true) ;
+      }
+    }else if (topicid > 0){
+      if (m->get_message_type() == MQTT_SUBSCRIBE && m->get_message_len() > 3){
+	// Subscribed by name. Any cached ID for the name or cached topic
+	// with the ID may be stale
+	char szname[PACKET_DRIVER_MAX_PAYLOAD] ;
+	mqtt_len_t namelen = m->get_message_len() - 3 ;
+	memcpy(szname, m->get_message() + 3, namelen) ;
+	szname[namelen] = '\0' ;
+	drop_stale_topic(topicid, szname) ;
+	if ((t=m_client_connection->topics.get_topic(szname)) &&
+	    t->is_complete() && t->get_id() != topicid){
+	  t->complete(topicid) ;
+	  save_topic_cache() ;
+	}
+      }
+      if ( (t=m_client_connection->topics.get_topic(topicid)) ){
 	// Topic exists already - could have been previously registered.
 	if (!t->is_complete()){
 	  // Complete the topic anyway
@@ -231,19 +328,33 @@ void ClientMqttSn::received_suback(uint8_t *sender_address, uint8_t *data, uint8
 	}
 	// Set subscription flag
 	t->set_subscribed(true) ;
-      }else if (! (t=m_client_connection.topics.complete_topic(messageid, topicid))){
+	resolve_topic_handler(t) ;
+	m_standby_synced = false ;
+      }else if (! (t=m_client_connection->topics.complete_topic(messageid, topicid))){
 	// Topic completion may not work if the topicid was already registered or
 	// previously subscribed
 	EPRINT("SUBACK: Client cannot complete topic ID %u for mid %u\n", topicid, messageid) ;
       }else{
 	// Set subscription flag
 	t->set_subscribed(true) ;
+	resolve_topic_handler(t) ;
+	m_standby_synced = false ;
       }
+    }else{
+      // Wildcard filters have no topic ID. Flag them so they can be
+      // made again after a failover
+      m_client_connection->topics.iterate_first_topic() ;
+      for (t = m_client_connection->topics.get_curr_topic(); t; t = m_client_connection->topics.get_next_topic())
+	if (t->is_wildcard() && t->get_message_id() == messageid) break ;
+      if (t) t->set_subscribed(true) ;
     }
+    // Keep the granted QoS to subscribe again with
+    if (t) t->set_qos(suback.qos() == FLAG_QOS2?2:suback.qos() == FLAG_QOS1?1:0) ;
 
     break ;
   case MQTT_RETURN_CONGESTION:
     EPRINT("SUBACK: {return code = Congestion}\n") ;
+    congested() ;
     break ;
   case MQTT_RETURN_INVALID_TOPIC:
     EPRINT("SUBACK: {return code = Invalid Topic}\n") ;
@@ -252,39 +363,36 @@ void ClientMqttSn::received_suback(uint8_t *sender_address, uint8_t *data, uint8
     EPRINT("SUBACK: {return code = Not Supported}\n") ;
     break ;
   default:
-    EPRINT("SUBACK: {return code = %u}\n", data[5]) ;
+    EPRINT("SUBACK: {return code = %u}\n", returncode) ;
     break;
   }
 
 #ifndef ARDUINO
   pthread_mutex_unlock(&m_mqttlock) ;
 #endif
-  if (m_fnsubscribed) (*m_fnsubscribed)(data[5] == MQTT_RETURN_ACCEPTED,
-					data[5], topicid, messageid,
-					m_client_connection.get_gwid());
+  if (m_fnsubscribed) (*m_fnsubscribed)(returncode == MQTT_RETURN_ACCEPTED,
+					returncode, topicid, messageid,
+					m_client_connection->get_gwid());
 }
 
-void ClientMqttSn::received_unsubscribe(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_unsubscribe(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
 
 }
 
-void ClientMqttSn::received_unsuback(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_unsuback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
 
 }
 
-void ClientMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len < 5) return ; // not long enough to be a publish
-  uint16_t topicid = (data[1] << 8) | data[2] ; // Assuming MSB is first
-  uint16_t messageid = (data[3] << 8) | data[4] ; // Assuming MSB is first
-  uint8_t qos = data[0] & FLAG_QOSN1 ;
-  uint8_t topic_type = data[0] & (FLAG_DEFINED_TOPIC_ID | FLAG_SHORT_TOPIC_NAME);
-  uint8_t payload[PACKET_DRIVER_MAX_PAYLOAD] ;
-  int payload_len = len-5 ;
-
-  memcpy(payload, data+5, payload_len) ;
+  MqttPublishView pub(data, len) ;
+  if (!pub.valid()) return ; // not long enough to be a publish
+  uint16_t topicid = pub.topic_id() ;
+  uint16_t messageid = pub.message_id() ;
+  uint8_t qos = pub.qos() ;
+  uint8_t topic_type = pub.topic_type() ;
 
   m_buff[0] = data[1] ; // replicate topic id 
   m_buff[1] = data[2] ; // replicate topic id 
@@ -292,12 +400,13 @@ void ClientMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint
   m_buff[3] = data[4] ; // replicate message id
 
   DPRINT("PUBLISH: {Flags = %X, QoS = %u, Topic ID = %u, Mess ID = %u}\n",
-	 data[0], qos, topicid, messageid) ;
+	 pub.flags(), qos, topicid, messageid) ;
 
   // Check connection status, are we connected, otherwise ignore
-  if (!m_client_connection.is_connected()) return ;
+  if (!m_client_connection->is_connected() && !m_client_connection->is_awake()) return ;
   // Verify the source address is our connected gateway
-  if (!m_client_connection.address_match(sender_address)) return ; 
+  if (!m_client_connection->address_match(sender_address)) return ; 
+  m_client_connection->update_activity() ;
 
   // Search and get the topic from ID
   MqttTopic *t = NULL ;
@@ -305,7 +414,7 @@ void ClientMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint
   char szshort[3] ;
   switch(topic_type){
   case FLAG_NORMAL_TOPIC_ID:
-    t=m_client_connection.topics.get_topic(topicid);
+    t=m_client_connection->topics.get_topic(topicid);
     break ;
   case FLAG_DEFINED_TOPIC_ID:
     t = m_predefined_topics.get_topic(topicid);
@@ -319,7 +428,7 @@ void ClientMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint
   default:
     // Unknown or not implemented
     m_buff[4] = MQTT_RETURN_NOT_SUPPORTED;
-    writemqtt(&m_client_connection, MQTT_PUBACK, m_buff, 5) ;
+    writemqtt(m_client_connection, MQTT_PUBACK, m_buff, 5) ;
     return ;
   }
   if (topic_type != FLAG_SHORT_TOPIC_NAME){
@@ -327,31 +436,38 @@ void ClientMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint
       sztopic = t->get_topic() ;
     }else{
       m_buff[4] = MQTT_RETURN_INVALID_TOPIC ;
-      writemqtt(&m_client_connection, MQTT_PUBACK, m_buff, 5) ;
+      writemqtt(m_client_connection, MQTT_PUBACK, m_buff, 5) ;
       return ;
     }
   }
   
   // tell client of message
-  // bool success, uint8_t return, const char* topic, uint8_t* payload, uint8_t payloadlen, uint8_t gwid
-  if (m_fnmessage) (*m_fnmessage)(true, MQTT_RETURN_ACCEPTED, sztopic, payload, payload_len, m_client_connection.get_gwid());
+  // bool success, uint8_t return, const char* topic, uint8_t* payload, mqtt_len_t payloadlen, uint8_t gwid
+  if (t && t->has_handler()){
+    t->handle(sztopic, pub.payload(), pub.payload_len(), m_client_connection->get_gwid()) ;
+  }else if (!t && (t = find_topic_handler(sztopic))){
+    // Short topics have no registration to hold the handler
+    t->handle(sztopic, pub.payload(), pub.payload_len(), m_client_connection->get_gwid()) ;
+  }else if (m_fnmessage){
+    (*m_fnmessage)(true, MQTT_RETURN_ACCEPTED, sztopic, pub.payload(), pub.payload_len(), m_client_connection->get_gwid());
+  }
 
   // QoS 0 and 1 can be handled without a message adding to queue
   if (qos == FLAG_QOS0 || qos == FLAG_QOS1){
 
     if (qos == FLAG_QOS1){
       m_buff[4] = MQTT_RETURN_ACCEPTED ;
-      writemqtt(&m_client_connection, MQTT_PUBACK, m_buff, 5);
+      writemqtt(m_client_connection, MQTT_PUBACK, m_buff, 5);
     }
     return ;
   }
 
   // QoS 2 messages require a PUBREC
-  MqttMessage *m = m_client_connection.messages.add_message(MqttMessage::Activity::publishing);
+  MqttMessage *m = m_client_connection->messages.add_message(MqttMessage::Activity::publishing);
   if (!m){
     EPRINT("PUBLISH: Cannot process publish due to full message queue\n");
     m_buff[4] = MQTT_RETURN_CONGESTION ;
-    writemqtt(&m_client_connection, MQTT_PUBACK, m_buff, 5) ;
+    writemqtt(m_client_connection, MQTT_PUBACK, m_buff, 5) ;
     return ;
   }
 
@@ -362,32 +478,46 @@ void ClientMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint
   m->set_message(MQTT_PUBREC, m_buff+2, 2) ;
 }
 
-void ClientMqttSn::received_register(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_register(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len < 4) return ;
-  uint16_t topicid = (data[0] << 8) | data[1] ; // Assuming MSB is first
-  uint16_t messageid = (data[2] << 8) | data[3] ; // Assuming MSB is first
+  MqttRegisterView reg(data, len) ;
+  if (!reg.valid()) return ;
+  uint16_t topicid = reg.topic_id() ;
+  uint16_t messageid = reg.message_id() ;
   char sztopic[PACKET_DRIVER_MAX_PAYLOAD - MQTT_REGISTER_HDR_LEN +1] ;
-  if (len - 4 > PACKET_DRIVER_MAX_PAYLOAD - MQTT_REGISTER_HDR_LEN) return ; // overflow
-  memcpy(sztopic, data+4, len-4) ;
-  sztopic[len-4] = '\0';
+  if (reg.topic_len() > PACKET_DRIVER_MAX_PAYLOAD - MQTT_REGISTER_HDR_LEN) return ; // overflow
+  memcpy(sztopic, reg.topic(), reg.topic_len()) ;
+  sztopic[reg.topic_len()] = '\0';
 
   // Check connection status, are we connected, otherwise ignore
-  if (!m_client_connection.is_connected()) return ;
+  if (!m_client_connection->is_connected() && !m_client_connection->is_awake()) return ;
   // Verify the source address is our connected gateway
-  if (!m_client_connection.address_match(sender_address)) return ; 
+  if (!m_client_connection->address_match(sender_address)) return ; 
 
 #ifndef ARDUINO
   pthread_mutex_lock(&m_mqttlock) ;
 #endif
   
-  m_client_connection.update_activity() ; // Reset timers
+  m_client_connection->update_activity() ; // Reset timers
   
   DPRINT("REGISTER: {topicid: %u, messageid: %u, topic %s}\n", topicid, messageid, sztopic) ;
 
-  MqttTopic *t = NULL;
-  if (!(t=m_client_connection.topics.create_topic(sztopic, topicid))){
-    EPRINT("Server error, cannot create topic %s, possible memory error or topic already exists\n", sztopic) ;
+  MqttTopic *t = m_client_connection->topics.get_topic(topicid) ;
+  if (t && strcmp(t->get_topic(), sztopic) == 0){
+    // Cached topic confirmed by the gateway
+  }else{
+    // Replace any cached registrations which no longer match
+    if (t) m_client_connection->topics.del_topic(t) ;
+    if ((t = m_client_connection->topics.get_topic(sztopic)))
+      m_client_connection->topics.del_topic(t) ;
+    if (!(t=m_client_connection->topics.create_topic(sztopic, topicid))){
+      EPRINT("Server error, cannot create topic %s, possible memory error or topic already exists\n", sztopic) ;
+    }else{
+      t->complete(topicid) ;
+      resolve_topic_handler(t) ;
+      save_topic_cache() ;
+      m_standby_synced = false ;
+    }
   }
   
   uint8_t response[5] ;
@@ -396,34 +526,41 @@ void ClientMqttSn::received_register(uint8_t *sender_address, uint8_t *data, uin
   response[2] = data[2] ; // Echo back the messageid received
   response[3] = data[3] ; // Echo back the messageid received
   response[4] = MQTT_RETURN_ACCEPTED ;
-  writemqtt(&m_client_connection, MQTT_REGACK, response, 5) ;
+  writemqtt(m_client_connection, MQTT_REGACK, response, 5) ;
 #ifndef ARDUINO
   pthread_mutex_unlock(&m_mqttlock) ;
 #endif
   // Call the client callback to inform of new topic
   // Implicitly acceped, returns zero for message ID as client didn't request
-  if (m_fnregister) (*m_fnregister)(true, MQTT_RETURN_ACCEPTED, topicid, 0, m_client_connection.get_gwid());
+  if (m_fnregister) (*m_fnregister)(true, MQTT_RETURN_ACCEPTED, topicid, 0, m_client_connection->get_gwid());
 
 }
 
-void ClientMqttSn::received_regack(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_regack(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len != 5) return ;
+  MqttAckView regack(data, len) ;
+  if (!regack.valid()) return ;
   bool bsuccess = false ;
+  MqttTopic *t = NULL ;
   
-  uint16_t topicid = (data[0] << 8) | data[1] ; // Assuming MSB is first
-  uint16_t messageid = (data[2] << 8) | data[3] ; // Assuming MSB is first
-  uint8_t returncode = data[4] ;
+  uint16_t topicid = regack.topic_id() ;
+  uint16_t messageid = regack.message_id() ;
+  uint8_t returncode = regack.return_code() ;
 
   DPRINT("REGACK: {topicid = %u, messageid = %u, returncode = %u}\n", topicid, messageid, returncode) ;
 
+  if (from_standby(sender_address)){
+    received_standby_regack(topicid, messageid, returncode) ;
+    return ;
+  }
+
   // Check connection status, are we connected, otherwise ignore
-  if (!m_client_connection.is_connected()) return ;
+  if (!m_client_connection->is_connected()) return ;
   // not for this client if the connection address is different
-  if (!m_client_connection.address_match(sender_address)) return ; 
-  m_client_connection.update_activity() ;
+  if (!m_client_connection->address_match(sender_address)) return ; 
+  m_client_connection->update_activity() ;
 
-  MqttMessage *m = m_client_connection.messages.get_message(messageid) ;
+  MqttMessage *m = m_client_connection->messages.get_message(messageid) ;
   if (!m){
     EPRINT("REGACK: received unknown message ID %u\n", messageid) ;
     return ;
@@ -434,32 +571,41 @@ void ClientMqttSn::received_regack(uint8_t *sender_address, uint8_t *data, uint8
 
   switch(returncode){
   case MQTT_RETURN_ACCEPTED:
-    if (!m_client_connection.topics.complete_topic(messageid, topicid)){
+    m_client_connection->topics.iterate_first_topic() ;
+    for (t = m_client_connection->topics.get_curr_topic(); t; t = m_client_connection->topics.get_next_topic())
+      if (t->get_message_id() == messageid && !t->is_complete()) break ;
+    if (t) drop_stale_topic(topicid, t->get_topic()) ;
+    if (!(t = m_client_connection->topics.complete_topic(messageid, topicid))){
       EPRINT("Cannot complete topic %u with messageid %u\n", topicid, messageid) ;
     }else{
       bsuccess = true ;
+      accepted() ;
+      resolve_topic_handler(t) ;
+      save_topic_cache() ;
+      m_standby_synced = false ;
     }
     break ;
   case MQTT_RETURN_CONGESTION:
     EPRINT("REGACK: {return code = Congestion}\n") ;
-    m_client_connection.topics.del_topic_by_messageid(messageid) ;
+    congested() ;
+    m_client_connection->topics.del_topic_by_messageid(messageid) ;
     break ;
   case MQTT_RETURN_INVALID_TOPIC:
     EPRINT("REGACK: {return code = Invalid Topic}\n") ;
-    m_client_connection.topics.del_topic_by_messageid(messageid) ;
+    m_client_connection->topics.del_topic_by_messageid(messageid) ;
     break ;
   case MQTT_RETURN_NOT_SUPPORTED:
     EPRINT("REGACK: {return code = Not Supported}\n") ;
-    m_client_connection.topics.del_topic_by_messageid(messageid) ;
+    m_client_connection->topics.del_topic_by_messageid(messageid) ;
     break ;
   default:
     EPRINT("REGACK: {return code = %u}\n", returncode) ;
-    m_client_connection.topics.del_topic_by_messageid(messageid) ;
+    m_client_connection->topics.del_topic_by_messageid(messageid) ;
   }
-  if (m_fnregister) (*m_fnregister)(bsuccess, returncode, topicid, messageid, m_client_connection.get_gwid());
+  if (m_fnregister) (*m_fnregister)(bsuccess, returncode, topicid, messageid, m_client_connection->get_gwid());
 }
 
-void ClientMqttSn::received_pingresp(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_pingresp(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
 #ifndef ARDUINO
   pthread_mutex_lock(&m_mqttlock) ;
@@ -467,10 +613,15 @@ void ClientMqttSn::received_pingresp(uint8_t *sender_address, uint8_t *data, uin
   MqttGwInfo *gw = get_gateway_address(sender_address);
   if (gw){
     gw->update_activity() ;
+    gw->response_received() ;
 
-    if (gw->get_gwid() == m_client_connection.get_gwid()){
+    if (gw->get_gwid() == m_client_connection->get_gwid()){
       // Ping received from connected gateway
-      m_client_connection.update_activity() ;
+      m_client_connection->update_activity() ;
+      // Buffered messages have been delivered to the awake client
+      if (m_client_connection->is_awake()) fall_asleep() ;
+    }else if (from_standby(sender_address)){
+      m_standby_connection->update_activity() ;
     }
   }
 #ifndef ARDUINO
@@ -478,36 +629,40 @@ void ClientMqttSn::received_pingresp(uint8_t *sender_address, uint8_t *data, uin
 #endif
 }
 
-void ClientMqttSn::received_pingreq(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_pingreq(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
   // regardless of client or gateway just send the ACK
   addrwritemqtt(sender_address, MQTT_PINGRESP, NULL, 0) ; 
 }
 
-void ClientMqttSn::received_advertised(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_advertised(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  uint16_t duration = (data[1] << 8) | data[2] ; // Assuming MSB is first
-  DPRINT("ADVERTISED: {gw = %u, duration = %u}\n", data[0], duration) ;
+  MqttAdvertiseView advertise(data, len) ;
+  if (!advertise.valid()) return ;
+  uint8_t gwid = advertise.gwid() ;
+  uint16_t duration = advertise.duration() ;
+  DPRINT("ADVERTISED: {gw = %u, duration = %u}\n", gwid, duration) ;
 
 #ifndef ARDUINO
   pthread_mutex_lock(&m_mqttlock) ;
 #endif
   // Call update gateway. This returns false if gateway is not known
-  if (!update_gateway(sender_address, data[0], duration)){
+  search_answered() ;
+  if (!update_gateway(sender_address, gwid, duration)){
 
     // New gateway
-    bool ret = add_gateway(sender_address, data[0], duration);
+    bool ret = add_gateway(sender_address, gwid, duration);
     if (!ret){
-      EPRINT("ADVERTISED: Cannot add gateway %u\n", data[0]) ;
+      EPRINT("ADVERTISED: Cannot add gateway %u\n", gwid) ;
     }else{
-      if (m_fngatewayinfo) (*m_fngatewayinfo)(true, data[0]) ;
+      if (m_fngatewayinfo) (*m_fngatewayinfo)(true, gwid) ;
     }
   }
 
   // If client is connected to this gateway then update client connection activity
-  if (m_client_connection.is_connected() &&
-      m_client_connection.get_gwid() == data[0]){
-    m_client_connection.update_activity() ;
+  if (m_client_connection->is_connected() &&
+      m_client_connection->get_gwid() == gwid){
+    m_client_connection->update_activity() ;
   }
 #ifndef ARDUINO
   pthread_mutex_unlock(&m_mqttlock) ;
@@ -516,7 +671,11 @@ void ClientMqttSn::received_advertised(uint8_t *sender_address, uint8_t *data, u
 
 bool ClientMqttSn::add_gateway(uint8_t *gateway_address, uint8_t gwid, uint16_t ad_duration, bool perm)
 {
-  for (uint8_t i=0; i < MQTT_MAX_GATEWAYS; i++){
+  // Use a free entry before replacing an inactive gateway and its history
+  uint8_t i = 0 ;
+  for (i=0; i < MQTT_MAX_GATEWAYS && m_gwinfo[i].is_allocated(); i++) ;
+  if (i == MQTT_MAX_GATEWAYS) i = 0 ;
+  for (uint8_t n=0; n < MQTT_MAX_GATEWAYS; n++, i = (i + 1) % MQTT_MAX_GATEWAYS){
     if (!m_gwinfo[i].is_allocated() || !m_gwinfo[i].is_active()){
       m_gwinfo[i].reset() ; // Clear gateway
       m_gwinfo[i].set_address(gateway_address, m_pDriver->get_address_len()) ;
@@ -566,11 +725,14 @@ bool ClientMqttSn::del_gateway(uint8_t gwid)
 }
 
 
-void ClientMqttSn::received_gwinfo(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_gwinfo(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
+  MqttGwInfoView gwinfo(data, len) ;
+  if (!gwinfo.valid()) return ;
+  uint8_t gwid = gwinfo.gwid() ;
 #ifdef DEBUG
-  DPRINT("GWINFO: {gw = %u, address = ", data[0]) ;
-  for (uint8_t j=0; j < len - 1; j++) DPRINT("%02X", data[j+1]) ;
+  DPRINT("GWINFO: {gw = %u, address = ", gwid) ;
+  for (mqtt_len_t j=0; j < gwinfo.address_len(); j++) DPRINT("%02X", gwinfo.address()[j]) ;
   DPRINT("}\n") ;
 #endif
   
@@ -579,28 +741,29 @@ void ClientMqttSn::received_gwinfo(uint8_t *sender_address, uint8_t *data, uint8
   pthread_mutex_lock(&m_mqttlock) ;
 #endif
 
-  MqttMessage *m = m_client_connection.messages.get_active_message() ;
-  if (!m){
-    EPRINT("GWINFO: Cannot find active request message\n") ;
-  }else{
-    m->set_inactive() ; // Complete message
-  }
+  // GWINFO is broadcast so may answer another client's search. Only
+  // the first reply to a search this client sent is timed
+  bool timed = m_search_timed ;
+  if (!search_answered()) timed = false ;
 
   // Reset activity if searching was requested
-  if (len == m_pDriver->get_address_len()+1) // Was the address populated in GWINFO?
-    gw_updated = update_gateway(data+1, data[0], 0);
+  if (gwinfo.address_len() == m_pDriver->get_address_len()) // Was the address populated in GWINFO?
+    gw_updated = update_gateway(gwinfo.address(), gwid, 0);
   else
-    gw_updated = update_gateway(sender_address, data[0], 0);
+    gw_updated = update_gateway(sender_address, gwid, 0);
   
   if (!gw_updated){
     // Insert new gateway. Overwrite old or expired gateways
-    if (len == m_pDriver->get_address_len()+1){ // Was the address populated in GWINFO?
-      add_gateway(data+1, data[0], 0);
+    if (gwinfo.address_len() == m_pDriver->get_address_len()){ // Was the address populated in GWINFO?
+      add_gateway(gwinfo.address(), gwid, 0);
     }else{ // No address, but the sender address can be used
-      add_gateway(sender_address, data[0], 0);
+      add_gateway(sender_address, gwid, 0);
     }
-    if (m_fngatewayinfo) (*m_fngatewayinfo)(true, data[0]) ;
+    if (m_fngatewayinfo) (*m_fngatewayinfo)(true, gwid) ;
   }
+  // Time the reply to the first search request
+  MqttGwInfo *gw = get_gateway(gwid) ;
+  if (gw && timed) gw->rtt_sample(TIMENOW_MS - m_search_sent_ms) ;
 #ifndef ARDUINO
   pthread_mutex_unlock(&m_mqttlock) ;
 #endif
@@ -611,28 +774,38 @@ void ClientMqttSn::received_gwinfo(uint8_t *sender_address, uint8_t *data, uint8
   
 }
 
-void ClientMqttSn::received_connack(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_connack(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
+  MqttConnackView connack(data, len) ;
+  if (!connack.valid()) return ;
+  uint8_t returncode = connack.return_code() ;
   bool bsuccess = false ;
 #ifndef ARDUINO
   pthread_mutex_lock(&m_mqttlock) ;
 #endif
+  if (from_standby(sender_address)){
+    received_standby_connack(returncode) ;
+#ifndef ARDUINO
+    pthread_mutex_unlock(&m_mqttlock) ;
+#endif
+    return ;
+  }
   // Was this client connecting?
-  if (m_client_connection.get_state() != MqttConnection::State::connecting){
+  if (m_client_connection->get_state() != MqttConnection::State::connecting){
 #ifndef ARDUINO
     pthread_mutex_unlock(&m_mqttlock) ;
 #endif
     return ; // not enabled and expected
   }
   
-  m_client_connection.update_activity() ;
+  m_client_connection->update_activity() ;
   // TO DO - confirm that the gateway sending this matches the address expected
   // not a major fault but is worth a check
 
-  MqttMessage *m = m_client_connection.messages.get_active_message() ;
+  MqttMessage *m = m_client_connection->messages.get_active_message() ;
   if (!m){
     EPRINT("CONNACK: No active connection message available, invalid connection state\n") ;
-    m_client_connection.set_state(MqttConnection::State::disconnected) ;
+    m_client_connection->set_state(MqttConnection::State::disconnected) ;
     return ;
   }
   m->set_inactive() ; // Complete message
@@ -641,55 +814,63 @@ void ClientMqttSn::received_connack(uint8_t *sender_address, uint8_t *data, uint
     EPRINT("CONNACK: Connection complete, but will topic or message not processed\n") ;
   }
 
-  switch(data[0]){
+  MqttGwInfo *gw = get_gateway(m_client_connection->get_gwid()) ;
+  if (gw){
+    gw->response_received() ;
+    if (returncode != MQTT_RETURN_ACCEPTED) gw->failed() ;
+  }
+
+  switch(returncode){
   case MQTT_RETURN_ACCEPTED:
-    m_client_connection.set_state(MqttConnection::State::connected);
-    m_client_connection.messages.clear_queue() ;
+    m_client_connection->set_state(MqttConnection::State::connected);
+    resolve_topic_handlers() ; // picks up predefined topics
+    m_client_connection->messages.clear_queue() ;
+    store_requeue() ;
     bsuccess = true ;
     break ;
   case MQTT_RETURN_CONGESTION:
     EPRINT("CONNACK: {return code = Congestion}\n") ;
-    m_client_connection.set_state(MqttConnection::State::disconnected); // Cannot connect
+    m_client_connection->set_state(MqttConnection::State::disconnected); // Cannot connect
     break ;
   case MQTT_RETURN_INVALID_TOPIC:
     EPRINT("CONNACK: {return code = Invalid Topic}\n") ;
     // Can this still count as a connection?
-    m_client_connection.set_state(MqttConnection::State::disconnected); // Don't allow?
+    m_client_connection->set_state(MqttConnection::State::disconnected); // Don't allow?
     break ;
   case MQTT_RETURN_NOT_SUPPORTED:
     EPRINT("CONNACK: {return code = Not Supported}\n") ;
-    m_client_connection.set_state(MqttConnection::State::disconnected); // Cannot connect
+    m_client_connection->set_state(MqttConnection::State::disconnected); // Cannot connect
     break ;
   default:
-    EPRINT("CONNACK: {return code = %u}\n", data[0]) ;
+    EPRINT("CONNACK: {return code = %u}\n", returncode) ;
     // ? Are we connected ?
-    m_client_connection.set_state(MqttConnection::State::disconnected); // Cannot connect
+    m_client_connection->set_state(MqttConnection::State::disconnected); // Cannot connect
   }
   
-  if (m_fnconnected) (*m_fnconnected) (bsuccess, data[0], m_client_connection.get_gwid()) ;
+  if (m_fnconnected) (*m_fnconnected) (bsuccess, returncode, m_client_connection->get_gwid()) ;
         
 #ifndef ARDUINO
   pthread_mutex_unlock(&m_mqttlock) ;
 #endif
 }
 
-void ClientMqttSn::received_willtopicreq(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_willtopicreq(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
 
   // Check that this is coming from the expected gateway
-  if (!m_client_connection.address_match(sender_address)) return ; 
-  m_client_connection.update_activity() ;
+  if (!m_client_connection->address_match(sender_address)) return ; 
+  m_client_connection->update_activity() ;
     
   // Only clients need to respond to this
   DPRINT("WILLTOPICREQ: {}\n") ;
-  if (m_client_connection.get_state() != MqttConnection::State::connecting) return ; // Unexpected
-  MqttMessage *m = m_client_connection.messages.get_active_message() ;
+  if (m_client_connection->get_state() != MqttConnection::State::connecting) return ; // Unexpected
+  MqttMessage *m = m_client_connection->messages.get_active_message() ;
   if (!m){
     EPRINT("WILLTOPICREQ: No active connection message available, invalid connection state\n") ;
-    m_client_connection.set_state(MqttConnection::State::disconnected) ;
+    m_client_connection->set_state(MqttConnection::State::disconnected) ;
     return ;
   }
-  int willtopiclen = strlen(m_client_connection.get_will_topic()) ;
+  int willtopiclen = strlen(m_client_connection->get_will_topic()) ;
   m->reset_message() ;
   if (willtopiclen == 0){
     // No topic set
@@ -697,7 +878,7 @@ void ClientMqttSn::received_willtopicreq(uint8_t *sender_address, uint8_t *data,
     m->set_message(MQTT_WILLTOPIC, NULL, 0) ;
   }else{
     m_buff[0] = 0 ;
-    switch(m_client_connection.get_will_qos()){
+    switch(m_client_connection->get_will_qos()){
     case 0:
       m_buff[0] = FLAG_QOS0 ;
       break ;
@@ -708,69 +889,80 @@ void ClientMqttSn::received_willtopicreq(uint8_t *sender_address, uint8_t *data,
     default: // Ignore other values and set to max QOS
       m_buff[0] = FLAG_QOS2 ;
     }
-    if (m_client_connection.get_will_retain()){
+    if (m_client_connection->get_will_retain()){
       m_buff[0] |= FLAG_RETAIN ;
     }
     // Any overflow of size should have been checked so shouldn't need to check again here.
-    memcpy(m_buff+1,m_client_connection.get_will_topic(), willtopiclen) ;
+    memcpy(m_buff+1,m_client_connection->get_will_topic(), willtopiclen) ;
     m->set_message(MQTT_WILLTOPIC, m_buff, willtopiclen+1) ;
   }
   m->set_activity(MqttMessage::Activity::willtopic) ;  
 }
 
-void ClientMqttSn::received_willmsgreq(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_willmsgreq(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
   // Check that this is coming from the expected gateway
-  if (!m_client_connection.address_match(sender_address)) return ; 
-  m_client_connection.update_activity() ;
+  if (!m_client_connection->address_match(sender_address)) return ; 
+  m_client_connection->update_activity() ;
 
   // Only clients need to respond to this
   DPRINT("WILLMSGREQ: {}\n") ;
-  if (m_client_connection.get_state() != MqttConnection::State::connecting) return ; // Unexpected
-  MqttMessage *m = m_client_connection.messages.get_active_message() ;
+  if (m_client_connection->get_state() != MqttConnection::State::connecting) return ; // Unexpected
+  MqttMessage *m = m_client_connection->messages.get_active_message() ;
   if (!m){
     EPRINT("WILLMSGREQ: No active connection message available, invalid connection state\n") ;
-    m_client_connection.set_state(MqttConnection::State::disconnected) ;
+    m_client_connection->set_state(MqttConnection::State::disconnected) ;
     return ;
   }
 
   // Reuse message for will response
   m->reset_message() ;
   
-  if (m_client_connection.get_will_message_len() == 0){
+  if (m_client_connection->get_will_message_len() == 0){
     // No topic set
     m->set_message(MQTT_WILLMSG, NULL, 0) ;
   }else{
     // Any overflow of size should have been checked so shouldn't need to check again here.
-    m->set_message(MQTT_WILLMSG, m_client_connection.get_will_message(),
-		   m_client_connection.get_will_message_len());
+    m->set_message(MQTT_WILLMSG, m_client_connection->get_will_message(),
+		   m_client_connection->get_will_message_len());
   }
   m->set_activity(MqttMessage::Activity::willmessage) ;  
 }
 
-void ClientMqttSn::received_disconnect(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ClientMqttSn::received_disconnect(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
   DPRINT("DISCONNECT: {}\n") ;
+  if (from_standby(sender_address)){
+    // Standby gateway closed the session. Another will be started
+    m_standby_connection->set_state(MqttConnection::State::disconnected) ;
+    return ;
+  }
   // Disconnect request from server to client
   // probably due to an error
-  MqttMessage *m = m_client_connection.messages.get_active_message() ;
+  MqttMessage *m = m_client_connection->messages.get_active_message() ;
   if (m && m->get_activity() == MqttMessage::Activity::disconnecting){
     // Disconnect sent by client
     m->set_inactive() ; // Complete connection
     if (m_sleep_duration)
-      m_client_connection.set_state(MqttConnection::State::asleep) ;
+      m_client_connection->set_state(MqttConnection::State::asleep) ;
     else
-      m_client_connection.set_state(MqttConnection::State::disconnected) ;
+      m_client_connection->set_state(MqttConnection::State::disconnected) ;
   }else{
+    // Gateway closed the session, including a sleeping session
+    // that was awake
     m_sleep_duration = 0 ;
-    m_client_connection.set_state(MqttConnection::State::disconnected) ;
+    m_client_connection->set_state(MqttConnection::State::disconnected) ;
   }
-  m_client_connection.topics.free_topics() ; // client always forgets topics
-  m_client_connection.messages.clear_queue() ; // remove any pending messages
+  // Topics are only remembered by the cache or while asleep
+  if (!m_topic_cache && !m_client_connection->is_sleeping())
+    free_topics() ;
+  m_client_connection->messages.clear_queue() ; // remove any pending messages
+  store_requeue() ;
   MqttGwInfo *gwi = get_gateway_address(sender_address);
   uint8_t gwid = gwi?gwi->get_gwid():0;
 
   if (m_fndisconnected) (*m_fndisconnected) (m_sleep_duration?true:false, m_sleep_duration, gwid) ;
+  if (m_client_connection->is_asleep()) fall_asleep() ;
 }
 
 void ClientMqttSn::set_client_id(const char *szclientid)
@@ -785,7 +977,11 @@ const char* ClientMqttSn::get_client_id()
 
 void ClientMqttSn::initialise(uint8_t address_len, uint8_t *broadcast, uint8_t *address)
 {
-  // N/A
+  // Seed search jitter from the device address so nodes powered up
+  // together pick different slots
+  m_random = 2166136261u ^ TIMENOW_MS ;
+  for (uint8_t i=0; i < address_len; i++) m_random = (m_random ^ address[i]) * 16777619u ;
+  if (m_random == 0) m_random = 1 ;
   MqttSnEmbed::initialise(address_len, broadcast, address) ;
 }
 
@@ -794,14 +990,18 @@ bool ClientMqttSn::manage_gw_connection()
   // Has connection been lost or does the connection need a keep-alive
   // ping to maintain connection?
   
-  if (m_client_connection.lost_contact()){
-    DPRINT("MANAGE CONNECTION: Client lost connection to gateway %u\n", m_client_connection.get_gwid()) ;
+  if (m_client_connection->lost_contact()){
+    DPRINT("MANAGE CONNECTION: Client lost connection to gateway %u\n", m_client_connection->get_gwid()) ;
+    MqttGwInfo *lost = get_gateway(m_client_connection->get_gwid()) ;
+    if (lost) lost->failed() ;
+    if (failover()) return true ;
     // Close connection. Take down connection
-    m_client_connection.set_state(MqttConnection::State::disconnected) ;
-    m_client_connection.messages.clear_queue();
-    m_client_connection.topics.free_topics() ; // clear all topics
+    m_client_connection->set_state(MqttConnection::State::disconnected) ;
+    m_client_connection->messages.clear_queue();
+    store_requeue() ;
+    if (!m_topic_cache) free_topics() ; // clear all topics
     // Disable the gateway in the client register
-    MqttGwInfo *gw = get_gateway(m_client_connection.get_gwid()) ;
+    MqttGwInfo *gw = get_gateway(m_client_connection->get_gwid()) ;
     if (gw){
       gw->set_active(false);
     }
@@ -811,145 +1011,303 @@ bool ClientMqttSn::manage_gw_connection()
     return false;
     
   }else{
-    // Another ping due?      
-    if (m_client_connection.send_another_ping()){
-      bool r = ping(m_client_connection.get_gwid()) ;
+    // Another ping due? A message waiting for a response is
+    // already checking the gateway is alive
+    MqttMessage *m = m_client_connection->messages.get_active_message() ;
+    if (m && m->has_content() && m->is_sending()) return true ;
+    if (m_client_connection->send_another_ping()){
+      bool r = ping(m_client_connection->get_gwid()) ;
       if (!r) EPRINT("MANAGE CONNECTION: Ping failed\n") ;
     }
   }
   return true ;
 }
 
-bool ClientMqttSn::manage_connections()
+bool ClientMqttSn::send_message(MqttConnection *con, MqttMessage *m)
 {
-  MqttMessage *m = NULL ;
-  bool message_expired = false ;
+  // Searching for gateway requires a broadcast
+  if (m->get_activity() == MqttMessage::Activity::searching) return send_search(m) ;
   
-  if (m_client_connection.get_state() == MqttConnection::State::connected){
-    manage_gw_connection();
-  }
-  m=m_client_connection.messages.get_active_message();
-  // If the active message exists and has content (message set) then
-  // manage the status
-  if (m && m->has_content()){
-    if(!m->is_sending()){
-      // Send message to server for first attempt
-      // Check the activity as searching for gateway requires a broadcast
-      if (m->get_activity() == MqttMessage::Activity::searching){
-	if (addrwritemqtt(m_pDriver->get_broadcast(), MQTT_SEARCHGW,
-			  m->get_message(), m->get_message_len())){
-	  m->sending() ; // Flag as sending 
-	}
-      }else{
-	DPRINT("MANAGE CONNECTION: Sending MQTT message %s, Message ID %u, length %u\n",
+  if(!m->is_sending()){
+    // Send message to server for first attempt
+    DPRINT("MANAGE CONNECTION: Sending MQTT message %s, Message ID %u, length %u\n",
+	   mqtt_code_str(m->get_message_type()),
+	   m->get_message_id(),
+	   m->get_message_len());
+    if (writeframe(con,
+		   m->get_message_type(),
+		   m->get_frame())){
+      m->sending() ; // Flag as sending
+      DPRINT("MANAGE CONNECTION: WriteMqtt success\n") ;
+    }else{
+      EPRINT("MANAGE CONNECTION: WriteMqtt failed\n") ;
+    }
+  }else{
+    // Message has been sent. Check retry timers
+    if (m->has_expired(m_Tretry)){
+      if (m->has_failed(m_Nretry)){
+	// Connection has failed retry attempts
+	// Set this message to inactive and process the next message
+	DPRINT("MANAGE CONNECTION: Message failed to deliver %s, Message ID %u, length %u\n",
 	       mqtt_code_str(m->get_message_type()),
 	       m->get_message_id(),
 	       m->get_message_len());
-	if (writemqtt(&m_client_connection,
-		      m->get_message_type(),
-		      m->get_message(), m->get_message_len())){
-	  m->sending() ; // Flag as sending
-	  DPRINT("MANAGE CONNECTION: WriteMqtt success\n") ;
-	}else{
-	  EPRINT("MANAGE CONNECTION: WriteMqtt failed\n") ;
-	}
-      }
-    }else{
-      // Message has been sent. Check retry timers
-      if (m->has_expired(m_Tretry)){
-	if (m->has_failed(m_Nretry)){
-	  // Connection has failed retry attempts
-	  // Set this message to inactive and process the next message
-	  DPRINT("MANAGE CONNECTION: Message failed to deliver %s, Message ID %u, length %u\n",
-		 mqtt_code_str(m->get_message_type()),
-		 m->get_message_id(),
-		 m->get_message_len());
-	  m->set_inactive();
-	  message_expired = true ;
-	
-	}else{
-	  // Write the message again
-	  DPRINT("MANAGE CONNECTION: Resending message %s, Message ID %u\n",
-		 mqtt_code_str(m->get_message_type()), m->get_message_id());
-	  if (m->get_activity() == MqttMessage::Activity::searching){
-	    addrwritemqtt(m_pDriver->get_broadcast(), MQTT_SEARCHGW,
-			  m->get_message(), m->get_message_len());
-	  }else{
-	    writemqtt(&m_client_connection,
-		      m->get_message_type(),
-		      m->get_message(),
-		      m->get_message_len()) ;
-	  }
+	MQTT_METRIC(m_metrics.failures.inc()) ;
+	MqttGwInfo *gw = get_gateway(con->get_gwid()) ;
+	if (gw) gw->failed() ;
+	m->set_inactive();
+	return true ;
+      }else{
+	// Write the message again
+	MQTT_METRIC(m_metrics.retries.inc()) ;
+	DPRINT("MANAGE CONNECTION: Resending message %s, Message ID %u\n",
+	       mqtt_code_str(m->get_message_type()), m->get_message_id());
+	MqttGwInfo *gw = get_gateway(con->get_gwid()) ;
+	if (gw){
+	  gw->retried() ;
+	  if (m->get_message_type() == MQTT_CONNECT) gw->request_sent() ;
 	}
+	writeframe(con,
+		   m->get_message_type(),
+		   m->get_frame()) ;
       }
     }
   }
+  return false ;
+}
 
-  if (message_expired){
-    switch (m_client_connection.get_state()){
-    case MqttConnection::State::connected:
-      switch(m->get_activity()){
-      case MqttMessage::Activity::registering:
-	if (m_fnregister) (*m_fnregister)(false, MQTT_RETURN_MSG_FAILURE,
-					  0, m->get_message_id(),
-					  m_client_connection.get_gwid());
-	break;
-      case MqttMessage::Activity::publishing:
-	if (m_fnpublished) (*m_fnpublished)(false, MQTT_RETURN_MSG_FAILURE,
-					    0, m->get_message_id(),
-					    m_client_connection.get_gwid());
-	break;
-      case MqttMessage::Activity::subscribing:
-	if (m_fnsubscribed) (*m_fnsubscribed)(false, MQTT_RETURN_MSG_FAILURE,
-					      0, m->get_message_id(),
-					      m_client_connection.get_gwid());
-	break ;
-      case MqttMessage::Activity::disconnecting:
-	m_client_connection.set_state(MqttConnection::State::disconnected) ;
-	if (m_fndisconnected) (*m_fndisconnected)(false,
-						  MQTT_RETURN_MSG_FAILURE,
-						  m_client_connection.get_gwid()) ;
-	break;
-      default:
-	break ;
-      }
-    
-
+void ClientMqttSn::message_failed(MqttMessage *m)
+{
+  switch (m_client_connection->get_state()){
+  case MqttConnection::State::connected:
+    switch(m->get_activity()){
+    case MqttMessage::Activity::registering:
+      if (m_fnregister) (*m_fnregister)(false, MQTT_RETURN_MSG_FAILURE,
+					0, m->get_message_id(),
+					m_client_connection->get_gwid());
       break;
-    case MqttConnection::State::connecting:
-      m_client_connection.set_state(MqttConnection::State::disconnected) ;
-      // Failed to connect
-      if (m_fnconnected) (*m_fnconnected) (false,
-					   MQTT_RETURN_MSG_FAILURE,
-					   m_client_connection.get_gwid()) ;
+    case MqttMessage::Activity::publishing:
+      if (m_fnpublished) (*m_fnpublished)(false, MQTT_RETURN_MSG_FAILURE,
+					  0, m->get_message_id(),
+					  m_client_connection->get_gwid());
       break;
-    case MqttConnection::State::disconnected:
-      // Retry searches if no response.
-      if (m->get_activity() == MqttMessage::Activity::searching){
-	if (m_fngatewayinfo) (*m_fngatewayinfo)(false, 0) ;
-      }
-      
-      break ;
-    case MqttConnection::State::asleep:
+    case MqttMessage::Activity::subscribing:
+      if (m_fnsubscribed) (*m_fnsubscribed)(false, MQTT_RETURN_MSG_FAILURE,
+					    0, m->get_message_id(),
+					    m_client_connection->get_gwid());
       break ;
+    case MqttMessage::Activity::disconnecting:
+      m_client_connection->set_state(MqttConnection::State::disconnected) ;
+      if (m_fndisconnected) (*m_fndisconnected)(false,
+						MQTT_RETURN_MSG_FAILURE,
+						m_client_connection->get_gwid()) ;
+      break;
     default:
-      break ; // unhandled connection state
+      break ;
+    }
+    
+
+    break;
+  case MqttConnection::State::connecting:
+    m_client_connection->set_state(MqttConnection::State::disconnected) ;
+    // Failed to connect
+    if (m_fnconnected) (*m_fnconnected) (false,
+					 MQTT_RETURN_MSG_FAILURE,
+					 m_client_connection->get_gwid()) ;
+    break;
+  case MqttConnection::State::disconnected:
+    // Retry searches if no response.
+    if (m->get_activity() == MqttMessage::Activity::searching){
+      if (m_fngatewayinfo) (*m_fngatewayinfo)(false, 0) ;
+    }
+    
+    break ;
+  case MqttConnection::State::asleep:
+    break ;
+  default:
+    break ; // unhandled connection state
+  }
+}
+
+bool ClientMqttSn::manage_connections()
+{
+  MqttMessage *m = NULL ;
+  
+  if (m_client_connection->get_state() == MqttConnection::State::connected){
+    manage_gw_connection();
+  }else if (m_client_connection->is_sleeping()){
+    manage_sleep() ;
+  }
+  // Send publishes stored while disconnected
+  if (m_store && !m_store->is_empty() && m_client_connection->is_connected())
+    drain_store() ;
+
+  m=m_client_connection->messages.get_active_message();
+  // Hold back new messages to a congested gateway. Messages already sent
+  // carry on with their retries
+  if (m && !m->is_sending() && congestion_hold() &&
+      (m->get_activity() == MqttMessage::Activity::publishing ||
+       m->get_activity() == MqttMessage::Activity::subscribing ||
+       m->get_activity() == MqttMessage::Activity::registering))
+    m = NULL ;
+  // If the active message exists and has content (message set) then
+  // manage the status
+  if (m && m->has_content()){
+    bool publishing = m->get_activity() == MqttMessage::Activity::publishing ;
+    if (send_message(m_client_connection, m)) message_failed(m) ;
+
+    // Publishes queued behind a publish are sent without waiting for
+    // earlier acknowledgements, up to the send window. Stop at any
+    // other message so registrations complete before their topics are used
+    uint8_t window = 1 ;
+    MqttMessage *next = m ;
+    while (publishing && window < m_send_window &&
+	   m_client_connection->is_connected() &&
+	   (next = m_client_connection->messages.get_next_active_message(next))){
+      if (next->get_activity() != MqttMessage::Activity::publishing ||
+	  !next->has_content()) break ;
+      if (!next->is_sending() && congestion_hold()) break ;
+      window++ ;
+      if (send_message(m_client_connection, next)) message_failed(next) ;
     }
   }
+  manage_standby() ;
   // TO DO - Issue search if no gateways. Currently managed by APP
 
   // Process inbound messages
   return dispatch_queue() ;
 }
 
+void ClientMqttSn::set_publish_window(uint8_t window)
+{
+  if (window < 1) window = 1 ;
+  if (window > MQTT_MESSAGES_INFLIGHT) window = MQTT_MESSAGES_INFLIGHT ;
+  m_publish_window = window ;
+  m_send_window = window ;
+  m_send_accepted = 0 ;
+}
+
+void ClientMqttSn::congested()
+{
+  m_send_window /= 2 ;
+  if (m_send_window < 1) m_send_window = 1 ;
+  m_send_accepted = 0 ;
+  // Back off from MQTT_CONGESTION_BACKOFF_MS, doubling while the gateway
+  // stays congested, and pick a random time in the second half so
+  // clients refused together don't return together
+  if (m_congestion_backoff_ms == 0) m_congestion_backoff_ms = MQTT_CONGESTION_BACKOFF_MS ;
+  else if (m_congestion_backoff_ms < MQTT_CONGESTION_BACKOFF_MAX_MS) m_congestion_backoff_ms *= 2 ;
+  if (m_congestion_backoff_ms > MQTT_CONGESTION_BACKOFF_MAX_MS) m_congestion_backoff_ms = MQTT_CONGESTION_BACKOFF_MAX_MS ;
+  m_congestion_due_ms = TIMENOW_MS + m_congestion_backoff_ms / 2 + random_ms(m_congestion_backoff_ms / 2) ;
+  DPRINT("CONGESTION: Send window %u, holding back for %u ms\n", m_send_window,
+	 (uint32_t)(m_congestion_due_ms - TIMENOW_MS)) ;
+}
+
+void ClientMqttSn::accepted()
+{
+  m_congestion_backoff_ms = 0 ;
+  if (m_send_window >= m_publish_window) return ;
+  if (++m_send_accepted >= m_send_window){
+    m_send_window++ ;
+    m_send_accepted = 0 ;
+  }
+}
+
+bool ClientMqttSn::congestion_hold()
+{
+  return m_congestion_backoff_ms > 0 &&
+    (int32_t)(TIMENOW_MS - m_congestion_due_ms) < 0 ;
+}
+
+void ClientMqttSn::set_ping_stretch(uint8_t stretch)
+{
+  if (stretch < 1) stretch = 1 ;
+  if (stretch > MQTT_PING_STRETCH_MAX) stretch = MQTT_PING_STRETCH_MAX ;
+  m_connections[0].set_ping_stretch(stretch) ;
+  m_connections[1].set_ping_stretch(stretch) ;
+}
+
 bool ClientMqttSn::searchgw(uint8_t radius)
 {
-  MqttMessage *m = m_client_connection.messages.add_message(MqttMessage::Activity::searching);
+  MqttMessage *m = m_client_connection->messages.get_active_message() ;
+  if (m && m->get_activity() == MqttMessage::Activity::searching)
+    return true ; // already searching
+  m = m_client_connection->messages.add_message(MqttMessage::Activity::searching);
   if (!m) return false ; // too many queued messages
   m->set_message(MQTT_SEARCHGW, &radius, 1);
+  // Wait a random time so nodes starting together do not search at once
+  m_search_attempts = 0 ;
+  m_search_due_ms = TIMENOW_MS + random_ms(MQTT_SEARCHGW_JITTER_MS) ;
   
   return true ;
 }
+
+bool ClientMqttSn::send_search(MqttMessage *m)
+{
+  if ((int32_t)(TIMENOW_MS - m_search_due_ms) < 0) return false ; // not due
+  if (m->is_sending()){
+    if (m_search_attempts > m_Nretry){
+      DPRINT("SEARCHGW: No response from any gateway\n") ;
+      MQTT_METRIC(m_metrics.failures.inc()) ;
+      m_search_timed = false ;
+      m->set_inactive() ;
+      return true ;
+    }
+    MQTT_METRIC(m_metrics.retries.inc()) ;
+    m_search_timed = false ; // replies can't be matched to a request
+  }
+  if (addrwriteframe(m_pDriver->get_broadcast(), MQTT_SEARCHGW,
+		     m->get_frame())){
+    if (!m->is_sending()){
+      m->sending() ; // Flag as sending
+      m_search_sent_ms = TIMENOW_MS ;
+      m_search_timed = true ;
+    }
+  }
+  // Back off from Tretry, doubling each attempt, and pick a random
+  // time in the second half of the back off
+  uint32_t backoff = (uint32_t)m_Tretry * 1000 ;
+  for (uint8_t i=0; i < m_search_attempts && backoff < MQTT_SEARCHGW_BACKOFF_MAX * 1000UL; i++)
+    backoff *= 2 ;
+  if (backoff > MQTT_SEARCHGW_BACKOFF_MAX * 1000UL) backoff = MQTT_SEARCHGW_BACKOFF_MAX * 1000UL ;
+  m_search_attempts++ ;
+  m_search_due_ms = TIMENOW_MS + backoff / 2 + random_ms(backoff / 2) ;
+  return false ;
+}
+
+bool ClientMqttSn::search_answered()
+{
+  // Later replies can't be matched to a request
+  m_search_timed = false ;
+  MqttMessage *m = m_client_connection->messages.get_active_message() ;
+  if (m && m->get_activity() == MqttMessage::Activity::searching){
+    DPRINT("SEARCHGW: Search answered\n") ;
+    m->set_inactive() ; // Complete message
+    return true ;
+  }
+  return false ;
+}
+
+void ClientMqttSn::received_searchgw(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
+{
+  // Another client is searching. Hold back a search which hasn't been
+  // sent as the broadcast GWINFO answers both
+  MqttMessage *m = m_client_connection->messages.get_active_message() ;
+  if (m && m->get_activity() == MqttMessage::Activity::searching && !m->is_sending()){
+    m_search_due_ms = TIMENOW_MS + MQTT_GWINFO_WINDOW_MS + random_ms(MQTT_SEARCHGW_JITTER_MS) ;
+    DPRINT("SEARCHGW: Holding search while another client searches\n") ;
+  }
+}
+
+uint32_t ClientMqttSn::random_ms(uint32_t range)
+{
+  if (range == 0) return 0 ;
+  // xorshift32
+  m_random ^= m_random << 13 ;
+  m_random ^= m_random >> 17 ;
+  m_random ^= m_random << 5 ;
+  return m_random % range ;
+}
 #ifndef ARDUINO
 uint16_t ClientMqttSn::register_topic(const wchar_t *topic)
 {
@@ -964,11 +1322,11 @@ uint16_t ClientMqttSn::register_topic(const char *topic)
 {
   uint16_t len = strlen(topic) ; // len excluding terminator
 
-  if (m_client_connection.is_connected()){
+  if (m_client_connection->is_connected()){
     // Reject topic if too long for payload
     if (len > m_pDriver->get_payload_width() - MQTT_REGISTER_HDR_LEN) return 0;
 
-    MqttMessage *m = m_client_connection.messages.add_message(MqttMessage::Activity::registering);
+    MqttMessage *m = m_client_connection->messages.add_message(MqttMessage::Activity::registering);
     if (!m){
       EPRINT("Register_Topic: Cannot creae a new message\n") ;
       return 0 ;
@@ -980,7 +1338,7 @@ uint16_t ClientMqttSn::register_topic(const char *topic)
 
     uint16_t mid = m->get_message_id() ;
     // Register the topic. Return value is zero if topic is new
-    MqttTopic *t = m_client_connection.topics.reg_topic(topic, mid) ;
+    MqttTopic *t = m_client_connection->topics.reg_topic(topic, mid) ;
     if(t->get_id() > 0){
       // Topic already exists
       if (t->is_complete()){
@@ -1017,10 +1375,10 @@ uint16_t ClientMqttSn::register_topic(const char *topic)
 
 uint16_t ClientMqttSn::subscribe(uint8_t qos, const char *sztopic, bool bshorttopic)
 {
-  if (!m_client_connection.is_connected()) return 0 ;
+  if (!m_client_connection->is_connected()) return 0 ;
 
   if (qos > 2) return 0 ; // Invalid QoS
-  uint8_t topic_len = strlen(sztopic) ;
+  mqtt_len_t topic_len = strlen(sztopic) ;
   if (topic_len > m_pDriver->get_payload_width() - MQTT_SUBSCRIBE_HDR_LEN){
     EPRINT("Send subscribe: Topic %s is too long to fit in subscription message\n", sztopic) ;
     return 0 ;
@@ -1031,7 +1389,7 @@ uint16_t ClientMqttSn::subscribe(uint8_t qos, const char *sztopic, bool bshortto
     return subscribe(qos, topicid, FLAG_SHORT_TOPIC_NAME);
   }
 
-  MqttMessage *m = m_client_connection.messages.add_message(MqttMessage::Activity::subscribing) ;
+  MqttMessage *m = m_client_connection->messages.add_message(MqttMessage::Activity::subscribing) ;
   if (!m){
     EPRINT("Send subscribe: Too may in-flight messages\n") ;
     return 0 ; // Too many in-flight messages
@@ -1046,7 +1404,7 @@ uint16_t ClientMqttSn::subscribe(uint8_t qos, const char *sztopic, bool bshortto
 
   memcpy (m_buff+3, sztopic, topic_len) ;
 
-  MqttTopic *t = m_client_connection.topics.reg_topic(sztopic, mid) ;
+  MqttTopic *t = m_client_connection->topics.reg_topic(sztopic, mid) ;
   if (t->get_id() > 0 && t->is_subscribed()){
     return false;
   }
@@ -1064,7 +1422,7 @@ uint16_t ClientMqttSn::subscribe(uint8_t qos, const char *sztopic, bool bshortto
 
 uint16_t ClientMqttSn::subscribe(uint8_t qos, uint16_t topicid, uint8_t topictype)
 {
-  if (!m_client_connection.is_connected()) return 0 ;
+  if (!m_client_connection->is_connected()) return 0 ;
   if (qos > 2 || (topictype != FLAG_DEFINED_TOPIC_ID && topictype != FLAG_SHORT_TOPIC_NAME)) return 0 ;
 
   // Check if topic exists for defined topic
@@ -1073,7 +1431,7 @@ uint16_t ClientMqttSn::subscribe(uint8_t qos, uint16_t topicid, uint8_t topictyp
     return 0;
   }
 
-  MqttMessage *m = m_client_connection.messages.add_message(MqttMessage::Activity::subscribing) ;
+  MqttMessage *m = m_client_connection->messages.add_message(MqttMessage::Activity::subscribing) ;
   if (!m){
     return 0 ; // Too many in-flight messages
   }
@@ -1105,11 +1463,14 @@ bool ClientMqttSn::ping(uint8_t gwid)
   size_t clientid_len = strlen(m_szclient_id) ;
   MqttGwInfo *gw = get_gateway(gwid) ;
   if (!gw) return false ; // no gateway known
+  gw->request_sent() ;
 
   // Record when the ping was attempted, note that this doesn't care
   // if it worked
-  if (m_client_connection.get_gwid() == gwid)
-    m_client_connection.reset_ping() ;
+  if (m_client_connection->get_gwid() == gwid)
+    m_client_connection->ping_sent() ;
+  else if (m_standby_connection->get_gwid() == gwid)
+    m_standby_connection->ping_sent() ;
   
   if (addrwritemqtt(gw->get_address(), MQTT_PINGREQ, (uint8_t *)m_szclient_id, clientid_len))
     return true ;
@@ -1121,10 +1482,10 @@ bool ClientMqttSn::disconnect(uint16_t sleep_duration)
 {
   uint8_t len = 0 ;
   // Already disconnected or other issue closed the connection
-  if (m_client_connection.is_disconnected()) return false ;
-  if (m_client_connection.is_asleep()) return false ;
+  if (m_client_connection->is_disconnected()) return false ;
+  if (m_client_connection->is_sleeping()) return false ;
 
-  MqttMessage *m = m_client_connection.messages.add_message(MqttMessage::Activity::disconnecting) ;
+  MqttMessage *m = m_client_connection->messages.add_message(MqttMessage::Activity::disconnecting) ;
   if (!m){
     EPRINT("Send disconnect: Too many in-flight messages\n") ;
     return false ;
@@ -1142,7 +1503,62 @@ bool ClientMqttSn::disconnect(uint16_t sleep_duration)
   return true ; 
 }
 
-bool ClientMqttSn::publish_noqos(uint8_t gwid, const char* sztopic, const uint8_t *payload, uint8_t payload_len, bool retain)
+bool ClientMqttSn::poll()
+{
+  if (!m_client_connection->is_asleep()) return false ;
+
+  if (m_fnsleep) (*m_fnsleep)(false, 0) ;
+  if (m_sleep_power_down && !power_up()) return false ;
+  DPRINT("POLL: Waking to poll gateway %u\n", m_client_connection->get_gwid()) ;
+  m_client_connection->set_state(MqttConnection::State::awake) ;
+  m_poll_sent = TIMENOW ;
+  m_poll_attempts = 0 ;
+  // A ping with the client ID asks the gateway for buffered messages
+  return ping(m_client_connection->get_gwid()) ;
+}
+
+void ClientMqttSn::fall_asleep()
+{
+  m_client_connection->set_state(MqttConnection::State::asleep) ;
+  m_client_connection->asleep_from = TIMENOW ;
+  m_client_connection->sleep_duration = m_sleep_duration ;
+  DPRINT("SLEEP: Sleeping for %u sec\n", m_sleep_duration) ;
+  if (m_sleep_power_down) shutdown() ;
+  if (m_fnsleep) (*m_fnsleep)(true, m_sleep_duration) ;
+}
+
+void ClientMqttSn::manage_sleep()
+{
+  MqttGwInfo *gw = NULL ;
+  
+  if (m_client_connection->is_asleep()){
+    if (m_client_connection->asleep_from + m_client_connection->sleep_duration <= TIMENOW)
+      poll() ;
+    return ;
+  }
+  // Awake. Messages from the gateway show the poll is being answered
+  if (m_client_connection->get_last_activity() > m_poll_sent){
+    m_poll_sent = m_client_connection->get_last_activity() ;
+    m_poll_attempts = 0 ;
+  }
+  // Retry the poll if the gateway hasn't responded
+  if (m_poll_sent + m_Tretry > TIMENOW) return ;
+  if (++m_poll_attempts > m_Nretry){
+    DPRINT("POLL: Gateway %u did not respond to poll\n", m_client_connection->get_gwid()) ;
+    if ((gw = get_gateway(m_client_connection->get_gwid()))) gw->failed() ;
+    m_sleep_duration = 0 ;
+    m_client_connection->set_state(MqttConnection::State::disconnected) ;
+    m_client_connection->messages.clear_queue() ;
+    store_requeue() ;
+    if (!m_topic_cache) free_topics() ;
+    if (m_fndisconnected) (*m_fndisconnected)(false, 0, m_client_connection->get_gwid()) ;
+    return ;
+  }
+  m_poll_sent = TIMENOW ;
+  if (!ping(m_client_connection->get_gwid())) EPRINT("POLL: Ping failed\n") ;
+}
+
+bool ClientMqttSn::publish_noqos(uint8_t gwid, const char* sztopic, const uint8_t *payload, mqtt_len_t payload_len, bool retain)
 {
   uint16_t topicid = 0;
   // This will send Qos -1 messages with a short topic
@@ -1154,26 +1570,24 @@ bool ClientMqttSn::publish_noqos(uint8_t gwid, const char* sztopic, const uint8_
 		       payload, payload_len, retain) ;
 }
 
-bool ClientMqttSn::publish_noqos(uint8_t gwid, uint16_t topicid, uint8_t topictype, const uint8_t *payload, uint8_t payload_len, bool retain)
+bool ClientMqttSn::publish_noqos(uint8_t gwid, uint16_t topicid, uint8_t topictype, const uint8_t *payload, mqtt_len_t payload_len, bool retain)
 {
-  m_buff[0] = (retain?FLAG_RETAIN:0) | FLAG_QOSN1 | topictype ;
-  m_buff[1] = topicid >> 8 ;
-  m_buff[2] = topicid & 0x00FF ;
-  m_buff[3] = 0 ;
-  m_buff[4] = 0 ;
-  uint8_t len = payload_len + MQTT_PUBLISH_HDR_LEN ;
+  MqttFrame frame ;
   if (payload_len > (m_pDriver->get_payload_width() - MQTT_PUBLISH_HDR_LEN)){
     EPRINT("Send publish: Payload of %u bytes is too long for publish\n", payload_len) ;
     return false ;
   }
-  memcpy(m_buff+MQTT_PUBLISH_HDR_LEN,payload, payload_len);
+  frame.u8((retain?FLAG_RETAIN:0) | FLAG_QOSN1 | topictype)
+    .u16(topicid)
+    .u16(0)
+    .bytes(payload, payload_len) ;
 
   MqttGwInfo *gw = get_gateway(gwid) ;
   if (!gw) return false ;
 
   if(topictype == FLAG_SHORT_TOPIC_NAME ||
      topictype == FLAG_DEFINED_TOPIC_ID){
-    if (!addrwritemqtt(gw->get_address(), MQTT_PUBLISH, m_buff, len)){
+    if (!addrwriteframe(gw->get_address(), MQTT_PUBLISH, frame)){
       EPRINT("Send publish: Failed to send QoS -1 message\n") ;
       return false ;
     }
@@ -1187,7 +1601,7 @@ bool ClientMqttSn::publish_noqos(uint8_t gwid, uint16_t topicid, uint8_t topicty
   return true ;
 }
 
-uint16_t ClientMqttSn::publish(uint8_t qos, const char *sztopic, const uint8_t *payload, uint8_t payload_len, bool retain)
+uint16_t ClientMqttSn::publish(uint8_t qos, const char *sztopic, const uint8_t *payload, mqtt_len_t payload_len, bool retain)
 {
   uint16_t topicid = 0;
   // This will send messages with a short topic
@@ -1199,48 +1613,139 @@ uint16_t ClientMqttSn::publish(uint8_t qos, const char *sztopic, const uint8_t *
 		 payload, payload_len, retain) ;
 }
 
-uint16_t ClientMqttSn::publish(uint8_t qos, uint16_t topicid, uint16_t topictype, const uint8_t *payload, uint8_t payload_len, bool retain)
+uint16_t ClientMqttSn::publish(uint8_t qos, uint16_t topicid, uint16_t topictype, const uint8_t *payload, mqtt_len_t payload_len, bool retain)
 {
-  // This publish call will not handle -1 QoS messages
-  if (!m_client_connection.is_connected()) return false ;
-
   if (qos > 2) return false ; // Invalid QoS
 
   if (payload_len > (m_pDriver->get_payload_width() - MQTT_PUBLISH_HDR_LEN)){
     EPRINT("Send publish: Payload of %u bytes is too long for publish\n", payload_len) ;
     return 0 ;
   }
-  
-  MqttMessage *m = m_client_connection.messages.add_message(MqttMessage::Activity::publishing) ;
+
+  // Keep publishes in order behind any already stored
+  if (m_store && (!m_client_connection->is_connected() || !m_store->is_empty())){
+    if (topictype == FLAG_NORMAL_TOPIC_ID){
+      EPRINT("Send publish: Registered topic IDs cannot be stored while disconnected\n") ;
+      return 0 ;
+    }
+#ifndef ARDUINO
+    pthread_mutex_lock(&m_mqttlock) ;
+#endif
+    bool stored = m_store->push(topicid, topictype, payload, payload_len, qos, retain) ;
+#ifndef ARDUINO
+    pthread_mutex_unlock(&m_mqttlock) ;
+#endif
+    if (!stored){
+      EPRINT("Send publish: Offline store is full\n") ;
+      return 0 ;
+    }
+    return MQTT_MESSAGE_STORED ;
+  }
+  return send_publish(qos, topicid, topictype, payload, payload_len, retain) ;
+}
+
+uint16_t ClientMqttSn::send_publish(uint8_t qos, uint16_t topicid, uint16_t topictype, const uint8_t *payload, mqtt_len_t payload_len, bool retain)
+{
+  // This publish call will not handle -1 QoS messages
+  if (!m_client_connection->is_connected()) return false ;
+
+  MqttMessage *m = m_client_connection->messages.add_message(MqttMessage::Activity::publishing) ;
   if (!m){
     EPRINT("Send publish: Too many in-flight messages\n") ;
     return 0 ;
   }
-  m_buff[0] = (retain?FLAG_RETAIN:0) |
+  uint8_t flags = (retain?FLAG_RETAIN:0) |
     (qos==0?FLAG_QOS0:0) |
     (qos==1?FLAG_QOS1:0) |
     (qos==2?FLAG_QOS2:0) |
     topictype;
-  m_buff[1] = topicid >> 8 ;
-  m_buff[2] = topicid & 0x00FF ;
   uint16_t mid = m->get_message_id() ;
-  m_buff[3] = mid >> 8 ;
-  m_buff[4] = mid & 0x00FF ;
-  uint8_t len = payload_len + 5 ;
-
-  memcpy(m_buff+5,payload, payload_len);
 
-  m->set_message(MQTT_PUBLISH, m_buff, len);
+  // Encode straight into the message cache
+  m->encode_message(MQTT_PUBLISH)
+    .u8(flags)
+    .u16(topicid)
+    .u16(mid)
+    .bytes(payload, payload_len) ;
   if (qos == 0)
     m->one_shot(true) ;
 
   m->set_topic_id(topicid) ;
   m->set_topic_type(topictype) ;
-  m->set_qos(m_buff[0] & FLAG_QOSN1);
+  m->set_qos(flags & FLAG_QOSN1);
   
   return mid ;
 }
 
+void ClientMqttSn::drain_store()
+{
+  MqttSpooled *s = NULL ;
+  MqttMessage *m = NULL ;
+  uint16_t i = 0, complete = 0, mid = 0 ;
+  time_t now = TIMENOW ;
+  if (now != m_store_drain_time){
+    m_store_drain_time = now ;
+    m_store_drained = 0 ;
+  }
+#ifndef ARDUINO
+  pthread_mutex_lock(&m_mqttlock) ;
+#endif
+  // A held publish is complete once the gateway answers or, for QoS 0,
+  // once sent. Publishes which ran out of retries or were refused for
+  // congestion are sent again after any back off.
+  // Remove complete publishes from the front
+  for (i=0; i < m_store->held(); i++){
+    if (!m_store_mids[i]) continue ;
+    m = m_client_connection->messages.get_message(m_store_mids[i]) ;
+    if (m && m->is_active()) continue ;
+    s = m_store->at(i) ;
+    if (s->get_qos() == 0) m_store_mids[i] = 0 ;
+    else if (congestion_hold()) continue ;
+    else if ((mid = send_publish(s->get_qos(), s->get_topic_id(), s->get_topic_type(),
+				 s->get_payload(), s->get_payload_len(), s->get_retain())))
+      m_store_mids[i] = mid ;
+  }
+  while (complete < m_store->held() && m_store_mids[complete] == 0) complete++ ;
+  if (complete > 0){
+    for (i=0; i < complete; i++) m_store->pop() ;
+    for (i=0; i < m_store->held(); i++) m_store_mids[i] = m_store_mids[i + complete] ;
+  }
+  while (m_store_drained < m_store_rate &&
+	 m_store->held() < MQTT_MESSAGES_INFLIGHT &&
+	 m_client_connection->messages.count_active() < m_send_window &&
+	 (s = m_store->at(m_store->held()))){
+    // Leave in the store until there's room for another message
+    if (!(mid = send_publish(s->get_qos(), s->get_topic_id(), s->get_topic_type(),
+			     s->get_payload(), s->get_payload_len(), s->get_retain()))) break ;
+    m_store_mids[m_store->held()] = mid ;
+    m_store->hold() ;
+    m_store_drained++ ;
+  }
+#ifndef ARDUINO
+  pthread_mutex_unlock(&m_mqttlock) ;
+#endif
+}
+
+void ClientMqttSn::store_requeue()
+{
+  if (m_store) m_store->release() ;
+}
+
+void ClientMqttSn::store_complete(uint16_t messageid)
+{
+  if (!m_store) return ;
+  for (uint16_t i=0; i < m_store->held(); i++)
+    if (m_store_mids[i] == messageid) m_store_mids[i] = 0 ;
+}
+
+bool ClientMqttSn::store_holds(uint16_t messageid)
+{
+  if (!m_store) return false ;
+  for (uint16_t i=0; i < m_store->held(); i++)
+    if (m_store_mids[i] == messageid) return true ;
+  return false ;
+}
+
 bool ClientMqttSn::connect(uint8_t gwid, bool will, bool clean, uint16_t keepalive)
 {
   MqttGwInfo *gw ;
@@ -1259,17 +1764,31 @@ bool ClientMqttSn::connect(uint8_t gwid, bool will, bool clean, uint16_t keepali
     EPRINT("Send connect: Gateway ID unknown") ;
     return false ;
   }
+  // Connecting ends any sleep
+  if (m_sleep_power_down && m_client_connection->is_asleep()) power_up() ;
+  // A standby session would clash with a connection to the same gateway
+  drop_standby() ;
+  gw->request_sent() ;
   // Copy connection details
-  m_client_connection.set_state(MqttConnection::State::disconnected) ;
-  m_client_connection.topics.free_topics() ; // clear all topics
-  m_client_connection.set_gwid(gwid) ;
-  m_client_connection.set_address(gw->get_address(), m_pDriver->get_address_len()) ;
-  m_client_connection.duration = keepalive ;
+  m_client_connection->set_state(MqttConnection::State::disconnected) ;
+  // Cached topics are only valid when resuming a session with the same gateway
+  if (clean || !m_topic_cache || gwid != m_topic_cache_gwid){
+    free_topics() ; // clear all topics
+    m_topic_cache_gwid = gwid ;
+    save_topic_cache() ;
+  }
+  m_client_connection->set_gwid(gwid) ;
+  m_client_connection->set_address(gw->get_address(), m_pDriver->get_address_len()) ;
+  m_client_connection->duration = keepalive ;
+  // Congestion is measured per gateway
+  m_send_window = m_publish_window ;
+  m_send_accepted = 0 ;
+  m_congestion_backoff_ms = 0 ;
 #ifndef ARDUINO
   pthread_mutex_unlock(&m_mqttlock) ;
 #endif
   
-  uint8_t len = strlen(m_szclient_id) ;
+  mqtt_len_t len = strlen(m_szclient_id) ;
   if (len > m_pDriver->get_payload_width() - MQTT_CONNECT_HDR_LEN){
     len = m_pDriver->get_payload_width() - MQTT_CONNECT_HDR_LEN ; // Client ID is too long. Truncate
   }
@@ -1281,13 +1800,14 @@ bool ClientMqttSn::connect(uint8_t gwid, bool will, bool clean, uint16_t keepali
 #endif
   // Clear out any pending messages (mostly search messages)
   // to provide room for the connection
-  m_client_connection.messages.clear_queue() ;
-  MqttMessage *m = m_client_connection.messages.add_message(MqttMessage::Activity::willtopic) ;
+  m_client_connection->messages.clear_queue() ;
+  store_requeue() ;
+  MqttMessage *m = m_client_connection->messages.add_message(MqttMessage::Activity::willtopic) ;
   if (!m){
     EPRINT("Send connect: Cannot establish a new message for server connection\n");
     return false ;
   }
-  m_client_connection.set_state(MqttConnection::State::connecting) ;
+  m_client_connection->set_state(MqttConnection::State::connecting) ;
   m->set_message(MQTT_CONNECT, m_buff, 4+len) ;
   if (!will){
     m->set_activity(MqttMessage::Activity::none) ;
@@ -1323,18 +1843,23 @@ void ClientMqttSn::print_gw_table()
 
 bool ClientMqttSn::is_disconnected()
 {
-  return m_client_connection.is_disconnected() ;
+  return m_client_connection->is_disconnected() ;
 }
 
 bool ClientMqttSn::is_connected(uint8_t gwid)
 {
-  return m_client_connection.is_connected() && 
-    (m_client_connection.get_gwid() == gwid) ;
+  return m_client_connection->is_connected() && 
+    (m_client_connection->get_gwid() == gwid) ;
 }
 
 bool ClientMqttSn::is_connected()
 {
-  return m_client_connection.is_connected() ;
+  return m_client_connection->is_connected() ;
+}
+
+bool ClientMqttSn::is_asleep()
+{
+  return m_client_connection->is_sleeping() ;
 }
 
 bool ClientMqttSn::set_willtopic(const char *topic, uint8_t qos, bool retain)
@@ -1342,7 +1867,7 @@ bool ClientMqttSn::set_willtopic(const char *topic, uint8_t qos, bool retain)
   int len = topic?strlen(topic):0 ;
   if (len > m_pDriver->get_payload_width() - MQTT_WILLTOPIC_HDR_LEN)
     return false ;
-  return m_client_connection.set_will_topic(topic, qos, retain) ;
+  return m_client_connection->set_will_topic(topic, qos, retain) ;
 }
 
 #ifndef ARDUINO
@@ -1350,7 +1875,7 @@ bool ClientMqttSn::set_willtopic(const wchar_t *topic, uint8_t qos, bool retain)
 {
   char willtopic[PACKET_DRIVER_MAX_PAYLOAD - MQTT_WILLTOPIC_HDR_LEN +1] ;
   size_t len = wcslen(topic) ;
-  if ((uint8_t)len > m_pDriver->get_payload_width() - MQTT_WILLTOPIC_HDR_LEN){
+  if ((mqtt_len_t)len > m_pDriver->get_payload_width() - MQTT_WILLTOPIC_HDR_LEN){
     EPRINT("Set will topic: Will topic too long for payload\n") ;
     return false ;
   }
@@ -1358,7 +1883,7 @@ bool ClientMqttSn::set_willtopic(const wchar_t *topic, uint8_t qos, bool retain)
   size_t ret = wchar_to_utf8(topic, willtopic, m_pDriver->get_payload_width() - MQTT_WILLTOPIC_HDR_LEN);
   if (ret < 0) return false ;  
 
-  return m_client_connection.set_will_topic(willtopic, qos, retain) ;
+  return m_client_connection->set_will_topic(willtopic, qos, retain) ;
 }
 #endif
 #ifndef ARDUINO
@@ -1374,31 +1899,35 @@ bool ClientMqttSn::set_willmessage(const wchar_t *message)
   
   size_t len = wchar_to_utf8(message, (char*)willmessage, maxlen) ;
   if (len < 0) return false ;
-  return m_client_connection.set_will_message(willmessage, (uint8_t)len) ;
+  return m_client_connection->set_will_message(willmessage, (mqtt_len_t)len) ;
 }
 #endif
-bool ClientMqttSn::set_willmessage(const uint8_t *message, uint8_t len)
+bool ClientMqttSn::set_willmessage(const uint8_t *message, mqtt_len_t len)
 {
   if (len > m_pDriver->get_payload_width() - MQTT_WILLMSG_HDR_LEN)
     return false ; //WILL message too long for payload
-  return m_client_connection.set_will_message(message, len) ;
+  return m_client_connection->set_will_message(message, len) ;
 }
 
 MqttGwInfo* ClientMqttSn::get_available_gateway()
 {
-  if (m_client_connection.is_connected()){
-    uint8_t gwid = m_client_connection.get_gwid();
+  if (m_client_connection->is_connected()){
+    uint8_t gwid = m_client_connection->get_gwid();
     return get_gateway(gwid) ;
   }
 
+  // Choose the lowest scoring gateway, but stay with the last connected
+  // gateway unless another is clearly better
+  MqttGwInfo *best = NULL, *last = NULL ;
   for (unsigned int i=0; i < MQTT_MAX_GATEWAYS;i++){
     if (m_gwinfo[i].is_allocated() && m_gwinfo[i].is_active()){
-      // return the first known gateway
-      DPRINT("Seaching for gateways found active GW %u\n", m_gwinfo[i].get_gwid());
-      return &(m_gwinfo[i]) ;
+      if (!best || m_gwinfo[i].score() < best->score()) best = &(m_gwinfo[i]) ;
+      if (m_gwinfo[i].get_gwid() == m_client_connection->get_gwid()) last = &(m_gwinfo[i]) ;
     }
   }
-  return NULL ;
+  if (last && last->score() <= best->score() + MQTT_GW_HYSTERESIS_MS) best = last ;
+  if (best) DPRINT("Seaching for gateways found active GW %u, score %u\n", best->get_gwid(), best->score());
+  return best ;
 }
 
 MqttGwInfo* ClientMqttSn::get_gateway_address(uint8_t *gwaddress)
@@ -1437,8 +1966,8 @@ uint8_t *ClientMqttSn::get_gateway_address()
 
 bool ClientMqttSn::get_known_gateway(uint8_t *gwid)
 {
-  if (m_client_connection.is_connected()){
-    *gwid = m_client_connection.get_gwid();
+  if (m_client_connection->is_connected()){
+    *gwid = m_client_connection->get_gwid();
     return true ;
   }
 
@@ -1449,3 +1978,386 @@ bool ClientMqttSn::get_known_gateway(uint8_t *gwid)
 
   return true ;
 }
+
+uint16_t ClientMqttSn::get_topic_id(const char *sztopic)
+{
+  uint16_t topicid = 0 ;
+#ifndef ARDUINO
+  pthread_mutex_lock(&m_mqttlock) ;
+#endif
+  MqttTopic *t = m_client_connection->topics.get_topic(sztopic) ;
+  if (t && t->is_complete()) topicid = t->get_id() ;
+#ifndef ARDUINO
+  pthread_mutex_unlock(&m_mqttlock) ;
+#endif
+  return topicid ;
+}
+
+void ClientMqttSn::drop_stale_topic(uint16_t topicid, const char *sztopic)
+{
+  MqttTopic *t = m_client_connection->topics.get_topic(topicid) ;
+  if (!t || t->is_short_topic() || strcmp(t->get_topic(), sztopic) == 0) return ;
+  DPRINT("TOPIC CACHE: Topic ID %u now %s, dropping %s\n", topicid, sztopic, t->get_topic()) ;
+  m_client_connection->topics.del_topic(t) ;
+  save_topic_cache() ;
+}
+
+void ClientMqttSn::free_topics()
+{
+  MqttTopic *t = NULL ;
+  m_client_connection->topics.free_topics() ;
+  m_short_subscriptions.free_topics() ;
+  m_predefined_topics.iterate_first_topic() ;
+  for (t = m_predefined_topics.get_curr_topic(); t; t = m_predefined_topics.get_next_topic())
+    t->set_subscribed(false) ;
+}
+
+void ClientMqttSn::save_topic_cache()
+{
+#ifndef ARDUINO
+  if (!m_topic_cache_file) return ;
+
+  MqttTopicCacheHeader hdr ;
+  MqttTopic *t = NULL ;
+  memset(&hdr, 0, sizeof(hdr)) ;
+  hdr.magic = MQTT_TOPIC_CACHE_MAGIC ;
+  hdr.gwid = m_topic_cache_gwid ;
+  fseek(m_topic_cache_file, sizeof(hdr), SEEK_SET) ;
+  m_client_connection->topics.iterate_first_topic() ;
+  for (t = m_client_connection->topics.get_curr_topic(); t; t = m_client_connection->topics.get_next_topic()){
+    // Only gateway registrations are cached
+    if (!t->is_complete() || t->is_wildcard() || t->is_predefined() ||
+	t->is_short_topic() || t->get_id() == 0) continue ;
+    uint16_t topicid = t->get_id() ;
+    uint16_t len = strlen(t->get_topic()) ;
+    fwrite(&topicid, sizeof(topicid), 1, m_topic_cache_file) ;
+    fwrite(&len, sizeof(len), 1, m_topic_cache_file) ;
+    fwrite(t->get_topic(), 1, len, m_topic_cache_file) ;
+    hdr.count++ ;
+  }
+  if (ftruncate(fileno(m_topic_cache_file), ftell(m_topic_cache_file)) != 0){
+    EPRINT("TOPIC CACHE: Cannot truncate cache file\n") ;
+  }
+  fseek(m_topic_cache_file, 0, SEEK_SET) ;
+  if (fwrite(&hdr, sizeof(hdr), 1, m_topic_cache_file) != 1){
+    EPRINT("TOPIC CACHE: Cannot write cache file\n") ;
+  }
+  fflush(m_topic_cache_file) ;
+#endif
+}
+
+#ifndef ARDUINO
+bool ClientMqttSn::set_topic_cache_file(const char *szpath)
+{
+  if (m_topic_cache_file){
+    fclose(m_topic_cache_file) ;
+    m_topic_cache_file = NULL ;
+  }
+  m_topic_cache = true ;
+  if (!szpath) return true ; // RAM only
+
+  FILE *f = fopen(szpath, "r+b") ;
+  if (f){
+    // Load registrations from a previous run
+    MqttTopicCacheHeader hdr ;
+    char sztopic[PACKET_DRIVER_MAX_PAYLOAD - MQTT_REGISTER_HDR_LEN +1] ;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != MQTT_TOPIC_CACHE_MAGIC){
+      EPRINT("TOPIC CACHE: %s is not a topic cache file\n", szpath) ;
+      fclose(f) ;
+      return false ;
+    }
+    pthread_mutex_lock(&m_mqttlock) ;
+    m_client_connection->topics.free_topics() ;
+    m_topic_cache_gwid = hdr.gwid ;
+    for (uint16_t i=0; i < hdr.count; i++){
+      uint16_t topicid = 0, len = 0 ;
+      if (fread(&topicid, sizeof(topicid), 1, f) != 1 ||
+	  fread(&len, sizeof(len), 1, f) != 1 ||
+	  len > PACKET_DRIVER_MAX_PAYLOAD - MQTT_REGISTER_HDR_LEN ||
+	  fread(sztopic, 1, len, f) != len){
+	EPRINT("TOPIC CACHE: %s is truncated\n", szpath) ;
+	break ;
+      }
+      sztopic[len] = '\0' ;
+      MqttTopic *t = m_client_connection->topics.create_topic(sztopic, topicid) ;
+      if (t) t->complete(topicid) ;
+    }
+    resolve_topic_handlers() ;
+    pthread_mutex_unlock(&m_mqttlock) ;
+    m_topic_cache_file = f ;
+    DPRINT("TOPIC CACHE: Loaded %u topics for gateway %u from %s\n", hdr.count, hdr.gwid, szpath) ;
+    return true ;
+  }
+
+  f = fopen(szpath, "w+b") ;
+  if (!f){
+    EPRINT("TOPIC CACHE: Cannot create cache file %s\n", szpath) ;
+    return false ;
+  }
+  m_topic_cache_file = f ;
+  save_topic_cache() ;
+  return true ;
+}
+#endif
+
+bool ClientMqttSn::set_topic_handler(const char *szfilter, MQTTMSGCALLBACK(fn))
+{
+  if (!szfilter || strlen(szfilter) > PACKET_DRIVER_MAX_PAYLOAD - MQTT_REGISTER_HDR_LEN) return false ;
+#ifndef ARDUINO
+  pthread_mutex_lock(&m_mqttlock) ;
+#endif
+  MqttTopic *t = m_topic_handlers.get_topic(szfilter) ;
+  if (!fn){
+    m_topic_handlers.del_topic(t) ;
+  }else{
+    if (!t) t = m_topic_handlers.reg_topic(szfilter, 0) ;
+    if (t) t->set_handler(fn) ;
+  }
+  resolve_topic_handlers() ;
+#ifndef ARDUINO
+  pthread_mutex_unlock(&m_mqttlock) ;
+#endif
+  return t != NULL || !fn ;
+}
+
+MqttTopic* ClientMqttSn::find_topic_handler(const char *sztopic)
+{
+  m_topic_handlers.iterate_first_topic() ;
+  for (MqttTopic *t = m_topic_handlers.get_curr_topic(); t; t = m_topic_handlers.get_next_topic()){
+    if (t->match(sztopic)) return t ;
+  }
+  return NULL ;
+}
+
+void ClientMqttSn::resolve_topic_handler(MqttTopic *t)
+{
+  // Wildcard subscriptions are resolved as the gateway registers each topic
+  if (t->is_wildcard()) return ;
+  t->copy_handler(find_topic_handler(t->get_topic())) ;
+}
+
+void ClientMqttSn::resolve_topic_handlers()
+{
+  MqttTopic *t = NULL ;
+  m_client_connection->topics.iterate_first_topic() ;
+  for (t = m_client_connection->topics.get_curr_topic(); t; t = m_client_connection->topics.get_next_topic())
+    resolve_topic_handler(t) ;
+  m_predefined_topics.iterate_first_topic() ;
+  for (t = m_predefined_topics.get_curr_topic(); t; t = m_predefined_topics.get_next_topic())
+    resolve_topic_handler(t) ;
+}
+
+bool ClientMqttSn::get_standby_gateway(uint8_t *gwid)
+{
+  if (!m_standby_connection->is_connected()) return false ;
+  *gwid = m_standby_connection->get_gwid() ;
+  return true ;
+}
+
+void ClientMqttSn::drop_standby()
+{
+  if (m_standby_connection->is_disconnected()) return ;
+  if (m_standby_connection->is_connected())
+    writemqtt(m_standby_connection, MQTT_DISCONNECT, NULL, 0) ;
+  m_standby_connection->set_state(MqttConnection::State::disconnected) ;
+  m_standby_connection->messages.clear_queue() ;
+  m_standby_connection->topics.free_topics() ;
+}
+
+bool ClientMqttSn::failover()
+{
+  if (!m_standby_connection->is_connected()) return false ;
+
+  MqttConnection *lost = m_client_connection ;
+  MqttMessage *m = NULL ;
+  MqttTopic *t = NULL ;
+  MqttGwInfo *gw = get_gateway(lost->get_gwid()) ;
+  if (gw) gw->set_active(false) ;
+  DPRINT("FAILOVER: Switching from gateway %u to standby gateway %u\n",
+	 lost->get_gwid(), m_standby_connection->get_gwid()) ;
+
+  // Fail messages abandoned on the lost gateway. Stored publishes are
+  // sent again from the store
+  for (m = lost->messages.get_active_message(); m; m = lost->messages.get_next_active_message(m))
+    if (!store_holds(m->get_message_id())) message_failed(m) ;
+
+  m_client_connection = m_standby_connection ;
+  m_standby_connection = lost ;
+  lost->set_state(MqttConnection::State::disconnected) ;
+  lost->messages.clear_queue() ;
+  store_requeue() ;
+
+  // The standby session has no subscriptions. Make them again and
+  // report any that do not fit in the message queue
+  lost->topics.iterate_first_topic() ;
+  for (t = lost->topics.get_curr_topic(); t; t = lost->topics.get_next_topic()){
+    if (!t->is_subscribed()) continue ;
+    if (!subscribe(t->get_qos(), t->get_topic(), false)){
+      EPRINT("FAILOVER: Subscription to %s must be made again\n", t->get_topic()) ;
+      if (m_fnsubscribed) (*m_fnsubscribed)(false, MQTT_RETURN_MSG_FAILURE, 0, 0,
+					    m_client_connection->get_gwid()) ;
+    }
+  }
+  m_predefined_topics.iterate_first_topic() ;
+  for (t = m_predefined_topics.get_curr_topic(); t; t = m_predefined_topics.get_next_topic()){
+    if (!t->is_subscribed()) continue ;
+    if (!subscribe(t->get_qos(), t->get_id(), FLAG_DEFINED_TOPIC_ID)){
+      EPRINT("FAILOVER: Subscription to predefined topic %u must be made again\n", t->get_id()) ;
+      t->set_subscribed(false) ;
+      if (m_fnsubscribed) (*m_fnsubscribed)(false, MQTT_RETURN_MSG_FAILURE, t->get_id(), 0,
+					    m_client_connection->get_gwid()) ;
+    }
+  }
+  m_short_subscriptions.iterate_first_topic() ;
+  for (t = m_short_subscriptions.get_curr_topic(); t; t = m_short_subscriptions.get_next_topic()){
+    if (!t->is_subscribed()) continue ;
+    if (!subscribe(t->get_qos(), t->get_topic(), true)){
+      EPRINT("FAILOVER: Subscription to short topic %s must be made again\n", t->get_topic()) ;
+      t->set_subscribed(false) ;
+      if (m_fnsubscribed) (*m_fnsubscribed)(false, MQTT_RETURN_MSG_FAILURE, 0, 0,
+					    m_client_connection->get_gwid()) ;
+    }
+  }
+  lost->topics.free_topics() ;
+  m_standby_synced = false ;
+  m_standby_attempt = 0 ;
+  m_send_window = m_publish_window ;
+  m_send_accepted = 0 ;
+  m_congestion_backoff_ms = 0 ;
+
+  m_topic_cache_gwid = m_client_connection->get_gwid() ;
+  save_topic_cache() ;
+  resolve_topic_handlers() ;
+
+  if (m_fngatewayinfo) (*m_fngatewayinfo)(false, lost->get_gwid()) ;
+  if (m_fnconnected) (*m_fnconnected)(true, MQTT_RETURN_ACCEPTED, m_client_connection->get_gwid()) ;
+  return true ;
+}
+
+void ClientMqttSn::manage_standby()
+{
+  MqttConnection *con = m_standby_connection ;
+  MqttMessage *m = NULL ;
+  MqttTopic *t = NULL ;
+  MqttGwInfo *gw = NULL ;
+
+  if (!m_standby || !m_client_connection->is_connected()){
+    drop_standby() ;
+    return ;
+  }
+
+  switch(con->get_state()){
+  case MqttConnection::State::disconnected:
+    {
+      if (TIMENOW - m_standby_attempt < m_Tretry) return ;
+      m_standby_attempt = TIMENOW ;
+      // Best scoring of the other active gateways
+      for (unsigned int i=0; i < MQTT_MAX_GATEWAYS; i++){
+	if (m_gwinfo[i].is_allocated() && m_gwinfo[i].is_active() &&
+	    m_gwinfo[i].get_gwid() != m_client_connection->get_gwid() &&
+	    (!gw || m_gwinfo[i].score() < gw->score())){
+	  gw = &m_gwinfo[i] ;
+	}
+      }
+      if (!gw) return ;
+      gw->request_sent() ;
+
+      mqtt_len_t len = strlen(m_szclient_id) ;
+      if (len > m_pDriver->get_payload_width() - MQTT_CONNECT_HDR_LEN)
+	len = m_pDriver->get_payload_width() - MQTT_CONNECT_HDR_LEN ;
+      con->messages.clear_queue() ;
+      con->topics.free_topics() ;
+      con->set_gwid(gw->get_gwid()) ;
+      con->set_address(gw->get_address(), m_pDriver->get_address_len()) ;
+      con->duration = m_client_connection->duration ;
+      if (!(m = con->messages.add_message(MqttMessage::Activity::none))) return ;
+      // Clean session without a will
+      m->encode_message(MQTT_CONNECT)
+	.u8(FLAG_CLEANSESSION)
+	.u8(MQTT_PROTOCOL)
+	.u16(con->duration)
+	.bytes(m_szclient_id, len) ;
+      con->set_state(MqttConnection::State::connecting) ;
+      DPRINT("STANDBY: Connecting to gateway %u\n", gw->get_gwid()) ;
+    }
+    break ;
+  case MqttConnection::State::connected:
+    if (con->lost_contact()){
+      DPRINT("STANDBY: Lost standby gateway %u\n", con->get_gwid()) ;
+      if ((gw = get_gateway(con->get_gwid()))) gw->failed() ;
+      drop_standby() ;
+      return ;
+    }
+    if (con->send_another_ping()) ping(con->get_gwid()) ;
+
+    // Register the next topic missing from the standby gateway
+    m = con->messages.get_active_message() ;
+    if (!m_standby_synced && !(m && m->has_content())){
+      m_client_connection->topics.iterate_first_topic() ;
+      for (t = m_client_connection->topics.get_curr_topic(); t; t = m_client_connection->topics.get_next_topic()){
+	if (!t->is_complete() || t->is_wildcard() || t->is_predefined() ||
+	    t->is_short_topic() || t->get_id() == 0) continue ;
+	if (!con->topics.get_topic(t->get_topic())) break ;
+      }
+      if (!t){
+	m_standby_synced = true ;
+      }else if ((m = con->messages.add_message(MqttMessage::Activity::registering))){
+	const char *sz = t->get_topic() ;
+	con->topics.reg_topic(sz, m->get_message_id()) ;
+	m->encode_message(MQTT_REGISTER)
+	  .u16(0)
+	  .u16(m->get_message_id())
+	  .bytes(sz, strlen(sz)) ;
+      }
+    }
+    break ;
+  default:
+    break ;
+  }
+
+  m = con->messages.get_active_message() ;
+  if (m && m->has_content() && send_message(con, m)){
+    DPRINT("STANDBY: No response from gateway %u\n", con->get_gwid()) ;
+    drop_standby() ;
+  }
+}
+
+void ClientMqttSn::received_standby_connack(uint8_t returncode)
+{
+  MqttMessage *m = m_standby_connection->messages.get_active_message() ;
+  if (m_standby_connection->get_state() != MqttConnection::State::connecting || !m) return ;
+  m->set_inactive() ;
+  m_standby_connection->update_activity() ;
+  MqttGwInfo *gw = get_gateway(m_standby_connection->get_gwid()) ;
+  if (gw){
+    gw->response_received() ;
+    if (returncode != MQTT_RETURN_ACCEPTED) gw->failed() ;
+  }
+  if (returncode == MQTT_RETURN_ACCEPTED){
+    DPRINT("STANDBY: Connected to gateway %u\n", m_standby_connection->get_gwid()) ;
+    m_standby_connection->set_state(MqttConnection::State::connected) ;
+    m_standby_synced = false ;
+  }else{
+    EPRINT("STANDBY: Gateway %u refused connection, return code %u\n",
+	   m_standby_connection->get_gwid(), returncode) ;
+    m_standby_connection->set_state(MqttConnection::State::disconnected) ;
+  }
+}
+
+void ClientMqttSn::received_standby_regack(uint16_t topicid, uint16_t messageid, uint8_t returncode)
+{
+  MqttMessage *m = m_standby_connection->messages.get_message(messageid) ;
+  if (!m) return ;
+  m->set_inactive() ;
+  m_standby_connection->update_activity() ;
+  if (returncode == MQTT_RETURN_ACCEPTED){
+    m_standby_connection->topics.complete_topic(messageid, topicid) ;
+  }else{
+    // Leave the topic to be registered after a failover and stop
+    // trying until the topics change
+    EPRINT("STANDBY: Gateway %u refused registration, return code %u\n",
+	   m_standby_connection->get_gwid(), returncode) ;
+    m_standby_connection->topics.del_topic_by_messageid(messageid) ;
+    m_standby_synced = true ;
+  }
+}
@@ -21,14 +21,8 @@
 #include "mqttsnembed.hpp"
 #include "mqttconnection.hpp"
 #include "mqtttopic.hpp"
-#ifdef ARDUINO
- #include <TimeLib.h>
- #include <arduino.h>
- #define TIMENOW now()
-#else
- #include <time.h>
- #define TIMENOW time(NULL)
-#endif
+#include "mqttspool.hpp"
+#include "mqttclock.hpp"
 
 // Callback - bool success, uint8_t return_code, uint8_t gwid
 #define MQTTCONCALLBACK(fn) void (*fn)(bool, uint8_t, uint8_t)
@@ -36,6 +30,8 @@
 #define MQTTDISCALLBACK(fn) void (*fn)(bool, uint16_t, uint8_t)
 // Callback - bool active, uint8_t gwid
 #define MQTTGWCALLBACK(fn) void (*fn)(bool, uint8_t)
+// Callback - bool asleep, uint16_t seconds until the next poll
+#define MQTTSLEEPCALLBACK(fn) void (*fn)(bool, uint16_t)
 // Callback for publish - bool success, uint8_t return_code, uint16_t topic_id, uint16_t message_id, uint8_t gwid
 #define MQTTPUBCALLBACK(fn) void (*fn)(bool, uint8_t, uint16_t, uint16_t, uint8_t)
 // Callback for registration - bool success, uint8_t return_code, uint16_t topic_id, uint16_t message_id, uint8_t gwid
@@ -46,10 +42,6 @@
 // bool success, uint8_t return_code, uint16_t topic_id, uint16_t message_id, uint8_t gwid
 #define MQTTSUBCALLBACK(fn) void (*fn)(bool, uint8_t, uint16_t, uint16_t, uint8_t)
 
-// Callback for published messages sent by the server
-// bool success, uint8_t return, const char* topic, uint8_t* payload, uint8_t payloadlen, uint8_t gwid
-#define MQTTMSGCALLBACK(fn) void (*fn)(bool, uint8_t, const char*, uint8_t *, uint8_t, uint8_t)
-
 class ClientMqttSn : public MqttSnEmbed{
 public:
   ClientMqttSn();
@@ -71,10 +63,76 @@ public:
   void set_client_id(const char *szclientid) ;
   const char* get_client_id() ; // Returns pointer to client identfier
 
+  // Number of QoS 0, 1 and 2 publishes sent without waiting for
+  // earlier publishes to be acknowledged. Acknowledgements are matched
+  // to publishes by message ID. Defaults to 1, one message at a time
+  // as the MQTT-SN specification recommends
+  void set_publish_window(uint8_t window) ;
+  uint8_t get_publish_window(){return m_publish_window;}
+  // Window in use. CONGESTION from the gateway halves it and holds back
+  // new messages for a while. It grows by one each time a window of
+  // messages is accepted, up to the publish window
+  uint8_t get_send_window(){return m_send_window;}
+
+  // Publishes made while disconnected are held in the store and sent
+  // once connected, in order. Publish calls return MQTT_MESSAGE_STORED
+  // for stored messages. Only short topic names and predefined topic IDs
+  // can be stored as registered topic IDs do not survive a reconnect.
+  // The store policy decides what happens when full. NULL, the default,
+  // disables the store
+  void set_offline_store(MqttSpool *store){m_store = store;}
+  // Stored publishes sent each second once connected. Defaults to MQTT_SPOOL_DRAIN_RATE
+  void set_offline_store_rate(uint16_t rate){m_store_rate = rate;}
+
+  // Keep registered topic IDs while disconnected or asleep. A connect to
+  // the same gateway without a clean session reuses them so topics don't
+  // need registering again. Cached IDs are dropped if the gateway
+  // rejects them as invalid topics. Defaults to false
+  void set_topic_cache(bool enable){m_topic_cache = enable;}
+#ifndef ARDUINO
+  // Keep the topic cache in a file so it survives a restart. Enables the
+  // cache. Returns false if the file cannot be used
+  bool set_topic_cache_file(const char *szpath) ;
+#endif
+  // Registered topic ID for a topic name. Returns zero if the topic is
+  // not registered
+  uint16_t get_topic_id(const char *sztopic) ;
+
+  // Publishes on topics matching the filter are passed to the handler
+  // instead of the message callback. Filters can use + and # wildcards
+  // and the first matching filter added is used. Handlers are found when
+  // topic IDs are registered so received publishes are not matched
+  // against filters. A NULL handler removes the filter.
+  // Returns false if the filter cannot be added
+  bool set_topic_handler(const char *szfilter, MQTTMSGCALLBACK(fn)) ;
+
+  // Keep a standby session with a second known gateway while connected.
+  // Registered topics are also registered with the standby gateway. If
+  // the connected gateway is lost the client switches to the standby
+  // session instead of reconnecting and the connected callback is called
+  // with the standby gateway ID. Topic IDs differ between gateways so
+  // use get_topic_id after switching. Subscriptions are not made on the
+  // standby gateway and it has no will. They are made again after
+  // switching, with short topic and predefined topic subscriptions kept
+  // as their own topic types. Defaults to false
+  void set_standby(bool enable){m_standby = enable;}
+  // Gets the standby gateway. Returns false if no standby session is connected
+  bool get_standby_gateway(uint8_t *gwid) ;
+
+  // Pings are only sent when no other message has been exchanged with
+  // the gateway for the keep alive duration. While idle, answered pings
+  // stretch the ping interval up to stretch times the keep alive
+  // duration. Gateways from this library tolerate MQTT_PING_STRETCH_MAX,
+  // other gateways may disconnect a client not heard from within the
+  // duration. Defaults to 1, which pings every keep alive duration
+  void set_ping_stretch(uint8_t stretch) ;
+
   //////////////////////////////////////
   // MQTT messages
   
-  // Send a request for a gateway. Gateway responds with gwinfo data
+  // Send a request for a gateway. Gateway responds with gwinfo data.
+  // The search is sent after a random delay and is cancelled by a
+  // GWINFO or ADVERTISE from any gateway. Only one search is queued
   // Returns false if connection couldn't be made due to timeout (only applies if using acks on pipes)
   bool searchgw(uint8_t radius) ;
 
@@ -87,12 +145,13 @@ public:
   bool is_connected(uint8_t gwid) ; // are we connected to this gw?
   bool is_connected() ; // are we connected to any gateway?
   bool is_disconnected() ; // are we disconnected to any gateway?
+  bool is_asleep() ; // sleeping between polls of the gateway?
 #ifndef ARDUINO
   bool set_willtopic(const wchar_t *topic, uint8_t qos, bool retain) ;
   bool set_willmessage(const wchar_t *message) ;
 #endif
   bool set_willtopic(const char *topic, uint8_t qos, bool retain);
-  bool set_willmessage(const uint8_t *message, uint8_t len) ;
+  bool set_willmessage(const uint8_t *message, mqtt_len_t len) ;
   // TO DO: Protocol also allows update of will messages during connection to server
   
   // Disconnect. Optional sleep duration can be set. If zero then
@@ -100,13 +159,23 @@ public:
   // Returns false if disconnect cannot be sent (ACK enabled)
   bool disconnect(uint16_t sleep_duration = 0) ;
 
+  // Sleeping clients wake when the sleep duration expires, or when poll
+  // is called, and send a ping to collect messages buffered by the
+  // gateway. The client sleeps again once the gateway responds to the
+  // ping. Call connect to stop sleeping.
+  // Returns false if the client is not asleep or the ping fails
+  bool poll() ;
+  // Shutdown the driver while asleep and power it up again to poll.
+  // Defaults to false
+  void set_sleep_power_down(bool enable){m_sleep_power_down = enable;}
+
   // Publishes a -1 QoS message which do not require a connection.
   // This call publishes short topics (2 bytes).
   // Requires a known gateway (requires manual specification of GW)
   bool publish_noqos(uint8_t gwid,
 		     const char* sztopic,
 		     const uint8_t *payload,
-		     uint8_t payload_len,
+		     mqtt_len_t payload_len,
 		     bool retain) ;
 
   // Publish a -1 QoS message. Topic ID must relate to a pre-defined
@@ -115,26 +184,28 @@ public:
 		     uint16_t topicid,
 		     uint8_t topictype,
 		     const uint8_t *payload,
-		     uint8_t payload_len,
+		     mqtt_len_t payload_len,
 		     bool retain);
 
   // Publish for connected clients. Doesn't support -1 QoS
   // Sets a 2 letter short topic
-  // Returns message ID on success or zeroon failure
+  // Returns message ID on success or zeroon failure.
+  // Returns MQTT_MESSAGE_STORED if held in the offline store
   uint16_t publish(uint8_t qos,
 		   const char* sztopic,
 		   const uint8_t *payload,
-		   uint8_t payload_len,
+		   mqtt_len_t payload_len,
 		   bool retain);
   
   // Publish for connected clients. Doesn't support -1 QoS
   // Supports topic ids on the connection or permanent on server
-  // Returns message ID on success or zero on failure
+  // Returns message ID on success or zero on failure.
+  // Returns MQTT_MESSAGE_STORED if held in the offline store
   uint16_t publish(uint8_t qos,
 		   uint16_t topicid,
 		   uint16_t topictype,
 		   const uint8_t *payload,
-		   uint8_t payload_len,
+		   mqtt_len_t payload_len,
 		   bool retain);
   
   // Ping for use by a client to check a gateway is alive
@@ -185,29 +256,110 @@ public:
   void set_callback_register(MQTTREGCALLBACK(fn)){m_fnregister = fn ;}
   void set_callback_subscribed(MQTTSUBCALLBACK(fn)){m_fnsubscribed = fn ;}
   void set_callback_message(MQTTMSGCALLBACK(fn)){m_fnmessage = fn;}
+  // Called when the client sleeps, after any driver shutdown, and when
+  // it wakes to poll, before the driver powers up
+  void set_callback_sleep(MQTTSLEEPCALLBACK(fn)){m_fnsleep = fn;}
 protected:
 
+  // Send or repeat a queued search when its random slot is due.
+  // Returns true if the search has failed
+  bool send_search(MqttMessage *m) ;
+  // Cancel a queued search as a gateway has been found. Returns false
+  // if no search was active
+  bool search_answered() ;
+  // Random number from 0 to range - 1
+  uint32_t random_ms(uint32_t range) ;
+
+  // Gateway returned CONGESTION. Halve the send window and back off
+  void congested() ;
+  // Gateway accepted a message. Grows the send window
+  void accepted() ;
+  // True while new messages are held back after CONGESTION
+  bool congestion_hold() ;
+
+  // Poll the gateway when the sleep duration expires and retry
+  // unanswered polls
+  void manage_sleep() ;
+  // Sleep until the next poll
+  void fall_asleep() ;
+
   // Connection state handling for clients
   bool manage_gw_connection() ;
 
-  virtual void received_advertised(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_gwinfo(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_connack(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_willtopicreq(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_willmsgreq(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_pingresp(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_pingreq(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_pubrel(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_disconnect(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_register(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_regack(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_puback(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_pubrec(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_pubcomp(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_suback(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_unsubscribe(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_unsuback(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  virtual void received_publish(uint8_t *sender_address, uint8_t *data, uint8_t len);
+  // Connect and register topics with a standby gateway
+  void manage_standby() ;
+  // Close the standby session. Sends a disconnect if connected
+  void drop_standby() ;
+  // Make the standby session the connection. Returns false if there is
+  // no connected standby. Messages in flight to the lost gateway fail
+  // and subscriptions are made again on the standby gateway
+  bool failover() ;
+  // Is the packet from the standby gateway?
+  bool from_standby(uint8_t *sender_address){
+    return !m_standby_connection->is_disconnected() &&
+      m_standby_connection->address_match(sender_address) ;
+  }
+  void received_standby_connack(uint8_t returncode) ;
+  void received_standby_regack(uint16_t topicid, uint16_t messageid, uint8_t returncode) ;
+
+  // Send or resend a queued message to the connection's gateway.
+  // Returns true if the message has used all retries and been abandoned
+  bool send_message(MqttConnection *con, MqttMessage *m) ;
+  // Report an abandoned message through the callbacks
+  void message_failed(MqttMessage *m) ;
+
+  // Queue a publish for a connected client
+  uint16_t send_publish(uint8_t qos,
+			uint16_t topicid,
+			uint16_t topictype,
+			const uint8_t *payload,
+			mqtt_len_t payload_len,
+			bool retain);
+  // Publish stored messages at the store rate, up to the free send
+  // window. Stored publishes are removed once complete
+  void drain_store() ;
+  // The message queue was cleared. Stored publishes being sent are
+  // sent again
+  void store_requeue() ;
+  // The gateway answered a stored publish
+  void store_complete(uint16_t messageid) ;
+  // Is the message a stored publish being sent?
+  bool store_holds(uint16_t messageid) ;
+
+  // Forget the topics and subscriptions of the connected session
+  void free_topics() ;
+  // Write the completed topic registrations to the cache file
+  void save_topic_cache() ;
+  // A gateway that did not resume the session reuses topic IDs. Drop
+  // any cached topic holding the ID under another name
+  void drop_stale_topic(uint16_t topicid, const char *sztopic) ;
+
+  // First handler filter matching the topic. Returns NULL if no filters match
+  MqttTopic* find_topic_handler(const char *sztopic) ;
+  // Set the handler for a topic from the handler filters
+  void resolve_topic_handler(MqttTopic *t) ;
+  // Set the handlers for all registered and predefined topics
+  void resolve_topic_handlers() ;
+
+  virtual void received_advertised(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_gwinfo(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_connack(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_willtopicreq(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_willmsgreq(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_pingresp(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_pingreq(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_searchgw(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_pubrel(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_disconnect(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_register(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_regack(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_puback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_pubrec(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_pubcomp(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_suback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_unsubscribe(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_unsuback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  virtual void received_publish(uint8_t *sender_address, uint8_t *data, mqtt_len_t len);
   MqttGwInfo* get_gateway(uint8_t gwid);
   MqttGwInfo* get_gateway_address(uint8_t *gwaddress) ;
   MqttGwInfo* get_available_gateway();
@@ -218,14 +370,56 @@ protected:
   char m_szclient_id[PACKET_DRIVER_MAX_PAYLOAD - MQTT_CONNECT_HDR_LEN +1] ; // Client ID
   MqttGwInfo m_gwinfo[MQTT_MAX_GATEWAYS] ;
 
-  // Connection attributes for a client
-  MqttConnection m_client_connection ;
+  // Connection attributes for a client. The standby connection is
+  // swapped in on failover
+  MqttConnection m_connections[2] ;
+  MqttConnection *m_client_connection ;
+  MqttConnection *m_standby_connection ;
+  bool m_standby ;
+  bool m_standby_synced ;
+  time_t m_standby_attempt ;
+
+  // Times replies to the first SEARCHGW attempt
+  uint32_t m_search_sent_ms ;
+  bool m_search_timed ;
+  // Jittered SEARCHGW back off
+  uint32_t m_search_due_ms ;
+  uint8_t m_search_attempts ;
+  uint32_t m_random ;
   //char m_willtopic[PACKET_DRIVER_MAX_PAYLOAD - MQTT_WILLTOPIC_HDR_LEN +1] ;
   //uint8_t m_willmessage[PACKET_DRIVER_MAX_PAYLOAD - MQTT_WILLMSG_HDR_LEN] ;
   //size_t m_willtopicsize ;
   //size_t m_willmessagesize ;
   //uint8_t m_willtopicqos ;
   uint16_t m_sleep_duration ;
+  bool m_sleep_power_down ;
+  time_t m_poll_sent ;
+  uint16_t m_poll_attempts ;
+  uint8_t m_publish_window ;
+  // Congestion control of the publish window
+  uint8_t m_send_window ;
+  uint8_t m_send_accepted ;
+  uint32_t m_congestion_backoff_ms ;
+  uint32_t m_congestion_due_ms ;
+
+  MqttSpool *m_store ;
+  uint16_t m_store_rate ;
+  time_t m_store_drain_time ;
+  uint16_t m_store_drained ;
+  // Message IDs of the publishes held in the store, in store order.
+  // Zero once complete
+  uint16_t m_store_mids[MQTT_MESSAGES_INFLIGHT] ;
+
+  // Filters with handlers for received publishes
+  MqttTopicCollection m_topic_handlers ;
+  // Short topic subscriptions. These have no registration to flag
+  MqttTopicCollection m_short_subscriptions ;
+
+  bool m_topic_cache ;
+  uint8_t m_topic_cache_gwid ;
+#ifndef ARDUINO
+  FILE *m_topic_cache_file ;
+#endif
 
   // General payload buffer for memory reuse across calls
   uint8_t m_buff[PACKET_DRIVER_MAX_PAYLOAD - MQTT_HDR_LEN] ;
@@ -238,6 +432,7 @@ protected:
   MQTTREGCALLBACK(m_fnregister) ;
   MQTTSUBCALLBACK(m_fnsubscribed) ;
   MQTTMSGCALLBACK(m_fnmessage) ;
+  MQTTSLEEPCALLBACK(m_fnsleep) ;
 };
 
 
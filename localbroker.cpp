@@ -0,0 +1,213 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "localbroker.hpp"
+#include <string.h>
+#include <stdio.h>
+
+LocalBroker::LocalBroker()
+{
+  m_event_head = 0 ;
+  m_event_count = 0 ;
+  m_mid = 0 ;
+  m_connected = false ;
+  pthread_mutex_init(&m_lock, NULL) ;
+}
+
+LocalBroker::~LocalBroker()
+{
+  shutdown() ;
+  pthread_mutex_destroy(&m_lock) ;
+}
+
+int LocalBroker::new_mid()
+{
+  if (++m_mid <= 0) m_mid = 1 ;
+  return m_mid ;
+}
+
+bool LocalBroker::initialise(const char *szclientid,
+			     const char *szwilltopic,
+			     const void *will, int willlen)
+{
+  // The will is never published as the broker cannot lose the gateway
+  pthread_mutex_lock(&m_lock) ;
+  m_connected = true ;
+  queue_event(LocalBrokerEvent::Type::connect, 0, NULL, NULL, 0, 0, false) ;
+  pthread_mutex_unlock(&m_lock) ;
+  DPRINT("Init: Local broker started for %s\n", szclientid) ;
+  return true ;
+}
+
+void LocalBroker::shutdown()
+{
+  pthread_mutex_lock(&m_lock) ;
+  m_connected = false ;
+  m_subscriptions.free_topics() ;
+  m_retained.clear() ;
+  m_event_head = 0 ;
+  m_event_count = 0 ;
+  pthread_mutex_unlock(&m_lock) ;
+}
+
+bool LocalBroker::queue_event(LocalBrokerEvent::Type type, int mid,
+			      const char *sztopic, const void *payload, int len,
+			      int qos, bool retain)
+{
+  if (m_event_count >= MQTT_LOCAL_BROKER_EVENTS) return false ;
+  LocalBrokerEvent *e = &m_events[(m_event_head + m_event_count) % MQTT_LOCAL_BROKER_EVENTS] ;
+  e->type = type ;
+  e->mid = mid ;
+  e->qos = qos ;
+  e->retain = retain ;
+  e->sztopic[0] = '\0' ;
+  if (sztopic) strcpy(e->sztopic, sztopic) ;
+  e->len = len ;
+  if (payload && len > 0) memcpy(e->payload, payload, len) ;
+  m_event_count++ ;
+  return true ;
+}
+
+int LocalBroker::publish(int *mid, const char *sztopic,
+			 int payloadlen, const void *payload,
+			 int qos, bool retain)
+{
+  if (!sztopic || sztopic[0] == '\0' || strpbrk(sztopic, "#+") ||
+      strlen(sztopic) > MQTT_RETAIN_TOPIC_LEN ||
+      payloadlen < 0 || payloadlen > MQTT_RETAIN_PAYLOAD_LEN)
+    return BROKER_ERR_INVAL ;
+
+  pthread_mutex_lock(&m_lock) ;
+  if (!m_connected){
+    pthread_mutex_unlock(&m_lock) ;
+    return BROKER_ERR_NO_CONN ;
+  }
+
+  bool subscribed = false ;
+  m_subscriptions.iterate_first_topic() ;
+  for (MqttTopic *t = m_subscriptions.get_curr_topic(); t; t = m_subscriptions.get_next_topic()){
+    if (t->match(sztopic)){
+      subscribed = true ;
+      break ;
+    }
+  }
+  // Room for the publish completion and the delivered message
+  if (free_events() < (subscribed?2:1)){
+    pthread_mutex_unlock(&m_lock) ;
+    return BROKER_ERR_NOMEM ;
+  }
+
+  int id = new_mid() ;
+  if (mid) *mid = id ;
+  if (retain) m_retained.store(sztopic, (const uint8_t*)payload, payloadlen) ;
+  // Live messages are delivered without the retain flag
+  if (subscribed)
+    queue_event(LocalBrokerEvent::Type::message, 0, sztopic, payload, payloadlen, qos, false) ;
+  queue_event(LocalBrokerEvent::Type::publish, id, NULL, NULL, 0, qos, retain) ;
+  pthread_mutex_unlock(&m_lock) ;
+  return BROKER_ERR_SUCCESS ;
+}
+
+int LocalBroker::subscribe(int *mid, const char *sztopic, int qos)
+{
+  if (!sztopic || sztopic[0] == '\0' || strlen(sztopic) > MQTT_RETAIN_TOPIC_LEN)
+    return BROKER_ERR_INVAL ;
+
+  pthread_mutex_lock(&m_lock) ;
+  if (!m_connected){
+    pthread_mutex_unlock(&m_lock) ;
+    return BROKER_ERR_NO_CONN ;
+  }
+  if (free_events() < 1){
+    pthread_mutex_unlock(&m_lock) ;
+    return BROKER_ERR_NOMEM ;
+  }
+  MqttTopic *t = m_subscriptions.add_topic(sztopic) ;
+  if (!t){
+    pthread_mutex_unlock(&m_lock) ;
+    return BROKER_ERR_NOMEM ;
+  }
+  t->set_qos(qos) ;
+  int id = new_mid() ;
+  if (mid) *mid = id ;
+  queue_event(LocalBrokerEvent::Type::subscribe, id, NULL, NULL, 0, qos, false) ;
+
+  // Replay retained values after the subscription completes
+  for (MqttRetained *r = m_retained.first_match(t); r; r = m_retained.next_match(t)){
+    if (!queue_event(LocalBrokerEvent::Type::message, 0, r->get_topic(),
+		     r->get_payload(), r->get_payload_len(), qos, true)){
+      EPRINT("Local broker: Event queue full, retained topic %s not sent\n", r->get_topic()) ;
+      break ;
+    }
+  }
+  pthread_mutex_unlock(&m_lock) ;
+  return BROKER_ERR_SUCCESS ;
+}
+
+int LocalBroker::unsubscribe(int *mid, const char *sztopic)
+{
+  pthread_mutex_lock(&m_lock) ;
+  MqttTopic *t = m_subscriptions.get_topic(sztopic) ;
+  if (!t){
+    pthread_mutex_unlock(&m_lock) ;
+    return BROKER_ERR_INVAL ;
+  }
+  m_subscriptions.del_topic(t) ;
+  if (mid) *mid = new_mid() ;
+  pthread_mutex_unlock(&m_lock) ;
+  return BROKER_ERR_SUCCESS ;
+}
+
+void LocalBroker::loop()
+{
+  LocalBrokerEvent e ;
+  // Only process events queued before the loop started. Callbacks may
+  // queue further events which are returned on the next loop
+  pthread_mutex_lock(&m_lock) ;
+  uint16_t count = m_event_count ;
+  pthread_mutex_unlock(&m_lock) ;
+
+  for (uint16_t i=0; i < count; i++){
+    pthread_mutex_lock(&m_lock) ;
+    if (m_event_count == 0){
+      pthread_mutex_unlock(&m_lock) ;
+      break ;
+    }
+    e = m_events[m_event_head] ;
+    m_event_head = (m_event_head + 1) % MQTT_LOCAL_BROKER_EVENTS ;
+    m_event_count-- ;
+    pthread_mutex_unlock(&m_lock) ;
+
+    // Callbacks are made without holding the broker lock
+    switch(e.type){
+    case LocalBrokerEvent::Type::connect:
+      if (m_fnconnect) (*m_fnconnect)(m_callback_context, 0) ;
+      break ;
+    case LocalBrokerEvent::Type::publish:
+      if (m_fnpublish) (*m_fnpublish)(m_callback_context, e.mid) ;
+      break ;
+    case LocalBrokerEvent::Type::subscribe:
+      if (m_fnsubscribe) (*m_fnsubscribe)(m_callback_context, e.mid, e.qos) ;
+      break ;
+    case LocalBrokerEvent::Type::message:
+      if (m_fnmessage) (*m_fnmessage)(m_callback_context, e.sztopic, e.payload, e.len, e.qos, e.retain) ;
+      break ;
+    default:
+      break ;
+    }
+  }
+}
@@ -0,0 +1,83 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef __LOCAL_BROKER
+#define __LOCAL_BROKER
+
+#include "mqttbroker.hpp"
+#include "mqttparams.hpp"
+#include "mqtttopic.hpp"
+#include "mqttretain.hpp"
+#include <pthread.h>
+
+class LocalBrokerEvent{
+public:
+  enum Type{
+    none, connect, publish, subscribe, message
+  };
+  LocalBrokerEvent(){type = none; mid = 0; qos = 0; retain = false; len = 0; sztopic[0] = '\0';}
+  Type type ;
+  int mid ;
+  int qos ;
+  bool retain ;
+  char sztopic[MQTT_RETAIN_TOPIC_LEN+1] ;
+  uint8_t payload[MQTT_RETAIN_PAYLOAD_LEN] ;
+  mqtt_len_t len ;
+};
+
+// In-process broker. Routes messages between clients of a single
+// gateway without an external MQTT server. Calls queue their results
+// which are returned through the callbacks when loop() is called, in
+// the same order a network broker would return them.
+// Retained messages are kept in a bounded cache
+class LocalBroker : public IMqttBroker{
+public:
+  LocalBroker() ;
+  ~LocalBroker() ;
+
+  bool initialise(const char *szclientid,
+		  const char *szwilltopic,
+		  const void *will, int willlen) ;
+  void shutdown() ;
+
+  int publish(int *mid, const char *sztopic,
+	      int payloadlen, const void *payload,
+	      int qos, bool retain) ;
+  int subscribe(int *mid, const char *sztopic, int qos) ;
+  int unsubscribe(int *mid, const char *sztopic) ;
+
+  void loop() ;
+
+protected:
+  // Returns false if the event queue is full
+  bool queue_event(LocalBrokerEvent::Type type, int mid,
+		   const char *sztopic, const void *payload, int len,
+		   int qos, bool retain) ;
+  uint16_t free_events(){return MQTT_LOCAL_BROKER_EVENTS - m_event_count;}
+  int new_mid() ;
+
+  MqttTopicCollection m_subscriptions ;
+  MqttRetainedCache m_retained ;
+  LocalBrokerEvent m_events[MQTT_LOCAL_BROKER_EVENTS] ;
+  uint16_t m_event_head ;
+  uint16_t m_event_count ;
+  int m_mid ;
+  bool m_connected ;
+  pthread_mutex_t m_lock ;
+};
+
+#endif
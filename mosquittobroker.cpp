@@ -0,0 +1,193 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "mosquittobroker.hpp"
+#include "mqttparams.hpp"
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+// The mosquitto library is shared by all broker connections
+static pthread_mutex_t s_liblock = PTHREAD_MUTEX_INITIALIZER ;
+static int s_libusers = 0 ;
+
+MosquittoBroker::MosquittoBroker(const char *szhost, int port, int keepalive)
+{
+  strncpy(m_szhost, szhost, sizeof(m_szhost)-1) ;
+  m_szhost[sizeof(m_szhost)-1] = '\0' ;
+  m_port = port ;
+  m_keepalive = keepalive ;
+  m_pmosquitto = NULL ;
+  m_lib_initialised = false ;
+}
+
+MosquittoBroker::~MosquittoBroker()
+{
+  shutdown() ;
+}
+
+int MosquittoBroker::error_code(int mosquitto_err)
+{
+  switch(mosquitto_err){
+  case MOSQ_ERR_SUCCESS:
+    return BROKER_ERR_SUCCESS ;
+  case MOSQ_ERR_INVAL:
+    return BROKER_ERR_INVAL ;
+  case MOSQ_ERR_NO_CONN:
+    return BROKER_ERR_NO_CONN ;
+  case MOSQ_ERR_NOMEM:
+    return BROKER_ERR_NOMEM ;
+  default:
+    return BROKER_ERR_UNKNOWN ;
+  }
+}
+
+bool MosquittoBroker::initialise(const char *szclientid,
+				 const char *szwilltopic,
+				 const void *will, int willlen)
+{
+  if (!m_lib_initialised){
+    pthread_mutex_lock(&s_liblock) ;
+    if (s_libusers++ == 0) mosquitto_lib_init();
+    pthread_mutex_unlock(&s_liblock) ;
+    m_lib_initialised = true ;
+  }
+
+  m_pmosquitto = mosquitto_new(szclientid, false, this) ;
+  if (!m_pmosquitto){
+    EPRINT("Init: Cannot create a new mosquitto instance\n") ;
+    return false ;
+  }
+
+  mosquitto_message_callback_set(m_pmosquitto, on_message) ;
+  mosquitto_connect_callback_set(m_pmosquitto, on_connect) ;
+  mosquitto_disconnect_callback_set(m_pmosquitto, on_disconnect);
+  mosquitto_publish_callback_set(m_pmosquitto, on_publish) ;
+  mosquitto_subscribe_callback_set(m_pmosquitto, on_subscribe) ;
+
+  if (szwilltopic)
+    mosquitto_will_set(m_pmosquitto, szwilltopic, willlen, will, 1, true) ;
+    
+  int ret = mosquitto_connect_async(m_pmosquitto, m_szhost, m_port, m_keepalive) ;
+  if (ret != MOSQ_ERR_SUCCESS){
+    EPRINT("Init: Cannot connect to mosquitto broker %s:%d\n", m_szhost, m_port) ;
+  }
+
+  ret = mosquitto_loop_start(m_pmosquitto) ;
+  if (ret != MOSQ_ERR_SUCCESS){
+    EPRINT("Init: Cannot start mosquitto loop\n") ;
+    return false ;
+  }
+
+#ifdef DEBUG
+  int major, minor, revision ;
+  mosquitto_lib_version(&major, &minor, &revision) ;
+    
+  DPRINT("Init: Mosquitto server connected %d.%d.%d\n", major, minor, revision) ;
+#endif
+  return true ;
+}
+
+void MosquittoBroker::shutdown()
+{
+  if (m_pmosquitto){
+    mosquitto_disconnect(m_pmosquitto) ;
+    mosquitto_loop_stop(m_pmosquitto, false) ;
+    mosquitto_destroy(m_pmosquitto) ;
+    m_pmosquitto = NULL ;
+  }
+  if (m_lib_initialised){
+    pthread_mutex_lock(&s_liblock) ;
+    if (--s_libusers == 0) mosquitto_lib_cleanup() ;
+    pthread_mutex_unlock(&s_liblock) ;
+    m_lib_initialised = false ;
+  }
+}
+
+int MosquittoBroker::publish(int *mid, const char *sztopic,
+			     int payloadlen, const void *payload,
+			     int qos, bool retain)
+{
+  if (!m_pmosquitto) return BROKER_ERR_NO_CONN ;
+  return error_code(mosquitto_publish(m_pmosquitto, mid, sztopic,
+				      payloadlen, payload, qos, retain)) ;
+}
+
+int MosquittoBroker::subscribe(int *mid, const char *sztopic, int qos)
+{
+  if (!m_pmosquitto) return BROKER_ERR_NO_CONN ;
+  return error_code(mosquitto_subscribe(m_pmosquitto, mid, sztopic, qos)) ;
+}
+
+int MosquittoBroker::unsubscribe(int *mid, const char *sztopic)
+{
+  if (!m_pmosquitto) return BROKER_ERR_NO_CONN ;
+  return error_code(mosquitto_unsubscribe(m_pmosquitto, mid, sztopic)) ;
+}
+
+void MosquittoBroker::on_message(struct mosquitto *m,
+				 void *data,
+				 const struct mosquitto_message *message)
+{
+  MosquittoBroker *broker = (MosquittoBroker*)data ;
+  if (broker->m_fnmessage)
+    (*broker->m_fnmessage)(broker->m_callback_context,
+			   message->topic,
+			   message->payload,
+			   message->payloadlen,
+			   message->qos,
+			   message->retain) ;
+}
+
+void MosquittoBroker::on_subscribe(struct mosquitto *m,
+				   void *data,
+				   int mid,
+				   int qoscount,
+				   const int *grantedqos)
+{
+  MosquittoBroker *broker = (MosquittoBroker*)data ;
+  if (broker->m_fnsubscribe)
+    (*broker->m_fnsubscribe)(broker->m_callback_context, mid,
+			     qoscount > 0?grantedqos[0]:0) ;
+}
+
+void MosquittoBroker::on_publish(struct mosquitto *m,
+				 void *data,
+				 int mid)
+{
+  MosquittoBroker *broker = (MosquittoBroker*)data ;
+  if (broker->m_fnpublish)
+    (*broker->m_fnpublish)(broker->m_callback_context, mid) ;
+}
+
+void MosquittoBroker::on_disconnect(struct mosquitto *m,
+				    void *data,
+				    int res)
+{
+  MosquittoBroker *broker = (MosquittoBroker*)data ;
+  if (broker->m_fndisconnect)
+    (*broker->m_fndisconnect)(broker->m_callback_context, res) ;
+}
+
+void MosquittoBroker::on_connect(struct mosquitto *m,
+				 void *data,
+				 int res)
+{
+  MosquittoBroker *broker = (MosquittoBroker*)data ;
+  if (broker->m_fnconnect)
+    (*broker->m_fnconnect)(broker->m_callback_context, res) ;
+}
@@ -0,0 +1,70 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef __MOSQUITTO_BROKER
+#define __MOSQUITTO_BROKER
+
+#include "mqttbroker.hpp"
+#include <mosquitto.h>
+
+// Broker connection using libmosquitto. Callbacks are made from the
+// mosquitto network thread
+class MosquittoBroker : public IMqttBroker{
+public:
+  MosquittoBroker(const char *szhost = "localhost", int port = 1883, int keepalive = 60) ;
+  ~MosquittoBroker() ;
+
+  bool initialise(const char *szclientid,
+		  const char *szwilltopic,
+		  const void *will, int willlen) ;
+  void shutdown() ;
+
+  int publish(int *mid, const char *sztopic,
+	      int payloadlen, const void *payload,
+	      int qos, bool retain) ;
+  int subscribe(int *mid, const char *sztopic, int qos) ;
+  int unsubscribe(int *mid, const char *sztopic) ;
+
+protected:
+  static int error_code(int mosquitto_err) ;
+  
+  static void on_message(struct mosquitto *m,
+			 void *data,
+			 const struct mosquitto_message *message) ;
+  static void on_subscribe(struct mosquitto *m,
+			   void *data,
+			   int mid,
+			   int qoscount,
+			   const int *grantedqos);
+  static void on_publish(struct mosquitto *m,
+			 void *data,
+			 int mid);
+  static void on_disconnect(struct mosquitto *m,
+			    void *data,
+			    int res);
+  static void on_connect(struct mosquitto *m,
+			 void *data,
+			 int res);
+
+  struct mosquitto *m_pmosquitto ;
+  char m_szhost[256] ;
+  int m_port ;
+  int m_keepalive ;
+  bool m_lib_initialised ;
+};
+
+#endif
@@ -0,0 +1,265 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+// Microbenchmarks for topic matching, topic and message collections and
+// received packet dispatch. Results are written to stdout as CSV, or
+// JSON with -j, for tracking performance between releases.
+// Build and run with make bench
+
+#include "mqttsnembed.hpp"
+#include "mqtttopic.hpp"
+#include "mqttconnection.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static bool json = false ;
+static bool first_result = true ;
+static volatile uint32_t sink = 0 ; // stops results being optimised away
+
+static uint64_t now_ns()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec ;
+}
+
+static void report(const char *szbench, const char *szparam, uint32_t ops, uint64_t ns)
+{
+  double per_op = ops > 0?(double)ns / ops:0.0 ;
+  if (json){
+    printf("%s\n  {\"benchmark\": \"%s\", \"param\": \"%s\", \"ops\": %u, \"ns_per_op\": %.2f}",
+	   first_result?"":",", szbench, szparam, ops, per_op) ;
+  }else{
+    printf("%s,%s,%u,%.2f\n", szbench, szparam, ops, per_op) ;
+  }
+  first_result = false ;
+}
+
+// Packet driver which discards everything sent
+class BenchDriver : public IPacketDriver{
+public:
+  bool initialise(uint8_t *device, uint8_t *broadcast, uint8_t length){
+    memcpy(m_broadcast, broadcast, length) ;
+    m_address_len = length ;
+    return true ;
+  }
+  bool send(const uint8_t *receiver, uint8_t *data, uint8_t len){return true;}
+  bool shutdown(){return true;}
+  uint8_t get_payload_width(){return PACKET_DRIVER_MAX_PAYLOAD;}
+  uint8_t get_address_len(){return m_address_len;}
+  uint8_t *get_broadcast(){return m_broadcast;}
+protected:
+  uint8_t m_broadcast[PACKET_DRIVER_MAX_ADDRESS_LEN] ;
+  uint8_t m_address_len ;
+};
+
+// Counts dispatched publishes
+class BenchEmbed : public MqttSnEmbed{
+public:
+  BenchEmbed(){published = 0;}
+  // Same path as a packet from the driver
+  void receive(uint8_t *addr, uint8_t *packet){m_fn_packet_received(this, addr, packet);}
+  bool dispatch(){return dispatch_queue();}
+  uint32_t published ;
+protected:
+  void received_publish(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){published++;}
+};
+
+// Topic of levels l0/l1/.../ln
+static void make_topic(char *sz, uint8_t depth)
+{
+  sz[0] = '\0' ;
+  for (uint8_t i=0; i < depth; i++)
+    sprintf(sz + strlen(sz), "%sl%u", i?"/":"", i) ;
+}
+
+static void bench_match_case(const char *szname, uint8_t depth, const char *szfilter, const char *sztopic)
+{
+  const uint32_t ops = 1000000 ;
+  char szparam[16] ;
+  MqttTopic filter(1, 0, szfilter) ;
+  uint32_t matched = 0 ;
+  uint64_t start = now_ns() ;
+  for (uint32_t i=0; i < ops; i++)
+    if (filter.match(sztopic)) matched++ ;
+  uint64_t end = now_ns() ;
+  sink += matched ;
+  snprintf(szparam, sizeof(szparam), "depth=%u", depth) ;
+  report(szname, szparam, ops, end - start) ;
+}
+
+static void bench_match()
+{
+  char szfilter[64], sztopic[64] ;
+  const uint8_t depths[] = {1, 4, 8} ;
+  for (uint8_t d=0; d < sizeof(depths); d++){
+    uint8_t depth = depths[d] ;
+    make_topic(sztopic, depth) ;
+
+    strcpy(szfilter, sztopic) ;
+    bench_match_case("match_literal", depth, szfilter, sztopic) ;
+    szfilter[strlen(szfilter)-1] = 'x' ;
+    bench_match_case("match_literal_miss", depth, szfilter, sztopic) ;
+
+    // Single level wildcard replacing the first level
+    strcpy(szfilter, "+") ;
+    strcat(szfilter, strchr(sztopic, '/')?strchr(sztopic, '/'):"") ;
+    bench_match_case("match_plus", depth, szfilter, sztopic) ;
+
+    // Multi level wildcard after the first level
+    strcpy(szfilter, "l0/#") ;
+    bench_match_case("match_hash", depth, szfilter, sztopic) ;
+  }
+}
+
+static void bench_topics()
+{
+  const uint32_t sizes[] = {10, 100, 1000, 10000} ;
+  char sztopic[32], szparam[16] ;
+  for (uint8_t s=0; s < sizeof(sizes)/sizeof(sizes[0]); s++){
+    uint32_t n = sizes[s] ;
+    snprintf(szparam, sizeof(szparam), "n=%u", n) ;
+    MqttTopicCollection topics ;
+    
+    uint64_t start = now_ns() ;
+    for (uint32_t i=0; i < n; i++){
+      snprintf(sztopic, sizeof(sztopic), "bench/%u", i) ;
+      topics.add_topic(sztopic) ;
+    }
+    report("topics_add", szparam, n, now_ns() - start) ;
+
+    // Lookups spread over the collection
+    start = now_ns() ;
+    for (uint32_t i=0; i < n; i++){
+      MqttTopic *t = topics.get_topic((uint16_t)((i * 7919) % n + 1)) ;
+      if (t) sink += t->get_id() ;
+    }
+    report("topics_get_id", szparam, n, now_ns() - start) ;
+
+    start = now_ns() ;
+    for (uint32_t i=0; i < n; i++){
+      snprintf(sztopic, sizeof(sztopic), "bench/%u", (i * 7919) % n) ;
+      MqttTopic *t = topics.get_topic(sztopic) ;
+      if (t) sink += t->get_id() ;
+    }
+    report("topics_get_name", szparam, n, now_ns() - start) ;
+
+    start = now_ns() ;
+    uint32_t count = 0 ;
+    topics.iterate_first_topic() ;
+    for (MqttTopic *t = topics.get_curr_topic(); t; t = topics.get_next_topic()) count++ ;
+    sink += count ;
+    report("topics_iterate", szparam, count, now_ns() - start) ;
+
+    start = now_ns() ;
+    for (uint32_t i=0; i < n; i++)
+      topics.del_topic((uint16_t)((i * 7919) % n + 1)) ;
+    report("topics_del_id", szparam, n, now_ns() - start) ;
+  }
+}
+
+static void bench_messages()
+{
+  const uint32_t ops = 1000000 ;
+  const uint16_t inflight[] = {1, MQTT_MESSAGES_INFLIGHT / 2} ;
+  char szparam[16] ;
+  for (uint8_t f=0; f < sizeof(inflight)/sizeof(inflight[0]); f++){
+    MqttMessageCollection messages ;
+    MqttMessage *m = NULL ;
+    // Keep some messages in flight for the searches
+    for (uint16_t i=1; i < inflight[f]; i++){
+      m = messages.add_message(MqttMessage::Activity::publishing) ;
+      m->set_message_id(i, true) ;
+    }
+    snprintf(szparam, sizeof(szparam), "inflight=%u", inflight[f]) ;
+
+    uint64_t start = now_ns() ;
+    for (uint32_t i=0; i < ops; i++){
+      m = messages.add_message(MqttMessage::Activity::publishing) ;
+      if (!m) continue ;
+      m->set_message_id(1000, true) ;
+      m = messages.get_message(1000, true) ;
+      if (m) m->set_inactive() ; // complete
+      sink += messages.get_active_message() != NULL ;
+    }
+    report("messages_add_get_complete", szparam, ops, now_ns() - start) ;
+  }
+}
+
+static void bench_dispatch()
+{
+  const uint32_t rounds = 100000 ;
+  uint8_t address[] = {0xC1, 0xC1, 0xC1, 0xC1, 0xC1} ;
+  uint8_t broadcast[] = {0xC2, 0xC2, 0xC2, 0xC2, 0xC2} ;
+  uint8_t packet[PACKET_DRIVER_MAX_PAYLOAD] ;
+  BenchDriver drv ;
+  BenchEmbed embed ;
+  char szparam[16] ;
+  embed.set_driver(&drv) ;
+  if (!embed.initialise(sizeof(address), broadcast, address)){
+    fprintf(stderr, "Cannot initialise dispatch benchmark\n") ;
+    return ;
+  }
+  
+  // QoS 0 publish with 8 bytes of data
+  memset(packet, 0, sizeof(packet)) ;
+  packet[0] = MQTT_PUBLISH_HDR_LEN + 8 ;
+  packet[1] = MQTT_PUBLISH ;
+
+  // Fill the queue without overwriting before each dispatch
+  const uint16_t batch = MQTT_MAX_QUEUE - 1 ;
+  uint64_t start = now_ns() ;
+  for (uint32_t r=0; r < rounds; r++){
+    for (uint16_t i=0; i < batch; i++) embed.receive(address, packet) ;
+    embed.dispatch() ;
+  }
+  snprintf(szparam, sizeof(szparam), "batch=%u", batch) ;
+  report("queue_dispatch", szparam, embed.published, now_ns() - start) ;
+}
+
+int main(int argc, char **argv)
+{
+  int opt = 0 ;
+  while ((opt = getopt(argc, argv, "j")) != -1){
+    switch(opt){
+    case 'j':
+      json = true ;
+      break ;
+    default:
+      fprintf(stderr, "Usage: %s [-j]\n", argv[0]) ;
+      return EXIT_FAILURE ;
+    }
+  }
+
+  // Measure the code, not the logging
+  mqtt_log_set_level(MQTT_LOG_NONE) ;
+
+  if (json) printf("[") ;
+  else printf("benchmark,param,ops,ns_per_op\n") ;
+  
+  bench_match() ;
+  bench_topics() ;
+  bench_messages() ;
+  bench_dispatch() ;
+
+  if (json) printf("\n]\n") ;
+  return EXIT_SUCCESS ;
+}
@@ -0,0 +1,94 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef __MQTT_BROKER
+#define __MQTT_BROKER
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Return codes for broker calls
+#define BROKER_ERR_SUCCESS 0
+#define BROKER_ERR_INVAL 1
+#define BROKER_ERR_NO_CONN 2
+#define BROKER_ERR_NOMEM 3
+#define BROKER_ERR_UNKNOWN 4
+
+// Use the QoS requested by the client for broker calls
+#define BROKER_QOS_PASSTHROUGH 0xFF
+
+// Callbacks from the broker to the gateway. The first parameter is the
+// context set with set_callback_context.
+// Message: context, topic, payload, payload length, QoS, retain
+#define BROKERMESSAGECALLBACK(fn) void fn(void *, const char *, const void *, int, int, bool)
+// Publish complete: context, message id
+#define BROKERPUBLISHCALLBACK(fn) void fn(void *, int)
+// Subscribe complete: context, message id, granted QoS
+#define BROKERSUBSCRIBECALLBACK(fn) void fn(void *, int, int)
+// Connect and disconnect: context, result code (zero for success)
+#define BROKERCONNECTCALLBACK(fn) void fn(void *, int)
+#define BROKERDISCONNECTCALLBACK(fn) void fn(void *, int)
+
+// Upstream broker used by the gateway. Implementations may call back
+// from their own thread or from loop()
+class IMqttBroker{
+public:
+  IMqttBroker(){
+    m_callback_context = NULL ;
+    m_fnmessage = NULL ;
+    m_fnpublish = NULL ;
+    m_fnsubscribe = NULL ;
+    m_fnconnect = NULL ;
+    m_fndisconnect = NULL ;
+  }
+  virtual ~IMqttBroker(){}
+
+  // Start the broker connection. The will is published by the broker
+  // if the gateway is lost. Returns false if the broker cannot be started
+  virtual bool initialise(const char *szclientid,
+			  const char *szwilltopic,
+			  const void *will, int willlen) = 0 ;
+  virtual void shutdown() = 0 ;
+
+  // Calls return BROKER_ERR_SUCCESS or an error code. The message id
+  // is set to match the publish or subscribe callback
+  virtual int publish(int *mid, const char *sztopic,
+		      int payloadlen, const void *payload,
+		      int qos, bool retain) = 0 ;
+  virtual int subscribe(int *mid, const char *sztopic, int qos) = 0 ;
+  virtual int unsubscribe(int *mid, const char *sztopic) = 0 ;
+
+  // Called regularly by the gateway to process pending work.
+  virtual void loop(){}
+
+  void set_callback_context(void *context){m_callback_context = context;}
+  void set_message_callback(BROKERMESSAGECALLBACK((*fn))){m_fnmessage = fn;}
+  void set_publish_callback(BROKERPUBLISHCALLBACK((*fn))){m_fnpublish = fn;}
+  void set_subscribe_callback(BROKERSUBSCRIBECALLBACK((*fn))){m_fnsubscribe = fn;}
+  void set_connect_callback(BROKERCONNECTCALLBACK((*fn))){m_fnconnect = fn;}
+  void set_disconnect_callback(BROKERDISCONNECTCALLBACK((*fn))){m_fndisconnect = fn;}
+
+protected:
+  void *m_callback_context ;
+  BROKERMESSAGECALLBACK((*m_fnmessage)) ;
+  BROKERPUBLISHCALLBACK((*m_fnpublish)) ;
+  BROKERSUBSCRIBECALLBACK((*m_fnsubscribe)) ;
+  BROKERCONNECTCALLBACK((*m_fnconnect)) ;
+  BROKERDISCONNECTCALLBACK((*m_fndisconnect)) ;
+};
+
+#endif
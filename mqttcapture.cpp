@@ -0,0 +1,172 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "mqttcapture.hpp"
+#include <string.h>
+#include <time.h>
+
+#define MQTT_CAPTURE_VERSION 1
+
+static uint64_t capture_now_us()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 ;
+}
+
+static void write_le(FILE *f, uint32_t v, uint8_t bytes)
+{
+  for (uint8_t i=0; i < bytes; i++) fputc((v >> (i*8)) & 0xFF, f) ;
+}
+
+static bool read_le(FILE *f, uint32_t *v, uint8_t bytes)
+{
+  *v = 0 ;
+  for (uint8_t i=0; i < bytes; i++){
+    int c = fgetc(f) ;
+    if (c == EOF) return false ;
+    *v |= (uint32_t)c << (i*8) ;
+  }
+  return true ;
+}
+
+MqttCapture::MqttCapture()
+{
+  m_file = NULL ;
+  m_address_len = 0 ;
+  m_last_us = 0 ;
+  m_count = 0 ;
+  pthread_mutex_init(&m_lock, NULL) ;
+}
+
+MqttCapture::~MqttCapture()
+{
+  close() ;
+  pthread_mutex_destroy(&m_lock) ;
+}
+
+bool MqttCapture::open(const char *szpath, uint8_t address_len)
+{
+  if (address_len > PACKET_DRIVER_MAX_ADDRESS_LEN) return false ;
+  close() ;
+  FILE *f = fopen(szpath, "wb") ;
+  if (!f){
+    EPRINT("CAPTURE: Cannot open %s for writing\n", szpath) ;
+    return false ;
+  }
+  fwrite("MQCP", 4, 1, f) ;
+  fputc(MQTT_CAPTURE_VERSION, f) ;
+  fputc(address_len, f) ;
+
+  pthread_mutex_lock(&m_lock) ;
+  m_file = f ;
+  m_address_len = address_len ;
+  m_last_us = capture_now_us() ;
+  m_count = 0 ;
+  pthread_mutex_unlock(&m_lock) ;
+  return true ;
+}
+
+void MqttCapture::close()
+{
+  pthread_mutex_lock(&m_lock) ;
+  if (m_file){
+    if (fclose(m_file) != 0) EPRINT("CAPTURE: Failed closing capture\n") ;
+    m_file = NULL ;
+  }
+  pthread_mutex_unlock(&m_lock) ;
+}
+
+void MqttCapture::record(uint8_t direction, const uint8_t *address,
+			 const uint8_t *data, mqtt_len_t len)
+{
+  pthread_mutex_lock(&m_lock) ;
+  if (m_file){
+    uint64_t now = capture_now_us() ;
+    uint64_t delta = now - m_last_us ;
+    m_last_us = now ;
+    write_le(m_file, delta > 0xFFFFFFFF?0xFFFFFFFF:(uint32_t)delta, 4) ;
+    fputc(direction, m_file) ;
+    write_le(m_file, len, 2) ;
+    if (m_address_len > 0) fwrite(address, m_address_len, 1, m_file) ;
+    if (len > 0) fwrite(data, len, 1, m_file) ;
+    // Keep the capture usable if the process dies
+    fflush(m_file) ;
+    m_count++ ;
+  }
+  pthread_mutex_unlock(&m_lock) ;
+}
+
+MqttCaptureReader::MqttCaptureReader()
+{
+  m_file = NULL ;
+  m_address_len = 0 ;
+}
+
+MqttCaptureReader::~MqttCaptureReader()
+{
+  close() ;
+}
+
+bool MqttCaptureReader::open(const char *szpath)
+{
+  char magic[4] ;
+  close() ;
+  m_file = fopen(szpath, "rb") ;
+  if (!m_file){
+    EPRINT("CAPTURE: Cannot open %s\n", szpath) ;
+    return false ;
+  }
+  int version = EOF, address_len = EOF ;
+  if (fread(magic, 4, 1, m_file) == 1){
+    version = fgetc(m_file) ;
+    address_len = fgetc(m_file) ;
+  }
+  if (memcmp(magic, "MQCP", 4) != 0 || version != MQTT_CAPTURE_VERSION ||
+      address_len == EOF || address_len > PACKET_DRIVER_MAX_ADDRESS_LEN){
+    EPRINT("CAPTURE: %s is not a capture file\n", szpath) ;
+    close() ;
+    return false ;
+  }
+  m_address_len = address_len ;
+  return true ;
+}
+
+void MqttCaptureReader::close()
+{
+  if (m_file) fclose(m_file) ;
+  m_file = NULL ;
+}
+
+bool MqttCaptureReader::next(MqttCaptureFrame &frame)
+{
+  uint32_t v = 0 ;
+  if (!m_file) return false ;
+  if (!read_le(m_file, &frame.delta_us, 4)) return false ;
+  int direction = fgetc(m_file) ;
+  if (direction == EOF || !read_le(m_file, &v, 2)) return false ;
+  if (v > PACKET_DRIVER_MAX_PAYLOAD){
+    EPRINT("CAPTURE: Frame of %u bytes too long for driver\n", v) ;
+    return false ;
+  }
+  frame.direction = direction ;
+  frame.len = v ;
+  if (m_address_len > 0 && fread(frame.address, m_address_len, 1, m_file) != 1) return false ;
+  if (frame.len > 0 && fread(frame.data, frame.len, 1, m_file) != 1) return false ;
+  return true ;
+}
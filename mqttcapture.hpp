@@ -0,0 +1,93 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef __MQTT_CAPTURE
+#define __MQTT_CAPTURE
+
+#include "mqttparams.hpp"
+#include <stdio.h>
+#include <pthread.h>
+
+// Packet capture at the driver boundary for offline replay.
+// Capture file layout, little endian:
+//   "MQCP", version (1 byte), address length (1 byte)
+// followed by a record for each frame:
+//   microseconds since the previous frame (4 bytes), direction (1 byte),
+//   frame length (2 bytes), address, frame including the MQTT-SN header
+
+class MqttCaptureFrame{
+public:
+  enum Direction{
+    received, // from a remote device to this device
+    sent      // from this device to a remote device
+  };
+  MqttCaptureFrame(){delta_us = 0; direction = received; len = 0;}
+  uint32_t delta_us ;
+  uint8_t direction ;
+  uint8_t address[PACKET_DRIVER_MAX_ADDRESS_LEN] ;
+  uint8_t data[PACKET_DRIVER_MAX_PAYLOAD] ;
+  mqtt_len_t len ;
+};
+
+// Writes frames to a capture file. Safe to record from the driver
+// callback and the sending thread
+class MqttCapture{
+public:
+  MqttCapture() ;
+  ~MqttCapture() ;
+
+  // Create the capture file. Returns false if it cannot be written
+  bool open(const char *szpath, uint8_t address_len) ;
+  void close() ;
+  bool is_open(){return m_file != NULL;}
+
+  void record(uint8_t direction, const uint8_t *address,
+	      const uint8_t *data, mqtt_len_t len) ;
+
+  // Frames written since open
+  uint32_t count(){return m_count;}
+
+protected:
+  FILE *m_file ;
+  uint8_t m_address_len ;
+  uint64_t m_last_us ;
+  uint32_t m_count ;
+  pthread_mutex_t m_lock ;
+};
+
+// Reads frames back from a capture file
+class MqttCaptureReader{
+public:
+  MqttCaptureReader() ;
+  ~MqttCaptureReader() ;
+
+  // Returns false if the file cannot be read or is not a capture
+  bool open(const char *szpath) ;
+  void close() ;
+  uint8_t get_address_len(){return m_address_len;}
+
+  // Read the next frame. Returns false at the end of the capture or
+  // if the file is truncated
+  bool next(MqttCaptureFrame &frame) ;
+
+protected:
+  FILE *m_file ;
+  uint8_t m_address_len ;
+};
+
+#endif
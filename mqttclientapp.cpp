@@ -47,16 +47,16 @@ void data_received(bool success,
 		   uint8_t returncode,
 		   const char* sztopic,
 		   uint8_t *payload,
-		   uint8_t payloadlen,
+		   mqtt_len_t payloadlen,
 		   uint8_t gwid)
 {
   if (success){
     printf("Publish received: Topic [%s] Payload [", sztopic) ;
-    for (uint8_t i=0; i < payloadlen; i++){
+    for (mqtt_len_t i=0; i < payloadlen; i++){
       printf(" %X", payload[i]) ;
     }
     printf(" - '");
-    for (uint8_t i=0; i < payloadlen; i++){
+    for (mqtt_len_t i=0; i < payloadlen; i++){
       printf("%c", payload[i]) ;
     }
     printf("']\n") ;
@@ -140,6 +140,15 @@ void disconnect(char params[][30], int count)
   }
 }
 
+void poll_gateway(char params[][30], int count)
+{
+  if (pradio->poll()){
+    printf("Polling gateway for messages\n");
+  }else{
+    printf("Client is not asleep\n");
+  }
+}
+
 void rf24_state(char params[][30], int count)
 {
   print_state(pdrv) ;
@@ -258,8 +267,8 @@ void register_topic(char params[][30], int count)
 
 int main(int argc, char **argv)
 {
-  const char usage[] = "Usage: %s -c ce -i irq -a address -b address [-n clientname] [-o channel] [-s 250|1|2] [-x]\n" ;
-  const char optlist[] = "i:c:o:a:b:s:n:x" ;
+  const char usage[] = "Usage: %s -c ce -i irq -a address -b address [-n clientname] [-o channel] [-s 250|1|2] [-x] [-f storefile]\n" ;
+  const char optlist[] = "i:c:o:a:b:s:n:xf:" ;
   int opt = 0 ;
   uint8_t rf24address[ADDR_WIDTH] ;
   uint8_t rf24broadcast[ADDR_WIDTH] ;
@@ -272,6 +281,7 @@ int main(int argc, char **argv)
 			Command("search",&search,true),
 			Command("rf24", &rf24_state, true),
 			Command("disconnect", &disconnect, true),
+			Command("poll", &poll_gateway, true),
 			Command("gwinfo", &gwinfo, true),
 			Command("addgw", &addgw, true),
 			Command("publish", &publish, true),
@@ -282,6 +292,8 @@ int main(int argc, char **argv)
 
   ClientMqttSn mqtt ;
   RF24Driver drv ;
+  MqttSpool store ;
+  char *szstore = NULL ;
 
   pdrv = &drv ;
   pradio = &mqtt;
@@ -330,6 +342,9 @@ int main(int argc, char **argv)
       strncpy(szclientid, optarg, PACKET_DRIVER_MAX_PAYLOAD - MQTT_CONNECT_HDR_LEN) ;
       opt_cname = 1 ;
       break;
+    case 'f': // offline store file
+      szstore = optarg ;
+      break ;
     default: // ? opt
       fprintf(stderr, usage, argv[0]);
       exit(EXIT_FAILURE);
@@ -389,6 +404,16 @@ int main(int argc, char **argv)
   else
     mqtt.set_client_id("CL") ;
 
+  if (szstore){
+    // Keep the newest readings if disconnected for a long time
+    store.set_policy(MqttSpool::drop_oldest) ;
+    if (!store.set_file(szstore)){
+      fprintf(stderr, "Cannot use store file %s\n", szstore) ;
+      return EXIT_FAILURE ;
+    }
+    mqtt.set_offline_store(&store) ;
+  }
+
   mqtt.initialise(ADDR_WIDTH, rf24broadcast, rf24address) ;
   // Link layer specific options
   drv.set_channel(opt_channel) ; // 2.400GHz + channel MHz
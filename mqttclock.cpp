@@ -0,0 +1,58 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "mqttclock.hpp"
+
+static bool s_virtual = false ;
+static time_t s_virtual_now = 0 ;
+static uint64_t s_virtual_ms = 0 ;
+
+time_t mqtt_clock_now()
+{
+  return s_virtual?s_virtual_now:time(NULL) ;
+}
+
+uint32_t mqtt_clock_now_ms()
+{
+  if (s_virtual) return (uint32_t)s_virtual_ms ;
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) ;
+}
+
+void mqtt_clock_set_virtual(bool enable)
+{
+  s_virtual = enable ;
+}
+
+bool mqtt_clock_is_virtual()
+{
+  return s_virtual ;
+}
+
+void mqtt_clock_set(time_t t)
+{
+  s_virtual_now = t ;
+  s_virtual_ms = (uint64_t)t * 1000 ;
+}
+
+void mqtt_clock_set_ms(uint64_t ms)
+{
+  s_virtual_now = ms / 1000 ;
+  s_virtual_ms = ms ;
+}
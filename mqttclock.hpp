@@ -0,0 +1,50 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef __MQTT_CLOCK
+#define __MQTT_CLOCK
+
+// Time source, in seconds, for all protocol timers.
+// TIMENOW_MS is a wrapping millisecond count for measuring round trips
+#ifdef ARDUINO
+ #include <TimeLib.h>
+ #include <arduino.h>
+ #define TIMENOW now()
+ #define TIMENOW_MS millis()
+#else
+ #include <time.h>
+ #include <stdint.h>
+ #define TIMENOW mqtt_clock_now()
+ #define TIMENOW_MS mqtt_clock_now_ms()
+
+// System time unless the virtual clock is enabled
+time_t mqtt_clock_now() ;
+// Monotonic milliseconds unless the virtual clock is enabled
+uint32_t mqtt_clock_now_ms() ;
+
+// Replace the system time with a virtual clock which only moves when
+// set. Lets simulations run hours of timers in seconds.
+// Not thread safe, set the clock between calls into the library
+void mqtt_clock_set_virtual(bool enable) ;
+bool mqtt_clock_is_virtual() ;
+void mqtt_clock_set(time_t t) ;
+// Set the virtual clock with millisecond resolution
+void mqtt_clock_set_ms(uint64_t ms) ;
+#endif
+
+#endif
@@ -22,12 +22,14 @@ void MqttMessage::reset()
 {
   m_active = false ;
   m_message_cache_typeid = 0;
-  m_message_cache_len = 0;
+  m_message_cache.reset() ;
   m_messageid = 0;
   m_external_message = false ;
   m_topicid = 0;
   m_topictype = 0;
   m_mosmid = 0;
+  MQTT_METRIC(m_broker_sent_us = 0) ;
+  MQTT_TRACE_POINT(m_trace.clear()) ;
   m_state = Activity::none ;
   m_lasttry = 0 ;
   m_attempts = 0 ;
@@ -48,21 +50,22 @@ void MqttMessage::sending()
     if (m_attempts == 1 &&
 	(m_message_cache_typeid == MQTT_SUBSCRIBE ||
 	 m_message_cache_typeid == MQTT_PUBLISH)){
-      if (m_message_cache_len > 0) m_message_cache[0] |= FLAG_DUP ;
+      if (m_message_cache.len() > 0) m_message_cache.body()[0] |= FLAG_DUP ;
     }
   }
 }
 
-void MqttMessage::set_message(uint8_t messagetypeid, const uint8_t *message, uint8_t len)
+void MqttMessage::set_message(uint8_t messagetypeid, const uint8_t *message, mqtt_len_t len)
+{
+  encode_message(messagetypeid).bytes(message, len) ;
+}
+
+MqttFrame& MqttMessage::encode_message(uint8_t messagetypeid)
 {
   m_message_set = true ;
   m_message_cache_typeid = messagetypeid ;
-  if(message){
-    memcpy(m_message_cache, message, len) ;
-  }else{
-    len = 0;
-  }
-  m_message_cache_len = len ;
+  m_message_cache.reset() ;
+  return m_message_cache ;
 }
 
 bool MqttMessage::has_expired(time_t timeout)
@@ -86,7 +89,7 @@ MqttMessageCollection::MqttMessageCollection()
 
 uint16_t MqttMessageCollection::get_new_messageid()
 {
-  if(m_lastmessageid == 0xFFFF)
+  if(m_lastmessageid >= MQTT_MESSAGE_STORED - 1)
     m_lastmessageid=0;
   m_lastmessageid++ ;
   return m_lastmessageid;
@@ -170,6 +173,17 @@ MqttMessage* MqttMessageCollection::get_active_message()
   return NULL ; // No active messages
 }
 
+MqttMessage* MqttMessageCollection::get_next_active_message(MqttMessage *m)
+{
+  uint16_t mpos = m - m_messages ;
+  for(;;){
+    mpos++ ;
+    if (mpos == MQTT_MESSAGES_INFLIGHT) mpos = 0;
+    if (mpos == m_queuehead) return NULL ;
+    if (m_messages[mpos].is_active()) return &(m_messages[mpos]) ;
+  }
+}
+
 void MqttMessageCollection::clear_queue()
 {
   for(int i=0; i < MQTT_MESSAGES_INFLIGHT; i++){
@@ -179,6 +193,24 @@ void MqttMessageCollection::clear_queue()
   m_queuetail = 0;
 }
 
+uint16_t MqttMessageCollection::count_active()
+{
+  uint16_t count = 0 ;
+  for(int i=0; i < MQTT_MESSAGES_INFLIGHT; i++){
+    if (m_messages[i].is_active()) count++ ;
+  }
+  return count ;
+}
+
+uint16_t MqttMessageCollection::count_waiting()
+{
+  uint16_t count = 0 ;
+  for(int i=0; i < MQTT_MESSAGES_INFLIGHT; i++){
+    if (m_messages[i].is_active() && !m_messages[i].has_content()) count++ ;
+  }
+  return count ;
+}
+
 
 
 MqttConnection::MqttConnection(){
@@ -190,6 +222,9 @@ MqttConnection::MqttConnection(){
   sleep_duration = 0 ;
   asleep_from = 0 ;
   m_last_ping =0;
+  m_ping_pending = false ;
+  m_ping_stretch = 1 ;
+  m_ping_steps = 0 ;
   m_address_len = 0 ;
   m_state = State::disconnected ;
   m_szclientid[0] = '\0' ;
@@ -203,14 +238,31 @@ MqttConnection::MqttConnection(){
 
 void MqttConnection::update_activity()
 {
-  // received activity from client or server
+  // received activity from client or server. Any message answers
+  // an outstanding ping
+  if (m_ping_pending && m_ping_steps < 0xFF) m_ping_steps++ ;
+  m_ping_pending = false ;
   m_lastactivity = TIMENOW ;
   reset_ping() ;
 }
 
+uint32_t MqttConnection::ping_interval()
+{
+  uint32_t step = duration / 2 ;
+  if (step == 0) step = 1 ;
+  uint32_t interval = duration + (uint32_t)m_ping_steps * step ;
+  uint32_t cap = (uint32_t)duration * (m_ping_stretch?m_ping_stretch:1) ;
+  return interval < cap ? interval : cap ;
+}
+
 bool MqttConnection::send_another_ping()
 {
-  return ((m_last_ping + (duration)) < TIMENOW) ;
+  if (m_ping_pending){
+    // Last ping is unanswered. Retry at the keep alive duration
+    m_ping_steps = 0 ;
+    return ((m_last_ping + (duration)) < TIMENOW) ;
+  }
+  return ((m_last_ping + ping_interval()) < TIMENOW) ;
 }
 
 bool MqttConnection::lost_contact()
@@ -255,7 +307,7 @@ bool MqttConnection::set_will_topic(const char *topic, uint8_t qos, bool retain)
   return true ;
 }
 
-bool MqttConnection::set_will_message(const uint8_t *message, uint8_t len)
+bool MqttConnection::set_will_message(const uint8_t *message, mqtt_len_t len)
 {
   if (!message || len == 0){
     m_willmessagesize = 0;
@@ -19,15 +19,11 @@
 #define __MQTT_CONNECTION
 
 #include "mqttparams.hpp"
-#ifdef ARDUINO
- #include <TimeLib.h>
- #include <arduino.h>
- #define TIMENOW now()
-#else
- #include <time.h>
- #define TIMENOW time(NULL)
-#endif
+#include "mqttclock.hpp"
 #include "mqtttopic.hpp"
+#include "mqttpacket.hpp"
+#include "mqttmetrics.hpp"
+#include "mqtttrace.hpp"
 
 class MqttMessage{
 public:
@@ -45,15 +41,22 @@ public:
   Activity get_activity(){return m_state;}
   
   // Write a packet to cache against the connection.
-  void set_message(uint8_t messagetypeid, const uint8_t *message, uint8_t len) ;
+  void set_message(uint8_t messagetypeid, const uint8_t *message, mqtt_len_t len) ;
+
+  // Clears the cache and returns it for the message body to be
+  // encoded in place. Avoids building the body in a separate buffer
+  MqttFrame& encode_message(uint8_t messagetypeid) ;
 
   // Read the cache data
-  const uint8_t* get_message(){return m_message_cache;}
+  const uint8_t* get_message(){return m_message_cache.body();}
+
+  // Cached frame, sent in place by writeframe
+  MqttFrame& get_frame(){return m_message_cache;}
 
   uint8_t get_message_type(){return m_message_cache_typeid;}
   
   // Read cache size
-  uint8_t get_message_len(){return m_message_cache_len;}
+  mqtt_len_t get_message_len(){return m_message_cache.len();}
 
   bool has_content(){return m_message_set;}
 
@@ -72,6 +75,14 @@ public:
 
   void set_mosquitto_mid(int mid){m_mosmid = mid ;}
   int get_mosquitto_mid(){return m_mosmid;}
+#ifdef MQTT_METRICS_ENABLED
+  // When the message was published to the broker
+  void set_broker_sent_us(uint32_t us){m_broker_sent_us = us;}
+  uint32_t get_broker_sent_us(){return m_broker_sent_us;}
+#endif
+#ifdef MQTT_TRACE_ENABLED
+  MqttTrace& get_trace(){return m_trace;}
+#endif
 
   //bool state_timeout(uint16_t timeout);
   //uint16_t state_timeout_count(){return m_attempts;}
@@ -91,8 +102,7 @@ public:
 protected:
   bool m_active ; // Is this in-use or free to hold another connection?
   uint8_t m_message_cache_typeid ; // MQTT message header ID
-  uint8_t m_message_cache[PACKET_DRIVER_MAX_PAYLOAD] ;
-  uint8_t m_message_cache_len ;
+  MqttFrame m_message_cache ;
   
   uint16_t m_messageid ;
   bool m_external_message ;
@@ -100,6 +110,8 @@ protected:
   uint8_t m_topictype ;
   uint8_t m_qos ;
   int m_mosmid ;
+  MQTT_METRIC(uint32_t m_broker_sent_us ;)
+  MQTT_TRACE_POINT(MqttTrace m_trace ;)
   Activity m_state ;
 
   bool m_sent ;
@@ -122,7 +134,15 @@ public:
   MqttMessage* get_message(uint16_t messageid, bool externalid=false);
   MqttMessage* get_mos_message(int messageid) ;
   MqttMessage* get_active_message() ;
+  // Next active message in queue order after m, which must be in this
+  // collection. Returns NULL once the queue head is reached
+  MqttMessage* get_next_active_message(MqttMessage *m) ;
   void clear_queue() ;
+  // Number of active messages
+  uint16_t count_active() ;
+  // Number of active messages without content. Gateways use these to
+  // wait on the broker
+  uint16_t count_waiting() ;
   
   
 protected:
@@ -137,7 +157,7 @@ protected:
 class MqttConnection{
 public:
   enum State{
-    disconnected, connected, asleep, // states
+    disconnected, connected, asleep, awake, // states
     connecting // transition states
   };
   
@@ -145,15 +165,36 @@ public:
   void update_activity(); // received activity from client or server
   bool send_another_ping() ;
   void reset_ping(){m_last_ping = TIMENOW ;}
+  // Record a ping waiting for a response. Any response counts
+  void ping_sent(){m_last_ping = TIMENOW ; m_ping_pending = true ;}
+  // Pings answered while idle stretch the ping interval in steps of
+  // half the keep alive duration, up to duration times the stretch.
+  // An unanswered ping returns to pinging every duration.
+  // 1, the default, pings every duration
+  void set_ping_stretch(uint8_t stretch){m_ping_stretch = stretch ;}
+  // Seconds until the next ping is due after activity
+  uint32_t ping_interval() ;
+  time_t get_last_activity(){return m_lastactivity;}
   bool is_asleep(){
     return m_state == State::asleep ;
   }
+  // Asleep client polling for buffered messages
+  bool is_awake(){
+    return m_state == State::awake ;
+  }
+  bool is_sleeping(){
+    return m_state == State::asleep || m_state == State::awake ;
+  }
 
   void set_client_id(const char *sz){strncpy(m_szclientid, sz, PACKET_DRIVER_MAX_PAYLOAD - MQTT_CONNECT_HDR_LEN);}
   bool client_id_match(const char *sz){return (strcmp(sz, m_szclientid) == 0);}
   const char* get_client_id(){return m_szclientid;}
   State get_state(){return m_state;}
-  void set_state(State s){m_state = s;}
+  void set_state(State s){
+    // New sessions start pinging every duration
+    if (s == State::connecting){m_ping_steps = 0 ; m_ping_pending = false ;}
+    m_state = s;
+  }
   bool is_connected(){
     return m_state == State::connected ;
   }
@@ -188,7 +229,7 @@ public:
   MqttMessageCollection messages;
   
   bool set_will_topic(const char *topic, uint8_t qos, bool retain) ;
-  bool set_will_message(const uint8_t *message, uint8_t len) ;
+  bool set_will_message(const uint8_t *message, mqtt_len_t len) ;
   bool get_will_retain() ;
   char* get_will_topic() ;
   uint8_t* get_will_message();
@@ -198,6 +239,9 @@ public:
 protected:
   uint8_t m_gwid ; // gw id for client connections
   time_t m_last_ping ;
+  bool m_ping_pending ;
+  uint8_t m_ping_stretch ;
+  uint8_t m_ping_steps ; // answered idle pings
   time_t m_lastactivity ; // when did we last hear from the client (sec)
   char m_szclientid[PACKET_DRIVER_MAX_PAYLOAD - MQTT_CONNECT_HDR_LEN+1] ; // client id for gw
   uint8_t m_connect_address[PACKET_DRIVER_MAX_ADDRESS_LEN] ; // client or gw address
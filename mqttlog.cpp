@@ -0,0 +1,245 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "mqttlog.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef DEBUG
+std::atomic<uint8_t> g_mqtt_log_level(MQTT_LOG_DEBUG) ;
+#else
+std::atomic<uint8_t> g_mqtt_log_level(MQTT_LOG_NONE) ;
+#endif
+
+static MqttLogRecord s_ring[MQTT_LOG_RECORDS] ;
+static std::atomic<uint32_t> s_tail(0) ; // next record to claim
+static std::atomic<uint32_t> s_head(0) ; // next record to write
+static std::atomic<uint32_t> s_dropped(0) ;
+static std::atomic<bool> s_stop(false) ;
+static pthread_once_t s_once = PTHREAD_ONCE_INIT ;
+static pthread_t s_writer ;
+static bool s_started = false ;
+
+static bool log_write_one() ;
+static void *log_writer(void *) ;
+static void log_stop() ;
+
+static void log_start()
+{
+  for (uint32_t i=0; i < MQTT_LOG_RECORDS; i++)
+    s_ring[i].m_seq.store(i, std::memory_order_relaxed) ;
+  if (pthread_create(&s_writer, NULL, log_writer, NULL) != 0){
+    fprintf(stderr, "Cannot start log writer thread\n") ;
+    return ;
+  }
+  s_started = true ;
+  atexit(log_stop) ;
+}
+
+static void log_stop()
+{
+  s_stop.store(true) ;
+  if (s_started) pthread_join(s_writer, NULL) ;
+  s_started = false ;
+  while (log_write_one()) ;
+  fflush(stdout) ;
+}
+
+void mqtt_log_set_level(uint8_t level)
+{
+  g_mqtt_log_level.store(level, std::memory_order_relaxed) ;
+}
+
+uint32_t mqtt_log_dropped()
+{
+  return s_dropped.load(std::memory_order_relaxed) ;
+}
+
+void MqttLogRecord::add_str(const char *sz)
+{
+  if (m_nargs >= MQTT_LOG_MAX_ARGS) return ;
+  if (!sz) sz = "(null)" ;
+  uint16_t room = MQTT_LOG_STR_LEN - m_strused ;
+  if (room == 0){
+    // Last byte is always the end of the previous string
+    add(MQTT_LOG_STR_LEN - 1, arg_str) ;
+    return ;
+  }
+  size_t len = strlen(sz) ;
+  if (len > (size_t)room - 1) len = room - 1 ;
+  memcpy(m_str + m_strused, sz, len) ;
+  m_str[m_strused + len] = '\0' ;
+  add(m_strused, arg_str) ;
+  m_strused += len + 1 ;
+}
+
+MqttLogRecord* mqtt_log_claim()
+{
+  pthread_once(&s_once, log_start) ;
+  uint32_t pos = s_tail.load(std::memory_order_relaxed) ;
+  for (;;){
+    MqttLogRecord *r = &s_ring[pos & (MQTT_LOG_RECORDS - 1)] ;
+    int32_t dif = (int32_t)(r->m_seq.load(std::memory_order_acquire) - pos) ;
+    if (dif == 0){
+      if (s_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+	r->m_pos = pos ;
+	return r ;
+      }
+    }else if (dif < 0){
+      // Full. Drop rather than block the caller
+      s_dropped.fetch_add(1, std::memory_order_relaxed) ;
+      return NULL ;
+    }else{
+      pos = s_tail.load(std::memory_order_relaxed) ;
+    }
+  }
+}
+
+void mqtt_log_commit(MqttLogRecord *r)
+{
+  r->m_seq.store(r->m_pos + 1, std::memory_order_release) ;
+}
+
+// Formats a record using its format string. Length modifiers in the
+// format are replaced as all integers are captured as 64 bit values
+static void log_format(MqttLogRecord *r, char *out, size_t outlen)
+{
+  size_t used = 0 ;
+  uint8_t arg = 0 ;
+  const char *p = r->m_fmt ;
+  char spec[32] ;
+
+  while (*p && used < outlen - 1){
+    if (*p != '%'){
+      out[used++] = *p++ ;
+      continue ;
+    }
+    if (p[1] == '%'){
+      out[used++] = '%' ;
+      p += 2 ;
+      continue ;
+    }
+    size_t sl = 0 ;
+    spec[sl++] = *p++ ;
+    while (*p && strchr("-+ #0123456789.", *p) && sl < sizeof(spec) - 4) spec[sl++] = *p++ ;
+    while (*p && strchr("hlLqjzt", *p)) p++ ;
+    char conv = *p ;
+    if (!conv) break ;
+    p++ ;
+
+    size_t room = outlen - used ;
+    int n = 0 ;
+    if (arg >= r->m_nargs){
+      n = snprintf(out + used, room, "%%%c", conv) ;
+    }else{
+      uint8_t type = r->m_types[arg] ;
+      uint64_t v = r->m_args[arg] ;
+      switch(conv){
+      case 'd':
+      case 'i':
+	spec[sl++] = 'l' ; spec[sl++] = 'l' ; spec[sl++] = conv ; spec[sl] = '\0' ;
+	n = snprintf(out + used, room, spec,
+		     type == MqttLogRecord::arg_double?(long long)r->m_doubles[arg]:(long long)v) ;
+	break ;
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+	spec[sl++] = 'l' ; spec[sl++] = 'l' ; spec[sl++] = conv ; spec[sl] = '\0' ;
+	n = snprintf(out + used, room, spec,
+		     type == MqttLogRecord::arg_double?(unsigned long long)r->m_doubles[arg]:(unsigned long long)v) ;
+	break ;
+      case 'c':
+	spec[sl++] = conv ; spec[sl] = '\0' ;
+	n = snprintf(out + used, room, spec, (int)v) ;
+	break ;
+      case 's':
+	spec[sl++] = conv ; spec[sl] = '\0' ;
+	n = snprintf(out + used, room, spec,
+		     type == MqttLogRecord::arg_str?r->m_str + v:"(?)") ;
+	break ;
+      case 'p':
+	spec[sl++] = conv ; spec[sl] = '\0' ;
+	n = snprintf(out + used, room, spec, (void*)(uintptr_t)v) ;
+	break ;
+      case 'f':
+      case 'F':
+      case 'e':
+      case 'E':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A':
+	spec[sl++] = conv ; spec[sl] = '\0' ;
+	n = snprintf(out + used, room, spec,
+		     type == MqttLogRecord::arg_double?r->m_doubles[arg]:(double)(int64_t)v) ;
+	break ;
+      default:
+	n = snprintf(out + used, room, "%%%c", conv) ;
+	break ;
+      }
+      arg++ ;
+    }
+    if (n > 0) used += (size_t)n < room?n:room - 1 ;
+  }
+  out[used] = '\0' ;
+}
+
+static bool log_write_one()
+{
+  uint32_t pos = s_head.load(std::memory_order_relaxed) ;
+  MqttLogRecord *r = &s_ring[pos & (MQTT_LOG_RECORDS - 1)] ;
+  if (r->m_seq.load(std::memory_order_acquire) != pos + 1) return false ;
+
+  char line[512] ;
+  log_format(r, line, sizeof(line)) ;
+  if (r->m_level == MQTT_LOG_ERROR){
+    fputs(line, stderr) ;
+  }else{
+    fputs(line, stdout) ;
+  }
+  // Release the record for reuse
+  r->m_seq.store(pos + MQTT_LOG_RECORDS, std::memory_order_release) ;
+  s_head.store(pos + 1, std::memory_order_release) ;
+  return true ;
+}
+
+static void *log_writer(void *)
+{
+  struct timespec wait = {0, 1000000} ; // 1ms
+  while (!s_stop.load()){
+    if (log_write_one()){
+      while (log_write_one()) ;
+      fflush(stdout) ;
+    }else{
+      nanosleep(&wait, NULL) ;
+    }
+  }
+  return NULL ;
+}
+
+void mqtt_log_flush()
+{
+  uint32_t tail = s_tail.load(std::memory_order_acquire) ;
+  struct timespec wait = {0, 1000000} ; // 1ms
+  while (s_started && (int32_t)(s_head.load(std::memory_order_acquire) - tail) < 0)
+    nanosleep(&wait, NULL) ;
+}
@@ -0,0 +1,146 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef __MQTT_LOG
+#define __MQTT_LOG
+
+// Asynchronous logger used by DPRINT and EPRINT. Callers only copy the
+// format string pointer and raw argument values into a lock-free ring.
+// Messages are formatted and written by a background thread.
+// Format strings must be string literals. String arguments are copied
+// and truncated to fit in the record.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <type_traits>
+
+#define MQTT_LOG_NONE 0
+#define MQTT_LOG_ERROR 1
+#define MQTT_LOG_DEBUG 2
+
+#ifndef MQTT_LOG_RECORDS
+#define MQTT_LOG_RECORDS 1024 // must be a power of 2
+#endif
+#ifndef MQTT_LOG_MAX_ARGS
+#define MQTT_LOG_MAX_ARGS 8
+#endif
+// Space for copies of string arguments in each record
+#ifndef MQTT_LOG_STR_LEN
+#define MQTT_LOG_STR_LEN 128
+#endif
+
+extern std::atomic<uint8_t> g_mqtt_log_level ;
+
+// Change the logging level at runtime. Defaults to MQTT_LOG_DEBUG for
+// DEBUG builds and MQTT_LOG_NONE otherwise
+void mqtt_log_set_level(uint8_t level) ;
+inline uint8_t mqtt_log_get_level(){return g_mqtt_log_level.load(std::memory_order_relaxed);}
+inline bool mqtt_log_enabled(uint8_t level){return level <= mqtt_log_get_level();}
+
+// Wait until all queued messages have been written
+void mqtt_log_flush() ;
+
+// Messages dropped because the ring was full
+uint32_t mqtt_log_dropped() ;
+
+class MqttLogRecord{
+public:
+  enum ArgType{
+    arg_int, arg_uint, arg_double, arg_str, arg_ptr
+  };
+
+  void clear(){m_nargs = 0; m_strused = 0;}
+  
+  void add(int64_t v, ArgType type){
+    if (m_nargs >= MQTT_LOG_MAX_ARGS) return ;
+    m_args[m_nargs] = (uint64_t)v ;
+    m_types[m_nargs++] = type ;
+  }
+  void add_double(double v){
+    if (m_nargs >= MQTT_LOG_MAX_ARGS) return ;
+    m_doubles[m_nargs] = v ;
+    m_types[m_nargs++] = arg_double ;
+  }
+  void add_str(const char *sz) ;
+
+  // Ring position claimed by the writer and ready flag for the reader
+  std::atomic<uint32_t> m_seq ;
+  uint32_t m_pos ;
+  uint8_t m_level ;
+  const char *m_fmt ;
+  uint8_t m_nargs ;
+  uint8_t m_types[MQTT_LOG_MAX_ARGS] ;
+  union{
+    uint64_t m_args[MQTT_LOG_MAX_ARGS] ;
+    double m_doubles[MQTT_LOG_MAX_ARGS] ;
+  };
+  uint16_t m_strused ;
+  char m_str[MQTT_LOG_STR_LEN] ;
+};
+
+// Claim a record from the ring. Returns NULL if the ring is full
+MqttLogRecord* mqtt_log_claim() ;
+// Hand a filled record to the writer thread
+void mqtt_log_commit(MqttLogRecord *r) ;
+
+// Argument capture
+inline void mqtt_log_capture(MqttLogRecord *){}
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+mqtt_log_arg(MqttLogRecord *r, T v)
+{
+  if (std::is_signed<T>::value)
+    r->add((int64_t)v, MqttLogRecord::arg_int) ;
+  else
+    r->add((int64_t)(uint64_t)v, MqttLogRecord::arg_uint) ;
+}
+
+template<typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+mqtt_log_arg(MqttLogRecord *r, T v)
+{
+  r->add_double(v) ;
+}
+
+inline void mqtt_log_arg(MqttLogRecord *r, const char *sz){r->add_str(sz);}
+inline void mqtt_log_arg(MqttLogRecord *r, char *sz){r->add_str(sz);}
+template<typename T>
+void mqtt_log_arg(MqttLogRecord *r, T *p){r->add((int64_t)(uintptr_t)p, MqttLogRecord::arg_ptr);}
+
+template<typename T, typename... Args>
+void mqtt_log_capture(MqttLogRecord *r, T v, Args... args)
+{
+  mqtt_log_arg(r, v) ;
+  mqtt_log_capture(r, args...) ;
+}
+
+template<typename... Args>
+void mqtt_log(uint8_t level, const char *fmt, Args... args)
+{
+  MqttLogRecord *r = mqtt_log_claim() ;
+  if (!r) return ;
+  r->m_level = level ;
+  r->m_fmt = fmt ;
+  r->clear() ;
+  mqtt_log_capture(r, args...) ;
+  mqtt_log_commit(r) ;
+}
+
+#endif
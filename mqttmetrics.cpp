@@ -0,0 +1,91 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "mqttmetrics.hpp"
+#ifdef MQTT_METRICS_ENABLED
+#include "mqttparams.hpp"
+#include <stdio.h>
+
+void MqttHistogram::record(uint32_t value)
+{
+  uint8_t bucket = value == 0?0:32 - __builtin_clz(value) ;
+  m_buckets[bucket].inc() ;
+  m_count.inc() ;
+  uint32_t max = m_max.load(std::memory_order_relaxed) ;
+  while (value > max &&
+	 !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) ;
+}
+
+uint32_t MqttHistogram::percentile(uint8_t pc) const
+{
+  uint32_t total = count() ;
+  if (total == 0) return 0 ;
+  uint64_t target = ((uint64_t)total * pc + 99) / 100 ;
+  uint64_t seen = 0 ;
+  for (uint8_t i=0; i < MQTT_HISTOGRAM_BUCKETS; i++){
+    seen += m_buckets[i].get() ;
+    if (seen >= target){
+      if (i == 0) return 0 ;
+      // The bucket bound can be above every recorded value
+      uint32_t bound = i == 32?0xFFFFFFFF:(1UL << i) - 1 ;
+      return bound < max()?bound:max() ;
+    }
+  }
+  return max() ;
+}
+
+void MqttMetrics::snapshot(MQTTMETRICCALLBACK((*fn)), void *context)
+{
+  char szname[64] ;
+  char szvalue[16] ;
+
+  for (uint8_t i=0; i < MQTT_METRICS_TYPES; i++){
+    if (packets_in[i].get() > 0){
+      snprintf(szname, sizeof(szname), "packets/in/%s", mqtt_code_str(i)) ;
+      snprintf(szvalue, sizeof(szvalue), "%u", packets_in[i].get()) ;
+      (*fn)(context, szname, szvalue) ;
+    }
+    if (packets_out[i].get() > 0){
+      snprintf(szname, sizeof(szname), "packets/out/%s", mqtt_code_str(i)) ;
+      snprintf(szvalue, sizeof(szvalue), "%u", packets_out[i].get()) ;
+      (*fn)(context, szname, szvalue) ;
+    }
+  }
+
+  snprintf(szvalue, sizeof(szvalue), "%u", send_failures.get()) ;
+  (*fn)(context, "packets/send_failures", szvalue) ;
+  snprintf(szvalue, sizeof(szvalue), "%u", queue_overflows.get()) ;
+  (*fn)(context, "queue/overflows", szvalue) ;
+  snprintf(szvalue, sizeof(szvalue), "%u", retries.get()) ;
+  (*fn)(context, "messages/retries", szvalue) ;
+  snprintf(szvalue, sizeof(szvalue), "%u", failures.get()) ;
+  (*fn)(context, "messages/failures", szvalue) ;
+  snprintf(szvalue, sizeof(szvalue), "%u", connections.get()) ;
+  (*fn)(context, "connections", szvalue) ;
+
+  snprintf(szvalue, sizeof(szvalue), "%u", broker_publish_us.count()) ;
+  (*fn)(context, "broker/publish_us/count", szvalue) ;
+  snprintf(szvalue, sizeof(szvalue), "%u", broker_publish_us.percentile(50)) ;
+  (*fn)(context, "broker/publish_us/p50", szvalue) ;
+  snprintf(szvalue, sizeof(szvalue), "%u", broker_publish_us.percentile(99)) ;
+  (*fn)(context, "broker/publish_us/p99", szvalue) ;
+  snprintf(szvalue, sizeof(szvalue), "%u", broker_publish_us.max()) ;
+  (*fn)(context, "broker/publish_us/max", szvalue) ;
+}
+
+#endif
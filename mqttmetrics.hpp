@@ -0,0 +1,109 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef __MQTT_METRICS
+#define __MQTT_METRICS
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Metrics are compiled out for Arduino builds or by defining
+// MQTT_NO_METRICS. Wrap any metric updates in MQTT_METRIC
+#if !defined(ARDUINO) && !defined(MQTT_NO_METRICS)
+#define MQTT_METRICS_ENABLED
+#endif
+
+#ifdef MQTT_METRICS_ENABLED
+#define MQTT_METRIC(x) x
+#else
+#define MQTT_METRIC(x)
+#endif
+
+#ifdef MQTT_METRICS_ENABLED
+#include <atomic>
+#include <time.h>
+
+// Message type ids are all below this value
+#define MQTT_METRICS_TYPES 32
+// Power of 2 histogram buckets. Bucket 0 holds zero values and bucket n
+// values from 2^(n-1) to 2^n - 1
+#define MQTT_HISTOGRAM_BUCKETS 33
+
+// Callback for each metric in a snapshot: context, name, value
+#define MQTTMETRICCALLBACK(fn) void fn(void *, const char *, const char *)
+
+// Monotonic time for latency measurements
+inline uint32_t mqtt_metrics_now_us()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000) ;
+}
+
+// Counters and histograms can be updated from any thread without
+// locking. Reads are not synchronised with each other, so a snapshot
+// is only approximately consistent
+class MqttCounter{
+public:
+  MqttCounter() : m_value(0){}
+  void inc(uint32_t n=1){m_value.fetch_add(n, std::memory_order_relaxed);}
+  void set(uint32_t n){m_value.store(n, std::memory_order_relaxed);}
+  uint32_t get() const {return m_value.load(std::memory_order_relaxed);}
+protected:
+  std::atomic<uint32_t> m_value ;
+};
+
+class MqttHistogram{
+public:
+  MqttHistogram() : m_max(0){}
+  void record(uint32_t value) ;
+  uint32_t count() const {return m_count.get();}
+  uint32_t max() const {return m_max.load(std::memory_order_relaxed);}
+  // Upper bound of the bucket holding the percentile (0 to 100),
+  // limited to the largest recorded value
+  uint32_t percentile(uint8_t pc) const ;
+protected:
+  MqttCounter m_buckets[MQTT_HISTOGRAM_BUCKETS] ;
+  MqttCounter m_count ;
+  std::atomic<uint32_t> m_max ;
+};
+
+class MqttMetrics{
+public:
+  // Packets by MQTT-SN message type
+  MqttCounter packets_in[MQTT_METRICS_TYPES] ;
+  MqttCounter packets_out[MQTT_METRICS_TYPES] ;
+  MqttCounter send_failures ;
+  // Received packets overwritten before they were dispatched
+  MqttCounter queue_overflows ;
+  // Messages resent and messages abandoned after all retries
+  MqttCounter retries ;
+  MqttCounter failures ;
+  // Connected clients, set by the gateway
+  MqttCounter connections ;
+  // Microseconds from a broker publish to the broker acknowledging it
+  MqttHistogram broker_publish_us ;
+
+  // Calls fn with the name and text value of each metric. Packet
+  // counts are only included for message types which have been seen
+  void snapshot(MQTTMETRICCALLBACK((*fn)), void *context) ;
+};
+
+#endif
+
+#endif
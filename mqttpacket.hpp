@@ -0,0 +1,250 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef __MQTT_PACKET
+#define __MQTT_PACKET
+
+#include "mqttparams.hpp"
+#include <string.h>
+
+// Read only views of received MQTT-SN message bodies. Fields are read
+// in place from the queued packet so nothing is copied. Views are only
+// valid while the packet data is valid (i.e. in the received_* handlers).
+// All reads are bounds checked and read zero past the end of the packet.
+// Use valid() to check the packet is long enough for the message type.
+class MqttPacketView{
+public:
+  constexpr MqttPacketView(uint8_t *data, mqtt_len_t len) : m_data(data), m_len(len){}
+
+  constexpr uint8_t *data() const {return m_data;}
+  constexpr mqtt_len_t len() const {return m_len;}
+
+protected:
+  constexpr uint8_t u8(mqtt_len_t off) const {
+    return off < m_len ? m_data[off] : 0 ;
+  }
+  // MSB first
+  constexpr uint16_t u16(mqtt_len_t off) const {
+    return off + 1 < m_len ? (uint16_t)((m_data[off] << 8) | m_data[off+1]) : 0 ;
+  }
+  constexpr uint8_t *ptr(mqtt_len_t off) const {
+    return off < m_len ? m_data + off : m_data + m_len ;
+  }
+  constexpr mqtt_len_t rest(mqtt_len_t off) const {
+    return off < m_len ? m_len - off : 0 ;
+  }
+
+  uint8_t *m_data ;
+  mqtt_len_t m_len ;
+};
+
+// Flags byte shared by PUBLISH, SUBSCRIBE, SUBACK, CONNECT and WILLTOPIC
+class MqttFlagsView : public MqttPacketView{
+public:
+  constexpr MqttFlagsView(uint8_t *data, mqtt_len_t len) : MqttPacketView(data, len){}
+  constexpr uint8_t flags() const {return u8(0);}
+  constexpr uint8_t qos() const {return u8(0) & FLAG_QOSN1;}
+  constexpr uint8_t topic_type() const {return u8(0) & (FLAG_DEFINED_TOPIC_ID | FLAG_SHORT_TOPIC_NAME);}
+  constexpr bool retain() const {return (u8(0) & FLAG_RETAIN) != 0;}
+  constexpr bool dup() const {return (u8(0) & FLAG_DUP) != 0;}
+};
+
+// PUBLISH - flags, topic id, message id, data
+class MqttPublishView : public MqttFlagsView{
+public:
+  constexpr MqttPublishView(uint8_t *data, mqtt_len_t len) : MqttFlagsView(data, len){}
+  constexpr bool valid() const {return m_len >= 5;}
+  constexpr uint16_t topic_id() const {return u16(1);}
+  constexpr uint16_t message_id() const {return u16(3);}
+  constexpr uint8_t *payload() const {return ptr(5);}
+  constexpr mqtt_len_t payload_len() const {return rest(5);}
+};
+
+// PUBACK and REGACK - topic id, message id, return code
+class MqttAckView : public MqttPacketView{
+public:
+  constexpr MqttAckView(uint8_t *data, mqtt_len_t len) : MqttPacketView(data, len){}
+  constexpr bool valid() const {return m_len == 5;}
+  constexpr uint16_t topic_id() const {return u16(0);}
+  constexpr uint16_t message_id() const {return u16(2);}
+  constexpr uint8_t return_code() const {return u8(4);}
+};
+
+// PUBREC, PUBREL, PUBCOMP and UNSUBACK - message id
+class MqttMessageIdView : public MqttPacketView{
+public:
+  constexpr MqttMessageIdView(uint8_t *data, mqtt_len_t len) : MqttPacketView(data, len){}
+  constexpr bool valid() const {return m_len == 2;}
+  constexpr uint16_t message_id() const {return u16(0);}
+};
+
+// REGISTER - topic id, message id, topic name
+class MqttRegisterView : public MqttPacketView{
+public:
+  constexpr MqttRegisterView(uint8_t *data, mqtt_len_t len) : MqttPacketView(data, len){}
+  constexpr bool valid() const {return m_len >= 4;}
+  constexpr uint16_t topic_id() const {return u16(0);}
+  constexpr uint16_t message_id() const {return u16(2);}
+  const char *topic() const {return (const char*)ptr(4);}
+  constexpr mqtt_len_t topic_len() const {return rest(4);}
+};
+
+// SUBSCRIBE - flags, message id, topic name or topic id
+class MqttSubscribeView : public MqttFlagsView{
+public:
+  constexpr MqttSubscribeView(uint8_t *data, mqtt_len_t len) : MqttFlagsView(data, len){}
+  constexpr bool valid() const {return m_len >= 3;}
+  constexpr uint16_t message_id() const {return u16(1);}
+  // Predefined or short topics
+  constexpr uint16_t topic_id() const {return u16(3);}
+  // Normal topic names
+  const char *topic() const {return (const char*)ptr(3);}
+  constexpr mqtt_len_t topic_len() const {return rest(3);}
+};
+
+// SUBACK - flags, topic id, message id, return code
+class MqttSubackView : public MqttFlagsView{
+public:
+  constexpr MqttSubackView(uint8_t *data, mqtt_len_t len) : MqttFlagsView(data, len){}
+  constexpr bool valid() const {return m_len >= 6;}
+  constexpr uint16_t topic_id() const {return u16(1);}
+  constexpr uint16_t message_id() const {return u16(3);}
+  constexpr uint8_t return_code() const {return u8(5);}
+};
+
+// CONNECT - flags, protocol id, duration, client id
+class MqttConnectView : public MqttFlagsView{
+public:
+  constexpr MqttConnectView(uint8_t *data, mqtt_len_t len) : MqttFlagsView(data, len){}
+  constexpr bool valid() const {return m_len >= 5;}
+  constexpr bool will() const {return (u8(0) & FLAG_WILL) != 0;}
+  constexpr bool clean() const {return (u8(0) & FLAG_CLEANSESSION) != 0;}
+  constexpr uint8_t protocol() const {return u8(1);}
+  constexpr uint16_t duration() const {return u16(2);}
+  const char *client_id() const {return (const char*)ptr(4);}
+  constexpr mqtt_len_t client_id_len() const {return rest(4);}
+};
+
+// CONNACK - return code
+class MqttConnackView : public MqttPacketView{
+public:
+  constexpr MqttConnackView(uint8_t *data, mqtt_len_t len) : MqttPacketView(data, len){}
+  constexpr bool valid() const {return m_len >= 1;}
+  constexpr uint8_t return_code() const {return u8(0);}
+};
+
+// WILLTOPIC - flags, will topic. Zero length is a valid empty will
+class MqttWillTopicView : public MqttFlagsView{
+public:
+  constexpr MqttWillTopicView(uint8_t *data, mqtt_len_t len) : MqttFlagsView(data, len){}
+  constexpr bool empty() const {return m_len == 0;}
+  const char *topic() const {return (const char*)ptr(1);}
+  constexpr mqtt_len_t topic_len() const {return rest(1);}
+};
+
+// ADVERTISE - gateway id, duration
+class MqttAdvertiseView : public MqttPacketView{
+public:
+  constexpr MqttAdvertiseView(uint8_t *data, mqtt_len_t len) : MqttPacketView(data, len){}
+  constexpr bool valid() const {return m_len >= 3;}
+  constexpr uint8_t gwid() const {return u8(0);}
+  constexpr uint16_t duration() const {return u16(1);}
+};
+
+// GWINFO - gateway id, optional gateway address
+class MqttGwInfoView : public MqttPacketView{
+public:
+  constexpr MqttGwInfoView(uint8_t *data, mqtt_len_t len) : MqttPacketView(data, len){}
+  constexpr bool valid() const {return m_len >= 1;}
+  constexpr uint8_t gwid() const {return u8(0);}
+  constexpr uint8_t *address() const {return ptr(1);}
+  constexpr mqtt_len_t address_len() const {return rest(1);}
+};
+
+// DISCONNECT - optional sleep duration
+class MqttDisconnectView : public MqttPacketView{
+public:
+  constexpr MqttDisconnectView(uint8_t *data, mqtt_len_t len) : MqttPacketView(data, len){}
+  constexpr bool has_duration() const {return m_len == 2;}
+  constexpr uint16_t duration() const {return u16(0);}
+};
+
+// Outbound message encoder. The body is written in place after space
+// reserved for the MQTT-SN header. frame() writes the header directly in
+// front of the body so the whole packet can be handed to the driver
+// without copying. Writes that would leave no room for the header are
+// dropped and flagged as overflow.
+class MqttFrame{
+public:
+  MqttFrame(){reset();}
+
+  void reset(){m_len = 0; m_overflow = false;}
+
+  MqttFrame& u8(uint8_t v){
+    if (m_len + 1 > MQTT_FRAME_MAX_BODY){m_overflow = true; return *this;}
+    m_buff[MQTT_FRAME_RESERVE + m_len++] = v ;
+    return *this ;
+  }
+  // MSB first
+  MqttFrame& u16(uint16_t v){
+    if (m_len + 2 > MQTT_FRAME_MAX_BODY){m_overflow = true; return *this;}
+    m_buff[MQTT_FRAME_RESERVE + m_len++] = v >> 8 ;
+    m_buff[MQTT_FRAME_RESERVE + m_len++] = v & 0x00FF ;
+    return *this ;
+  }
+  MqttFrame& bytes(const void *data, mqtt_len_t len){
+    if (!data || len == 0) return *this ;
+    if (m_len + len > MQTT_FRAME_MAX_BODY){m_overflow = true; return *this;}
+    memcpy(m_buff + MQTT_FRAME_RESERVE + m_len, data, len) ;
+    m_len += len ;
+    return *this ;
+  }
+
+  uint8_t *body(){return m_buff + MQTT_FRAME_RESERVE;}
+  mqtt_len_t len() const {return m_len;}
+  bool overflow() const {return m_overflow;}
+
+  // Write the header in front of the body. Returns the start of the
+  // packet and sets frame_len to the full packet length
+  uint8_t *frame(uint8_t messageid, mqtt_len_t &frame_len){
+    uint8_t hdr_len = MQTT_HDR_LEN ;
+#if PACKET_DRIVER_MAX_PAYLOAD > 255
+    // Switch to the 3 byte length field if 1 byte cannot hold the length
+    if (m_len + MQTT_HDR_LEN > 0xFF) hdr_len = MQTT_EXT_HDR_LEN ;
+#endif
+    uint8_t *start = body() - hdr_len ;
+    // The body limit keeps this within mqtt_len_t
+    frame_len = m_len + hdr_len ;
+#if PACKET_DRIVER_MAX_PAYLOAD > 255
+    if (hdr_len == MQTT_EXT_HDR_LEN){
+      start[0] = MQTT_EXT_LEN_FLAG ;
+      start[1] = frame_len >> 8 ;
+      start[2] = frame_len & 0x00FF ;
+    }else
+#endif
+      start[0] = frame_len ;
+    start[hdr_len-1] = messageid ;
+    return start ;
+  }
+
+protected:
+  uint8_t m_buff[PACKET_DRIVER_MAX_PAYLOAD] ;
+  mqtt_len_t m_len ;
+  bool m_overflow ;
+};
+
+#endif
@@ -28,12 +28,105 @@
 #ifndef MQTT_MAX_GATEWAYS
 #define MQTT_MAX_GATEWAYS 5
 #endif
+// Gateway selection. Gateways are scored by smoothed round trip time
+// in ms plus penalties for failures, retries and missed advertises.
+// The lowest score wins
+#ifndef MQTT_GW_DEFAULT_RTT_MS
+#define MQTT_GW_DEFAULT_RTT_MS 500 // Score for gateways not yet measured
+#endif
+#ifndef MQTT_GW_FAILURE_PENALTY_MS
+#define MQTT_GW_FAILURE_PENALTY_MS 2000
+#endif
+#ifndef MQTT_GW_RETRY_PENALTY_MS
+#define MQTT_GW_RETRY_PENALTY_MS 200
+#endif
+#ifndef MQTT_GW_AD_MISSED_PENALTY_MS
+#define MQTT_GW_AD_MISSED_PENALTY_MS 500
+#endif
+// Seconds between halving failure, retry and missed advertise counts
+#ifndef MQTT_GW_STATS_DECAY
+#define MQTT_GW_STATS_DECAY 300
+#endif
+// A client stays with its last gateway unless another scores this much lower
+#ifndef MQTT_GW_HYSTERESIS_MS
+#define MQTT_GW_HYSTERESIS_MS 100
+#endif
+// Clients wait a random time up to MQTT_SEARCHGW_JITTER_MS before sending
+// SEARCHGW. Unanswered searches are repeated after a random time between
+// half and all of a back off which starts at Tretry and doubles up to
+// MQTT_SEARCHGW_BACKOFF_MAX seconds
+#ifndef MQTT_SEARCHGW_JITTER_MS
+#define MQTT_SEARCHGW_JITTER_MS 5000
+#endif
+#ifndef MQTT_SEARCHGW_BACKOFF_MAX
+#define MQTT_SEARCHGW_BACKOFF_MAX 300
+#endif
+// Gateways answer SEARCHGW with one broadcast GWINFO per window
+#ifndef MQTT_GWINFO_WINDOW_MS
+#define MQTT_GWINFO_WINDOW_MS 1000
+#endif
+// Most a client may stretch idle keep alive pings, in multiples of the
+// keep alive duration. Gateways drop clients not heard from for 5 times
+// the duration, which leaves time to retry an unanswered ping
+#ifndef MQTT_PING_STRETCH_MAX
+#define MQTT_PING_STRETCH_MAX 3
+#endif
 #ifndef MQTT_MESSAGES_INFLIGHT
 #define MQTT_MESSAGES_INFLIGHT 20
 #endif
+// Gateways return CONGESTION to new publishes and subscriptions once a
+// client has MQTT_CONGESTION_QUEUE messages queued or the broker has not
+// yet acknowledged MQTT_CONGESTION_BACKLOG publishes and subscriptions
+#ifndef MQTT_CONGESTION_QUEUE
+#define MQTT_CONGESTION_QUEUE (MQTT_MESSAGES_INFLIGHT - 4)
+#endif
+#ifndef MQTT_CONGESTION_BACKLOG
+#define MQTT_CONGESTION_BACKLOG 64
+#endif
+// Clients hold back new messages after CONGESTION for a random time
+// between half and all of a back off which starts at
+// MQTT_CONGESTION_BACKOFF_MS and doubles up to MQTT_CONGESTION_BACKOFF_MAX_MS
+// while the gateway stays congested
+#ifndef MQTT_CONGESTION_BACKOFF_MS
+#define MQTT_CONGESTION_BACKOFF_MS 1000
+#endif
+#ifndef MQTT_CONGESTION_BACKOFF_MAX_MS
+#define MQTT_CONGESTION_BACKOFF_MAX_MS 30000
+#endif
+#ifndef MQTT_MAX_RETAINED
+#define MQTT_MAX_RETAINED 32
+#endif
+// Locally delivered publishes remembered to suppress the broker echo
+#ifndef MQTT_LOCAL_ECHO_MAX
+#define MQTT_LOCAL_ECHO_MAX 16
+#endif
+// Seconds to wait for a broker echo of a locally delivered publish
+#ifndef MQTT_LOCAL_ECHO_TIMEOUT
+#define MQTT_LOCAL_ECHO_TIMEOUT 10
+#endif
+// Pending callbacks held by the in-process broker
+#ifndef MQTT_LOCAL_BROKER_EVENTS
+#define MQTT_LOCAL_BROKER_EVENTS 32
+#endif
+// Topic prefix for gateway metrics
+#ifndef MQTT_METRICS_TOPIC
+#define MQTT_METRICS_TOPIC "$SYS/mqttsn"
+#endif
+// Publishes held while the broker is unavailable
+#ifndef MQTT_SPOOL_MAX
+#define MQTT_SPOOL_MAX 32
+#endif
+// Spooled publishes sent to the broker each second after reconnecting
+#ifndef MQTT_SPOOL_DRAIN_RATE
+#define MQTT_SPOOL_DRAIN_RATE 10
+#endif
 
 #define MQTT_PROTOCOL 0x01
 
+// Returned by client publish calls in place of a message ID when the
+// publish is held in the offline store. Never allocated as a message ID
+#define MQTT_MESSAGE_STORED 0xFFFF
+
 #ifndef _BV
 #define _BV(x) 1 << x
 #endif
@@ -85,7 +178,7 @@
 #define MQTT_WILLTOPICRESP 0x1B
 #define MQTT_WILLMSGRESP 0x1D
 
-#ifdef DEBUG
+// Message type names for logs and metrics
 #include <stdio.h>
 inline const char* mqtt_code_str(uint8_t code)
 {
@@ -124,7 +217,6 @@ inline const char* mqtt_code_str(uint8_t code)
   sprintf(szError, "UNKNOWN %u", code) ;
   return szError ;
 }
-#endif
 // MQTT size macros - driver agnostic
 #define MQTT_HDR_LEN 2
 #define MQTT_HDR_FLAGS_LEN 1
@@ -133,6 +225,33 @@ inline const char* mqtt_code_str(uint8_t code)
 #define MQTT_HDR_PROTOCOLID_LEN 1
 #define MQTT_HDR_DURATION_LEN 2
 
+// Extended header uses the 3 byte length field (0x01 followed by
+// 2 byte length) and is only used for messages over 255 bytes.
+// The current IPacketDriver reports its width and takes a send length
+// as uint8_t, so no driver can carry these frames yet. The path is kept
+// for a driver contract with 16 bit lengths.
+#define MQTT_EXT_LEN_FLAG 0x01
+#define MQTT_EXT_HDR_LEN 4
+
+// Message length type. Drivers that support payloads over 255 bytes
+// need a 2 byte length to frame the 3 byte length field
+#if PACKET_DRIVER_MAX_PAYLOAD > 255
+typedef uint16_t mqtt_len_t ;
+#else
+typedef uint8_t mqtt_len_t ;
+#endif
+
+// Space reserved ahead of an outbound message body so the header
+// can be written in place before sending
+#if PACKET_DRIVER_MAX_PAYLOAD > 255
+#define MQTT_FRAME_RESERVE MQTT_EXT_HDR_LEN
+#else
+#define MQTT_FRAME_RESERVE MQTT_HDR_LEN
+#endif
+// Largest outbound message body. The header and body together must
+// fit the driver payload and the length field
+#define MQTT_FRAME_MAX_BODY (PACKET_DRIVER_MAX_PAYLOAD - MQTT_FRAME_RESERVE)
+
 #define MQTT_CONNECT_HDR_LEN (MQTT_HDR_LEN + MQTT_HDR_FLAGS_LEN + MQTT_HDR_PROTOCOLID_LEN + MQTT_HDR_DURATION_LEN)
 #define MQTT_REGISTER_HDR_LEN (MQTT_HDR_LEN + MQTT_HDR_TOPICID_LEN + MQTT_HDR_MSGID_LEN)
 #define MQTT_WILLTOPIC_HDR_LEN (MQTT_HDR_LEN + MQTT_HDR_FLAGS_LEN)
@@ -140,6 +259,7 @@ inline const char* mqtt_code_str(uint8_t code)
 #define MQTT_WILLMSG_HDR_LEN (MQTT_HDR_LEN)
 #define MQTT_SUBSCRIBE_HDR_LEN (MQTT_HDR_LEN + MQTT_HDR_FLAGS_LEN + MQTT_HDR_MSGID_LEN)
 
+#if defined(ARDUINO) || defined(MQTT_SYNC_LOG)
 #ifdef DEBUG
 #define DPRINT(x,...) fprintf(stdout,x,##__VA_ARGS__)
 #define EPRINT(x,...) fprintf(stderr,x,##__VA_ARGS__)
@@ -147,6 +267,13 @@ inline const char* mqtt_code_str(uint8_t code)
 #define DPRINT(x,...)
 #define EPRINT(x,...)
 #endif
+#else
+// Logging is asynchronous and the level can be changed at runtime
+// with mqtt_log_set_level
+#include "mqttlog.hpp"
+#define DPRINT(x,...) do{if (mqtt_log_enabled(MQTT_LOG_DEBUG)) mqtt_log(MQTT_LOG_DEBUG,x,##__VA_ARGS__);}while(0)
+#define EPRINT(x,...) do{if (mqtt_log_enabled(MQTT_LOG_ERROR)) mqtt_log(MQTT_LOG_ERROR,x,##__VA_ARGS__);}while(0)
+#endif
 
 
 #endif
@@ -0,0 +1,245 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+// Replays a packet capture, recorded with mqttsnserver -w, into a gateway
+// using the embedded broker. Reports processing throughput and any frames
+// the gateway sends which differ from the capture.
+
+#include "servermqtt.hpp"
+#include "localbroker.hpp"
+#include "mqttcapture.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// Frames held for comparison
+#define REPLAY_COMPARE_MAX 64
+// Divergences printed before going quiet
+#define REPLAY_REPORT_MAX 10
+
+static uint64_t now_us()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 ;
+}
+
+static uint8_t frame_type(const MqttCaptureFrame &f)
+{
+  if (f.len >= MQTT_EXT_HDR_LEN && f.data[0] == MQTT_EXT_LEN_FLAG) return f.data[2] ;
+  if (f.len >= MQTT_HDR_LEN) return f.data[1] ;
+  return 0xFF ;
+}
+
+// Frames sent by the gateway on a timer rather than in response to a
+// received frame cannot be expected in the same place as the capture
+static bool timer_frame(const MqttCaptureFrame &f)
+{
+  uint8_t type = frame_type(f) ;
+  return type == MQTT_ADVERTISE || type == MQTT_PINGREQ ;
+}
+
+// Bounded FIFO of frames waiting to be compared
+class FrameFifo{
+public:
+  FrameFifo(){head = 0; count = 0; dropped = 0;}
+  void push(const MqttCaptureFrame &f){
+    if (count == REPLAY_COMPARE_MAX){dropped++; return;}
+    frames[(head + count++) % REPLAY_COMPARE_MAX] = f ;
+  }
+  MqttCaptureFrame *front(){return count?&frames[head]:NULL;}
+  void pop(){if (count){head = (head + 1) % REPLAY_COMPARE_MAX; count--;}}
+  MqttCaptureFrame frames[REPLAY_COMPARE_MAX] ;
+  uint16_t head ;
+  uint16_t count ;
+  uint32_t dropped ;
+};
+
+// Driver which keeps sent frames for comparison with the capture
+class ReplayDriver : public IPacketDriver{
+public:
+  ReplayDriver(uint8_t address_len){m_address_len = address_len; memset(m_broadcast, 0xFF, sizeof(m_broadcast));}
+  bool initialise(uint8_t *device, uint8_t *broadcast, uint8_t length){return true;}
+  bool send(const uint8_t *receiver, uint8_t *data, uint8_t len){
+    MqttCaptureFrame f ;
+    f.direction = MqttCaptureFrame::sent ;
+    memcpy(f.address, receiver, m_address_len) ;
+    memcpy(f.data, data, len) ;
+    f.len = len ;
+    if (!timer_frame(f)) sent.push(f) ;
+    return true ;
+  }
+  bool shutdown(){return true;}
+  uint8_t get_payload_width(){return PACKET_DRIVER_MAX_PAYLOAD;}
+  uint8_t get_address_len(){return m_address_len;}
+  uint8_t *get_broadcast(){return m_broadcast;}
+  FrameFifo sent ;
+protected:
+  uint8_t m_address_len ;
+  uint8_t m_broadcast[PACKET_DRIVER_MAX_ADDRESS_LEN] ;
+};
+
+// Gateway which accepts frames from the capture as if from the driver
+class ReplayServer : public ServerMqttSn{
+public:
+  void inject(uint8_t *address, uint8_t *packet){m_fn_packet_received(this, address, packet);}
+};
+
+class Comparison{
+public:
+  Comparison(uint8_t address_len){m_address_len = address_len; matched = 0; diverged = 0;}
+
+  // Compare sent frames in order with the captured frames
+  void compare(FrameFifo &expected, FrameFifo &actual){
+    while(expected.front() && actual.front()){
+      MqttCaptureFrame *e = expected.front(), *a = actual.front() ;
+      if (e->len == a->len && memcmp(e->data, a->data, e->len) == 0 &&
+	  memcmp(e->address, a->address, m_address_len) == 0)
+	matched++ ;
+      else
+	report("differs", e, a) ;
+      expected.pop() ;
+      actual.pop() ;
+    }
+  }
+  // Anything left once the capture has finished
+  void finish(FrameFifo &expected, FrameFifo &actual){
+    compare(expected, actual) ;
+    for (; expected.front(); expected.pop()) report("missing", expected.front(), NULL) ;
+    for (; actual.front(); actual.pop()) report("extra", NULL, actual.front()) ;
+    diverged += expected.dropped + actual.dropped ;
+  }
+
+  uint32_t matched ;
+  uint32_t diverged ;
+
+protected:
+  void report(const char *szwhat, MqttCaptureFrame *e, MqttCaptureFrame *a){
+    diverged++ ;
+    if (diverged > REPLAY_REPORT_MAX) return ;
+    printf("Frame %u %s:", matched + diverged, szwhat) ;
+    if (e) print_frame(" capture", e) ;
+    if (a) print_frame(" replay", a) ;
+    printf("\n") ;
+  }
+  void print_frame(const char *szname, MqttCaptureFrame *f){
+    printf("%s ", szname) ;
+    for (uint8_t i=0; i < m_address_len; i++) printf("%02X", f->address[i]) ;
+    printf(" %s [", mqtt_code_str(frame_type(*f))) ;
+    for (mqtt_len_t i=0; i < f->len; i++) printf("%s%02X", i?" ":"", f->data[i]) ;
+    printf("]") ;
+  }
+  uint8_t m_address_len ;
+};
+
+int main(int argc, char **argv)
+{
+  const char usage[] = "Usage: %s -r capturefile [-s speed] [-g gwid]\n"
+    "  speed is a multiple of real time, 0 replays as fast as possible\n" ;
+  const char *opt_capture = NULL ;
+  double opt_speed = 1.0 ;
+  int opt_gwid = 88 ;
+  int opt = 0 ;
+
+  while ((opt = getopt(argc, argv, "r:s:g:")) != -1){
+    switch(opt){
+    case 'r':
+      opt_capture = optarg ;
+      break ;
+    case 's':
+      opt_speed = atof(optarg) ;
+      if (opt_speed < 0){
+	fprintf(stderr, "Speed cannot be negative\n") ;
+	return EXIT_FAILURE ;
+      }
+      break ;
+    case 'g':
+      opt_gwid = atoi(optarg) ;
+      break ;
+    default:
+      fprintf(stderr, usage, argv[0]) ;
+      return EXIT_FAILURE ;
+    }
+  }
+  if (!opt_capture){
+    fprintf(stderr, usage, argv[0]) ;
+    return EXIT_FAILURE ;
+  }
+
+  MqttCaptureReader reader ;
+  if (!reader.open(opt_capture)){
+    fprintf(stderr, "Cannot read capture %s\n", opt_capture) ;
+    return EXIT_FAILURE ;
+  }
+  uint8_t address_len = reader.get_address_len() ;
+  uint8_t address[PACKET_DRIVER_MAX_ADDRESS_LEN] ;
+  memset(address, 0, sizeof(address)) ;
+
+  ReplayDriver drv(address_len) ;
+  LocalBroker broker ;
+  ReplayServer mqtt ;
+  mqtt.set_driver(&drv) ;
+  mqtt.set_broker(&broker) ;
+  mqtt.set_gateway_id(opt_gwid) ;
+  mqtt.initialise(address_len, drv.get_broadcast(), address) ;
+  mqtt.manage_connections() ; // connect to the embedded broker
+
+  FrameFifo expected ;
+  Comparison comparison(address_len) ;
+  MqttCaptureFrame frame ;
+  uint64_t capture_us = 0 ;
+  uint32_t replayed = 0 ;
+  uint64_t busy_us = 0 ;
+  uint64_t start = now_us() ;
+
+  while(reader.next(frame)){
+    capture_us += frame.delta_us ;
+    if (frame.direction == MqttCaptureFrame::sent){
+      if (!timer_frame(frame)) expected.push(frame) ;
+      continue ;
+    }
+    // Keep the gateway running until the frame is due
+    if (opt_speed > 0){
+      uint64_t due = start + (uint64_t)(capture_us / opt_speed) ;
+      for (uint64_t now = now_us(); now < due; now = now_us()){
+	mqtt.manage_connections() ;
+	usleep(due - now > 1000?1000:due - now) ;
+      }
+    }
+    uint64_t t = now_us() ;
+    mqtt.inject(frame.address, frame.data) ;
+    mqtt.manage_connections() ;
+    busy_us += now_us() - t ;
+    replayed++ ;
+    comparison.compare(expected, drv.sent) ;
+  }
+  // Let the gateway respond to the last frames
+  mqtt.manage_connections() ;
+  comparison.finish(expected, drv.sent) ;
+  uint64_t elapsed = now_us() - start ;
+
+  printf("Replayed %u frames in %.3f s, capture length %.3f s\n",
+	 replayed, elapsed / 1e6, capture_us / 1e6) ;
+  printf("Processing %.0f frames/s, %.1f us per frame\n",
+	 busy_us?replayed * 1e6 / busy_us:0.0, replayed?(double)busy_us / replayed:0.0) ;
+  printf("Sent frames matched %u, diverged %u\n", comparison.matched, comparison.diverged) ;
+
+  return comparison.diverged?EXIT_FAILURE:EXIT_SUCCESS ;
+}
@@ -0,0 +1,125 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "mqttretain.hpp"
+#include <string.h>
+
+MqttRetainedCache::MqttRetainedCache()
+{
+  m_iterator = 0 ;
+  m_use_count = 0 ;
+}
+
+void MqttRetainedCache::clear()
+{
+  for (uint16_t i=0; i < MQTT_MAX_RETAINED; i++) m_retained[i].reset() ;
+  m_iterator = 0 ;
+}
+
+MqttRetained* MqttRetainedCache::find(const char *sztopic)
+{
+  for (uint16_t i=0; i < MQTT_MAX_RETAINED; i++){
+    if (m_retained[i].m_set && strcmp(m_retained[i].m_sztopic, sztopic) == 0)
+      return &m_retained[i] ;
+  }
+  return NULL ;
+}
+
+bool MqttRetainedCache::store(const char *sztopic, const uint8_t *payload, mqtt_len_t len)
+{
+  if (len == 0 || !payload){
+    // Empty retained message clears the topic
+    remove(sztopic) ;
+    return true ;
+  }
+  if (strlen(sztopic) > MQTT_RETAIN_TOPIC_LEN || len > MQTT_RETAIN_PAYLOAD_LEN){
+    // Cannot cache. Drop any old value so it isn't replayed
+    remove(sztopic) ;
+    return false ;
+  }
+
+  MqttRetained *r = find(sztopic) ;
+  if (!r){
+    // Use a free entry or replace the least recently used
+    r = &m_retained[0] ;
+    for (uint16_t i=0; i < MQTT_MAX_RETAINED; i++){
+      if (!m_retained[i].m_set){
+	r = &m_retained[i] ;
+	break ;
+      }
+      if (m_retained[i].m_last_used < r->m_last_used) r = &m_retained[i] ;
+    }
+    strcpy(r->m_sztopic, sztopic) ;
+    r->m_set = true ;
+  }
+  memcpy(r->m_payload, payload, len) ;
+  r->m_payload_len = len ;
+  r->m_last_used = ++m_use_count ;
+  return true ;
+}
+
+bool MqttRetainedCache::remove(const char *sztopic)
+{
+  MqttRetained *r = find(sztopic) ;
+  if (!r) return false ;
+  r->reset() ;
+  return true ;
+}
+
+bool MqttRetainedCache::is_cached(const char *sztopic, const uint8_t *payload, mqtt_len_t len)
+{
+  MqttRetained *r = find(sztopic) ;
+  if (!r) return false ;
+  return r->m_payload_len == len && memcmp(r->m_payload, payload, len) == 0 ;
+}
+
+MqttRetained* MqttRetainedCache::search_match(MqttTopic *filter, uint16_t from)
+{
+  for (m_iterator = from; m_iterator < MQTT_MAX_RETAINED; m_iterator++){
+    if (m_retained[m_iterator].m_set && filter->match(m_retained[m_iterator].m_sztopic)){
+      m_retained[m_iterator].m_last_used = ++m_use_count ;
+      return &m_retained[m_iterator] ;
+    }
+  }
+  return NULL ;
+}
+
+MqttRetained* MqttRetainedCache::first_match(MqttTopic *filter)
+{
+  return search_match(filter, 0) ;
+}
+
+MqttRetained* MqttRetainedCache::next_match(MqttTopic *filter)
+{
+  if (m_iterator >= MQTT_MAX_RETAINED) return NULL ;
+  return search_match(filter, m_iterator+1) ;
+}
+
+MqttRetained* MqttRetainedCache::first()
+{
+  for (m_iterator = 0; m_iterator < MQTT_MAX_RETAINED; m_iterator++)
+    if (m_retained[m_iterator].m_set) return &m_retained[m_iterator] ;
+  return NULL ;
+}
+
+MqttRetained* MqttRetainedCache::next()
+{
+  if (m_iterator >= MQTT_MAX_RETAINED) return NULL ;
+  for (m_iterator++; m_iterator < MQTT_MAX_RETAINED; m_iterator++)
+    if (m_retained[m_iterator].m_set) return &m_retained[m_iterator] ;
+  return NULL ;
+}
@@ -0,0 +1,92 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef __MQTT_RETAIN
+#define __MQTT_RETAIN
+
+#include "mqttparams.hpp"
+#include "mqtttopic.hpp"
+
+// Max length of a cached retained topic name. Matches the topic length
+// which can be registered with a client
+#define MQTT_RETAIN_TOPIC_LEN (PACKET_DRIVER_MAX_PAYLOAD - MQTT_REGISTER_HDR_LEN)
+// Max payload which can be published to a client
+#define MQTT_RETAIN_PAYLOAD_LEN (PACKET_DRIVER_MAX_PAYLOAD - MQTT_PUBLISH_HDR_LEN)
+
+class MqttRetained{
+public:
+  MqttRetained(){reset();}
+  void reset(){
+    m_set = false ;
+    m_sztopic[0] = '\0' ;
+    m_payload_len = 0 ;
+    m_last_used = 0 ;
+  }
+  bool is_set(){return m_set;}
+  const char *get_topic(){return m_sztopic;}
+  uint8_t *get_payload(){return m_payload;}
+  mqtt_len_t get_payload_len(){return m_payload_len;}
+
+protected:
+  friend class MqttRetainedCache ;
+  bool m_set ;
+  char m_sztopic[MQTT_RETAIN_TOPIC_LEN+1] ;
+  uint8_t m_payload[MQTT_RETAIN_PAYLOAD_LEN] ;
+  mqtt_len_t m_payload_len ;
+  uint32_t m_last_used ;
+};
+
+// Bounded cache of the last retained value for each topic. Least
+// recently used entries are replaced when the cache is full.
+// Not thread safe, callers should hold the gateway lock
+class MqttRetainedCache{
+public:
+  MqttRetainedCache() ;
+
+  // Store the retained value for a topic. An empty payload deletes
+  // the topic as per MQTT retained message rules.
+  // Returns false if the topic or payload is too large to cache
+  bool store(const char *sztopic, const uint8_t *payload, mqtt_len_t len) ;
+
+  // Remove a topic from the cache. Returns false if not cached
+  bool remove(const char *sztopic) ;
+
+  // Returns true if the topic is cached with an identical payload
+  bool is_cached(const char *sztopic, const uint8_t *payload, mqtt_len_t len) ;
+
+  // Iterate cached values matching a subscription topic filter.
+  // Returns NULL when no more matches
+  MqttRetained* first_match(MqttTopic *filter) ;
+  MqttRetained* next_match(MqttTopic *filter) ;
+
+  // Iterate all cached values without changing their use order.
+  // Returns NULL when no more values
+  MqttRetained* first() ;
+  MqttRetained* next() ;
+  
+  void clear() ;
+
+protected:
+  MqttRetained* find(const char *sztopic) ;
+  MqttRetained* search_match(MqttTopic *filter, uint16_t from) ;
+  
+  MqttRetained m_retained[MQTT_MAX_RETAINED] ;
+  uint16_t m_iterator ;
+  uint32_t m_use_count ;
+};
+
+#endif
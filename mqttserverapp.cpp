@@ -17,6 +17,9 @@
 
 #include "RF24Driver.hpp"
 #include "servermqtt.hpp"
+#include "mosquittobroker.hpp"
+#include "localbroker.hpp"
+#include "shardedbroker.hpp"
 #include "wpihardware.hpp"
 #include "spihardware.hpp"
 #include "radioutil.hpp"
@@ -37,7 +40,16 @@ int opt_irq = 0,
   opt_channel = 76,
   opt_cname = 0,
   opt_speed = 1,
-  opt_ack = 0;
+  opt_ack = 0,
+  opt_local = 0,
+  opt_embedded = 0,
+  opt_port = 1883,
+  opt_shards = 1,
+  opt_qos = 1,
+  opt_metrics = 0;
+const char *opt_host = "localhost",
+  *opt_spool = NULL,
+  *opt_capture = NULL ;
 
 void siginterrupt(int sig)
 {
@@ -52,8 +64,8 @@ void siginterrupt(int sig)
 
 int main(int argc, char **argv)
 {
-  const char usage[] = "Usage: %s -c ce -i irq -a address -b address [-o channel] [-s 250|1|2] [-x]\n" ;
-  const char optlist[] = "i:c:o:a:b:s:x" ;
+  const char usage[] = "Usage: %s -c ce -i irq -a address -b address [-o channel] [-s 250|1|2] [-x] [-l] [-e | -m host [-p port] [-k connections]] [-f spoolfile] [-q 0|1|2|p] [-t seconds] [-w capturefile]\n" ;
+  const char optlist[] = "i:c:o:a:b:s:xlem:p:k:f:q:t:w:" ;
   int opt = 0 ;
   uint8_t rf24address[ADDR_WIDTH] ;
   uint8_t rf24broadcast[ADDR_WIDTH] ;
@@ -86,6 +98,37 @@ int main(int argc, char **argv)
     case 'x': //ack
       opt_ack = 1 ;
       break ;
+    case 'l': // local delivery between clients
+      opt_local = 1 ;
+      break ;
+    case 'e': // embedded broker
+      opt_embedded = 1 ;
+      break ;
+    case 'm': // broker host
+      opt_host = optarg ;
+      break ;
+    case 'p': // broker port
+      opt_port = atoi(optarg) ;
+      break ;
+    case 'k': // broker connections
+      opt_shards = atoi(optarg) ;
+      if (opt_shards < 1 || opt_shards > MQTT_MAX_BROKER_SHARDS){
+	fprintf(stderr, "Broker connections must be between 1 and %d\n", MQTT_MAX_BROKER_SHARDS) ;
+	return EXIT_FAILURE ;
+      }
+      break ;
+    case 'q': // broker QoS
+      opt_qos = optarg[0] == 'p'?BROKER_QOS_PASSTHROUGH:atoi(optarg) ;
+      break ;
+    case 't': // metrics interval
+      opt_metrics = atoi(optarg) ;
+      break ;
+    case 'f': // spool file
+      opt_spool = optarg ;
+      break ;
+    case 'w': // capture file
+      opt_capture = optarg ;
+      break ;
     case 'i': // IRQ pin
       opt_irq = atoi(optarg) ;
       break ;
@@ -166,8 +209,38 @@ int main(int argc, char **argv)
   drv.reset_rf24();
 
   mqtt.set_driver(&drv) ;
+
+  MosquittoBroker mosquitto(opt_host, opt_port) ;
+  LocalBroker local ;
+  ShardedBroker pool ;
+  MosquittoBroker *shards[MQTT_MAX_BROKER_SHARDS] ;
+  if (opt_embedded)
+    mqtt.set_broker(&local) ;
+  else if (opt_shards > 1){
+    for (int i=0; i < opt_shards; i++){
+      shards[i] = new MosquittoBroker(opt_host, opt_port) ;
+      pool.add_shard(shards[i]) ;
+    }
+    mqtt.set_broker(&pool) ;
+  }else
+    mqtt.set_broker(&mosquitto) ;
   
   mqtt.set_gateway_id(88) ;
+  mqtt.set_local_delivery(opt_local) ;
+  mqtt.set_default_broker_qos(opt_qos) ;
+  mqtt.set_metrics_interval(opt_metrics) ;
+  if (opt_spool && !mqtt.set_spool_file(opt_spool)){
+    fprintf(stderr, "Cannot use spool file %s\n", opt_spool) ;
+    exit(EXIT_FAILURE) ;
+  }
+  MqttCapture capture ;
+  if (opt_capture){
+    if (!capture.open(opt_capture, ADDR_WIDTH)){
+      fprintf(stderr, "Cannot write capture file %s\n", opt_capture) ;
+      exit(EXIT_FAILURE) ;
+    }
+    mqtt.set_capture(&capture) ;
+  }
 
   mqtt.initialise(ADDR_WIDTH, rf24broadcast, rf24address) ;
   mqtt.set_advertise_interval(400);
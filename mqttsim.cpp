@@ -0,0 +1,594 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+// Discrete event simulation of a gateway and many clients sharing a
+// lossy radio channel. Protocol timers run on the virtual clock so a day
+// of keep-alives, retries and advertises runs in seconds. Reports airtime,
+// delivery ratio and publish latency for the retry settings used.
+
+#include "servermqtt.hpp"
+#include "clientmqtt.hpp"
+#include "localbroker.hpp"
+#include "mqttclock.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef MQTT_METRICS_ENABLED
+#error mqttsim requires metrics for latency histograms
+#endif
+
+#define SIM_ADDR_WIDTH 5
+// Frames in flight on the channel
+#define SIM_CHANNEL_FRAMES 65536
+// Radio preamble, address, control field and CRC sent with each frame
+#define SIM_FRAME_OVERHEAD 9
+// Publishes tracked for latency per client
+#define SIM_PENDING 16
+// Virtual start time. Avoids timers treating zero as unset
+#define SIM_EPOCH 1000000
+// Topics subscribed to in the failover run
+#define SIM_SHORT_TOPIC "sf"
+#define SIM_PREDEFINED_ID 1
+#define SIM_PREDEFINED_TOPIC "sim/failover"
+
+class SimChannel ;
+
+// Radio driver for a simulated node. Sends go onto the shared channel
+class SimDriver : public IPacketDriver{
+public:
+  SimDriver(){m_channel = NULL; m_index = 0;}
+  void attach(SimChannel *channel, uint16_t index){m_channel = channel; m_index = index;}
+  bool initialise(uint8_t *device, uint8_t *broadcast, uint8_t length){return true;}
+  bool send(const uint8_t *receiver, uint8_t *data, uint8_t len) ;
+  bool shutdown(){return true;}
+  uint8_t get_payload_width(){return PACKET_DRIVER_MAX_PAYLOAD;}
+  uint8_t get_address_len(){return SIM_ADDR_WIDTH;}
+  uint8_t *get_broadcast() ;
+protected:
+  SimChannel *m_channel ;
+  uint16_t m_index ;
+};
+
+// Node index is held in the address. Node zero is the gateway and the
+// standby gateway follows the clients
+static void sim_address(uint16_t index, uint8_t *address)
+{
+  memset(address, 0, SIM_ADDR_WIDTH) ;
+  address[0] = 0xA0 ;
+  address[1] = index >> 8 ;
+  address[2] = index & 0xFF ;
+}
+
+static uint8_t sim_broadcast[SIM_ADDR_WIDTH] = {0xB0, 0xB0, 0xB0, 0xB0, 0xB0} ;
+
+uint8_t *SimDriver::get_broadcast(){return sim_broadcast;}
+
+// Repeatable random numbers for loss and start times
+static uint64_t sim_seed = 88172645463325252ULL ;
+static uint32_t sim_random()
+{
+  sim_seed ^= sim_seed << 13 ;
+  sim_seed ^= sim_seed >> 7 ;
+  sim_seed ^= sim_seed << 17 ;
+  return (uint32_t)(sim_seed >> 32) ;
+}
+
+class SimFrame{
+public:
+  uint64_t due_ms ;
+  uint16_t from ;
+  uint16_t to ;
+  uint8_t len ;
+  uint8_t data[PACKET_DRIVER_MAX_PAYLOAD] ;
+};
+
+// Shared radio channel. Every frame arrives after a fixed latency or is
+// lost, independently for each receiver of a broadcast
+class SimChannel{
+public:
+  SimChannel(uint16_t nodes, double loss, uint32_t latency_ms){
+    m_nodes = nodes ;
+    m_loss = (uint32_t)(loss * 0xFFFFFFFFU) ;
+    m_latency_ms = latency_ms ;
+    m_frames = new SimFrame[SIM_CHANNEL_FRAMES] ;
+    m_head = 0 ;
+    m_count = 0 ;
+    now_ms = 0 ;
+    sent = 0 ;
+    bytes = 0 ;
+    lost = 0 ;
+    overflows = 0 ;
+  }
+  ~SimChannel(){delete[] m_frames;}
+
+  void send(uint16_t from, const uint8_t *receiver, const uint8_t *data, uint8_t len){
+    sent++ ;
+    bytes += len ;
+    if (memcmp(receiver, sim_broadcast, SIM_ADDR_WIDTH) == 0){
+      for (uint16_t i=0; i < m_nodes; i++)
+	if (i != from) queue(from, i, data, len) ;
+    }else{
+      uint16_t to = (receiver[1] << 8) | receiver[2] ;
+      if (to < m_nodes) queue(from, to, data, len) ;
+    }
+  }
+  // Oldest frame in flight or NULL
+  SimFrame *front(){return m_count?&m_frames[m_head]:NULL;}
+  void pop(){m_head = (m_head + 1) % SIM_CHANNEL_FRAMES; m_count--;}
+
+  uint64_t now_ms ;
+  uint32_t sent ;
+  uint64_t bytes ;
+  uint32_t lost ;
+  uint32_t overflows ;
+
+protected:
+  void queue(uint16_t from, uint16_t to, const uint8_t *data, uint8_t len){
+    if (sim_random() < m_loss){
+      lost++ ;
+      return ;
+    }
+    if (m_count == SIM_CHANNEL_FRAMES){
+      overflows++ ;
+      return ;
+    }
+    SimFrame *f = &m_frames[(m_head + m_count++) % SIM_CHANNEL_FRAMES] ;
+    f->due_ms = now_ms + m_latency_ms ;
+    f->from = from ;
+    f->to = to ;
+    f->len = len ;
+    memcpy(f->data, data, len) ;
+  }
+  SimFrame *m_frames ;
+  uint32_t m_head ;
+  uint32_t m_count ;
+  uint16_t m_nodes ;
+  uint32_t m_loss ;
+  uint32_t m_latency_ms ;
+};
+
+bool SimDriver::send(const uint8_t *receiver, uint8_t *data, uint8_t len)
+{
+  m_channel->send(m_index, receiver, data, len) ;
+  return true ;
+}
+
+class SimGateway : public ServerMqttSn{
+public:
+  void inject(uint8_t *address, uint8_t *packet){m_fn_packet_received(this, address, packet);}
+};
+
+class SimClient : public ClientMqttSn{
+public:
+  void inject(uint8_t *address, uint8_t *packet){m_fn_packet_received(this, address, packet);}
+};
+
+// Broker which only returns results every opt_broker_ms, as a busy
+// upstream broker would
+class SimBroker : public LocalBroker{
+public:
+  SimBroker(){m_last_ms = 0 ;}
+  void loop() ;
+protected:
+  uint64_t m_last_ms ;
+};
+
+class SimNode{
+public:
+  SimNode(){
+    connecting = false ;
+    subscribed = false ;
+    got_short = false ;
+    got_predefined = false ;
+    next_search_ms = 0 ;
+    next_publish_ms = 0 ;
+    touched = false ;
+    for (uint8_t i=0; i < SIM_PENDING; i++) pending_mid[i] = 0 ;
+  }
+  SimClient mqtt ;
+  SimDriver drv ;
+  bool connecting ;
+  bool subscribed ;
+  // Publishes received after the failover
+  bool got_short ;
+  bool got_predefined ;
+  uint64_t next_search_ms ;
+  uint64_t next_publish_ms ;
+  bool touched ;
+  uint16_t pending_mid[SIM_PENDING] ;
+  uint64_t pending_ms[SIM_PENDING] ;
+};
+
+// Results across all clients
+class SimStats{
+public:
+  SimStats(){
+    searches = connects = connect_failures = lost_gateway = 0 ;
+    publishes = refused = delivered = failed = congested = 0 ;
+  }
+  uint32_t searches ;
+  uint32_t connects ;
+  uint32_t connect_failures ;
+  uint32_t lost_gateway ;
+  uint32_t publishes ;
+  uint32_t refused ;
+  uint32_t delivered ;
+  uint32_t failed ;
+  uint32_t congested ;
+  MqttHistogram latency_ms ;
+};
+
+static SimChannel *channel = NULL ;
+static SimStats stats ;
+// Client whose callbacks are running. Callbacks have no context so the
+// simulation sets this before calling into a client
+static SimNode *current = NULL ;
+
+static uint32_t opt_clients = 100 ;
+static uint32_t opt_duration = 3600 ;
+static double opt_loss = 0.0 ;
+static uint32_t opt_tretry = 10 ;
+static uint32_t opt_nretry = 5 ;
+static uint32_t opt_keepalive = 60 ;
+static uint32_t opt_interval = 60 ;
+static uint32_t opt_latency_ms = 5 ;
+static uint32_t opt_bitrate = 250000 ;
+static uint32_t opt_advertise = 900 ;
+static uint32_t opt_burst = 1 ;
+static uint32_t opt_window = 1 ;
+static uint32_t opt_stretch = 1 ;
+static bool opt_together = false ;
+static uint32_t opt_broker_ms = 0 ;
+static uint32_t opt_failover = 0 ;
+
+static void con_callback(bool success, uint8_t return_code, uint8_t gwid)
+{
+  current->connecting = false ;
+  if (success) stats.connects++ ;
+  else stats.connect_failures++ ;
+}
+
+static void dis_callback(bool sleeping, uint16_t sleep_duration, uint8_t gwid)
+{
+  current->connecting = false ;
+  if (!sleeping) stats.lost_gateway++ ;
+}
+
+static void pub_callback(bool success, uint8_t return_code, uint16_t topic_id, uint16_t message_id, uint8_t gwid)
+{
+  uint8_t slot = message_id % SIM_PENDING ;
+  if (!success || return_code != MQTT_RETURN_ACCEPTED){
+    stats.failed++ ;
+    if (return_code == MQTT_RETURN_CONGESTION) stats.congested++ ;
+  }else{
+    stats.delivered++ ;
+    if (current->pending_mid[slot] == message_id)
+      stats.latency_ms.record((uint32_t)(channel->now_ms - current->pending_ms[slot])) ;
+  }
+  current->pending_mid[slot] = 0 ;
+}
+
+static void sub_callback(bool success, uint8_t return_code, uint16_t topic_id, uint16_t message_id, uint8_t gwid)
+{
+  // Subscribe again if the gateway refused
+  if (!success) current->subscribed = false ;
+}
+
+static void msg_callback(bool success, uint8_t return_code, const char *sztopic, uint8_t *payload, mqtt_len_t len, uint8_t gwid)
+{
+  if (channel->now_ms < (uint64_t)opt_failover * 1000) return ;
+  if (strcmp(sztopic, SIM_SHORT_TOPIC) == 0) current->got_short = true ;
+  else if (strcmp(sztopic, SIM_PREDEFINED_TOPIC) == 0) current->got_predefined = true ;
+}
+
+void SimBroker::loop()
+{
+  if (channel->now_ms < m_last_ms + opt_broker_ms) return ;
+  m_last_ms = channel->now_ms ;
+  LocalBroker::loop() ;
+}
+
+// Application behaviour of a client, run once a second
+static void client_tick(SimNode *node)
+{
+  uint8_t gwid = 0 ;
+  uint64_t now = channel->now_ms ;
+  ClientMqttSn *mqtt = &node->mqtt ;
+
+  if (!mqtt->is_connected()){
+    node->subscribed = false ;
+    if (node->connecting) return ;
+    if (mqtt->get_known_gateway(&gwid)){
+      // Failover runs start every client on the first gateway
+      if (opt_failover && now < (uint64_t)opt_failover * 1000) gwid = 1 ;
+      if (mqtt->connect(gwid, false, true, opt_keepalive)) node->connecting = true ;
+    }else if (now >= node->next_search_ms){
+      stats.searches++ ;
+      mqtt->searchgw(1) ;
+      node->next_search_ms = now + 15000 + sim_random() % 15000 ;
+    }
+    return ;
+  }
+  if (opt_failover && !node->subscribed){
+    // Subscribe once per session. The client subscribes again itself
+    // after failing over
+    if (mqtt->subscribe(1, SIM_SHORT_TOPIC, true) &&
+	mqtt->subscribe(1, SIM_PREDEFINED_ID, FLAG_DEFINED_TOPIC_ID))
+      node->subscribed = true ;
+  }
+  if (now >= node->next_publish_ms){
+    uint8_t payload[8] ;
+    memcpy(payload, &now, sizeof(payload)) ;
+    for (uint32_t i=0; i < opt_burst; i++){
+      uint16_t mid = mqtt->publish(1, "sm", payload, sizeof(payload), false) ;
+      if (mid == 0){
+	stats.refused++ ;
+      }else{
+	stats.publishes++ ;
+	node->pending_mid[mid % SIM_PENDING] = mid ;
+	node->pending_ms[mid % SIM_PENDING] = now ;
+      }
+    }
+    node->next_publish_ms += opt_interval * 1000 ;
+    if (node->next_publish_ms < now) node->next_publish_ms = now + opt_interval * 1000 ;
+  }
+}
+
+static void set_clock(uint64_t ms)
+{
+  channel->now_ms = ms ;
+  mqtt_clock_set_ms((uint64_t)SIM_EPOCH * 1000 + ms) ;
+}
+
+int main(int argc, char **argv)
+{
+  const char usage[] = "Usage: %s [-c clients] [-d seconds] [-l loss] [-r Tretry] [-n Nretry] [-k keepalive] [-i interval] [-p burst] [-w window] [-x stretch] [-a advertise] [-t latency_ms] [-b bitrate] [-g broker_ms] [-f seconds] [-s seed] [-u] [-v]\n" ;
+  int opt = 0 ;
+  bool verbose = false ;
+
+  while ((opt = getopt(argc, argv, "c:d:l:r:n:k:i:p:w:x:a:t:b:g:f:s:uv")) != -1){
+    switch(opt){
+    case 'c':
+      opt_clients = atoi(optarg) ;
+      break ;
+    case 'd':
+      opt_duration = atoi(optarg) ;
+      break ;
+    case 'l':
+      opt_loss = atof(optarg) ;
+      break ;
+    case 'r':
+      opt_tretry = atoi(optarg) ;
+      break ;
+    case 'n':
+      opt_nretry = atoi(optarg) ;
+      break ;
+    case 'k':
+      opt_keepalive = atoi(optarg) ;
+      break ;
+    case 'i':
+      opt_interval = atoi(optarg) ;
+      break ;
+    case 'p':
+      opt_burst = atoi(optarg) ;
+      break ;
+    case 'w':
+      opt_window = atoi(optarg) ;
+      break ;
+    case 'x':
+      opt_stretch = atoi(optarg) ;
+      break ;
+    case 'a':
+      opt_advertise = atoi(optarg) ;
+      break ;
+    case 't':
+      opt_latency_ms = atoi(optarg) ;
+      break ;
+    case 'b':
+      opt_bitrate = atoi(optarg) ;
+      break ;
+    case 'g':
+      opt_broker_ms = atoi(optarg) ;
+      break ;
+    case 'f':
+      opt_failover = atoi(optarg) ;
+      break ;
+    case 's':
+      sim_seed = strtoull(optarg, NULL, 0) | 1 ;
+      break ;
+    case 'u':
+      opt_together = true ;
+      break ;
+    case 'v':
+      verbose = true ;
+      break ;
+    default:
+      fprintf(stderr, usage, argv[0]) ;
+      return EXIT_FAILURE ;
+    }
+  }
+  if (opt_clients < 1 || opt_clients > 0xFFFE || opt_loss < 0 || opt_loss > 1 ||
+      opt_latency_ms < 1 || opt_bitrate < 1 || opt_interval < 1 || opt_burst < 1){
+    fprintf(stderr, usage, argv[0]) ;
+    return EXIT_FAILURE ;
+  }
+  if (!verbose) mqtt_log_set_level(MQTT_LOG_NONE) ;
+
+  mqtt_clock_set_virtual(true) ;
+  // A failover run adds a standby gateway and takes the first gateway
+  // off the air at the failover time
+  uint32_t gateways = opt_failover?2:1 ;
+  uint16_t standby_node = opt_clients + 1 ;
+  channel = new SimChannel(opt_clients + gateways, opt_loss, opt_latency_ms) ;
+  set_clock(0) ;
+
+  uint8_t address[SIM_ADDR_WIDTH] ;
+  SimDriver gwdrv[2] ;
+  SimBroker broker[2] ;
+  SimGateway gateway[2] ;
+  for (uint32_t g=0; g < gateways; g++){
+    gwdrv[g].attach(channel, g?standby_node:0) ;
+    sim_address(g?standby_node:0, address) ;
+    gateway[g].set_driver(&gwdrv[g]) ;
+    gateway[g].set_broker(&broker[g]) ;
+    gateway[g].set_gateway_id(g + 1) ;
+    gateway[g].set_retry_attributes(opt_tretry, opt_nretry) ;
+    gateway[g].initialise(SIM_ADDR_WIDTH, sim_broadcast, address) ;
+    gateway[g].set_advertise_interval(opt_advertise) ;
+    gateway[g].create_predefined_topic(SIM_PREDEFINED_ID, SIM_PREDEFINED_TOPIC) ;
+  }
+  bool gateway_down = false ;
+
+  SimNode *nodes = new SimNode[opt_clients] ;
+  char szclientid[16] ;
+  for (uint32_t i=0; i < opt_clients; i++){
+    SimNode *n = &nodes[i] ;
+    n->drv.attach(channel, i + 1) ;
+    sim_address(i + 1, address) ;
+    snprintf(szclientid, sizeof(szclientid), "sim%u", i + 1) ;
+    n->mqtt.set_driver(&n->drv) ;
+    n->mqtt.set_client_id(szclientid) ;
+    n->mqtt.set_retry_attributes(opt_tretry, opt_nretry) ;
+    n->mqtt.set_publish_window(opt_window) ;
+    n->mqtt.set_ping_stretch(opt_stretch) ;
+    n->mqtt.initialise(SIM_ADDR_WIDTH, sim_broadcast, address) ;
+    n->mqtt.set_callback_connected(&con_callback) ;
+    n->mqtt.set_callback_disconnected(&dis_callback) ;
+    n->mqtt.set_callback_published(&pub_callback) ;
+    n->mqtt.set_callback_subscribed(&sub_callback) ;
+    n->mqtt.set_callback_message(&msg_callback) ;
+    n->mqtt.create_predefined_topic(SIM_PREDEFINED_ID, SIM_PREDEFINED_TOPIC) ;
+    n->mqtt.set_standby(opt_failover > 0) ;
+    // Spread start up so clients don't all search at once
+    n->next_search_ms = opt_together?0:sim_random() % 10000 ;
+    n->next_publish_ms = sim_random() % (opt_interval * 1000) ;
+  }
+
+  if (opt_together){
+    // Clients power up after the first advertise, as after a power
+    // cut, and all search at once
+    for (uint32_t g=0; g < gateways; g++) gateway[g].manage_connections() ;
+    while (channel->front()) channel->pop() ;
+  }
+
+  SimNode **touched = new SimNode*[opt_clients] ;
+  uint32_t touched_count = 0 ;
+  uint64_t wall_start = mqtt_metrics_now_us() ;
+
+  for (uint64_t sec = 0; sec < opt_duration; sec++){
+    // Timers and application behaviour once a second
+    set_clock(sec * 1000) ;
+    if (opt_failover && sec >= opt_failover){
+      gateway_down = true ;
+      // Publishes for the clients which moved to the standby gateway
+      int mid = 0 ;
+      broker[1].publish(&mid, SIM_SHORT_TOPIC, 1, "f", 0, false) ;
+      broker[1].publish(&mid, SIM_PREDEFINED_TOPIC, 1, "f", 0, false) ;
+    }
+    for (uint32_t g=gateway_down?1:0; g < gateways; g++) gateway[g].manage_connections() ;
+    for (uint32_t i=0; i < opt_clients; i++){
+      current = &nodes[i] ;
+      client_tick(current) ;
+      current->mqtt.manage_connections() ;
+    }
+
+    // Deliver frames due before the next second. Only nodes which
+    // received frames run, so quiet periods cost nothing
+    SimFrame *f = channel->front() ;
+    while (f && f->due_ms < (sec + 1) * 1000){
+      uint64_t due = f->due_ms ;
+      uint32_t gateway_frames[2] = {0, 0} ;
+      set_clock(due) ;
+      for (; f && f->due_ms == due; f = channel->front()){
+	uint8_t from[SIM_ADDR_WIDTH] ;
+	sim_address(f->from, from) ;
+	if (gateway_down && (f->to == 0 || f->from == 0)){
+	  // Lost with the gateway
+	  channel->pop() ;
+	  continue ;
+	}
+	if (f->to == 0 || f->to == standby_node){
+	  uint32_t g = f->to?1:0 ;
+	  gateway[g].inject(from, f->data) ;
+	  // Dispatch before the receive queue wraps
+	  if (++gateway_frames[g] % (MQTT_MAX_QUEUE - 1) == 0) gateway[g].manage_connections() ;
+	}else{
+	  SimNode *n = &nodes[f->to - 1] ;
+	  n->mqtt.inject(from, f->data) ;
+	  if (!n->touched){
+	    n->touched = true ;
+	    touched[touched_count++] = n ;
+	  }
+	}
+	channel->pop() ;
+      }
+      for (uint32_t g=0; g < gateways; g++){
+	if (gateway_frames[g] == 0) continue ;
+	gateway[g].manage_connections() ;
+	// Second pass returns broker results to clients
+	gateway[g].manage_connections() ;
+      }
+      for (uint32_t i=0; i < touched_count; i++){
+	current = touched[i] ;
+	current->touched = false ;
+	current->mqtt.manage_connections() ;
+	// Second pass sends messages released by the received frames
+	current->mqtt.manage_connections() ;
+      }
+      touched_count = 0 ;
+      f = channel->front() ;
+    }
+  }
+  double wall_s = (mqtt_metrics_now_us() - wall_start) / 1e6 ;
+
+  uint32_t connected = 0, got_short = 0, got_predefined = 0 ;
+  for (uint32_t i=0; i < opt_clients; i++){
+    if (nodes[i].mqtt.is_connected()) connected++ ;
+    if (nodes[i].got_short) got_short++ ;
+    if (nodes[i].got_predefined) got_predefined++ ;
+  }
+  double airtime_s = ((double)channel->sent * SIM_FRAME_OVERHEAD + channel->bytes) * 8 / opt_bitrate ;
+  uint32_t completed = stats.delivered + stats.failed ;
+
+  printf("Clients %u, duration %u s, loss %.1f%%, Tretry %u s, Nretry %u, keep alive %u s, %u publishes every %u s, window %u\n",
+	 opt_clients, opt_duration, opt_loss * 100, opt_tretry, opt_nretry, opt_keepalive, opt_burst, opt_interval, opt_window) ;
+  printf("Simulated in %.2f s wall time (%.0fx real time)\n", wall_s, wall_s > 0?opt_duration / wall_s:0.0) ;
+  printf("Frames sent %u, bytes %llu, lost %u, channel overflows %u\n",
+	 channel->sent, (unsigned long long)channel->bytes, channel->lost, channel->overflows) ;
+  printf("Airtime %.1f s at %u bit/s, channel utilisation %.2f%%\n",
+	 airtime_s, opt_bitrate, airtime_s * 100 / opt_duration) ;
+  printf("Searches %u, connects %u, connect failures %u, lost gateway %u, connected at end %u\n",
+	 stats.searches, stats.connects, stats.connect_failures, stats.lost_gateway, connected) ;
+  printf("Publishes %u, refused %u, delivered %u, failed %u, congestion %u, delivery ratio %.2f%%\n",
+	 stats.publishes, stats.refused, stats.delivered, stats.failed, stats.congested,
+	 completed?stats.delivered * 100.0 / completed:0.0) ;
+  if (stats.latency_ms.count() > 0)
+    printf("Publish latency ms p50 <= %u, p90 <= %u, p99 <= %u, max %u\n",
+	   stats.latency_ms.percentile(50), stats.latency_ms.percentile(90),
+	   stats.latency_ms.percentile(99), stats.latency_ms.max()) ;
+  if (opt_failover)
+    printf("Failover at %u s, clients receiving on short topic %u, on predefined topic %u\n",
+	   opt_failover, got_short, got_predefined) ;
+
+  delete[] touched ;
+  delete[] nodes ;
+  delete channel ;
+  return EXIT_SUCCESS ;
+}
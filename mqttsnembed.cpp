@@ -33,6 +33,10 @@ MqttSnEmbed::MqttSnEmbed()
   m_Nretry = 5 ; // attempts
 
   m_pDriver = NULL ;
+  m_device_address_len = 0 ;
+#ifndef ARDUINO
+  m_capture = NULL ;
+#endif
 }
 
 MqttSnEmbed::~MqttSnEmbed()
@@ -42,7 +46,7 @@ MqttSnEmbed::~MqttSnEmbed()
 
 bool MqttSnEmbed::create_predefined_topic(uint16_t topicid, const char *name)
 {
-  if ((uint8_t)strlen(name) > m_pDriver->get_payload_width() - MQTT_REGISTER_HDR_LEN){
+  if ((mqtt_len_t)strlen(name) > m_pDriver->get_payload_width() - MQTT_REGISTER_HDR_LEN){
     EPRINT("Pre-defined topic %s too long\n", name) ;
     return false ;
   }
@@ -65,18 +69,47 @@ bool MqttSnEmbed::create_predefined_topic(uint16_t topicid, const wchar_t *name)
 void MqttSnEmbed::set_retry_attributes(uint16_t Tretry, uint16_t Nretry)
 {
   m_Tretry = Tretry ;
-  m_Nretry = Tretry ;
+  m_Nretry = Nretry ;
 }
 
 bool MqttSnEmbed::m_fn_packet_received(void *pContext, uint8_t *sender_addr, uint8_t *packet)
 {
+  MqttSnEmbed *embed = (MqttSnEmbed *)pContext ;
+  // The driver delivers at most its payload width. Lengths beyond it
+  // would read past the received frame
+  uint8_t width = embed->m_pDriver->get_payload_width() ;
   // Read the MQTT-SN payload
-  uint8_t length = packet[0] ;
-  uint8_t messageid = packet[1] ;
-  uint8_t *mqtt_payload = packet+MQTT_HDR_LEN ;
+  mqtt_len_t length = packet[0] ;
+  uint8_t hdr_len = MQTT_HDR_LEN ;
+
+  if (length == MQTT_EXT_LEN_FLAG){
+    // 3 byte length field. Only possible if the driver can carry
+    // more than 255 bytes, which the 8 bit driver contract cannot yet.
+    // The width check drops these frames until it can
+#if PACKET_DRIVER_MAX_PAYLOAD > 255
+    length = (packet[1] << 8) | packet[2] ;
+    hdr_len = MQTT_EXT_HDR_LEN ;
+#else
+    DPRINT("Extended length field not supported by driver\n") ;
+    return true ;
+#endif
+  }
+#ifndef ARDUINO
+  // Capture bad packets as well, clipped to the driver payload
+  if (embed->m_capture){
+    embed->m_capture->record(MqttCaptureFrame::received, sender_addr, packet,
+			     length > width?width:length) ;
+  }
+#endif
+  if (length < hdr_len || length > width){
+    DPRINT("Bad packet received. Length %u\n", length) ;
+    return true ;
+  }
+  uint8_t messageid = packet[hdr_len-1] ;
+  uint8_t *mqtt_payload = packet+hdr_len ;
 
   // Queue the message and exit
-  ((MqttSnEmbed *)(pContext))->queue_received(sender_addr, messageid, mqtt_payload, length-MQTT_HDR_LEN) ;
+  embed->queue_received(sender_addr, messageid, mqtt_payload, length-hdr_len) ;
   return true ;
 }
 
@@ -106,6 +139,9 @@ bool MqttSnEmbed::initialise(uint8_t address_len, uint8_t *broadcast, uint8_t *a
     EPRINT("Address too long") ;
     address_len = PACKET_DRIVER_MAX_ADDRESS_LEN; // fix to max length, but not really fixing the programming error
   }
+  memcpy(m_device_address, address, address_len) ;
+  memcpy(m_broadcast_address, broadcast, address_len) ;
+  m_device_address_len = address_len ;
   
   if (!m_pDriver->initialise(address, broadcast, address_len)){
     EPRINT("Failed to initialise driver\n") ;
@@ -121,10 +157,20 @@ void MqttSnEmbed::shutdown()
 
 }
 
+bool MqttSnEmbed::power_up()
+{
+  if (!m_pDriver || m_device_address_len == 0) return false ; // never initialised
+  if (!m_pDriver->initialise(m_device_address, m_broadcast_address, m_device_address_len)){
+    EPRINT("Failed to power up driver\n") ;
+    return false ;
+  }
+  return true ;
+}
+
 void MqttSnEmbed::queue_received(const uint8_t *addr,
 				uint8_t messageid,
 				const uint8_t *data,
-				uint8_t len)
+				mqtt_len_t len)
 {
   // Len is too long, could be invalid or corrupt data packet
   // This function has to keep in mind that any old packet could be picked up
@@ -142,6 +188,10 @@ void MqttSnEmbed::queue_received(const uint8_t *addr,
   m_queue_head++ ;
   if (m_queue_head >= MQTT_MAX_QUEUE) m_queue_head = 0 ;
 
+  // Still waiting to be dispatched
+  MQTT_METRIC(if (m_queue[m_queue_head].set) m_metrics.queue_overflows.inc()) ;
+  MQTT_METRIC(m_metrics.packets_in[messageid].inc()) ;
+
   // Regardless of what's in the queue, either overwrite
   // an old entry or set a new one. 
   m_queue[m_queue_head].set = true ;
@@ -150,6 +200,7 @@ void MqttSnEmbed::queue_received(const uint8_t *addr,
   if (len > 0 && data != NULL)
     memcpy((void*)m_queue[m_queue_head].message_data, data, len) ;
   m_queue[m_queue_head].message_len = len ;
+  MQTT_TRACE_POINT(m_queue[m_queue_head].received_us = mqtt_metrics_now_us()) ;
 
 #ifndef ARDUINO
   pthread_mutex_unlock(&m_mqttlock) ;
@@ -166,6 +217,11 @@ bool MqttSnEmbed::dispatch_queue()
 
   do{ 
     if (m_queue[queue_ptr].set){
+#ifdef MQTT_TRACE_ENABLED
+      m_trace_current.start(m_queue[queue_ptr].messageid, m_queue[queue_ptr].received_us) ;
+      m_trace_current.stamp(MqttTrace::dispatched) ;
+      m_trace_log.dispatched(m_trace_current) ;
+#endif
       switch(m_queue[queue_ptr].messageid){
       case MQTT_ADVERTISE:
 	// Gateway message received
@@ -315,7 +371,7 @@ bool MqttSnEmbed::dispatch_queue()
 
 bool MqttSnEmbed::writemqtt(MqttConnection *con,
 			   uint8_t messageid,
-			   const uint8_t *buff, uint8_t len)
+			   const uint8_t *buff, mqtt_len_t len)
 {
   return addrwritemqtt(con->get_address(),messageid,buff,len);
 }
@@ -323,18 +379,47 @@ bool MqttSnEmbed::writemqtt(MqttConnection *con,
 bool MqttSnEmbed::addrwritemqtt(const uint8_t *address,
 			       uint8_t messageid,
 			       const uint8_t *buff,
-			       uint8_t len)
+			       mqtt_len_t len)
 {
-  uint8_t send_buff[PACKET_DRIVER_MAX_PAYLOAD] ;
-  // includes the length field and message type
-  uint8_t payload_len = len+MQTT_HDR_LEN;
+  MqttFrame frame ;
+  frame.bytes(buff, len) ;
+  return addrwriteframe(address, messageid, frame) ;
+}
 
-  send_buff[0] = payload_len ;
-  send_buff[1] = messageid ;
-  if (buff != NULL && len > 0)
-    memcpy(send_buff+MQTT_HDR_LEN, buff, len) ;
+bool MqttSnEmbed::writeframe(MqttConnection *con,
+			    uint8_t messageid,
+			    MqttFrame &frame)
+{
+  return addrwriteframe(con->get_address(), messageid, frame);
+}
 
+bool MqttSnEmbed::addrwriteframe(const uint8_t *address,
+				uint8_t messageid,
+				MqttFrame &frame)
+{
+  mqtt_len_t payload_len = 0 ;
+  if (frame.overflow()){
+    EPRINT("Message %u overflowed frame buffer\n", messageid) ;
+    return false ;
+  }
+  // includes the length field and message type
+  uint8_t *send_buff = frame.frame(messageid, payload_len) ;
+  // Driver width and send length are 8 bit so this also rejects
+  // any extended length frame before it can be truncated
+  if (payload_len > m_pDriver->get_payload_width()){
+    EPRINT("Message %u of %u bytes too long for driver\n", messageid, frame.len()) ;
+    return false ;
+  }
+
+#ifndef ARDUINO
+  if (m_capture)
+    m_capture->record(MqttCaptureFrame::sent, address, send_buff, payload_len) ;
+#endif
   bool ret = m_pDriver->send(address, send_buff, payload_len) ;
+#ifdef MQTT_METRICS_ENABLED
+  if (!ret) m_metrics.send_failures.inc() ;
+  else if (messageid < MQTT_METRICS_TYPES) m_metrics.packets_out[messageid].inc() ;
+#endif
   return ret;
 }
 
@@ -21,16 +21,15 @@
 #include "mqttparams.hpp"
 #include "mqttconnection.hpp"
 #include "mqtttopic.hpp"
-
-#ifdef ARDUINO
- #include <TimeLib.h>
- #include <arduino.h>
- #define TIMENOW now()
-#else
- #include <time.h>
- #define TIMENOW time(NULL)
+#include "mqttpacket.hpp"
+#include "mqttmetrics.hpp"
+#include "mqtttrace.hpp"
+#ifndef ARDUINO
+#include "mqttcapture.hpp"
 #endif
 
+#include "mqttclock.hpp"
+
 #define MQTT_RETURN_ACCEPTED 0x00
 #define MQTT_RETURN_CONGESTION 0x01
 #define MQTT_RETURN_INVALID_TOPIC 0x02
@@ -49,7 +48,8 @@ public:
   uint8_t address[PACKET_DRIVER_MAX_ADDRESS_LEN];
   uint8_t address_len ;
   uint8_t message_data[PACKET_DRIVER_MAX_PAYLOAD] ;
-  uint8_t message_len ;
+  mqtt_len_t message_len ;
+  MQTT_TRACE_POINT(uint32_t received_us ;)
 };
 
 
@@ -69,6 +69,14 @@ public:
     m_advertising = false ;
     m_lastactivity = 0 ;
     m_active = false ;
+    m_srtt_ms = 0 ;
+    m_rtt_sent_ms = 0 ;
+    m_rtt_pending = false ;
+    m_rtt_ambiguous = false ;
+    m_failures = 0 ;
+    m_retries = 0 ;
+    m_ad_missed = 0 ;
+    m_decay_time = TIMENOW ;
   }    
   
   bool is_advertising(){
@@ -76,6 +84,10 @@ public:
   }
   
   void advertised(uint16_t t){
+    // Count advertises which arrive well after the last duration
+    if (m_advertising && m_ad_duration > 0 &&
+	TIMENOW - m_ad_time > m_ad_duration + m_ad_duration / 2)
+      m_ad_missed++ ;
     m_advertising = true ;
     m_active = true ;
     m_ad_time = TIMENOW ;
@@ -123,8 +135,53 @@ public:
 
   uint8_t get_gwid(){return m_gwid;}
   void set_gwid(uint8_t gwid){m_gwid = gwid;}
+
+  // Link statistics. Round trips are timed from a request to its
+  // response. A request sent again before the response arrives can't be
+  // matched so is not timed
+  void request_sent(){
+    m_rtt_ambiguous = m_rtt_pending ;
+    m_rtt_pending = true ;
+    m_rtt_sent_ms = TIMENOW_MS ;
+  }
+  void response_received(){
+    if (m_rtt_pending && !m_rtt_ambiguous) rtt_sample(TIMENOW_MS - m_rtt_sent_ms) ;
+    m_rtt_pending = false ;
+  }
+  // Smoothed with a gain of 1/8
+  void rtt_sample(uint32_t ms){
+    if (ms > 0xFFFF) ms = 0xFFFF ;
+    if (m_srtt_ms == 0) m_srtt_ms = ms?ms:1 ;
+    else m_srtt_ms = (uint16_t)(((uint32_t)m_srtt_ms * 7 + ms) / 8) ;
+    if (m_srtt_ms == 0) m_srtt_ms = 1 ;
+  }
+  uint16_t get_rtt_ms(){return m_srtt_ms;}
+  void failed(){if (m_failures < 0xFF) m_failures++;}
+  void retried(){if (m_retries < 0xFF) m_retries++;}
+  // Lower is better
+  uint32_t score(){
+    decay() ;
+    return (m_srtt_ms?m_srtt_ms:MQTT_GW_DEFAULT_RTT_MS) +
+      (uint32_t)m_failures * MQTT_GW_FAILURE_PENALTY_MS +
+      (uint32_t)m_retries * MQTT_GW_RETRY_PENALTY_MS +
+      (uint32_t)m_ad_missed * MQTT_GW_AD_MISSED_PENALTY_MS ;
+  }
   
 protected:
+  // Older problems count for less
+  void decay(){
+    while (TIMENOW - m_decay_time >= MQTT_GW_STATS_DECAY){
+      m_decay_time += MQTT_GW_STATS_DECAY ;
+      if (!(m_failures || m_retries || m_ad_missed)){
+	m_decay_time = TIMENOW ;
+	break ;
+      }
+      m_failures /= 2 ;
+      m_retries /= 2 ;
+      m_ad_missed /= 2 ;
+    }
+  }
+
   bool m_active ;
   uint8_t m_address[PACKET_DRIVER_MAX_ADDRESS_LEN] ;
   uint8_t m_address_length ;
@@ -135,6 +192,15 @@ protected:
   bool m_permanent ;
   bool m_allocated ;
   bool m_advertising ;
+
+  uint16_t m_srtt_ms ;
+  uint32_t m_rtt_sent_ms ;
+  bool m_rtt_pending ;
+  bool m_rtt_ambiguous ;
+  uint8_t m_failures ;
+  uint8_t m_retries ;
+  uint8_t m_ad_missed ;
+  time_t m_decay_time ;
 };
 
 class MqttSnEmbed{
@@ -162,8 +228,23 @@ public:
   // Set the retry attributes. This affects all future connections
   void set_retry_attributes(uint16_t Tretry, uint16_t Nretry) ;
 
-  // Powers down the radio. Call initialise to power up again
+  // Powers down the radio. Call initialise or power_up to power up again
   void shutdown() ;
+  // Powers up the radio after a shutdown with the addresses given to
+  // initialise. Returns false if the driver fails to initialise
+  bool power_up() ;
+
+#ifdef MQTT_METRICS_ENABLED
+  MqttMetrics* get_metrics(){return &m_metrics;}
+#endif
+#ifndef ARDUINO
+  // Record all frames received and sent to a capture. NULL to stop
+  void set_capture(MqttCapture *capture){m_capture = capture;}
+#endif
+#ifdef MQTT_TRACE_ENABLED
+  // Write the recent message traces to file for offline analysis
+  bool dump_trace(const char *szpath){return m_trace_log.dump(szpath);}
+#endif
 
 protected:
 
@@ -174,37 +255,37 @@ protected:
 
   // Handle all MQTT messages with functions that can be overridden in base class
   static PACKETRECEIVEDCALLBACK(m_fn_packet_received);
-  virtual void received_unknown(uint8_t id, uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_advertised(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_searchgw(uint8_t *sender_address, uint8_t *data, uint8_t len){} 
-  virtual void received_gwinfo(uint8_t *sender_address, uint8_t *data, uint8_t len){} 
-  virtual void received_connect(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_connack(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_willtopicreq(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_willtopic(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_willmsgreq(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_willmsg(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_pingresp(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_pingreq(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_disconnect(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_register(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_regack(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_publish(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_puback(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_pubrec(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_pubrel(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_pubcomp(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_subscribe(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_suback(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_unsubscribe(uint8_t *sender_address, uint8_t *data, uint8_t len){}
-  virtual void received_unsuback(uint8_t *sender_address, uint8_t *data, uint8_t len){}
+  virtual void received_unknown(uint8_t id, uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_advertised(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_searchgw(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){} 
+  virtual void received_gwinfo(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){} 
+  virtual void received_connect(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_connack(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_willtopicreq(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_willtopic(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_willmsgreq(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_willmsg(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_pingresp(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_pingreq(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_disconnect(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_register(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_regack(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_publish(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_puback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_pubrec(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_pubrel(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_pubcomp(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_subscribe(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_suback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_unsubscribe(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
+  virtual void received_unsuback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len){}
   
   // Queue the data received until dispatch is called.
   // Overwrites old queue messages without error if not dispacted quickly
   void queue_received(const uint8_t *addr,
 		      uint8_t messageid,
 		      const uint8_t *data,
-		      uint8_t len) ;
+		      mqtt_len_t len) ;
 
   // Creates header and body. Writes to address
   // Throws MqttIOErr or MqttOutOfRange exceptions
@@ -212,9 +293,15 @@ protected:
   bool addrwritemqtt(const uint8_t *address,
 		     uint8_t messageid,
 		     const uint8_t *buff,
-		     uint8_t len);
+		     mqtt_len_t len);
 
-  bool writemqtt(MqttConnection *con, uint8_t messageid, const uint8_t *buff, uint8_t len);
+  bool writemqtt(MqttConnection *con, uint8_t messageid, const uint8_t *buff, mqtt_len_t len);
+
+  // Writes the header in place in front of an encoded frame body and
+  // sends it. No copy of the body is made.
+  // Returns false if the frame overflowed or the send failed
+  bool addrwriteframe(const uint8_t *address, uint8_t messageid, MqttFrame &frame);
+  bool writeframe(MqttConnection *con, uint8_t messageid, MqttFrame &frame);
   void listen_mode() ;
   void send_mode() ;
 
@@ -227,8 +314,18 @@ protected:
   uint16_t m_Nretry ;
 
   IPacketDriver *m_pDriver ;
+  // Addresses kept to power up the driver again
+  uint8_t m_device_address[PACKET_DRIVER_MAX_ADDRESS_LEN] ;
+  uint8_t m_broadcast_address[PACKET_DRIVER_MAX_ADDRESS_LEN] ;
+  uint8_t m_device_address_len ;
+
+  MQTT_METRIC(MqttMetrics m_metrics ;)
+  // Completed traces and the trace of the packet being dispatched
+  MQTT_TRACE_POINT(MqttTraceLog m_trace_log ;)
+  MQTT_TRACE_POINT(MqttTrace m_trace_current ;)
 
 #ifndef ARDUINO
+  MqttCapture *m_capture ;
   pthread_mutex_t m_mqttlock ;
 #endif
 };
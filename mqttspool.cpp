@@ -0,0 +1,244 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "mqttspool.hpp"
+#include <string.h>
+
+#ifndef ARDUINO
+// File header. Spooled entries follow in ring order by index
+#define MQTT_SPOOL_MAGIC 0x4D515350
+struct MqttSpoolHeader{
+  uint32_t magic ;
+  uint16_t max ;
+  uint16_t entry_size ;
+  uint16_t head ;
+  uint16_t count ;
+};
+#endif
+
+MqttSpool::MqttSpool()
+{
+#ifndef ARDUINO
+  m_file = NULL ;
+#endif
+  m_head = 0 ;
+  m_count = 0 ;
+  m_held = 0 ;
+  m_policy = refuse_new ;
+  m_dropped = 0 ;
+}
+
+MqttSpool::~MqttSpool()
+{
+#ifndef ARDUINO
+  if (m_file) fclose(m_file) ;
+#endif
+}
+
+void MqttSpool::clear()
+{
+  for (uint16_t i=0; i < MQTT_SPOOL_MAX; i++) m_spool[i].reset() ;
+  m_head = 0 ;
+  m_count = 0 ;
+  m_held = 0 ;
+#ifndef ARDUINO
+  write_header() ;
+#endif
+}
+
+bool MqttSpool::push(const char *sztopic, const void *payload, mqtt_len_t len,
+		     uint8_t qos, bool retain, bool echo)
+{
+  if (!sztopic || strlen(sztopic) > MQTT_SPOOL_TOPIC_LEN) return false ;
+  return store(sztopic, 0, 0, payload, len, qos, retain, echo) ;
+}
+
+bool MqttSpool::push(uint16_t topicid, uint8_t topictype, const void *payload,
+		     mqtt_len_t len, uint8_t qos, bool retain)
+{
+  return store("", topicid, topictype, payload, len, qos, retain, false) ;
+}
+
+bool MqttSpool::store(const char *sztopic, uint16_t topicid, uint8_t topictype,
+		      const void *payload, mqtt_len_t len,
+		      uint8_t qos, bool retain, bool echo)
+{
+  if (len > MQTT_SPOOL_PAYLOAD_LEN) return false ;
+
+  uint16_t index = 0 ;
+  MqttSpooled *s = NULL ;
+  if (m_policy == latest_per_topic){
+    // Replace the waiting publish for the topic, keeping its place
+    for (uint16_t i=m_held; i < m_count; i++){
+      index = (m_head + i) % MQTT_SPOOL_MAX ;
+      if (m_spool[index].m_topicid == topicid &&
+	  m_spool[index].m_topictype == topictype &&
+	  strcmp(m_spool[index].m_sztopic, sztopic) == 0){
+	s = &m_spool[index] ;
+	m_dropped++ ;
+	break ;
+      }
+    }
+  }
+  if (!s){
+    if (is_full()){
+      if (m_policy == refuse_new || m_held == m_count) return false ;
+      drop() ; // make room
+      m_dropped++ ;
+    }
+    index = (m_head + m_count) % MQTT_SPOOL_MAX ;
+    s = &m_spool[index] ;
+    m_count++ ;
+  }
+  strcpy(s->m_sztopic, sztopic) ;
+  s->m_topicid = topicid ;
+  s->m_topictype = topictype ;
+  if (payload && len > 0) memcpy(s->m_payload, payload, len) ;
+  else len = 0 ;
+  s->m_payload_len = len ;
+  s->m_qos = qos ;
+  s->m_retain = retain ;
+  s->m_echo = echo ;
+#ifndef ARDUINO
+  write_entry(index) ;
+  write_header() ;
+#endif
+  return true ;
+}
+
+MqttSpooled* MqttSpool::front()
+{
+  if (is_empty()) return NULL ;
+  return &m_spool[m_head] ;
+}
+
+void MqttSpool::pop()
+{
+  if (is_empty()) return ;
+  m_spool[m_head].reset() ;
+  m_head = (m_head + 1) % MQTT_SPOOL_MAX ;
+  m_count-- ;
+  if (m_held > 0) m_held-- ;
+#ifndef ARDUINO
+  write_header() ;
+#endif
+}
+
+MqttSpooled* MqttSpool::at(uint16_t n)
+{
+  if (n >= m_count) return NULL ;
+  return &m_spool[(m_head + n) % MQTT_SPOOL_MAX] ;
+}
+
+void MqttSpool::hold()
+{
+  if (m_held < m_count) m_held++ ;
+}
+
+void MqttSpool::drop()
+{
+  if (m_held == 0){
+    pop() ;
+    return ;
+  }
+  // Close the gap left behind the held publishes
+  for (uint16_t i=m_held; i+1 < m_count; i++){
+    uint16_t index = (m_head + i) % MQTT_SPOOL_MAX ;
+    m_spool[index] = m_spool[(index + 1) % MQTT_SPOOL_MAX] ;
+#ifndef ARDUINO
+    write_entry(index) ;
+#endif
+  }
+  m_count-- ;
+  m_spool[(m_head + m_count) % MQTT_SPOOL_MAX].reset() ;
+#ifndef ARDUINO
+  write_header() ;
+#endif
+}
+
+#ifndef ARDUINO
+bool MqttSpool::set_file(const char *szpath)
+{
+  if (m_file){
+    fclose(m_file) ;
+    m_file = NULL ;
+  }
+  if (!szpath) return true ; // RAM only
+  
+  FILE *f = fopen(szpath, "r+b") ;
+  if (f){
+    // Load an existing spool
+    MqttSpoolHeader hdr ;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	hdr.magic != MQTT_SPOOL_MAGIC ||
+	hdr.max != MQTT_SPOOL_MAX ||
+	hdr.entry_size != sizeof(MqttSpooled) ||
+	hdr.head >= MQTT_SPOOL_MAX ||
+	hdr.count > MQTT_SPOOL_MAX){
+      EPRINT("SPOOL: %s is not a compatible spool file\n", szpath) ;
+      fclose(f) ;
+      return false ;
+    }
+    if (fread(m_spool, sizeof(MqttSpooled), MQTT_SPOOL_MAX, f) != MQTT_SPOOL_MAX){
+      EPRINT("SPOOL: %s is truncated\n", szpath) ;
+      fclose(f) ;
+      return false ;
+    }
+    m_head = hdr.head ;
+    m_count = hdr.count ;
+    m_file = f ;
+    DPRINT("SPOOL: Loaded %u publishes from %s\n", m_count, szpath) ;
+    return true ;
+  }
+
+  // Create a new spool file from the current contents
+  f = fopen(szpath, "w+b") ;
+  if (!f){
+    EPRINT("SPOOL: Cannot create spool file %s\n", szpath) ;
+    return false ;
+  }
+  m_file = f ;
+  for (uint16_t i=0; i < MQTT_SPOOL_MAX; i++) write_entry(i) ;
+  write_header() ;
+  return true ;
+}
+
+void MqttSpool::write_header()
+{
+  if (!m_file) return ;
+  MqttSpoolHeader hdr ;
+  hdr.magic = MQTT_SPOOL_MAGIC ;
+  hdr.max = MQTT_SPOOL_MAX ;
+  hdr.entry_size = sizeof(MqttSpooled) ;
+  hdr.head = m_head ;
+  hdr.count = m_count ;
+  if (fseek(m_file, 0, SEEK_SET) != 0 ||
+      fwrite(&hdr, sizeof(hdr), 1, m_file) != 1)
+    EPRINT("SPOOL: Failed to write spool file header\n") ;
+  fflush(m_file) ;
+}
+
+void MqttSpool::write_entry(uint16_t index)
+{
+  if (!m_file) return ;
+  long offset = sizeof(MqttSpoolHeader) + (long)index * sizeof(MqttSpooled) ;
+  if (fseek(m_file, offset, SEEK_SET) != 0 ||
+      fwrite(&m_spool[index], sizeof(MqttSpooled), 1, m_file) != 1)
+    EPRINT("SPOOL: Failed to write spool file entry %u\n", index) ;
+}
+#endif
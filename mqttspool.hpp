@@ -0,0 +1,144 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef __MQTT_SPOOL
+#define __MQTT_SPOOL
+
+#include "mqttparams.hpp"
+#ifndef ARDUINO
+#include <stdio.h>
+#endif
+
+// Max length of a spooled topic name and payload. Matches what a
+// client can register and publish
+#define MQTT_SPOOL_TOPIC_LEN (PACKET_DRIVER_MAX_PAYLOAD - MQTT_REGISTER_HDR_LEN)
+#define MQTT_SPOOL_PAYLOAD_LEN (PACKET_DRIVER_MAX_PAYLOAD - MQTT_PUBLISH_HDR_LEN)
+
+// Publish held in the spool. Plain data so it can be written to file
+class MqttSpooled{
+public:
+  MqttSpooled(){reset();}
+  void reset(){
+    m_sztopic[0] = '\0' ;
+    m_topicid = 0 ;
+    m_topictype = 0 ;
+    m_payload_len = 0 ;
+    m_qos = 0 ;
+    m_retain = false ;
+    m_echo = false ;
+  }
+  // Empty for publishes stored by topic id
+  const char *get_topic(){return m_sztopic;}
+  uint16_t get_topic_id(){return m_topicid;}
+  uint8_t get_topic_type(){return m_topictype;}
+  uint8_t *get_payload(){return m_payload;}
+  mqtt_len_t get_payload_len(){return m_payload_len;}
+  uint8_t get_qos(){return m_qos;}
+  bool get_retain(){return m_retain;}
+  // Publish has already been delivered to local subscribers
+  bool get_echo(){return m_echo;}
+
+protected:
+  friend class MqttSpool ;
+  char m_sztopic[MQTT_SPOOL_TOPIC_LEN+1] ;
+  uint16_t m_topicid ;
+  uint8_t m_topictype ;
+  uint8_t m_payload[MQTT_SPOOL_PAYLOAD_LEN] ;
+  mqtt_len_t m_payload_len ;
+  uint8_t m_qos ;
+  bool m_retain ;
+  bool m_echo ;
+};
+
+// Bounded first in, first out store of publishes which cannot be sent
+// upstream yet. By default new publishes are refused when the spool is
+// full so accepted messages are never overwritten.
+// Optionally mirrored to a file so the spool survives a restart.
+// Not thread safe, callers should hold their own lock
+class MqttSpool{
+public:
+  enum Policy{
+    refuse_new,      // refuse publishes when full
+    drop_oldest,     // drop the oldest publish to make room
+    latest_per_topic // replace a waiting publish to the same topic, otherwise drop the oldest when full
+  };
+
+  MqttSpool() ;
+  ~MqttSpool() ;
+
+  void set_policy(Policy policy){m_policy = policy;}
+  Policy get_policy(){return m_policy;}
+  // Publishes dropped or replaced by the policy
+  uint32_t dropped(){return m_dropped;}
+
+#ifndef ARDUINO
+  // Back the spool with a file. Any publishes already in the file are
+  // loaded. Returns false if the file cannot be opened or is not a spool
+  // file of the same size
+  bool set_file(const char *szpath) ;
+#endif
+  
+  // Add a publish to the back of the spool. Returns false if full or
+  // the topic or payload is too large
+  bool push(const char *sztopic, const void *payload, mqtt_len_t len,
+	    uint8_t qos, bool retain, bool echo=false) ;
+  // Add a publish to a short topic name or predefined topic id
+  bool push(uint16_t topicid, uint8_t topictype, const void *payload,
+	    mqtt_len_t len, uint8_t qos, bool retain) ;
+
+  // Oldest publish or NULL if empty
+  MqttSpooled* front() ;
+  // Remove the oldest publish
+  void pop() ;
+
+  // Publishes being sent can be held at the front of the spool until
+  // delivered. Held publishes are never dropped or replaced by the policy.
+  // Publish n places behind the oldest or NULL
+  MqttSpooled* at(uint16_t n) ;
+  // Hold the oldest publish not yet held
+  void hold() ;
+  // Stop holding publishes so they are sent again from the front
+  void release(){m_held = 0;}
+  uint16_t held(){return m_held;}
+
+  uint16_t count(){return m_count;}
+  bool is_empty(){return m_count == 0;}
+  bool is_full(){return m_count == MQTT_SPOOL_MAX;}
+  void clear() ;
+
+protected:
+  bool store(const char *sztopic, uint16_t topicid, uint8_t topictype,
+	     const void *payload, mqtt_len_t len,
+	     uint8_t qos, bool retain, bool echo) ;
+#ifndef ARDUINO
+  void write_header() ;
+  void write_entry(uint16_t index) ;
+  FILE *m_file ;
+#endif
+  // Remove the oldest publish which isn't held
+  void drop() ;
+  
+  MqttSpooled m_spool[MQTT_SPOOL_MAX] ;
+  uint16_t m_head ;
+  uint16_t m_count ;
+  uint16_t m_held ;
+  Policy m_policy ;
+  uint32_t m_dropped ;
+};
+
+#endif
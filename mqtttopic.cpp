@@ -59,10 +59,9 @@ bool MqttTopic::match(const char* sztopic)
   for (char *c = m_sztopic; *c ; c++){
     switch(*c){
     case '+':
-      // Skip level
+      // Skip level. The separator is matched by the filter
       for ( ; *p && *p != '/'; p++) ;
-      if (*p == '/') p++ ;
-      break;
+      continue ;
     case '#':
       // Assumed to be final wildcard to match remaining
       return true ;      
@@ -92,6 +91,8 @@ void MqttTopic::reset()
   m_issubscribed = false ;
   m_topicqos = 0;
   m_isshort = false ;
+  m_fnhandler = NULL ;
+  m_retained_until = 0 ;
 }
 
 MqttTopicCollection::MqttTopicCollection()
@@ -216,11 +217,8 @@ bool MqttTopicCollection::del_topic_by_messageid(uint16_t messageid)
   MqttTopic *p = NULL ;
   for (p=topics;p;p = p->next()){
     if (p->get_message_id() == messageid){
-      if (p->is_head()){
-	topics = p->next() ;
-      }else{
-	p->unlink() ;
-      }
+      if (p->is_head()) topics = p->next() ;
+      p->unlink() ;
       delete p ;
       return true ;
     }
@@ -233,11 +231,8 @@ bool MqttTopicCollection::del_topic(uint16_t id)
   MqttTopic *p = NULL ;
   for (p=topics;p;p = p->next()){
     if (p->get_id() == id){
-      if (p->is_head()){
-	topics = p->next() ;
-      }else{
-	p->unlink() ;
-      }
+      if (p->is_head()) topics = p->next() ;
+      p->unlink() ;
       delete p ;
       return true ;
     }
@@ -248,6 +243,7 @@ bool MqttTopicCollection::del_topic(uint16_t id)
 void MqttTopicCollection::del_topic(MqttTopic *t)
 {
   if (!t) return ;
+  if (t == topics) topics = t->next() ;
   t->unlink() ;
   delete t ;
 }
@@ -20,14 +20,11 @@
 
 #include <stdint.h>
 #include "mqttparams.hpp"
-#ifdef ARDUINO
- #include <TimeLib.h>
- #include <arduino.h>
- #define TIMENOW now()
-#else
- #include <time.h>
- #define TIMENOW time(NULL)
-#endif
+#include "mqttclock.hpp"
+
+// Callback for published messages sent by the server
+// bool success, uint8_t return, const char* topic, uint8_t* payload, mqtt_len_t payloadlen, uint8_t gwid
+#define MQTTMSGCALLBACK(fn) void (*fn)(bool, uint8_t, const char*, uint8_t *, mqtt_len_t, uint8_t)
 
 class MqttTopic{
 public:
@@ -54,11 +51,22 @@ public:
   bool is_predefined(){return m_predefined;}
   void set_qos(uint8_t qos){m_topicqos = qos;}
   uint8_t get_qos(){return m_topicqos;}
-  void unlink(){if (!is_head())m_prev->m_next = m_next;}
-  void link_head(MqttTopic *topic){if (m_prev)m_prev->m_next = topic;m_prev = topic;} // adds topic ahead
-  void link_tail(MqttTopic *topic){if (m_next)m_next->m_prev = topic;m_next = topic;} // adds topic after
+  void unlink(){if (m_prev)m_prev->m_next = m_next;if (m_next)m_next->m_prev = m_prev;}
+  void link_head(MqttTopic *topic){if (m_prev)m_prev->m_next = topic;topic->m_prev = m_prev;topic->m_next = this;m_prev = topic;} // adds topic ahead
+  void link_tail(MqttTopic *topic){if (m_next)m_next->m_prev = topic;topic->m_next = m_next;topic->m_prev = this;m_next = topic;} // adds topic after
   void set_short_topic(bool bset){m_isshort = bset;}
   bool is_short_topic(){return m_isshort;}
+  // Handler for publishes received on the topic. Clients only
+  void set_handler(MQTTMSGCALLBACK(fn)){m_fnhandler = fn;}
+  void copy_handler(MqttTopic *from){m_fnhandler = from?from->m_fnhandler:NULL;}
+  bool has_handler(){return m_fnhandler != NULL;}
+  void handle(const char *sztopic, uint8_t *payload, mqtt_len_t len, uint8_t gwid){
+    (*m_fnhandler)(true, MQTT_RETURN_ACCEPTED, sztopic, payload, len, gwid);
+  }
+  // Gateways only pass broker retained replays to subscriptions made
+  // before the given time
+  void await_retained(time_t until){m_retained_until = until;}
+  bool awaiting_retained(){return m_retained_until >= TIMENOW;}
 protected:
   MqttTopic *m_next ;
   MqttTopic *m_prev ;
@@ -73,6 +81,8 @@ protected:
   bool m_issubscribed;
   uint8_t m_topicqos ;
   bool m_isshort;
+  MQTTMSGCALLBACK(m_fnhandler) ;
+  time_t m_retained_until ;
 };
 
 class MqttTopicCollection{
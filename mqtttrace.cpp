@@ -0,0 +1,134 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "mqtttrace.hpp"
+#ifdef MQTT_TRACE_ENABLED
+#include "mqttparams.hpp"
+#include <stdio.h>
+
+MqttTraceLog::MqttTraceLog()
+{
+  m_head = 0 ;
+  m_count = 0 ;
+  pthread_mutex_init(&m_lock, NULL) ;
+}
+
+MqttTraceLog::~MqttTraceLog()
+{
+  pthread_mutex_destroy(&m_lock) ;
+}
+
+const char *MqttTraceLog::stage_name(uint8_t stage)
+{
+  switch(stage){
+  case MqttTrace::received: return "received" ;
+  case MqttTrace::dispatched: return "dispatched" ;
+  case MqttTrace::broker_publish: return "broker_publish" ;
+  case MqttTrace::broker_ack: return "broker_ack" ;
+  case MqttTrace::acknowledged: return "acknowledged" ;
+  default:
+    return "unknown" ;
+  }
+}
+
+void MqttTraceLog::dispatched(const MqttTrace &trace)
+{
+  if (!trace.m_stamp[MqttTrace::received] || !trace.m_stamp[MqttTrace::dispatched]) return ;
+  m_stage_us[MqttTrace::dispatched].record(trace.m_stamp[MqttTrace::dispatched] -
+					   trace.m_stamp[MqttTrace::received]) ;
+}
+
+void MqttTraceLog::complete(MqttTrace &trace)
+{
+  if (!trace.is_set()) return ;
+
+  // Receive to dispatch is recorded by dispatched()
+  uint32_t last = trace.m_stamp[MqttTrace::dispatched] ;
+  for (uint8_t s=MqttTrace::broker_publish; s < MqttTrace::stages; s++){
+    if (!trace.m_stamp[s] || !last) continue ;
+    m_stage_us[s].record(trace.m_stamp[s] - last) ;
+    last = trace.m_stamp[s] ;
+  }
+  if (last) m_total_us.record(last - trace.m_stamp[MqttTrace::received]) ;
+
+  pthread_mutex_lock(&m_lock) ;
+  m_records[m_head] = trace ;
+  m_head = (m_head + 1) % MQTT_TRACE_RECORDS ;
+  if (m_count < MQTT_TRACE_RECORDS) m_count++ ;
+  pthread_mutex_unlock(&m_lock) ;
+
+  trace.clear() ;
+}
+
+static void write_le(FILE *f, uint32_t v, uint8_t bytes)
+{
+  for (uint8_t i=0; i < bytes; i++) fputc((v >> (i*8)) & 0xFF, f) ;
+}
+
+bool MqttTraceLog::dump(const char *szpath)
+{
+  FILE *f = fopen(szpath, "wb") ;
+  if (!f){
+    EPRINT("TRACE: Cannot open %s for writing\n", szpath) ;
+    return false ;
+  }
+
+  pthread_mutex_lock(&m_lock) ;
+  fwrite("MQTR", 4, 1, f) ;
+  fputc(1, f) ; // version
+  fputc(MqttTrace::stages, f) ;
+  write_le(f, m_count, 2) ;
+  // Oldest first
+  uint16_t index = (m_head + MQTT_TRACE_RECORDS - m_count) % MQTT_TRACE_RECORDS ;
+  for (uint16_t i=0; i < m_count; i++){
+    MqttTrace *t = &m_records[index] ;
+    for (uint8_t s=0; s < MqttTrace::stages; s++) write_le(f, t->m_stamp[s], 4) ;
+    write_le(f, t->m_messageid, 2) ;
+    fputc(t->m_type, f) ;
+    index = (index + 1) % MQTT_TRACE_RECORDS ;
+  }
+  pthread_mutex_unlock(&m_lock) ;
+
+  bool ret = ferror(f) == 0 ;
+  if (fclose(f) != 0) ret = false ;
+  if (!ret) EPRINT("TRACE: Failed writing %s\n", szpath) ;
+  return ret ;
+}
+
+void MqttTraceLog::snapshot(MQTTMETRICCALLBACK((*fn)), void *context)
+{
+  char szname[64] ;
+  char szvalue[16] ;
+  for (uint8_t s=MqttTrace::dispatched; s < MqttTrace::stages; s++){
+    if (m_stage_us[s].count() == 0) continue ;
+    snprintf(szname, sizeof(szname), "trace/%s/p50", stage_name(s)) ;
+    snprintf(szvalue, sizeof(szvalue), "%u", m_stage_us[s].percentile(50)) ;
+    (*fn)(context, szname, szvalue) ;
+    snprintf(szname, sizeof(szname), "trace/%s/p99", stage_name(s)) ;
+    snprintf(szvalue, sizeof(szvalue), "%u", m_stage_us[s].percentile(99)) ;
+    (*fn)(context, szname, szvalue) ;
+  }
+  if (m_total_us.count() > 0){
+    snprintf(szvalue, sizeof(szvalue), "%u", m_total_us.percentile(50)) ;
+    (*fn)(context, "trace/total/p50", szvalue) ;
+    snprintf(szvalue, sizeof(szvalue), "%u", m_total_us.percentile(99)) ;
+    (*fn)(context, "trace/total/p99", szvalue) ;
+  }
+}
+
+#endif
@@ -0,0 +1,116 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef __MQTT_TRACE
+#define __MQTT_TRACE
+
+#include "mqttmetrics.hpp"
+
+// Per-message latency tracing. Build with MQTT_TRACE defined to enable.
+// Requires metrics. Wrap trace calls in MQTT_TRACE_POINT
+#if defined(MQTT_TRACE) && defined(MQTT_METRICS_ENABLED)
+#define MQTT_TRACE_ENABLED
+#endif
+
+#ifdef MQTT_TRACE_ENABLED
+#define MQTT_TRACE_POINT(x) x
+#else
+#define MQTT_TRACE_POINT(x)
+#endif
+
+#ifdef MQTT_TRACE_ENABLED
+#include <pthread.h>
+
+// Completed traces kept for dumping
+#ifndef MQTT_TRACE_RECORDS
+#define MQTT_TRACE_RECORDS 256
+#endif
+
+// Timestamps of a message passing through the gateway. Unreached
+// stages are zero
+class MqttTrace{
+public:
+  enum Stage{
+    received,       // queued by the driver callback
+    dispatched,     // handler called from dispatch_queue
+    broker_publish, // sent to the broker
+    broker_ack,     // broker acknowledged the publish
+    acknowledged,   // PUBACK or PUBREC sent to the client
+    stages
+  };
+  MqttTrace(){clear();}
+  void clear(){
+    m_type = 0 ;
+    m_messageid = 0 ;
+    for (uint8_t i=0; i < stages; i++) m_stamp[i] = 0 ;
+  }
+  void start(uint8_t type, uint32_t received_us){
+    clear() ;
+    m_type = type ;
+    m_stamp[received] = received_us ;
+  }
+  void stamp(Stage s){m_stamp[s] = mqtt_metrics_now_us();}
+  void set_message_id(uint16_t messageid){m_messageid = messageid;}
+  uint32_t get_stamp(Stage s) const {return m_stamp[s];}
+  bool is_set() const {return m_stamp[received] != 0;}
+
+protected:
+  friend class MqttTraceLog ;
+  uint32_t m_stamp[stages] ;
+  uint16_t m_messageid ;
+  uint8_t m_type ;
+};
+
+// Aggregates completed traces into a latency histogram for each stage
+// and keeps the most recent traces for offline analysis
+class MqttTraceLog{
+public:
+  MqttTraceLog() ;
+  ~MqttTraceLog() ;
+
+  // Record a completed trace and clear it
+  void complete(MqttTrace &trace) ;
+  // Record the wait between receiving and dispatching a packet.
+  // Recorded for all packets, not only completed traces
+  void dispatched(const MqttTrace &trace) ;
+
+  // Binary dump of the recent traces. Header of 4 byte magic "MQTR",
+  // 1 byte version, 1 byte stage count and 2 byte record count, then
+  // records of a 4 byte timestamp per stage, 2 byte message id and
+  // 1 byte message type. Values are little endian.
+  // Returns false if the file cannot be written
+  bool dump(const char *szpath) ;
+
+  // Stage latency percentiles by name, as MqttMetrics::snapshot
+  void snapshot(MQTTMETRICCALLBACK((*fn)), void *context) ;
+
+protected:
+  static const char *stage_name(uint8_t stage) ;
+  
+  // Latency into each stage from the previous reached stage
+  MqttHistogram m_stage_us[MqttTrace::stages] ;
+  MqttHistogram m_total_us ;
+  MqttTrace m_records[MQTT_TRACE_RECORDS] ;
+  uint16_t m_head ;
+  uint16_t m_count ;
+  pthread_mutex_t m_lock ;
+};
+
+#endif
+
+#endif
@@ -16,6 +16,7 @@
 // along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "servermqtt.hpp"
+#include "mqttpacket.hpp"
 #include "radioutil.hpp"
 #include <string.h>
 #include <stdio.h>
@@ -35,17 +36,29 @@ ServerMqttSn::ServerMqttSn()
   m_connection_head = NULL ;
 
   m_last_advertised = 0 ;
+  m_gwinfo_pending = false ;
+  m_gwinfo_sent = false ;
+  m_gwinfo_sent_ms = 0 ;
   m_advertise_interval = 1500 ;
-  m_pmosquitto = NULL ;
+  m_broker = NULL ;
 
-  m_mosquitto_initialised = false ;
+  m_broker_initialised = false ;
   m_broker_connected = false ;
+  m_broker_backlog = 0 ;
+  m_retained_pruned = 0 ;
+  m_local_delivery = false ;
+  m_default_broker_qos = 1 ;
+  m_metrics_interval = 0 ;
+  m_last_metrics = 0 ;
+  m_spool_rate = MQTT_SPOOL_DRAIN_RATE ;
+  m_spool_drain_time = 0 ;
+  m_spool_drained = 0 ;
 }
 
 ServerMqttSn::~ServerMqttSn()
 {
-  if (m_mosquitto_initialised){
-    mosquitto_lib_cleanup() ;
+  if (m_broker_initialised){
+    m_broker->shutdown() ;
   }
   pthread_mutex_destroy(&m_mosquittolock) ;
 }
@@ -55,17 +68,24 @@ void ServerMqttSn::set_advertise_interval(uint16_t t)
   m_advertise_interval = t ;
 }
 
-void ServerMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint8_t len)
+bool ServerMqttSn::set_spool_file(const char *szpath)
 {
-  if (len < 6) return ; // not long enough to be a publish
-  uint16_t topicid = (data[1] << 8) | data[2] ; // Assuming MSB is first
-  uint16_t messageid = (data[3] << 8) | data[4] ; // Assuming MSB is first
-  uint8_t qos = data[0] & FLAG_QOSN1 ;
-  uint8_t topic_type = data[0] & (FLAG_DEFINED_TOPIC_ID | FLAG_SHORT_TOPIC_NAME);
-  uint8_t payload[PACKET_DRIVER_MAX_PAYLOAD] ;
-  int payload_len = len-5 ;
+  pthread_mutex_lock(&m_mosquittolock) ;
+  bool ret = m_spool.set_file(szpath) ;
+  pthread_mutex_unlock(&m_mosquittolock) ;
+  return ret ;
+}
+
+void ServerMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
+{
+  MqttPublishView pub(data, len) ;
+  // Gateway requires at least one byte of payload
+  if (!pub.valid() || pub.payload_len() == 0) return ; // not long enough to be a publish
+  uint16_t topicid = pub.topic_id() ;
+  uint16_t messageid = pub.message_id() ;
+  uint8_t qos = pub.qos() ;
+  uint8_t topic_type = pub.topic_type() ;
   int ret = 0;
-  memcpy(payload, data+5, payload_len) ;
 
   uint8_t buff[5] ; // Response buffer
   buff[0] = data[1] ; // replicate topic id 
@@ -76,10 +96,10 @@ void ServerMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint
   int mid = 0 ;
   
   DPRINT("PUBLISH: {Flags = %X, QoS = %d, Topic ID = %u, Mess ID = %u}\n",
-	 data[0], qos, topicid, messageid) ;
+	 pub.flags(), qos, topicid, messageid) ;
 
-  if (!m_mosquitto_initialised){
-    EPRINT("PUBLISH: Gateway is not connected to the Mosquitto server to process Publish\n") ;
+  if (!m_broker_initialised){
+    EPRINT("PUBLISH: Gateway is not connected to the broker to process Publish\n") ;
     buff[4] = MQTT_RETURN_CONGESTION;
     if(addrwritemqtt(sender_address, MQTT_PUBACK, buff, 5)){
       DPRINT("PUBLISH: Sending MQTT_PUBACK to client for message ID = %u\n",
@@ -108,18 +128,13 @@ void ServerMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint
       return ;
     }
     // Just publish and forget for QoS -1
+    char szshort[3] ;
+    const char *ptopic = NULL ;
     if (topic_type == FLAG_SHORT_TOPIC_NAME){
-      char szshort[3] ;
       szshort[0] = (char)(buff[0]);
       szshort[1] = (char)(buff[1]) ;
       szshort[2] = '\0';
-      // Publish with QoS 1 to server
-      ret = mosquitto_publish(m_pmosquitto,
-			      &mid,
-			      szshort,
-			      payload_len,
-			      payload, 1,
-			      data[0] & FLAG_RETAIN) ;
+      ptopic = szshort ;
     }else if(topic_type == FLAG_DEFINED_TOPIC_ID){
       MqttTopic *t = m_predefined_topics.get_topic(topicid);
       if (!t){
@@ -134,16 +149,30 @@ void ServerMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint
 	}
 	return ;
       }
-      // Publish with QoS 1 to server
-      ret = mosquitto_publish(m_pmosquitto,
-			      &mid,
-			      t->get_topic(),
-			      payload_len,
-			      payload, 1,
-			      data[0] & FLAG_RETAIN) ;	
+      ptopic = t->get_topic() ;
+    }
+    if (!ptopic) return ;
+    pthread_mutex_lock(&m_mosquittolock) ;
+    int upstream_qos = broker_qos(ptopic, qos) ;
+    if (!m_broker_connected){
+      // Hold until the broker returns
+      if (!m_spool.push(ptopic, pub.payload(), pub.payload_len(), upstream_qos, pub.retain()))
+	ret = BROKER_ERR_NOMEM ;
+    }else{
+      ret = m_broker->publish(&mid,
+			      ptopic,
+			      pub.payload_len(),
+			      pub.payload(), upstream_qos,
+			      pub.retain()) ;
+    }
+    pthread_mutex_unlock(&m_mosquittolock) ;
+    if (ret != BROKER_ERR_SUCCESS)
+      EPRINT("PUBLISH: Broker QoS -1 publish failed with code %d\n", ret) ;
+    else if (pub.retain()){
+      pthread_mutex_lock(&m_mosquittolock) ;
+      cache_retained(ptopic, pub.payload(), pub.payload_len()) ;
+      pthread_mutex_unlock(&m_mosquittolock) ;
     }
-    if (ret != MOSQ_ERR_SUCCESS)
-      EPRINT("PUBLISH: Mosquitto QoS -1 publish failed with code %d\n", ret) ;
     return ;    
   }
 
@@ -156,8 +185,9 @@ void ServerMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint
     pthread_mutex_unlock(&m_mosquittolock) ;
     return;
   }
+  con->update_activity() ;
   
-  if (!server_publish(con, messageid, topicid, topic_type, payload, payload_len, qos, data[0] & FLAG_RETAIN)){
+  if (!server_publish(con, messageid, topicid, topic_type, pub.payload(), pub.payload_len(), qos, pub.retain())){
     EPRINT("PUBLISH: server_publish failed\n") ;
   }
   
@@ -165,7 +195,7 @@ void ServerMqttSn::received_publish(uint8_t *sender_address, uint8_t *data, uint
 }
 
 bool ServerMqttSn::server_publish(MqttConnection *con, uint16_t messageid, uint16_t topicid,
-				  uint8_t topic_type, uint8_t *payload, uint8_t len,
+				  uint8_t topic_type, const uint8_t *payload, mqtt_len_t len,
 				  uint8_t qos, bool retain)
 {
   int mid = 0, ret = 0 ;
@@ -235,9 +265,20 @@ bool ServerMqttSn::server_publish(MqttConnection *con, uint16_t messageid, uint1
     return false ;
   }
 
-  MqttMessage *m = con->messages.add_message(MqttMessage::Activity::publishing);
-  if (!m){ // cannot allocate a message, server is out of space
-    EPRINT("PUBLISH: Cannot create new message, returning congestion error\n") ;
+  int upstream_qos = broker_qos(ptopic, qos) ;
+  MqttMessage *m = NULL ;
+  // A message is only needed to wait for the broker to acknowledge
+  // or to complete a QoS 2 exchange with the client
+  if (upstream_qos > 0 || qos == FLAG_QOS2){
+    if (congested(con)){
+      EPRINT("PUBLISH: Client %s or broker backlog is too long, returning congestion error\n",
+	     con->get_client_id()) ;
+    }else if (!(m = con->messages.add_message(MqttMessage::Activity::publishing))){
+      // cannot allocate a message, server is out of space
+      EPRINT("PUBLISH: Cannot create new message, returning congestion error\n") ;
+    }
+  }
+  if (!m && (upstream_qos > 0 || qos == FLAG_QOS2)){
     buff[4] = MQTT_RETURN_CONGESTION ;
     if (writemqtt(con, MQTT_PUBACK, buff, 5)){
       DPRINT("PUBLISH: Sending MQTT_PUBACK to client %s for message ID = %u\n",
@@ -250,17 +291,56 @@ bool ServerMqttSn::server_publish(MqttConnection *con, uint16_t messageid, uint1
     return false ;
   }
 
+  if (!m_broker_connected){
+    // Broker is unavailable. Accept the publish into the spool
+    // and acknowledge the client now
+    if (!m_spool.push(ptopic, payload, len, upstream_qos, retain, m_local_delivery)){
+      if (m) m->set_inactive() ;
+      EPRINT("PUBLISH: Spool cannot hold topic %s, returning congestion error\n", ptopic) ;
+      buff[4] = MQTT_RETURN_CONGESTION ;
+      if (writemqtt(con, MQTT_PUBACK, buff, 5)){
+	DPRINT("PUBLISH: Sending MQTT_PUBACK to client %s for message ID = %u\n",
+	       con->get_client_id(), messageid) ;
+      }else{
+	EPRINT("PUBLISH: Failed to send MQTT_PUBACK to client %s for message ID = %u\n",
+	       con->get_client_id(), messageid) ;
+      }
+      pthread_mutex_unlock(&m_mosquittolock) ;
+      return false ;
+    }
+    DPRINT("PUBLISH: Spooled topic %s, %u publishes waiting for the broker\n", ptopic, m_spool.count()) ;
+    if (retain) cache_retained(ptopic, payload, len) ;
+    if (m_local_delivery) route_message(ptopic, payload, len, false) ;
+    MQTT_TRACE_POINT(m_trace_current.set_message_id(messageid)) ;
+    if (m){
+      m->set_qos(qos) ;
+      m->set_topic_id(topicid) ;
+      m->set_message_id(messageid, true) ;
+      m->set_topic_type(topic_type) ;
+      MQTT_TRACE_POINT(m->get_trace() = m_trace_current) ;
+      complete_publish(con, m) ;
+    }else{
+      if (qos == FLAG_QOS1) send_puback(con, topicid, messageid, MQTT_RETURN_ACCEPTED) ;
+      MQTT_TRACE_POINT(m_trace_current.stamp(MqttTrace::acknowledged)) ;
+      MQTT_TRACE_POINT(m_trace_log.complete(m_trace_current)) ;
+    }
+    pthread_mutex_unlock(&m_mosquittolock) ;
+    return true ;
+  }
+
+  MQTT_METRIC(uint32_t sent_us = mqtt_metrics_now_us()) ;
+  MQTT_TRACE_POINT(m_trace_current.set_message_id(messageid)) ;
+  MQTT_TRACE_POINT(m_trace_current.stamp(MqttTrace::broker_publish)) ;
   // Lock the publish and recording of MID 
-  ret = mosquitto_publish(m_pmosquitto,
-			  &mid,
+  ret = m_broker->publish(&mid,
 			  ptopic,
 			  len,
 			  payload,
-			  1,
+			  upstream_qos,
 			  retain) ;
-  if (ret != MOSQ_ERR_SUCCESS){
-    m->set_inactive() ;
-    EPRINT("PUBLISH: Mosquitto failed %d, params - Topic: %s, len %u, retain %s\n", ret, ptopic, len, retain?"yes":"no");
+  if (ret != BROKER_ERR_SUCCESS){
+    if (m) m->set_inactive() ;
+    EPRINT("PUBLISH: Broker failed %d, params - Topic: %s, len %u, retain %s\n", ret, ptopic, len, retain?"yes":"no");
     buff[4] = MQTT_RETURN_CONGESTION ;
     if (writemqtt(con, MQTT_PUBACK, buff, 5)){
       DPRINT("PUBLISH: Sending MQTT_PUBACK to client %s for message ID = %u\n",
@@ -272,20 +352,37 @@ bool ServerMqttSn::server_publish(MqttConnection *con, uint16_t messageid, uint1
     pthread_mutex_unlock(&m_mosquittolock) ;
     return false ;
   }
-  m->set_mosquitto_mid(mid) ;
-  m->set_qos(qos) ;
-  m->set_topic_id(topicid) ;
-  m->set_message_id(messageid, true) ;
-  m->set_topic_type(topic_type) ;
+  if (m){
+    m_broker_backlog++ ;
+    m->set_mosquitto_mid(mid) ;
+    MQTT_METRIC(m->set_broker_sent_us(sent_us)) ;
+    m->set_qos(qos) ;
+    m->set_topic_id(topicid) ;
+    m->set_message_id(messageid, true) ;
+    m->set_topic_type(topic_type) ;
+    MQTT_TRACE_POINT(m->get_trace() = m_trace_current) ;
+  }else{
+    // Nothing to wait for from the broker
+    if (qos == FLAG_QOS1) send_puback(con, topicid, messageid, MQTT_RETURN_ACCEPTED) ;
+    MQTT_TRACE_POINT(m_trace_current.stamp(MqttTrace::acknowledged)) ;
+    MQTT_TRACE_POINT(m_trace_log.complete(m_trace_current)) ;
+  }
+  if (retain) cache_retained(ptopic, payload, len) ;
+  // Skip the broker round trip for clients on this gateway
+  if (m_local_delivery && route_message(ptopic, payload, len, false) > 0){
+    DPRINT("PUBLISH: Delivered topic %s to local subscribers\n", ptopic) ;
+    m_local_echo.add(ptopic, payload, len) ;
+  }
   pthread_mutex_unlock(&m_mosquittolock) ;
   
   return true ;
 }
 
-void ServerMqttSn::received_pubrel(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_pubrel(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len != 2) return ; // Invalid PUBREL message length
-  uint16_t messageid = (data[0] << 8) | data[1] ; // Assuming MSB is first
+  MqttMessageIdView pubrel(data, len) ;
+  if (!pubrel.valid()) return ; // Invalid PUBREL message length
+  uint16_t messageid = pubrel.message_id() ;
   DPRINT("PUBREL {messageid = %u}\n", messageid) ;
 
   pthread_mutex_lock(&m_mosquittolock) ;
@@ -316,11 +413,13 @@ void ServerMqttSn::received_pubrel(uint8_t *sender_address, uint8_t *data, uint8
   pthread_mutex_unlock(&m_mosquittolock) ;  
 }
 
-void ServerMqttSn::received_puback(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_puback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  uint16_t topicid = (data[0] << 8) | data[1] ;
-  uint16_t messageid = (data[2] << 8) | data[3] ;
-  uint8_t returncode = data[4] ;
+  MqttAckView puback(data, len) ;
+  if (!puback.valid()) return ;
+  uint16_t topicid = puback.topic_id() ;
+  uint16_t messageid = puback.message_id() ;
+  uint8_t returncode = puback.return_code() ;
 
   DPRINT("PUBACK: {topicid = %u, messageid = %u, returncode = %u}\n", topicid, messageid, returncode) ;
 
@@ -356,9 +455,10 @@ void ServerMqttSn::received_puback(uint8_t *sender_address, uint8_t *data, uint8
   pthread_mutex_unlock(&m_mosquittolock) ;
 }
 
-void ServerMqttSn::received_pubrec(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_pubrec(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len != 2) return ; // wrong length
+  MqttMessageIdView pubrec(data, len) ;
+  if (!pubrec.valid()) return ; // wrong length
 
   pthread_mutex_lock(&m_mosquittolock) ;
   MqttConnection *con = search_connection_address(sender_address);
@@ -369,7 +469,7 @@ void ServerMqttSn::received_pubrec(uint8_t *sender_address, uint8_t *data, uint8
     return ;
   }
   
-  uint16_t messageid = (data[0] << 8) | data[1] ; // Assuming MSB is first
+  uint16_t messageid = pubrec.message_id() ;
 
   con->update_activity() ;
   MqttMessage *m = con->messages.get_message(messageid) ;
@@ -388,9 +488,10 @@ void ServerMqttSn::received_pubrec(uint8_t *sender_address, uint8_t *data, uint8
   pthread_mutex_unlock(&m_mosquittolock) ;
 }
 
-void ServerMqttSn::received_pubcomp(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_pubcomp(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len != 2) return ; // wrong length
+  MqttMessageIdView pubcomp(data, len) ;
+  if (!pubcomp.valid()) return ; // wrong length
 
   pthread_mutex_lock(&m_mosquittolock) ;
   MqttConnection *con = search_connection_address(sender_address);
@@ -400,7 +501,7 @@ void ServerMqttSn::received_pubcomp(uint8_t *sender_address, uint8_t *data, uint
     pthread_mutex_unlock(&m_mosquittolock) ;
     return ;
   }
-  uint16_t messageid = (data[0] << 8) | data[1] ; // Assuming MSB is first
+  uint16_t messageid = pubcomp.message_id() ;
   con->update_activity() ;
   MqttMessage *m = con->messages.get_message(messageid) ;
   if (!m){
@@ -416,12 +517,13 @@ void ServerMqttSn::received_pubcomp(uint8_t *sender_address, uint8_t *data, uint
   pthread_mutex_unlock(&m_mosquittolock) ;
 }
 
-void ServerMqttSn::received_subscribe(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_subscribe(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len < 3) return ;
-  uint16_t messageid = (data[1] << 8) | data[2] ; // Assuming MSB is first
-  uint8_t qos = data[0] & FLAG_QOSN1 ;
-  uint8_t topic_type = data[0] & (FLAG_DEFINED_TOPIC_ID | FLAG_SHORT_TOPIC_NAME);
+  MqttSubscribeView sub(data, len) ;
+  if (!sub.valid()) return ;
+  uint16_t messageid = sub.message_id() ;
+  uint8_t qos = sub.qos() ;
+  uint8_t topic_type = sub.topic_type() ;
   uint8_t buff[PACKET_DRIVER_MAX_PAYLOAD] ;
   char sztopic[PACKET_DRIVER_MAX_PAYLOAD - MQTT_SUBSCRIBE_HDR_LEN + 1];
   int mid = 0, ret = 0;
@@ -444,8 +546,8 @@ void ServerMqttSn::received_subscribe(uint8_t *sender_address, uint8_t *data, ui
   }
   con->update_activity() ;
 
-  if (!m_mosquitto_initialised){
-    EPRINT("SUBSCRIBE: Gateway is not connected to the Mosquitto server to process Subscribe\n") ;
+  if (!m_broker_initialised){
+    EPRINT("SUBSCRIBE: Gateway is not connected to the broker to process Subscribe\n") ;
     buff[5] = MQTT_RETURN_CONGESTION;
     if (writemqtt(con, MQTT_SUBACK, buff, 5)){
       DPRINT("SUBSCRIBE: Sending MQTT_SUBACK to client %s for message ID %u\n",
@@ -462,8 +564,8 @@ void ServerMqttSn::received_subscribe(uint8_t *sender_address, uint8_t *data, ui
   case FLAG_NORMAL_TOPIC_ID:
   case FLAG_SHORT_TOPIC_NAME:
     // Topic is contained in remaining bytes of data
-    memcpy(sztopic, data+3, len - 3);
-    sztopic[len-3] = '\0' ;
+    memcpy(sztopic, sub.topic(), sub.topic_len());
+    sztopic[sub.topic_len()] = '\0' ;
     // Add topic if new, otherwise returns existing topic
     if (!(t=con->topics.get_topic(sztopic))){
       t = con->topics.add_topic(sztopic, messageid) ;
@@ -477,7 +579,7 @@ void ServerMqttSn::received_subscribe(uint8_t *sender_address, uint8_t *data, ui
 
     break;
   case FLAG_DEFINED_TOPIC_ID:
-    topicid = (data[3] << 8) | data[4] ;
+    topicid = sub.topic_id() ;
     t = m_predefined_topics.get_topic(topicid) ;
     if (!t){
       EPRINT("SUBSCRIBE: Topic %u unknown for predefined client subscription\n", topicid) ;
@@ -522,30 +624,47 @@ void ServerMqttSn::received_subscribe(uint8_t *sender_address, uint8_t *data, ui
       EPRINT("SUBSCRIBE: Failed to send MQTT_SUBACK to client %s for message ID %u\n",
 	     con->get_client_id(), messageid) ;
     }
+    // Broker will not replay retained values for an existing subscription
+    publish_retained(con, t, topic_type, false) ;
+    pthread_mutex_unlock(&m_mosquittolock) ;
+    return ;
+  }
+
+  if (congested(con)){
+    EPRINT("SUBSCRIBE: Client %s or broker backlog is too long, returning congestion error\n",
+	   con->get_client_id()) ;
+    buff[5] = MQTT_RETURN_CONGESTION;
+    if (writemqtt(con, MQTT_SUBACK, buff, 6)){
+      DPRINT("SUBSCRIBE: Sending MQTT_SUBACK to client %s for message ID %u\n",
+	     con->get_client_id(), messageid) ;
+    }else{
+      EPRINT("SUBSCRIBE: Failed to send MQTT_SUBACK to client %s for message ID %u\n",
+	     con->get_client_id(), messageid) ;
+    }
     pthread_mutex_unlock(&m_mosquittolock) ;
     return ;
   }
 
   t->set_qos(qos) ;
   t->set_subscribed(true) ;
+  // Retained values the broker replays for this subscription are
+  // passed on to this client only
+  t->await_retained(TIMENOW + m_Tretry * m_Nretry) ;
   
-  // Subscribe using QoS 1 to server.
-  // TO DO - may need a config setting for all mosquitto calls 
-  ret = mosquitto_subscribe(m_pmosquitto,
-			    &mid,
+  ret = m_broker->subscribe(&mid,
 			    t->get_topic(),
-			    1);
-  // SUBACK handled through mosquitto call-back
-  if (ret != MOSQ_ERR_SUCCESS){
-    EPRINT("SUBSCRIBE: Mosquitto subscribe failed with code %d\n",ret);
+			    broker_qos(t->get_topic(), qos));
+  // SUBACK handled through broker call-back
+  if (ret != BROKER_ERR_SUCCESS){
+    EPRINT("SUBSCRIBE: Broker subscribe failed with code %d\n",ret);
     t->set_subscribed(false) ; // remove subscription due to error
-    if (ret == MOSQ_ERR_INVAL){
+    if (ret == BROKER_ERR_INVAL){
       buff[5] = MQTT_RETURN_INVALID_TOPIC;
     }else{
       buff[5] = MQTT_RETURN_CONGESTION;
     }
 #ifdef DEBUG
-    DPRINT("SUBSCRIBE: Error from mosquitto. Sending following SUBACK: [") ;
+    DPRINT("SUBSCRIBE: Error from broker. Sending following SUBACK: [") ;
     for (int di=0; di < 6; di++)
       DPRINT("%02X ", buff[di]);
     DPRINT("]\n") ;
@@ -557,6 +676,22 @@ void ServerMqttSn::received_subscribe(uint8_t *sender_address, uint8_t *data, ui
       EPRINT("SUBSCRIBE: Failed to send MQTT_SUBACK to client %s for message ID %u\n",
 	     con->get_client_id(), messageid) ;
     }
+  }else if (filter_subscribed(t->get_topic(), t)){
+    // Another client holds the same broker subscription. Accept now and
+    // send cached retained values without waiting on the broker. Its
+    // replay still brings any values that are not cached
+    topicid = t->get_id();
+    buff[1] = topicid >> 8 ;
+    buff[2] = topicid & 0x00FF ;
+    buff[5] = MQTT_RETURN_ACCEPTED;
+    if (writemqtt(con, MQTT_SUBACK, buff, 6)){
+      DPRINT("SUBSCRIBE: Sending MQTT_SUBACK to client %s for message ID %u\n",
+	     con->get_client_id(), messageid) ;
+    }else{
+      EPRINT("SUBSCRIBE: Failed to send MQTT_SUBACK to client %s for message ID %u\n",
+	     con->get_client_id(), messageid) ;
+    }
+    publish_retained(con, t, topic_type, true) ;
   }else{
     // Don't set a topic ID if topic is a wildcard
     //    con->set_sub_entities(t->is_wildcard()?0:t->get_id(), messageid, qos) ;
@@ -576,38 +711,101 @@ void ServerMqttSn::received_subscribe(uint8_t *sender_address, uint8_t *data, ui
       m->set_message_id(messageid,true) ;
       m->set_qos(qos) ;
       m->set_mosquitto_mid(mid) ;
+      m_broker_backlog++ ;
       m->one_shot(true);
+      // Queued behind the SUBACK. Values covered by other
+      // subscriptions are not replayed again by the broker
+      publish_retained(con, t, topic_type, true) ;
     }
   }
   pthread_mutex_unlock(&m_mosquittolock) ;
   return ;
 }
 
-void ServerMqttSn::received_suback(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::publish_retained(MqttConnection *con, MqttTopic *t, uint8_t topic_type, bool is_new)
+{
+  for (MqttRetained *r = m_retained.first_match(t); r; r = m_retained.next_match(t)){
+    if (is_new && !subscription_covers(r->get_topic(), t)){
+      // Nothing kept the value current. Leave it to the broker replay
+      DPRINT("SUBSCRIBE: Dropping uncovered retained topic %s\n", r->get_topic()) ;
+      r->reset() ;
+      continue ;
+    }
+    DPRINT("SUBSCRIBE: Queuing retained topic %s to client %s\n", r->get_topic(), con->get_client_id()) ;
+    do_publish_topic(con, t, r->get_topic(), topic_type,
+		     r->get_payload(), r->get_payload_len(), true) ;
+  }
+}
+
+void ServerMqttSn::cache_retained(const char *sztopic, const uint8_t *payload, mqtt_len_t len)
+{
+  if (m_broker_connected && subscription_covers(sztopic))
+    m_retained.store(sztopic, payload, len) ;
+  else
+    m_retained.remove(sztopic) ;
+}
+
+bool ServerMqttSn::filter_subscribed(const char *szfilter, MqttTopic *except)
+{
+  for (MqttConnection *p = m_connection_head; p != NULL; p=p->next){
+    if (!p->is_connected() && !p->is_sleeping()) continue ;
+    MqttTopic *t = p->topics.get_topic(szfilter) ;
+    if (t && t != except && t->is_subscribed()) return true ;
+  }
+  return false ;
+}
+
+bool ServerMqttSn::subscription_covers(const char *sztopic, MqttTopic *except)
+{
+  MqttTopic *t = NULL ;
+  for (MqttConnection *p = m_connection_head; p != NULL; p=p->next){
+    if (!p->is_connected() && !p->is_sleeping()) continue ;
+    p->topics.iterate_first_topic() ;
+    for (t = p->topics.get_curr_topic(); t; t = p->topics.get_next_topic())
+      if (t != except && t->is_subscribed() && t->match(sztopic)) return true ;
+  }
+  m_predefined_topics.iterate_first_topic() ;
+  for (t = m_predefined_topics.get_curr_topic(); t; t = m_predefined_topics.get_next_topic())
+    if (t != except && t->is_subscribed() && t->match(sztopic)) return true ;
+  return false ;
+}
+
+void ServerMqttSn::prune_retained()
+{
+  for (MqttRetained *r = m_retained.first(); r; r = m_retained.next()){
+    if (!subscription_covers(r->get_topic())){
+      DPRINT("RETAINED: No subscription covers topic %s\n", r->get_topic()) ;
+      r->reset() ;
+    }
+  }
+}
+
+void ServerMqttSn::received_suback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
 
 }
 
-void ServerMqttSn::received_unsubscribe(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_unsubscribe(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
 
 }
 
-void ServerMqttSn::received_unsuback(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_unsuback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
 
 }
 
 
-void ServerMqttSn::received_register(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_register(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len < 4) return ;
-  uint16_t topicid = (data[0] << 8) | data[1] ; // Assuming MSB is first
-  uint16_t messageid = (data[2] << 8) | data[3] ; // Assuming MSB is first
+  MqttRegisterView reg(data, len) ;
+  if (!reg.valid()) return ;
+  uint16_t topicid = reg.topic_id() ;
+  uint16_t messageid = reg.message_id() ;
   char sztopic[PACKET_DRIVER_MAX_PAYLOAD - MQTT_REGISTER_HDR_LEN +1] ;
-  if (len - 4 > PACKET_DRIVER_MAX_PAYLOAD - MQTT_REGISTER_HDR_LEN) return ; // overflow
-  memcpy(sztopic, data+4, len-4) ;
-  sztopic[len-4] = '\0';
+  if (reg.topic_len() > PACKET_DRIVER_MAX_PAYLOAD - MQTT_REGISTER_HDR_LEN) return ; // overflow
+  memcpy(sztopic, reg.topic(), reg.topic_len()) ;
+  sztopic[reg.topic_len()] = '\0';
 
   DPRINT("REGISTER: {topicid: %u, messageid: %u, topic %s}\n", topicid, messageid, sztopic) ;
   pthread_mutex_lock(&m_mosquittolock) ;
@@ -638,13 +836,14 @@ void ServerMqttSn::received_register(uint8_t *sender_address, uint8_t *data, uin
   pthread_mutex_unlock(&m_mosquittolock) ;
 }
 
-void ServerMqttSn::received_regack(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_regack(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  if (len != 5) return ;
+  MqttAckView regack(data, len) ;
+  if (!regack.valid()) return ;
   
-  uint16_t topicid = (data[0] << 8) | data[1] ; // Assuming MSB is first
-  uint16_t messageid = (data[2] << 8) | data[3] ; // Assuming MSB is first
-  uint8_t returncode = data[4] ;
+  uint16_t topicid = regack.topic_id() ;
+  uint16_t messageid = regack.message_id() ;
+  uint8_t returncode = regack.return_code() ;
 
   DPRINT("REGACK: {topicid = %u, messageid = %u, returncode = %u}\n", topicid, messageid, returncode) ;
 
@@ -685,7 +884,7 @@ void ServerMqttSn::received_regack(uint8_t *sender_address, uint8_t *data, uint8
   pthread_mutex_unlock(&m_mosquittolock) ;
 }
 
-void ServerMqttSn::received_pingresp(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_pingresp(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
   pthread_mutex_lock(&m_mosquittolock) ;
   MqttConnection *con = search_connection_address(sender_address) ;
@@ -697,38 +896,36 @@ void ServerMqttSn::received_pingresp(uint8_t *sender_address, uint8_t *data, uin
   pthread_mutex_unlock(&m_mosquittolock) ;
 }
 
-void ServerMqttSn::received_pingreq(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_pingreq(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
   // Only respond to connected clients
   pthread_mutex_lock(&m_mosquittolock) ;
   MqttConnection *con = search_connection_address(sender_address) ;
   if (con){
     con->update_activity() ;
-    if (!writemqtt(con, MQTT_PINGRESP, NULL, 0)){
-      EPRINT("PINGREG: Failed to send ping response (IO if not ACKs enabled)\n") ;
+    if (con->is_asleep()){
+      // Sleeping client has woken to collect buffered messages. The
+      // ping response is sent once all messages are delivered
+      DPRINT("PINGREQ: Client %s is awake\n", con->get_client_id()) ;
+      con->set_state(MqttConnection::State::awake) ;
+    }else if (!con->is_awake()){
+      if (!writemqtt(con, MQTT_PINGRESP, NULL, 0)){
+	EPRINT("PINGREG: Failed to send ping response (IO if not ACKs enabled)\n") ;
+      }
     }
   }
   
   pthread_mutex_unlock(&m_mosquittolock) ; 
 }
 
-void ServerMqttSn::received_searchgw(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_searchgw(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
-  uint8_t buff[1] ;
-
   DPRINT("SEARCHGW: {radius = %u, broker connected %s}\n", data[0], m_broker_connected?"yes":"no") ;
 
   // Ignore radius value. This is a gw so respond with
-  // a broadcast message back.
-  if (m_broker_connected){
-    buff[0] = m_gwid ;
-    pthread_mutex_lock(&m_mosquittolock) ;
-    if (!addrwritemqtt(sender_address, MQTT_GWINFO, buff, 1)){
-      EPRINT("SEARCHGW: Failed to send GWINFO") ;
-    }
-    pthread_mutex_unlock(&m_mosquittolock) ;
-  }
-
+  // a broadcast message back. Searches are answered together
+  // by manage_connections
+  m_gwinfo_pending = true ;
 }
 
 MqttConnection* ServerMqttSn::search_connection(const char *szclientid)
@@ -824,17 +1021,18 @@ void ServerMqttSn::delete_connection(const char *szclientid)
   }
 }
 
-void ServerMqttSn::received_connect(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_connect(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
+  MqttConnectView connect(data, len) ;
   char szClientID[PACKET_DRIVER_MAX_PAYLOAD - MQTT_CONNECT_HDR_LEN +1] ;
-  if (len < 5 || len > (4 + (m_pDriver->get_payload_width() - MQTT_CONNECT_HDR_LEN))) return ; // invalid data length
+  if (!connect.valid() || connect.client_id_len() > m_pDriver->get_payload_width() - MQTT_CONNECT_HDR_LEN) return ; // invalid data length
   
-  memcpy(szClientID, data+4, len - 4) ; // copy identifier
-  szClientID[len-4] = '\0' ; // Create null terminated string
+  memcpy(szClientID, connect.client_id(), connect.client_id_len()) ; // copy identifier
+  szClientID[connect.client_id_len()] = '\0' ; // Create null terminated string
 
-  DPRINT("CONNECT: {flags = %02X, protocol = %02X, duration = %u, client ID = %s}\n", data[0], data[1], (data[2] << 8) | data[3], szClientID) ;
+  DPRINT("CONNECT: {flags = %02X, protocol = %02X, duration = %u, client ID = %s}\n", connect.flags(), connect.protocol(), connect.duration(), szClientID) ;
 
-  if (data[1] != MQTT_PROTOCOL){
+  if (connect.protocol() != MQTT_PROTOCOL){
     EPRINT("CONNECT: Invalid protocol ID in CONNECT from client %s\n", szClientID);
     return ;
   }
@@ -862,7 +1060,7 @@ void ServerMqttSn::received_connect(uint8_t *sender_address, uint8_t *data, uint
   con->asleep_from = 0 ;
   con->update_activity() ; // update activity from client
   con->set_client_id(szClientID) ;
-  con->duration = (data[2] << 8) | data[3] ; // MSB assumed
+  con->duration = connect.duration() ;
   con->set_address(sender_address, m_pDriver->get_address_len()) ;
   con->set_send_topics(false) ;
 
@@ -870,7 +1068,7 @@ void ServerMqttSn::received_connect(uint8_t *sender_address, uint8_t *data, uint
   con->messages.clear_queue() ;
 
   // If clean flag is set then remove all topics and will data
-  if (((FLAG_CLEANSESSION & data[0]) > 0)){
+  if (connect.clean()){
     con->topics.free_topics() ;
     con->set_will_topic(NULL, 0, false);
     con->set_will_message(NULL, 0) ;
@@ -880,7 +1078,7 @@ void ServerMqttSn::received_connect(uint8_t *sender_address, uint8_t *data, uint
   }
     
   // If WILL if flagged then set the flags for the message and topic
-  bool will = ((FLAG_WILL & data[0]) > 0) ;
+  bool will = connect.will() ;
 
   if (will){
     // Start with will topic request
@@ -924,9 +1122,11 @@ void ServerMqttSn::complete_client_connection(MqttConnection *p)
   }
 }
 
-void ServerMqttSn::received_willtopic(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_willtopic(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
+  MqttWillTopicView willtopic(data, len) ;
   char utf8[PACKET_DRIVER_MAX_PAYLOAD - MQTT_WILLTOPIC_HDR_LEN+1] ;
+  if (willtopic.topic_len() > PACKET_DRIVER_MAX_PAYLOAD - MQTT_WILLTOPIC_HDR_LEN) return ; // overflow
 
   pthread_mutex_lock(&m_mosquittolock) ;
   MqttConnection *con = search_connection_address(sender_address) ;
@@ -953,7 +1153,7 @@ void ServerMqttSn::received_willtopic(uint8_t *sender_address, uint8_t *data, ui
     return ;
   }
 
-  if (len == 0){
+  if (willtopic.empty()){
     // Client indicated a will but didn't send one
     // Complete connection and leave will unset
     con->set_will_topic(NULL,0,false);
@@ -969,13 +1169,13 @@ void ServerMqttSn::received_willtopic(uint8_t *sender_address, uint8_t *data, ui
     }
     m->set_inactive() ; // Complete message
   }else{
-    memcpy(utf8, data+1, len-1) ;
-    utf8[len-1] = '\0' ;
+    memcpy(utf8, willtopic.topic(), willtopic.topic_len()) ;
+    utf8[willtopic.topic_len()] = '\0' ;
     
     uint8_t qos = 0;
-    bool retain = (data[0] & FLAG_RETAIN) ;
-    if (data[0] & FLAG_QOS1) qos = 1;
-    else if (data[0] & FLAG_QOS2) qos =2 ;
+    bool retain = willtopic.retain() ;
+    if (willtopic.flags() & FLAG_QOS1) qos = 1;
+    else if (willtopic.flags() & FLAG_QOS2) qos =2 ;
     
     DPRINT("WILLTOPIC: {QOS = %u, Topic = %s, Retain = %s}\n", qos, utf8, retain?"Yes":"No") ;
 
@@ -990,7 +1190,7 @@ void ServerMqttSn::received_willtopic(uint8_t *sender_address, uint8_t *data, ui
   pthread_mutex_unlock(&m_mosquittolock) ;
 }
 
-void ServerMqttSn::received_willmsg(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_willmsg(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
   pthread_mutex_lock(&m_mosquittolock) ;
   MqttConnection *con = search_connection_address(sender_address) ;
@@ -1036,7 +1236,7 @@ void ServerMqttSn::received_willmsg(uint8_t *sender_address, uint8_t *data, uint
   pthread_mutex_unlock(&m_mosquittolock) ;
 }
 
-void ServerMqttSn::received_disconnect(uint8_t *sender_address, uint8_t *data, uint8_t len)
+void ServerMqttSn::received_disconnect(uint8_t *sender_address, uint8_t *data, mqtt_len_t len)
 {
   // Disconnect request from client
   pthread_mutex_lock(&m_mosquittolock) ;
@@ -1046,10 +1246,11 @@ void ServerMqttSn::received_disconnect(uint8_t *sender_address, uint8_t *data, u
     pthread_mutex_unlock(&m_mosquittolock) ;
     return ;
   }
-  time_t time_now = time(NULL) ;
-  if (len == 2){
+  MqttDisconnectView disconnect(data, len) ;
+  time_t time_now = TIMENOW ;
+  if (disconnect.has_duration()){
     // Contains a duration
-    con->sleep_duration = (data[0] << 8) | data[1] ; // MSB assumed
+    con->sleep_duration = disconnect.duration() ;
     DPRINT("DISCONNECT: {sleeping for %u sec}\n", con->sleep_duration) ;
     con->asleep_from = time_now ;
     con->set_state(MqttConnection::State::asleep) ;
@@ -1073,124 +1274,184 @@ void ServerMqttSn::initialise(uint8_t address_len, uint8_t *broadcast, uint8_t *
 {
   MqttSnEmbed::initialise(address_len, broadcast, address);
 
-  pthread_mutexattr_t attr ;
-  pthread_mutexattr_init(&attr);
-  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK) ;
-  if (pthread_mutex_init(&m_mosquittolock, &attr) != 0){
-    EPRINT("Init: Mosquitto mutex creation failed\n") ;
-    return ;
-  }
+  // m_mosquittolock is created recursive in the constructor. Routing
+  // re-enters the lock so it must not be recreated here
   
   char szgw[PACKET_DRIVER_MAX_PAYLOAD - MQTT_CONNECT_HDR_LEN+1];
-  if (!m_mosquitto_initialised) mosquitto_lib_init();
-  m_mosquitto_initialised = true ;
+  if (!m_broker){
+    EPRINT("Init: No broker set for the gateway\n") ;
+    return ;
+  }
 
   snprintf(szgw, m_pDriver->get_payload_width() - MQTT_CONNECT_HDR_LEN, "Gateway %u", m_gwid) ;
-  m_pmosquitto = mosquitto_new(szgw, false, this) ;
-  if (!m_pmosquitto){
-    EPRINT("Init: Cannot create a new mosquitto instance\n") ;
-  }else{
-
-    mosquitto_message_callback_set(m_pmosquitto, gateway_message_callback) ;
-    mosquitto_connect_callback_set(m_pmosquitto, gateway_connect_callback) ;
-    mosquitto_disconnect_callback_set(m_pmosquitto, gateway_disconnect_callback);
-    mosquitto_publish_callback_set(m_pmosquitto, gateway_publish_callback) ;
-    mosquitto_subscribe_callback_set(m_pmosquitto, gateway_subscribe_callback) ;
 
-    // Set a will. TO DO: Make this configurable
-    char szGwWill[1024] ;
-    snprintf(szGwWill, 1024, "gateway/%u/status", m_gwid) ;
-    mosquitto_will_set(m_pmosquitto, szGwWill, 7, "Offline", 1, true) ;
-    
-    // TO DO: add in config for the mosquitto server
-    int ret = mosquitto_connect_async(m_pmosquitto, "localhost", 1883, 60) ;
-    if (ret != MOSQ_ERR_SUCCESS){
-      EPRINT("Init: Cannot connect to mosquitto broker\n") ;
-    }
+  m_broker->set_callback_context(this) ;
+  m_broker->set_message_callback(gateway_message_callback) ;
+  m_broker->set_connect_callback(gateway_connect_callback) ;
+  m_broker->set_disconnect_callback(gateway_disconnect_callback);
+  m_broker->set_publish_callback(gateway_publish_callback) ;
+  m_broker->set_subscribe_callback(gateway_subscribe_callback) ;
 
-    ret = mosquitto_loop_start(m_pmosquitto) ;
-    if (ret != MOSQ_ERR_SUCCESS){
-      EPRINT("Init: Cannot start mosquitto loop\n") ;
-    }
+  // Set a will. TO DO: Make this configurable
+  char szGwWill[1024] ;
+  snprintf(szGwWill, 1024, "gateway/%u/status", m_gwid) ;
 
-#ifdef DEBUG
-    int major, minor, revision ;
-    mosquitto_lib_version(&major, &minor, &revision) ;
-    
-    DPRINT("Init: Mosquitto server connected %d.%d.%d\n", major, minor, revision) ;
-#endif
-  
+  if (!m_broker->initialise(szgw, szGwWill, "Offline", 7)){
+    EPRINT("Init: Cannot start the broker\n") ;
+    return ;
   }
+  m_broker_initialised = true ;
 }
 
-void ServerMqttSn::gateway_message_callback(struct mosquitto *m,
-					    void *data,
-					    const struct mosquitto_message *message)
+void ServerMqttSn::gateway_message_callback(void *data,
+					    const char *sztopic,
+					    const void *payload,
+					    int payloadlen,
+					    int qos,
+					    bool retain)
 {
-  DPRINT("MESSAGE CALLBACK: Received mosquitto message for topic %s at qos %d, with retain %s\n", message->topic, message->qos, message->retain?"true":"false") ;
-
-  /* mosquitto message struct
-  int mid;
-  char *topic;
-  void *payload;
-  int payloadlen;
-  int qos;
-  bool retain;
-  */
+  DPRINT("MESSAGE CALLBACK: Received broker message for topic %s at qos %d, with retain %s\n", sztopic, qos, retain?"true":"false") ;
 
   if (data == NULL) return ;
   ServerMqttSn *gateway = (ServerMqttSn*)data ;
 
-  MqttTopic *t = NULL;
-  MqttConnection *p = NULL ;
+  if (payloadlen > (gateway->m_pDriver->get_payload_width() - MQTT_PUBLISH_HDR_LEN)){
+    EPRINT("MESSAGE CALLBACK: Payload of %u bytes is too long for publish\n", payloadlen);
+    return ;
+  }
 
-  if (message->payloadlen > (gateway->m_pDriver->get_payload_width() - MQTT_PUBLISH_HDR_LEN)){
-    EPRINT("MESSAGE CALLBACK: Payload of %u bytes is too long for publish\n", message->payloadlen);
+  gateway->lock_mosquitto() ; // Using topic iterators, lock section
+  if (retain){
+    // Retained values are replayed by the broker on each new subscription
+    // and routed to subscriptions waiting for them. Those clients were
+    // sent an identical cached value when they subscribed
+    if (gateway->m_retained.is_cached(sztopic, (const uint8_t*)payload, payloadlen)){
+      DPRINT("MESSAGE CALLBACK: Retained topic %s already sent from the cache\n", sztopic) ;
+      gateway->unlock_mosquitto() ;
+      return ;
+    }
+    gateway->cache_retained(sztopic, (const uint8_t*)payload, payloadlen) ;
+  }else if (!gateway->m_retained.is_cached(sztopic, (const uint8_t*)payload, payloadlen)){
+    // Live messages may have replaced the retained value on the broker
+    gateway->m_retained.remove(sztopic) ;
+  }
+  if (gateway->m_local_delivery &&
+      gateway->m_local_echo.consume(sztopic, (const uint8_t*)payload, payloadlen)){
+    DPRINT("MESSAGE CALLBACK: Topic %s already delivered locally\n", sztopic) ;
+    gateway->unlock_mosquitto() ;
     return ;
   }
+  gateway->route_message(sztopic, payload, payloadlen, retain) ;
+  gateway->unlock_mosquitto() ;
+}
 
+uint16_t ServerMqttSn::route_message(const char *sztopic,
+				     const void *payload,
+				     mqtt_len_t payloadlen,
+				     bool retain)
+{
+  MqttTopic *t = NULL;
+  MqttConnection *p = NULL ;
   bool bfound = false ;
-  gateway->lock_mosquitto() ; // Using topic iterators, lock section
-  for(p = gateway->m_connection_head; p != NULL; p=p->next){
-    if (p->is_connected()){
+  uint16_t routed = 0 ;
+
+  pthread_mutex_lock(&m_mosquittolock) ; // Using topic iterators, lock section
+  for(p = m_connection_head; p != NULL; p=p->next){
+    // Messages for sleeping clients are held until the client polls
+    if (p->is_connected() || p->is_sleeping()){
       bfound = false ;
       p->topics.iterate_first_topic();
       t=p->topics.get_curr_topic();
       // Iterate the registered topics
       while (t){
-	if (t->is_subscribed() && t->match(message->topic)){
-	  gateway->do_publish_topic(p, t, message->topic, t->is_short_topic()?FLAG_SHORT_TOPIC_NAME:FLAG_NORMAL_TOPIC_ID, message->payload, message->payloadlen, message->retain) ;
+	if (t->is_subscribed() && (!retain || t->awaiting_retained()) && t->match(sztopic)){
+	  do_publish_topic(p, t, sztopic, t->is_short_topic()?FLAG_SHORT_TOPIC_NAME:FLAG_NORMAL_TOPIC_ID, payload, payloadlen, retain) ;
 	  bfound = true ;
+	  routed++ ;
 	  break ; //found a match, continue to next connection
 	}
 	t=p->topics.get_next_topic();
       }
       if (!bfound){
-	gateway->m_predefined_topics.iterate_first_topic() ;
-	t=gateway->m_predefined_topics.get_curr_topic();
+	m_predefined_topics.iterate_first_topic() ;
+	t=m_predefined_topics.get_curr_topic();
 	// Iterate the predefined topics
 	while (t){
-	  if (t->is_subscribed() && t->match(message->topic)){
-	    gateway->do_publish_topic(p, t, message->topic, t->is_short_topic()?FLAG_SHORT_TOPIC_NAME:FLAG_DEFINED_TOPIC_ID, message->payload, message->payloadlen, message->retain) ;
+	  if (t->is_subscribed() && (!retain || t->awaiting_retained()) && t->match(sztopic)){
+	    do_publish_topic(p, t, sztopic, t->is_short_topic()?FLAG_SHORT_TOPIC_NAME:FLAG_DEFINED_TOPIC_ID, payload, payloadlen, retain) ;
+	    routed++ ;
 	    break ; //found a match, continue to next connection
 	  }
-	  t=p->topics.get_next_topic();
+	  t=m_predefined_topics.get_next_topic();
 	}
       }
     }
   }
-  gateway->unlock_mosquitto() ;
+  pthread_mutex_unlock(&m_mosquittolock) ;
+  return routed ;
+}
+
+MqttEchoFilter::MqttEchoFilter()
+{
+  for (uint8_t i=0; i < MQTT_LOCAL_ECHO_MAX; i++){
+    m_set[i] = false ;
+    m_hash[i] = 0 ;
+    m_sent[i] = 0 ;
+  }
+  m_head = 0 ;
+}
+
+uint32_t MqttEchoFilter::hash(const char *sztopic, const uint8_t *payload, mqtt_len_t len)
+{
+  // FNV-1a over the topic, a separator and the payload
+  uint32_t h = 2166136261u ;
+  for (const char *c = sztopic; *c; c++){
+    h ^= (uint8_t)*c ;
+    h *= 16777619u ;
+  }
+  h *= 16777619u ;
+  for (mqtt_len_t i=0; i < len; i++){
+    h ^= payload[i] ;
+    h *= 16777619u ;
+  }
+  return h ;
+}
+
+void MqttEchoFilter::add(const char *sztopic, const uint8_t *payload, mqtt_len_t len)
+{
+  // Oldest entry is overwritten when full
+  m_hash[m_head] = hash(sztopic, payload, len) ;
+  m_sent[m_head] = TIMENOW ;
+  m_set[m_head] = true ;
+  m_head = (m_head + 1) % MQTT_LOCAL_ECHO_MAX ;
+}
+
+bool MqttEchoFilter::consume(const char *sztopic, const uint8_t *payload, mqtt_len_t len)
+{
+  uint32_t h = hash(sztopic, payload, len) ;
+  time_t now = TIMENOW ;
+  for (uint8_t i=0; i < MQTT_LOCAL_ECHO_MAX; i++){
+    if (!m_set[i]) continue ;
+    if (m_sent[i] + MQTT_LOCAL_ECHO_TIMEOUT < now){
+      m_set[i] = false ; // Echo never arrived
+      continue ;
+    }
+    if (m_hash[i] == h){
+      m_set[i] = false ;
+      return true ;
+    }
+  }
+  return false ;
 }
 
 void ServerMqttSn::do_publish_topic(MqttConnection *con,
 				    MqttTopic *t,
 				    const char *sztopic,
 				    uint8_t topic_type,
-				    void *payload,
-				    uint8_t payloadlen,
+				    const void *payload,
+				    mqtt_len_t payloadlen,
 				    bool retain)
 {
-  uint8_t buff[PACKET_DRIVER_MAX_PAYLOAD] ;
   uint8_t qos = t->get_qos() ;
   if (t->is_wildcard()){
     // Create new topic ID or use existing
@@ -1210,24 +1471,16 @@ void ServerMqttSn::do_publish_topic(MqttConnection *con,
     return ;
   }
   
-  buff[0] = (retain?FLAG_RETAIN:0) | qos | topic_type;
+  // Encode straight into the message cache
+  MqttFrame &frame = m->encode_message(MQTT_PUBLISH) ;
+  frame.u8((retain?FLAG_RETAIN:0) | qos | topic_type) ;
   uint16_t topicid = t->get_id() ;
   if (topic_type == FLAG_SHORT_TOPIC_NAME){
-    const char *szshort = t->get_topic() ;
-    buff[1] = szshort[0] ;
-    buff[2] = szshort[1] ;
+    frame.bytes(t->get_topic(), 2) ;
   }else{
-    buff[1] = topicid >> 8;
-    buff[2] = topicid & 0x00FF ;
+    frame.u16(topicid) ;
   }
-  uint16_t mid = m->get_message_id() ;
-  buff[3] = mid >> 8 ;
-  buff[4] = mid & 0x00FF ;
-  uint8_t len = payloadlen + 5;
-
-  memcpy(buff+5, payload, payloadlen) ;
-
-  m->set_message(MQTT_PUBLISH, buff, len) ;
+  frame.u16(m->get_message_id()).bytes(payload, payloadlen) ;
   if (qos != FLAG_QOS0){
     m->set_topic_id(topicid) ;
     m->set_topic_type(FLAG_NORMAL_TOPIC_ID) ;
@@ -1238,11 +1491,9 @@ void ServerMqttSn::do_publish_topic(MqttConnection *con,
   }
 }
 
-void ServerMqttSn::gateway_subscribe_callback(struct mosquitto *m,
-					      void *data,
+void ServerMqttSn::gateway_subscribe_callback(void *data,
 					      int mid,
-					      int qoscount,
-					      const int *grantedqos)
+					      int grantedqos)
 {
   if (data == NULL) return ;
   ServerMqttSn *gateway = (ServerMqttSn*)data ;
@@ -1252,7 +1503,7 @@ void ServerMqttSn::gateway_subscribe_callback(struct mosquitto *m,
   MqttConnection *con = gateway->search_mosquitto_id(mid, &mess) ;
 
   if (!con){
-    EPRINT("SUBSCRIBE CALLBACK: Cannot find Mosquitto ID %d in any connection for subscription\n", mid) ;
+    DPRINT("SUBSCRIBE CALLBACK: Broker ID %d not tracked. Could be a subscription already accepted\n", mid) ;
     gateway->unlock_mosquitto();
     return ;
   }
@@ -1271,9 +1522,8 @@ void ServerMqttSn::gateway_subscribe_callback(struct mosquitto *m,
   gateway->unlock_mosquitto();
 }
 
-void ServerMqttSn::gateway_publish_callback(struct mosquitto *m,
-						  void *data,
-						  int mid)
+void ServerMqttSn::gateway_publish_callback(void *data,
+					    int mid)
 {
   if (data == NULL) return ;
   
@@ -1284,18 +1534,74 @@ void ServerMqttSn::gateway_publish_callback(struct mosquitto *m,
   MqttConnection *con = gateway->search_mosquitto_id(mid, &mess) ;
 
   if (!con){
-    EPRINT("PUBLISH CALLBACK: Cannot find Mosquitto ID %d in any connection. Could be a QoS -1 message\n", mid) ;
+    DPRINT("PUBLISH CALLBACK: Broker ID %d not tracked. Could be a QoS 0, QoS -1 or spooled message\n", mid) ;
     gateway->unlock_mosquitto();
     return ;
   }
 
-  uint8_t buff[5] ; // Response buffer
+  MQTT_METRIC(gateway->m_metrics.broker_publish_us.record(mqtt_metrics_now_us() - mess->get_broker_sent_us())) ;
+  MQTT_TRACE_POINT(mess->get_trace().stamp(MqttTrace::broker_ack)) ;
+  gateway->complete_publish(con, mess) ;
+  gateway->unlock_mosquitto();
+}
+
+bool ServerMqttSn::send_puback(MqttConnection *con, uint16_t topicid,
+			       uint16_t messageid, uint8_t returncode)
+{
+  MqttFrame frame ;
+  frame.u16(topicid).u16(messageid).u8(returncode) ;
+  if (writeframe(con, MQTT_PUBACK, frame)){
+    DPRINT("PUBLISH: Sending MQTT_PUBACK to client %s, for message ID %u\n", con->get_client_id(), messageid) ;
+    return true ;
+  }
+  EPRINT("PUBLISH: Failed to send MQTT_PUBACK to client %s, for message ID %u\n", con->get_client_id(), messageid) ;
+  return false ;
+}
+
+bool ServerMqttSn::set_broker_qos(const char *szfilter, uint8_t qos)
+{
+  if (qos > 2 && qos != BROKER_QOS_PASSTHROUGH) return false ;
+  pthread_mutex_lock(&m_mosquittolock) ;
+  MqttTopic *t = m_broker_qos.get_topic(szfilter) ;
+  if (!t) t = m_broker_qos.add_topic(szfilter) ;
+  if (t) t->set_qos(qos) ;
+  pthread_mutex_unlock(&m_mosquittolock) ;
+  return t != NULL ;
+}
+
+bool ServerMqttSn::congested(MqttConnection *con)
+{
+  if (con->messages.count_active() >= MQTT_CONGESTION_QUEUE) return true ;
+  // Spooled publishes are acknowledged without waiting on the broker
+  return m_broker_connected && m_broker_backlog >= MQTT_CONGESTION_BACKLOG ;
+}
+
+int ServerMqttSn::broker_qos(const char *sztopic, uint8_t qos)
+{
+  uint8_t mapped = m_default_broker_qos ;
+  m_broker_qos.iterate_first_topic() ;
+  for (MqttTopic *t = m_broker_qos.get_curr_topic(); t; t = m_broker_qos.get_next_topic()){
+    if (t->match(sztopic)){
+      mapped = t->get_qos() ;
+      break ;
+    }
+  }
+  if (mapped != BROKER_QOS_PASSTHROUGH) return mapped ;
+
+  switch(qos){
+  case FLAG_QOS1:
+    return 1 ;
+  case FLAG_QOS2:
+    return 2 ;
+  default: // QoS 0 and -1
+    return 0 ;
+  }
+}
+
+void ServerMqttSn::complete_publish(MqttConnection *con, MqttMessage *mess)
+{
   uint16_t topicid = mess->get_topic_id() ;
   uint16_t messageid = mess->get_message_id() ;
-  buff[0] = topicid >> 8 ; // replicate topic id 
-  buff[1] = topicid & 0x00FF ; // replicate topic id 
-  buff[2] = messageid >> 8 ; // replicate message id
-  buff[3] = messageid & 0x00FF ; // replicate message id
 
   switch(mess->get_qos()){
   case FLAG_QOS0:
@@ -1303,40 +1609,88 @@ void ServerMqttSn::gateway_publish_callback(struct mosquitto *m,
     break;
   case FLAG_QOS1:
     mess->set_inactive() ;
-    buff[4] = MQTT_RETURN_ACCEPTED ;
-    if (gateway->writemqtt(con, MQTT_PUBACK, buff, 5)){
-      DPRINT("PUBLISH CALLBACK: Sending MQTT_PUBACK to client %s, for message ID %u\n", con->get_client_id(), messageid) ;
-    }else{
-      EPRINT("PUBLISH CALLBACK: Failed to send MQTT_PUBACK to client %s, for message ID %u\n", con->get_client_id(), messageid) ;
-    }
+    send_puback(con, topicid, messageid, MQTT_RETURN_ACCEPTED) ;
+    MQTT_TRACE_POINT(mess->get_trace().stamp(MqttTrace::acknowledged)) ;
     break ;
   case FLAG_QOS2:
-    mess->set_message(MQTT_PUBREC, buff+2, 2) ;
+    mess->encode_message(MQTT_PUBREC).u16(messageid) ;
+    MQTT_TRACE_POINT(mess->get_trace().stamp(MqttTrace::acknowledged)) ;
     break ;
   default:
     mess->set_inactive() ;
     EPRINT("PUBLISH CALLBACK: Invalid QoS %d\n", mess->get_qos()) ;
   }
-  gateway->unlock_mosquitto();
+  MQTT_TRACE_POINT(m_trace_log.complete(mess->get_trace())) ;
+}
+
+#ifdef MQTT_METRICS_ENABLED
+void ServerMqttSn::publish_metrics()
+{
+  uint16_t connected = 0 ;
+  for (MqttConnection *con = m_connection_head; con; con = con->next)
+    if (con->is_connected()) connected++ ;
+  m_metrics.connections.set(connected) ;
+  m_metrics.snapshot(publish_metric, this) ;
+  MQTT_TRACE_POINT(m_trace_log.snapshot(publish_metric, this)) ;
+}
+
+void ServerMqttSn::publish_metric(void *data, const char *szname, const char *szvalue)
+{
+  ServerMqttSn *gateway = (ServerMqttSn*)data ;
+  char sztopic[128] ;
+  int mid = 0 ;
+  snprintf(sztopic, sizeof(sztopic), "%s/%u/%s", MQTT_METRICS_TOPIC, gateway->m_gwid, szname) ;
+  int ret = gateway->m_broker->publish(&mid, sztopic, strlen(szvalue), szvalue, 0, false) ;
+  if (ret != BROKER_ERR_SUCCESS)
+    EPRINT("METRICS: Broker publish of %s failed with code %d\n", sztopic, ret) ;
+}
+#endif
+
+void ServerMqttSn::drain_spool()
+{
+  time_t now = TIMENOW ;
+  if (now != m_spool_drain_time){
+    m_spool_drain_time = now ;
+    m_spool_drained = 0 ;
+  }
+
+  MqttSpooled *s = NULL ;
+  while (m_spool_drained < m_spool_rate && (s = m_spool.front())){
+    int mid = 0 ;
+    int ret = m_broker->publish(&mid,
+				s->get_topic(),
+				s->get_payload_len(),
+				s->get_payload(),
+				s->get_qos(),
+				s->get_retain()) ;
+    if (ret != BROKER_ERR_SUCCESS){
+      // Leave in the spool and try again later
+      EPRINT("SPOOL: Broker publish failed with code %d, %u publishes waiting\n", ret, m_spool.count()) ;
+      return ;
+    }
+    if (s->get_echo()) m_local_echo.add(s->get_topic(), s->get_payload(), s->get_payload_len()) ;
+    m_spool.pop() ;
+    m_spool_drained++ ;
+  }
 }
 
-void ServerMqttSn::gateway_disconnect_callback(struct mosquitto *m,
-						    void *data,
-						    int res)
+void ServerMqttSn::gateway_disconnect_callback(void *data,
+					       int res)
 {
   ServerMqttSn *gateway = (ServerMqttSn*)data ;
-  DPRINT("DISCONNECT CALLBACK: Mosquitto disconnect: %d\n", res) ;
+  DPRINT("DISCONNECT CALLBACK: Broker disconnect: %d\n", res) ;
   gateway->lock_mosquitto();
   gateway->m_broker_connected = false ;
+  // Changes made while disconnected are not seen
+  gateway->m_retained.clear() ;
   gateway->unlock_mosquitto();
 }
 
-void ServerMqttSn::gateway_connect_callback(struct mosquitto *m,
-						 void *data,
-						 int res)
+void ServerMqttSn::gateway_connect_callback(void *data,
+					    int res)
 {
   ServerMqttSn *gateway = (ServerMqttSn*)data ;
-  DPRINT("CONNECT CALLBACK: Mosquitto connect: %d\n", res) ;
+  DPRINT("CONNECT CALLBACK: Broker connect: %d\n", res) ;
   // Gateway connected to the broker
   gateway->lock_mosquitto();
   if (res == 0){
@@ -1345,13 +1699,12 @@ void ServerMqttSn::gateway_connect_callback(struct mosquitto *m,
     char szGwWill[1024] ;
     snprintf(szGwWill, 1024, "gateway/%u/status", gateway->m_gwid) ;
     gateway->m_broker_connected = true ;
-    mosquitto_publish(gateway->m_pmosquitto,
-		      &mid,
-		      szGwWill,
-		      6,
-		      "Online",
-		      1,
-		      true) ;
+    gateway->m_broker->publish(&mid,
+			       szGwWill,
+			       6,
+			       "Online",
+			       1,
+			       true) ;
   }
     
   gateway->unlock_mosquitto();
@@ -1359,20 +1712,19 @@ void ServerMqttSn::gateway_connect_callback(struct mosquitto *m,
 
 void ServerMqttSn::send_will(MqttConnection *con)
 {
-  if (!m_mosquitto_initialised) return ; // cannot process
+  if (!m_broker_initialised) return ; // cannot process
 
   int mid = 0 ;
   pthread_mutex_lock(&m_mosquittolock) ;
   if (strlen(con->get_will_topic()) > 0){
-    int ret = mosquitto_publish(m_pmosquitto,
-				&mid,
+    int ret = m_broker->publish(&mid,
 				con->get_will_topic(),
 				con->get_will_message_len(),
 				con->get_will_message(),
 				con->get_will_qos(),
 				con->get_will_retain()) ;
-    if (ret != MOSQ_ERR_SUCCESS){
-      EPRINT("Sending WILL: Mosquitto publish failed with code %d\n", ret);
+    if (ret != BROKER_ERR_SUCCESS){
+      EPRINT("Sending WILL: Broker publish failed with code %d\n", ret);
     }
   }
   pthread_mutex_unlock(&m_mosquittolock) ;
@@ -1382,12 +1734,19 @@ bool ServerMqttSn::manage_connections()
 {
   MqttConnection *con = NULL ;
   MqttMessage *m = NULL ;
+
+  // Brokers may return results from this call
+  if (m_broker_initialised) m_broker->loop() ;
+
   pthread_mutex_lock(&m_mosquittolock) ;
   
+  uint16_t backlog = 0 ;
   for(con = m_connection_head; con != NULL; con=con->next){
+    backlog += con->messages.count_waiting() ;
     switch(con->get_state()){
     case MqttConnection::State::connected:
     case MqttConnection::State::connecting:
+    case MqttConnection::State::awake:
 
       if (con->lost_contact()){
 	// Client is not a sleeping client and is also
@@ -1413,9 +1772,9 @@ bool ServerMqttSn::manage_connections()
 		   m->get_message_id(),
 		   m->get_message_len(),
 		   con->get_client_id());
-	    if(writemqtt(con,
-			 m->get_message_type(),
-			 m->get_message(), m->get_message_len())){
+	    if(writeframe(con,
+			  m->get_message_type(),
+			  m->get_frame())){
 	      m->sending() ; // Acknowledge message is sending
 	    }else{
 	      EPRINT("MANAGE CONNECTION: IO failure - writemqtt failed for message %s, Message ID %u to client %s\n",
@@ -1426,6 +1785,7 @@ bool ServerMqttSn::manage_connections()
 	  }else{ // Already sending the active message, check retries
 	    if (m->has_expired(m_Tretry)){
 	      if (m->has_failed(m_Nretry)){
+		MQTT_METRIC(m_metrics.failures.inc()) ;
 		// Connection has failed retry attempts
 		DPRINT("MANAGE CONNECTION: Message failed to deliver %s, Message ID %u, length %u to client %s\n",
 		       mqtt_code_str(m->get_message_type()),
@@ -1443,15 +1803,15 @@ bool ServerMqttSn::manage_connections()
 		m->set_inactive();
 	      }else{
 		// Write the message again
+		MQTT_METRIC(m_metrics.retries.inc()) ;
 		DPRINT("MANAGE CONNECTION: Resending MQTT message %s, Message ID %u, length %u, to client %s\n",
 		       mqtt_code_str(m->get_message_type()),
 		       m->get_message_id(),
 		       m->get_message_len(),
 		       con->get_client_id());
-		if (!writemqtt(con,
-			       m->get_message_type(),
-			       m->get_message(),
-			       m->get_message_len())){
+		if (!writeframe(con,
+				m->get_message_type(),
+				m->get_frame())){
 		  EPRINT("MANAGE CONNECTION: IO failed to send message %s, message ID %u, to client %s\n",
 			 mqtt_code_str(m->get_message_type()),
 			 m->get_message_id(),
@@ -1460,6 +1820,16 @@ bool ServerMqttSn::manage_connections()
 	      }
 	    }
 	  }
+	}else if (con->is_awake() && !m){
+	  // All buffered messages delivered to the awake client.
+	  // Respond to the poll and the client returns to sleep. A
+	  // message still waiting on the broker keeps the client awake
+	  DPRINT("MANAGE CONNECTION: Client %s returning to sleep\n", con->get_client_id()) ;
+	  con->set_state(MqttConnection::State::asleep) ;
+	  con->asleep_from = TIMENOW ;
+	  if (!writemqtt(con, MQTT_PINGRESP, NULL, 0)){
+	    EPRINT("MANAGE CONNECTION: IO failed to send MQTT_PINGRESP to client %s\n", con->get_client_id()) ;
+	  }
 	}else{
 	  // No active message to send
 
@@ -1475,20 +1845,64 @@ bool ServerMqttSn::manage_connections()
     case MqttConnection::State::disconnected:
       break;
     case MqttConnection::State::asleep:
+      // Allow half the sleep duration again for the client to poll
+      if (con->asleep_from + con->sleep_duration + con->sleep_duration / 2 < TIMENOW){
+	DPRINT("MANAGE CONNECTION: Sleeping client %s did not wake\n", con->get_client_id()) ;
+	con->set_state(MqttConnection::State::disconnected) ;
+	con->messages.clear_queue() ;
+	send_will(con) ;
+      }
       break;
     default:
       break;
     }
   }
+  m_broker_backlog = backlog ;
+  if (m_retained_pruned != TIMENOW){
+    m_retained_pruned = TIMENOW ;
+    prune_retained() ;
+  }
   
   if (m_broker_connected){
+    // Forward publishes accepted while the broker was unavailable
+    if (!m_spool.is_empty()) drain_spool() ;
+
+#ifdef MQTT_METRICS_ENABLED
+    if (m_metrics_interval > 0 &&
+	m_last_metrics + m_metrics_interval <= TIMENOW){
+      publish_metrics() ;
+      m_last_metrics = TIMENOW ;
+    }
+#endif
+  }
+
+  // Clients can use the gateway while the broker is connected or the
+  // spool has room for their publishes
+  if (m_broker_initialised && (m_broker_connected || !m_spool.is_full())){
     // Send Advertise messages
-    time_t now = time(NULL) ;
+    time_t now = TIMENOW ;
     if (m_last_advertised+m_advertise_interval < now){
       DPRINT("MANAGE CONNECTION: Sending Advertised\n") ;
       advertise(m_advertise_interval) ;
       m_last_advertised = now ;
+      m_gwinfo_pending = false ; // advertise also answers searches
+    }
+
+    // Answer searches with a broadcast GWINFO, at most once per window
+    if (m_gwinfo_pending &&
+	(!m_gwinfo_sent || TIMENOW_MS - m_gwinfo_sent_ms >= MQTT_GWINFO_WINDOW_MS)){
+      uint8_t buff[1] ;
+      buff[0] = m_gwid ;
+      DPRINT("MANAGE CONNECTION: Sending GWINFO\n") ;
+      if (!addrwritemqtt(m_pDriver->get_broadcast(), MQTT_GWINFO, buff, 1)){
+	EPRINT("MANAGE CONNECTION: Failed to send GWINFO\n") ;
+      }
+      m_gwinfo_pending = false ;
+      m_gwinfo_sent = true ;
+      m_gwinfo_sent_ms = TIMENOW_MS ;
     }
+  }else{
+    m_gwinfo_pending = false ; // searches go unanswered
   }
 
   pthread_mutex_unlock(&m_mosquittolock) ;
@@ -1516,10 +1930,9 @@ bool ServerMqttSn::advertise(uint16_t duration)
 
 bool ServerMqttSn::register_topic(MqttConnection *con, MqttTopic *t)
 {
-  uint8_t buff[PACKET_DRIVER_MAX_PAYLOAD] ;
   // Gateway call to client
   pthread_mutex_lock(&m_mosquittolock) ;
-  if (!con->is_connected()){
+  if (!con->is_connected() && !con->is_sleeping()){
     pthread_mutex_unlock(&m_mosquittolock) ;
     return false ; // not connected
   }
@@ -1529,16 +1942,11 @@ bool ServerMqttSn::register_topic(MqttConnection *con, MqttTopic *t)
     return false ;
   }
   
-  uint16_t mid = m->get_message_id();
-  uint16_t topicid = t->get_id() ;
-  buff[0] = topicid >> 8;
-  buff[1] = topicid & 0x00FF ;
-  buff[2] = mid >> 8;
-  buff[3] = mid & 0x00FF ;
   const char *sz = t->get_topic() ;
-  size_t len = strlen(sz) ;
-  memcpy(buff+4, sz, len) ;
-  m->set_message(MQTT_REGISTER, buff, 4+len) ;
+  m->encode_message(MQTT_REGISTER)
+    .u16(t->get_id())
+    .u16(m->get_message_id())
+    .bytes(sz, strlen(sz)) ;
   if (con->get_send_topics()){
     m->set_activity(MqttMessage::Activity::registeringall) ;
   }
@@ -1551,11 +1959,14 @@ bool ServerMqttSn::ping(const char *szclientid)
 {
   pthread_mutex_lock(&m_mosquittolock) ;
   MqttConnection *con = search_connection(szclientid) ;
-  if (!con) return false ; // cannot ping unknown client
+  if (!con){
+    pthread_mutex_unlock(&m_mosquittolock) ;
+    return false ; // cannot ping unknown client
+  }
 
   // Record when the ping was attempted, note that this doesn't care
   // if it worked
-  con->reset_ping() ;
+  con->ping_sent() ;
 
   if (writemqtt(con, MQTT_PINGREQ, NULL, 0)){
     pthread_mutex_unlock(&m_mosquittolock) ;
@@ -21,10 +21,28 @@
 #include "mqttsnembed.hpp"
 #include "mqttconnection.hpp"
 #include "mqtttopic.hpp"
+#include "mqttretain.hpp"
+#include "mqttbroker.hpp"
+#include "mqttspool.hpp"
 #include <time.h>
-#include <mosquitto.h>
 #include <pthread.h>
 
+// Remembers publishes which have been delivered locally so the
+// copy returned from the broker can be dropped
+class MqttEchoFilter{
+public:
+  MqttEchoFilter() ;
+  void add(const char *sztopic, const uint8_t *payload, mqtt_len_t len) ;
+  // Returns true and forgets the entry if the message was delivered locally
+  bool consume(const char *sztopic, const uint8_t *payload, mqtt_len_t len) ;
+protected:
+  static uint32_t hash(const char *sztopic, const uint8_t *payload, mqtt_len_t len) ;
+  uint32_t m_hash[MQTT_LOCAL_ECHO_MAX] ;
+  time_t m_sent[MQTT_LOCAL_ECHO_MAX] ;
+  bool m_set[MQTT_LOCAL_ECHO_MAX] ;
+  uint8_t m_head ;
+};
+
 class ServerMqttSn : public MqttSnEmbed{
 public:
   ServerMqttSn();
@@ -43,10 +61,40 @@ public:
   ///////////////////////////////////////
   // Settings
   
+  // Upstream broker. Must be set before initialise
+  void set_broker(IMqttBroker *broker){m_broker = broker;}
+
   // Set this for gateways. Defaults to zero
   void set_gateway_id(const uint8_t gwid){m_gwid = gwid;}
   uint8_t get_gateway_id(){return m_gwid;}
 
+  // Deliver client publishes directly to other clients on this gateway
+  // subscribed to the topic, rather than waiting for the broker to return
+  // the publish. Defaults to false
+  void set_local_delivery(bool enable){m_local_delivery = enable;}
+  bool get_local_delivery(){return m_local_delivery;}
+
+  // Publishes received while the broker is unavailable are acknowledged
+  // and spooled, then forwarded once the broker reconnects.
+  // Keep the spool in a file so it survives a restart. Returns false
+  // if the file cannot be used
+  bool set_spool_file(const char *szpath) ;
+  // Spooled publishes forwarded each second. Defaults to MQTT_SPOOL_DRAIN_RATE
+  void set_spool_rate(uint16_t rate){m_spool_rate = rate;}
+
+  // QoS used for broker publishes and subscriptions. Topics matching a
+  // filter set with set_broker_qos use that QoS, the first filter added
+  // wins. Other topics use the default QoS, which is 1.
+  // BROKER_QOS_PASSTHROUGH uses the client QoS, with QoS -1 sent as 0.
+  // Client publishes sent to the broker with QoS 0 are acknowledged
+  // straight away. Returns false if the QoS is invalid
+  bool set_broker_qos(const char *szfilter, uint8_t qos) ;
+  void set_default_broker_qos(uint8_t qos){m_default_broker_qos = qos;}
+
+  // Seconds between publishing metrics to MQTT_METRICS_TOPIC/<gwid>/...
+  // Zero, the default, disables publishing
+  void set_metrics_interval(uint16_t t){m_metrics_interval = t;}
+
   
   //////////////////////////////////////
   // MQTT messages
@@ -73,60 +121,87 @@ public:
 
 protected:
 
-  static void gateway_message_callback(struct mosquitto *m,
-				       void *data,
-				       const struct mosquitto_message *message) ;
-  
-  static void gateway_subscribe_callback(struct mosquitto *m,
-					 void *data,
-					 int mid,
-					 int qoscount,
-					 const int *grantedqos);
-  
-  static void gateway_publish_callback(struct mosquitto *m,
-				       void *data,
-				       int mid);
-
-  static void gateway_disconnect_callback(struct mosquitto *m,
-					  void *data,
-					  int res);
-
-  static void gateway_connect_callback(struct mosquitto *m,
-				       void *data,
-				       int res);
+  static BROKERMESSAGECALLBACK(gateway_message_callback) ;
+  static BROKERSUBSCRIBECALLBACK(gateway_subscribe_callback) ;
+  static BROKERPUBLISHCALLBACK(gateway_publish_callback) ;
+  static BROKERDISCONNECTCALLBACK(gateway_disconnect_callback) ;
+  static BROKERCONNECTCALLBACK(gateway_connect_callback) ;
 
   // Use for any publish messages to client
   void do_publish_topic(MqttConnection *con,
 			MqttTopic *t,
 			const char *sztopic,
 			uint8_t topic_type,
-			void *payload,
-			uint8_t payloadlen,
+			const void *payload,
+			mqtt_len_t payloadlen,
 			bool retain);
+
+  // Acknowledge a client publish which has been accepted upstream
+  void complete_publish(MqttConnection *con, MqttMessage *mess) ;
+  bool send_puback(MqttConnection *con, uint16_t topicid,
+		   uint16_t messageid, uint8_t returncode) ;
+
+  // Broker QoS for a topic and client QoS flags
+  int broker_qos(const char *sztopic, uint8_t qos) ;
+
+  // True if a new publish or subscription from the client should be
+  // refused with CONGESTION as its queue or the broker backlog is too long
+  bool congested(MqttConnection *con) ;
+
+  // Forward spooled publishes to the broker at the spool rate
+  void drain_spool() ;
+
+#ifdef MQTT_METRICS_ENABLED
+  // Publish a snapshot of the gateway metrics to the broker
+  void publish_metrics() ;
+  static MQTTMETRICCALLBACK(publish_metric) ;
+#endif
+
+  // Publish a message to all connected clients subscribed to the topic.
+  // Retained replays only go to subscriptions waiting for them.
+  // Returns the number of clients the message was queued to
+  uint16_t route_message(const char *sztopic,
+			 const void *payload,
+			 mqtt_len_t payloadlen,
+			 bool retain) ;
+
+  // Queue any cached retained values matching a subscription. A new
+  // subscription is only sent values another subscription kept current
+  void publish_retained(MqttConnection *con, MqttTopic *t, uint8_t topic_type, bool is_new) ;
+  // Cache a retained value if the broker connection and a client
+  // subscription mean the gateway sees any change to it. Otherwise
+  // any cached value for the topic is dropped
+  void cache_retained(const char *sztopic, const uint8_t *payload, mqtt_len_t len) ;
+  // Is the topic covered by a client subscription other than except?
+  bool subscription_covers(const char *sztopic, MqttTopic *except=NULL) ;
+  // Is exactly this filter subscribed by a topic other than except?
+  bool filter_subscribed(const char *szfilter, MqttTopic *except) ;
+  // Drop cached retained values no subscription covers
+  void prune_retained() ;
   
   // Connection state handling for clients
   void connection_watchdog(MqttConnection *p);
   void manage_client_connection(MqttConnection *p);
   void complete_client_connection(MqttConnection *p) ;
 
-  void received_searchgw(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_connect(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_willtopic(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_willmsg(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_pingresp(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_pingreq(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_disconnect(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_register(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_regack(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_publish(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_pubrel(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_puback(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_pubrec(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_pubcomp(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_subscribe(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_suback(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_unsubscribe(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
-  void received_unsuback(uint8_t *sender_address, uint8_t *data, uint8_t len) ;
+  void received_searchgw(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_connect(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_willtopic(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_willmsg(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_pingresp(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_pingreq(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_disconnect(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_register(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_regack(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_publish(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_pubrel(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_puback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_pubrec(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_pubcomp(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_subscribe(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_suback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_unsubscribe(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
+  void received_unsuback(uint8_t *sender_address, uint8_t *data, mqtt_len_t len) ;
 
   // Searches for a client connection using the client ID
   // Only returns connected clients 
@@ -142,7 +217,7 @@ protected:
   MqttConnection* search_cached_connection_address(const uint8_t *clientaddr);
   // Creates a new connection and appends to end of client connection list
   MqttConnection* new_connection();
-  // Get the connection for a specified mosquitto connection.
+  // Get the connection for a specified broker message id.
   // Returns NULL if the message id cannot be found.
   MqttConnection* search_mosquitto_id(int mid, MqttMessage **pm) ;
   // Removes a connection from the connection cache.
@@ -152,7 +227,7 @@ protected:
   // Requires a connection to extract the registered topic
   // Returns false if the MQTT server cannot be processed
   bool server_publish(MqttConnection *con, uint16_t messageid, uint16_t topicid,
-		      uint8_t topic_type, uint8_t *payload, uint8_t len,
+		      uint8_t topic_type, const uint8_t *payload, mqtt_len_t len,
 		      uint8_t qos, bool retain);
 
   // Gateway function to send a WILL to the
@@ -162,12 +237,37 @@ protected:
   MqttConnection *m_connection_head ;
 
   // Gateway connection attributes
-  struct mosquitto *m_pmosquitto ;
+  IMqttBroker *m_broker ;
   time_t m_last_advertised ;
   uint16_t m_advertise_interval ;
-  bool m_mosquitto_initialised ;
+  // SEARCHGW answered by one GWINFO broadcast per window
+  bool m_gwinfo_pending ;
+  bool m_gwinfo_sent ;
+  uint32_t m_gwinfo_sent_ms ;
+  bool m_broker_initialised ;
   uint8_t m_gwid;
   bool m_broker_connected ;
+  // Publishes and subscriptions waiting on the broker. Counted each
+  // time connections are managed
+  uint16_t m_broker_backlog ;
+
+  // Last retained value of subscribed topics seen by the gateway
+  MqttRetainedCache m_retained ;
+  time_t m_retained_pruned ;
+
+  bool m_local_delivery ;
+  MqttEchoFilter m_local_echo ;
+
+  MqttTopicCollection m_broker_qos ;
+  uint8_t m_default_broker_qos ;
+
+  uint16_t m_metrics_interval ;
+  time_t m_last_metrics ;
+
+  MqttSpool m_spool ;
+  uint16_t m_spool_rate ;
+  time_t m_spool_drain_time ;
+  uint16_t m_spool_drained ;
   
   pthread_mutex_t m_mosquittolock ;
 };
@@ -0,0 +1,248 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "shardedbroker.hpp"
+#include "mqttparams.hpp"
+#include <string.h>
+#include <stdio.h>
+
+ShardedBroker::ShardedBroker()
+{
+  m_count = 0 ;
+  m_connected_count = 0 ;
+  for (uint8_t i=0; i < MQTT_MAX_BROKER_SHARDS; i++){
+    m_shards[i].owner = this ;
+    m_shards[i].index = i ;
+    m_shards[i].broker = NULL ;
+    m_connected[i] = false ;
+  }
+  pthread_mutex_init(&m_lock, NULL) ;
+}
+
+ShardedBroker::~ShardedBroker()
+{
+  pthread_mutex_destroy(&m_lock) ;
+}
+
+bool ShardedBroker::add_shard(IMqttBroker *broker)
+{
+  if (!broker || m_count >= MQTT_MAX_BROKER_SHARDS) return false ;
+  m_shards[m_count++].broker = broker ;
+  return true ;
+}
+
+uint8_t ShardedBroker::shard_for(const char *sztopic)
+{
+  // FNV-1a of the topic name
+  uint32_t h = 2166136261 ;
+  for (const char *p = sztopic; *p; p++){
+    h ^= (uint8_t)*p ;
+    h *= 16777619 ;
+  }
+  return h % m_count ;
+}
+
+bool ShardedBroker::initialise(const char *szclientid,
+			       const char *szwilltopic,
+			       const void *will, int willlen)
+{
+  if (m_count == 0){
+    EPRINT("Init: No broker shards added\n") ;
+    return false ;
+  }
+  
+  char szshardid[256] ;
+  for (uint8_t i=0; i < m_count; i++){
+    IMqttBroker *b = m_shards[i].broker ;
+    b->set_callback_context(&m_shards[i]) ;
+    b->set_message_callback(on_message) ;
+    b->set_publish_callback(on_publish) ;
+    b->set_subscribe_callback(on_subscribe) ;
+    b->set_connect_callback(on_connect) ;
+    b->set_disconnect_callback(on_disconnect) ;
+
+    // Broker client ids must be unique
+    snprintf(szshardid, sizeof(szshardid), "%s-%u", szclientid, i) ;
+    if (!b->initialise(szshardid,
+		       i == 0?szwilltopic:NULL,
+		       i == 0?will:NULL,
+		       i == 0?willlen:0)){
+      EPRINT("Init: Cannot start broker shard %u\n", i) ;
+      for (uint8_t j=0; j < i; j++) m_shards[j].broker->shutdown() ;
+      return false ;
+    }
+  }
+  DPRINT("Init: Started %u broker shards\n", m_count) ;
+  return true ;
+}
+
+void ShardedBroker::shutdown()
+{
+  for (uint8_t i=0; i < m_count; i++) m_shards[i].broker->shutdown() ;
+  pthread_mutex_lock(&m_lock) ;
+  for (uint8_t i=0; i < m_count; i++) m_connected[i] = false ;
+  m_connected_count = 0 ;
+  pthread_mutex_unlock(&m_lock) ;
+}
+
+int ShardedBroker::publish(int *mid, const char *sztopic,
+			   int payloadlen, const void *payload,
+			   int qos, bool retain)
+{
+  if (m_count == 0) return BROKER_ERR_NO_CONN ;
+  if (!sztopic) return BROKER_ERR_INVAL ;
+  uint8_t index = shard_for(sztopic) ;
+  int shardmid = 0 ;
+  int ret = m_shards[index].broker->publish(&shardmid, sztopic, payloadlen,
+					    payload, qos, retain) ;
+  if (mid) *mid = map_mid(index, shardmid) ;
+  return ret ;
+}
+
+int ShardedBroker::subscribe(int *mid, const char *sztopic, int qos)
+{
+  if (m_count == 0) return BROKER_ERR_NO_CONN ;
+  if (!sztopic) return BROKER_ERR_INVAL ;
+  uint8_t index = shard_for(sztopic) ;
+  int shardmid = 0 ;
+  int ret = m_shards[index].broker->subscribe(&shardmid, sztopic, qos) ;
+  if (mid) *mid = map_mid(index, shardmid) ;
+  if (ret == BROKER_ERR_SUCCESS){
+    pthread_mutex_lock(&m_lock) ;
+    if (!m_filters[index].get_topic(sztopic)) m_filters[index].add_topic(sztopic) ;
+    pthread_mutex_unlock(&m_lock) ;
+  }
+  return ret ;
+}
+
+int ShardedBroker::unsubscribe(int *mid, const char *sztopic)
+{
+  if (m_count == 0) return BROKER_ERR_NO_CONN ;
+  if (!sztopic) return BROKER_ERR_INVAL ;
+  uint8_t index = shard_for(sztopic) ;
+  int shardmid = 0 ;
+  int ret = m_shards[index].broker->unsubscribe(&shardmid, sztopic) ;
+  if (mid) *mid = map_mid(index, shardmid) ;
+  if (ret == BROKER_ERR_SUCCESS){
+    pthread_mutex_lock(&m_lock) ;
+    MqttTopic *t = m_filters[index].get_topic(sztopic) ;
+    if (t) m_filters[index].del_topic(t) ;
+    pthread_mutex_unlock(&m_lock) ;
+  }
+  return ret ;
+}
+
+bool ShardedBroker::delivered_below(uint8_t index, const char *sztopic)
+{
+  bool found = false ;
+  pthread_mutex_lock(&m_lock) ;
+  for (uint8_t i=0; i < index && !found; i++){
+    m_filters[i].iterate_first_topic() ;
+    for (MqttTopic *t = m_filters[i].get_curr_topic(); t; t = m_filters[i].get_next_topic()){
+      if (t->match(sztopic)){
+	found = true ;
+	break ;
+      }
+    }
+  }
+  pthread_mutex_unlock(&m_lock) ;
+  return found ;
+}
+
+void ShardedBroker::loop()
+{
+  for (uint8_t i=0; i < m_count; i++) m_shards[i].broker->loop() ;
+}
+
+void ShardedBroker::on_message(void *data, const char *sztopic,
+			       const void *payload, int payloadlen,
+			       int qos, bool retain)
+{
+  BrokerShard *shard = (BrokerShard*)data ;
+  ShardedBroker *pool = shard->owner ;
+  // Overlapping filters on another shard deliver the same message.
+  // Retained replays are only sent to the shard that subscribed
+  if (!retain && pool->delivered_below(shard->index, sztopic)){
+    DPRINT("MESSAGE CALLBACK: Broker shard %u dropped duplicate of topic %s\n", shard->index, sztopic) ;
+    return ;
+  }
+  if (pool->m_fnmessage)
+    (*pool->m_fnmessage)(pool->m_callback_context, sztopic, payload,
+			 payloadlen, qos, retain) ;
+}
+
+void ShardedBroker::on_publish(void *data, int mid)
+{
+  BrokerShard *shard = (BrokerShard*)data ;
+  ShardedBroker *pool = shard->owner ;
+  if (pool->m_fnpublish)
+    (*pool->m_fnpublish)(pool->m_callback_context,
+			 pool->map_mid(shard->index, mid)) ;
+}
+
+void ShardedBroker::on_subscribe(void *data, int mid, int grantedqos)
+{
+  BrokerShard *shard = (BrokerShard*)data ;
+  ShardedBroker *pool = shard->owner ;
+  if (pool->m_fnsubscribe)
+    (*pool->m_fnsubscribe)(pool->m_callback_context,
+			   pool->map_mid(shard->index, mid), grantedqos) ;
+}
+
+void ShardedBroker::on_connect(void *data, int res)
+{
+  BrokerShard *shard = (BrokerShard*)data ;
+  ShardedBroker *pool = shard->owner ;
+  if (res != 0){
+    // Failed connection attempts are passed on as they happen
+    if (pool->m_fnconnect) (*pool->m_fnconnect)(pool->m_callback_context, res) ;
+    return ;
+  }
+  
+  pthread_mutex_lock(&pool->m_lock) ;
+  if (!pool->m_connected[shard->index]){
+    pool->m_connected[shard->index] = true ;
+    pool->m_connected_count++ ;
+  }
+  bool all = pool->m_connected_count == pool->m_count ;
+  pthread_mutex_unlock(&pool->m_lock) ;
+
+  DPRINT("CONNECT CALLBACK: Broker shard %u connected\n", shard->index) ;
+  if (all && pool->m_fnconnect)
+    (*pool->m_fnconnect)(pool->m_callback_context, 0) ;
+}
+
+void ShardedBroker::on_disconnect(void *data, int res)
+{
+  BrokerShard *shard = (BrokerShard*)data ;
+  ShardedBroker *pool = shard->owner ;
+
+  pthread_mutex_lock(&pool->m_lock) ;
+  bool was_connected = pool->m_connected[shard->index] ;
+  // Report the pool as lost only on the first shard to go
+  bool first = was_connected && pool->m_connected_count == pool->m_count ;
+  if (was_connected){
+    pool->m_connected[shard->index] = false ;
+    pool->m_connected_count-- ;
+  }
+  pthread_mutex_unlock(&pool->m_lock) ;
+
+  DPRINT("DISCONNECT CALLBACK: Broker shard %u disconnected: %d\n", shard->index, res) ;
+  if (first && pool->m_fndisconnect)
+    (*pool->m_fndisconnect)(pool->m_callback_context, res) ;
+}
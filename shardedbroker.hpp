@@ -0,0 +1,96 @@
+//   Copyright 2020 Aidan Holmes
+//
+// This file is part of MQTT-SN-EMBED library for embedded devices.
+//
+// MQTT-SN-EMBED is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// MQTT_SN_EMBED is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with MQTT-SN-EMBED.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef __SHARDED_BROKER
+#define __SHARDED_BROKER
+
+#include "mqttbroker.hpp"
+#include "mqtttopic.hpp"
+#include <pthread.h>
+
+#ifndef MQTT_MAX_BROKER_SHARDS
+#define MQTT_MAX_BROKER_SHARDS 8
+#endif
+
+class ShardedBroker ;
+
+// Identifies which shard a callback came from
+struct BrokerShard{
+  ShardedBroker *owner ;
+  uint8_t index ;
+  IMqttBroker *broker ;
+};
+
+// Spreads upstream traffic over a pool of broker connections. Each topic
+// always uses the same connection so publishes on a topic stay in order.
+// Subscriptions use the connection chosen by the filter text. Where
+// filters on different shards overlap, a message is only passed on from
+// the lowest shard with a matching filter so it isn't delivered twice.
+// Retained replays only come from the shard of the new subscription and
+// are always passed on. Message ids from each shard are mapped so they
+// are unique across the pool. Reports connected once all shards connect
+// and disconnected when any shard is lost. Callbacks into the gateway
+// are still handled one at a time.
+class ShardedBroker : public IMqttBroker{
+public:
+  ShardedBroker() ;
+  ~ShardedBroker() ;
+
+  // Add a broker connection to the pool. Must be called before
+  // initialise. Returns false if the pool is full
+  bool add_shard(IMqttBroker *broker) ;
+  uint8_t get_shard_count(){return m_count;}
+
+  // Client IDs of each shard are suffixed with the shard number. Only the
+  // first shard sets the will
+  bool initialise(const char *szclientid,
+		  const char *szwilltopic,
+		  const void *will, int willlen) ;
+  void shutdown() ;
+
+  int publish(int *mid, const char *sztopic,
+	      int payloadlen, const void *payload,
+	      int qos, bool retain) ;
+  int subscribe(int *mid, const char *sztopic, int qos) ;
+  int unsubscribe(int *mid, const char *sztopic) ;
+
+  void loop() ;
+
+protected:
+  uint8_t shard_for(const char *sztopic) ;
+  int map_mid(uint8_t index, int mid){return mid * m_count + index;}
+  
+  static BROKERMESSAGECALLBACK(on_message) ;
+  static BROKERPUBLISHCALLBACK(on_publish) ;
+  static BROKERSUBSCRIBECALLBACK(on_subscribe) ;
+  static BROKERCONNECTCALLBACK(on_connect) ;
+  static BROKERDISCONNECTCALLBACK(on_disconnect) ;
+
+  // True if a shard below index has a filter matching the topic
+  bool delivered_below(uint8_t index, const char *sztopic) ;
+
+  BrokerShard m_shards[MQTT_MAX_BROKER_SHARDS] ;
+  bool m_connected[MQTT_MAX_BROKER_SHARDS] ;
+  // Filters subscribed on each shard
+  MqttTopicCollection m_filters[MQTT_MAX_BROKER_SHARDS] ;
+  uint8_t m_count ;
+  uint8_t m_connected_count ;
+  pthread_mutex_t m_lock ;
+};
+
+#endif